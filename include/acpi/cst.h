@@ -1,2 +1,22 @@
 /* @title: C States */
+#pragma once
+#include <acpi/cpu.h>
+
+/* `entry_method` of a parsed _CST state */
+#define ACPI_CSTATE_HALT 0     /* plain HLT, C1 only */
+#define ACPI_CSTATE_FFH 1      /* MWAIT, `addr` is the hint */
+#define ACPI_CSTATE_SYSTEMIO 2 /* read the I/O port at `addr` */
+
+/* Register address spaces a _CST state can be entered through */
+#define ACPI_CST_SPACE_SYSTEMIO 0x01
+#define ACPI_CST_SPACE_FFH 0x7F
+
+/* FFH register class for "MWAIT with the hint in the address" */
+#define ACPI_CST_FFH_CLASS_MWAIT 2
+
+/* States from the first processor object with a _CST, sorted from
+ * shallowest to deepest. Firmware gives every CPU the same table in
+ * practice, so it's used for all of them */
+extern struct acpi_cpu_power acpi_cst;
+
 void acpi_find_cst(void);
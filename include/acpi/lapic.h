@@ -84,7 +84,10 @@ static inline uint32_t lapic_read(uint32_t reg) {
 }
 
 #define TIMER_VECTOR 0x20
+#define TIMER_MODE_ONESHOT (0 << 17)
 #define TIMER_MODE_PERIODIC (1 << 17)
+#define TIMER_MODE_TSC_DEADLINE (2 << 17)
+#define IA32_TSC_DEADLINE 0x6E0
 #define IA32_APIC_BASE 0x1B
 #define APIC_X2APIC_ENABLE (1 << 10)
 
@@ -99,6 +102,8 @@ void lapic_timer_disable();
 bool lapic_timer_is_enabled();
 void lapic_timer_enable();
 void lapic_timer_set_ms(uint32_t ms);
+void lapic_timer_arm_us(uint64_t delta_us);
+void lapic_timer_disarm(void);
 void panic_broadcast(size_t exclude_core);
 void x2apic_init();
 
@@ -254,6 +254,22 @@ static inline void wait_for_interrupt(void) {
     asm volatile("hlt");
 }
 
+/* STI only takes effect after the next instruction, so nothing can
+ * sneak in between turning interrupts on and halting */
+static inline void enable_interrupts_and_wait(void) {
+    asm volatile("sti; hlt");
+}
+
+static inline void monitor(const void *addr) {
+    asm volatile("monitor" : : "a"(addr), "c"(0), "d"(0));
+}
+
+/* With bit 0 of `ext` set, an interrupt wakes it up even while they
+ * are disabled */
+static inline void mwait(uint32_t hint, uint32_t ext) {
+    asm volatile("mwait" : : "a"(hint), "c"(ext) : "memory");
+}
+
 static inline void hcf(void) {
     asm volatile("cli; hlt");
 }
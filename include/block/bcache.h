@@ -1,19 +1,43 @@
 /* @title: Block Cache */
 #include <block/bio.h>
+#include <compiler.h>
 #include <errno.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <structures/list.h>
 #include <sync/mutex.h>
+#include <sync/rcu.h>
+#include <sync/semaphore.h>
 #include <sync/spinlock.h>
 #include <types/refcount.h>
 #include <types/types.h>
 
 #pragma once
 #define DEFAULT_BLOCK_CACHE_SIZE 2048
-#define DEFAULT_MAX_DIRTY_ENTS 64
+#define BCACHE_SHARDS 16 /* must be a power of two */
+
+/* Largest I/O the cache sends, be it a multi-block read, a readahead
+ * read or a merged writeback run */
+#define BCACHE_MAX_IO_SECTORS 256
+
+/* Writeback tunables - ratios are a percentage of the cache capacity */
+#define BCACHE_WB_INTERVAL_MS 500     /* how often the daemon looks around */
+#define BCACHE_WB_EXPIRE_MS 3000      /* dirty for this long? write it */
+#define BCACHE_WB_BACKGROUND_PCT 10   /* past this, age doesn't matter */
+#define BCACHE_WB_THROTTLE_PCT 25     /* past this, writers wait */
+#define BCACHE_WB_THROTTLE_MS 10      /* one throttle wait */
+#define BCACHE_WB_THROTTLE_TRIES 8    /* waits before a writer gives up */
+#define BCACHE_WB_BATCH 128           /* entries gathered per pass */
+
+/* Readahead tunables - windows are in blocks */
+#define BCACHE_RA_STREAMS 16     /* streams tracked per disk */
+#define BCACHE_RA_MIN_WINDOW 4   /* where new streams start */
+#define BCACHE_RA_MAX_WINDOW 128 /* where doubling stops */
 
 struct generic_disk;
+struct daemon;
+struct daemon_work;
 
 /* must be allocated with malloc */
 struct bcache_entry {
@@ -25,8 +49,6 @@ struct bcache_entry {
     /* logical block address */
     uint64_t lba;
 
-    /* used with a counter - not a real 'timestamp' */
-    uint64_t access_time;
     struct mutex lock;
     bool dirty;
     bool no_evict;
@@ -35,34 +57,121 @@ struct bcache_entry {
     struct bio_request *request;
 
     refcount_t refcount;
+
+    /* writeback state, all protected by the writeback lock. `dirty` stays
+     * set while the entry is on the dirty list or is being written out */
+    struct list_head dirty_list;
+    time_t dirtied_at;
+    enum bio_request_priority wb_prio;
+    bool writeback; /* part of a write that has not completed yet */
 };
 
 struct bcache_wrapper {
     uint64_t key;               // block number
     struct bcache_entry *value; // pointer to cache entry
-    bool occupied;
-    struct bcache_wrapper *next;
+    _Atomic(struct bcache_wrapper *) next;
+
+    /* Set by every lookup, cleared as the CLOCK hand goes past */
+    atomic_bool referenced;
+    struct list_head clock;
+
+    bool free_value; /* Does the RCU callback also free `value`? */
+    struct rcu_cb rcu;
+};
+
+/* Lookups walk the chains under RCU and never take the lock. Inserts,
+ * removals and the CLOCK hand (the head of `clock`) are serialized by it */
+struct bcache_shard {
+    _Atomic(struct bcache_wrapper *) *buckets;
+    uint64_t bucket_count;
+    uint64_t count;
+    uint64_t capacity; /* Past this, inserts evict first */
+    struct list_head clock;
+    struct spinlock lock;
+} __cache_aligned;
+
+enum bcache_wb_state {
+    BCACHE_WB_STATE_OFF,      /* No daemon yet, it's started on first write */
+    BCACHE_WB_STATE_STARTING, /* Someone is creating the daemon */
+    BCACHE_WB_STATE_RUNNING,
+    BCACHE_WB_STATE_FAILED, /* Writers flush on their own */
+};
+
+struct bcache_writeback {
+    struct list_head dirty; /* oldest first */
+    uint64_t nr_dirty;
+    atomic_uint_fast64_t nr_writing;
+
+    uint64_t background_limit;
+    uint64_t throttle_limit;
+
+    /* Only one flusher at a time, so runs go out in LBA order */
+    struct mutex flush_lock;
+
+    /* Posted whenever a write completes, throttled writers wait on it */
+    struct semaphore throttle;
+
+    _Atomic(enum bcache_wb_state) state;
+    struct daemon *daemon;
+    struct daemon_work *work;
+
+    /* Set once anything got dirty, so teardown knows where to flush to */
+    struct generic_disk *disk;
+
+    struct spinlock lock;
+};
+
+/* One sequential reader. `next_lba` is where it goes if it keeps going,
+ * everything up to `ra_end` has already been asked for */
+struct bcache_ra_stream {
+    uint64_t id; /* 0 is a free slot */
+    uint64_t next_lba;
+    uint64_t ra_end;
+    uint64_t window;
+    time_t last_used;
+};
+
+struct bcache_readahead {
+    struct bcache_ra_stream streams[BCACHE_RA_STREAMS];
+    struct spinlock lock;
 };
 
-/* TODO: bitmap to mark present entries */
 struct bcache {
-    struct bcache_wrapper **entries;
-    _Atomic uint64_t ticks;
+    struct bcache_shard shards[BCACHE_SHARDS];
     uint64_t capacity;
-    uint64_t count;
     uint64_t spb;
-    struct spinlock lock;
+    struct bcache_writeback wb;
+    struct bcache_readahead ra;
 };
 
-static inline uint64_t bcache_hash(uint64_t x, uint64_t capacity) {
+static inline uint64_t bcache_mix(uint64_t x) {
     x ^= x >> 30;
     x *= 0xbf58476d1ce4e5b9ULL;
     x ^= x >> 27;
     x *= 0x94d049bb133111ebULL;
     x ^= x >> 31;
-    return x % capacity;
+    return x;
+}
+
+static inline uint64_t bcache_hash(uint64_t x, uint64_t capacity) {
+    return bcache_mix(x) % capacity;
+}
+
+/* The low bits pick the shard, the rest pick the bucket in it */
+static inline struct bcache_shard *bcache_shard_for(struct bcache *cache,
+                                                    uint64_t key) {
+    return &cache->shards[bcache_mix(key) & (BCACHE_SHARDS - 1)];
+}
+
+static inline uint64_t bcache_bucket_for(struct bcache_shard *shard,
+                                         uint64_t key) {
+    return (bcache_mix(key) / BCACHE_SHARDS) % shard->bucket_count;
 }
 
+SPINLOCK_GENERATE_LOCK_UNLOCK_FOR_STRUCT(bcache_shard, lock);
+SPINLOCK_GENERATE_LOCK_UNLOCK_FOR_STRUCT(bcache_writeback, lock);
+SPINLOCK_GENERATE_LOCK_UNLOCK_FOR_STRUCT(bcache_readahead, lock);
+
 void bcache_init(struct bcache *cache, uint64_t capacity);
 
 void *bcache_get(struct generic_disk *disk, uint64_t lba, uint64_t block_size,
@@ -74,6 +183,14 @@ bool bcache_writethrough(struct generic_disk *disk, struct bcache_entry *ent,
 void bcache_write_queue(struct generic_disk *disk, struct bcache_entry *ent,
                         uint64_t spb, enum bio_request_priority prio);
 
+void bcache_writeback_init(struct bcache_writeback *wb, uint64_t capacity);
+void bcache_writeback_destroy(struct bcache *cache);
+void bcache_writeback_mark_dirty(struct generic_disk *disk,
+                                 struct bcache_entry *ent,
+                                 enum bio_request_priority prio);
+size_t bcache_writeback_flush(struct generic_disk *disk, bool all);
+void bcache_sync(struct generic_disk *disk);
+
 void bcache_stat(struct generic_disk *disk, uint64_t *total_dirty_out,
                  uint64_t *total_present_out);
 
@@ -85,18 +202,25 @@ bool bcache_evict(struct generic_disk *disk, uint64_t spb);
 enum errno bcache_prefetch_async(struct generic_disk *disk, uint64_t lba,
                                  uint64_t block_size, uint64_t spb);
 
+enum errno bcache_prefetch_range_async(struct generic_disk *disk, uint64_t lba,
+                                       uint64_t blocks, uint64_t block_size,
+                                       uint64_t spb);
+
+/* Reads a range of blocks into the cache with as few requests as possible */
+enum errno bcache_read_range(struct generic_disk *disk, uint64_t lba,
+                             uint64_t blocks, uint64_t block_size,
+                             uint64_t spb);
+
+void bcache_readahead_init(struct bcache_readahead *ra);
+
+/* `stream` identifies the reader (a file, usually) and must not be 0 */
+void bcache_readahead(struct generic_disk *disk, uint64_t stream,
+                      uint64_t lba, uint64_t block_size, uint64_t spb);
+
 void *bcache_create_ent(struct generic_disk *disk, uint64_t lba,
                         uint64_t block_size, uint64_t sectors_per_block,
                         bool no_evict, struct bcache_entry **out_entry);
 
-static inline void bcache_increment_ticks(struct bcache *cache) {
-    atomic_fetch_add(&cache->ticks, 1);
-}
-
-static inline uint64_t bcache_get_ticks(struct bcache *cache) {
-    return atomic_load(&cache->ticks);
-}
-
 static inline void bcache_ent_lock(struct bcache_entry *ent) {
     mutex_lock(&ent->lock);
 }
@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <structures/list.h>
+#include <structures/rbt.h>
+#include <types/types.h>
 
 /* urgent requests bypass the bio_scheduler,
  * they get submitted immediately */
@@ -32,6 +34,14 @@ enum bio_request_status : int32_t {
     BIO_STATUS_UNKNOWN_ERR = -12
 };
 
+/* A piece of a vectored request. It never crosses a page, and is
+ * always a whole number of sectors long */
+struct bio_vec {
+    paddr_t page;
+    uint32_t offset;
+    uint32_t len;
+};
+
 /* everything WITHOUT the / const / comment next to it
  * can be changed by the scheduler during optimizations */
 struct bio_request {
@@ -46,6 +56,12 @@ struct bio_request {
 
     /* const */ void *buffer;
 
+    /* vectored requests leave `buffer` NULL and describe their memory
+     * with these instead, see `bio_add_page` */
+    /* const */ struct bio_vec *vecs;
+    /* const */ uint32_t vec_count;
+    /* const */ uint32_t vec_cap;
+
     /* buffer size in bytes  */
     uint64_t size;
 
@@ -69,6 +85,10 @@ struct bio_request {
 
     /* everything below this is internally used in scheduler */
 
+    /* hardware context it's queued on */
+    struct bio_sched_hctx *hctx;
+    struct rbt_node lba_node;
+
     /* coalescing */
     bool skip;
     bool is_aggregate;
@@ -81,11 +101,24 @@ struct bio_request {
     /* boosts are accelerated if it
      * boosts often */
     uint8_t boost_count;
+
+    /* id of the thread that submitted it, 0 if there was none,
+     * and its I/O weight at the time */
+    uint64_t issuer;
+    uint32_t io_weight;
+
+    /* owned by the ops' policy hooks while it is queued */
+    void *policy_data;
 };
 
 #define bio_request_from_list_node(ln)                                         \
     (container_of(ln, struct bio_request, list))
 
+/* Not every driver reports a status, those that don't leave it at INFLIGHT */
+static inline bool bio_request_failed(const struct bio_request *req) {
+    return req->status != BIO_STATUS_OK && req->status != BIO_STATUS_INFLIGHT;
+}
+
 struct bio_request *bio_create_write(struct generic_disk *d, uint64_t lba,
                                      uint64_t sectors, uint64_t size,
                                      void (*cb)(struct bio_request *),
@@ -95,3 +128,30 @@ struct bio_request *bio_create_read(struct generic_disk *d, uint64_t lba,
                                     uint64_t sectors, uint64_t size,
                                     void (*cb)(struct bio_request *),
                                     void *user, void *buf);
+
+/* Room for `max_vecs` vectors and nothing else, the size and sector
+ * count grow as pages get added */
+struct bio_request *bio_create_vectored(struct generic_disk *d, uint64_t lba,
+                                        bool write, uint32_t max_vecs,
+                                        void (*cb)(struct bio_request *),
+                                        void *user);
+
+/* `len` must be a whole number of sectors and `offset + len` must stay
+ * within the page. Returns false once the request is out of vectors */
+bool bio_add_page(struct bio_request *req, paddr_t page, uint32_t offset,
+                  uint32_t len);
+
+/* Adds a virtually contiguous, sector aligned buffer a page at a time */
+bool bio_add_buffer(struct bio_request *req, const void *buf, uint64_t len);
+
+/* Where PIO drivers find a vector's data */
+void *bio_vec_virt(const struct bio_vec *vec);
+
+/* For latency sensitive requests. Skips the scheduler and returns once
+ * `req` is done, spinning on the completion queue for a bit first if the
+ * driver supports polling. The status is left in `req` as usual */
+bool bio_submit_polled(struct bio_request *req);
+
+/* Only for requests from `bio_create_*`. The buffer, or the pages
+ * behind the vectors, are not freed */
+void bio_request_free(struct bio_request *req);
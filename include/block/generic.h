@@ -94,6 +94,11 @@ struct generic_disk {
     bool (*submit_bio_async)(struct generic_disk *disk,
                              struct bio_request *bio);
 
+    /* immediate submission, returns once the request is done. drivers
+     * that can poll their completion queue do so before sleeping */
+    bool (*submit_bio_polled)(struct generic_disk *disk,
+                              struct bio_request *bio);
+
     struct bio_scheduler_ops *ops;
     struct bio_scheduler *scheduler;
     struct bcache *cache;
@@ -5,11 +5,15 @@
 #include <block/generic.h>
 #include <fs/detect.h>
 #include <sch/sched.h>
+#include <smp/core.h>
+#include <structures/rbt.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <sync/mutex.h>
+#include <sync/spinlock.h>
 #include <thread/thread.h>
+#include <thread/timer.h>
 
 /*
  * This is the asynchronous block device
@@ -31,14 +35,26 @@
  *
  * When coalescing succeeds, the request with the lower LBA is marked
  * as `is_aggregate`, and the one with the higher LBA is marked `skip`.
+ * The skipped request is taken off the queues and hangs off the
+ * aggregate's `next_coalesced` chain from then on, so it goes out (and
+ * gets completed by the driver) with the aggregate.
+ *
+ * Merge candidates come from an LBA index, one rbt per direction keyed by
+ * starting LBA, holding every queued request. A request entering a context
+ * is merged with whatever ends right where it starts and whatever starts
+ * right where it ends, wherever those sit in the queues.
  *
  * ===================== Queue Structure =======================
  *
  * The scheduler uses a 5-level MLFQ to keep track of requests.
  * Each level is a different request priority level.
  *
- * The head of each MLFQ is always the first request in the queue
- * to get dispatched, and the head->next is the next, and so on.
+ * Dispatching a whole level goes in queue order. Early dispatches are
+ * deadline style instead: anything that has waited longer than
+ * `ops->max_wait_time` for its level goes first, oldest and highest
+ * level first. Otherwise the LBA index is swept upwards from where the
+ * last request ended, sticking to one direction while it has requests
+ * further up.
  *
  * The highest priority requests (BIO_RQ_URGENT) entirely skip
  * the queue and are immediately dispatched, giving them no
@@ -100,6 +116,20 @@
  *
  * Request starvation is automatically checked every `ops->tick_ms`
  * milliseconds.
+ *
+ * ===================== Multiple Queues =======================
+ *
+ * Everything above happens per hardware context (`struct bio_sched_hctx`),
+ * of which a disk has one per hardware submission queue it has. Each
+ * context has its own MLFQ and lock, and is ticked on its own.
+ *
+ * Submitters don't go to a context directly. Each CPU has a software
+ * queue (`struct bio_sched_swq`) mapped to one context, and requests are
+ * staged there first. Staged requests are merged with whatever was staged
+ * right before them, and are moved over to the context in one go, which
+ * happens right away if its lock is free, and otherwise once the CPU has
+ * staged BIO_SCHED_SWQ_BATCH requests, a HIGH priority request comes in,
+ * or the context ticks.
  */
 
 /* how many queue levels the bio_scheduler has */
@@ -112,13 +142,13 @@
 /* max of 2^4 threshold reduction */
 #define BIO_SCHED_BOOST_SHIFT_LIMIT 4
 
-/* max to scan before bail */
-#define BIO_SCHED_COALESCE_SCAN_LIMIT 8
-
 #define BIO_SCHED_MAX_BOOST_SCAN 32
 
-/* max coalesces in one enqueue() */
-#define BIO_SCHED_MAX_COALESCES 4
+/* staged requests a CPU holds on to while its context is busy */
+#define BIO_SCHED_SWQ_BATCH 8
+
+/* I/O weight of a timesharing thread, and of requests without one */
+#define BIO_SCHED_DEFAULT_WEIGHT 100
 
 struct bio_rqueue {
     struct list_head list;
@@ -129,12 +159,53 @@ struct bio_rqueue {
     bool dirty;
 };
 
-struct bio_scheduler {
+struct bio_sched_stats {
+    uint64_t front_merges;
+    uint64_t back_merges;
+
+    /* dispatched requests, merged ones count once */
+    uint64_t dispatched;
+
+    /* sectors of every bio that went out, merged ones included */
+    uint64_t dispatched_sectors;
+};
+
+struct bio_sched_hctx {
     struct generic_disk *disk;
     struct mutex lock;
     uint64_t total_requests;
     struct bio_rqueue queues[BIO_SCHED_LEVELS];
-    bool defer_pending;
+    atomic_bool tick_pending;
+    struct timer tick_timer;
+
+    /* every queued request by starting LBA, reads and writes */
+    struct rbt lba_index[2];
+
+    /* where the elevator picks up */
+    uint64_t next_lba;
+    bool next_write;
+
+    struct bio_sched_stats stats;
+
+    /* owned by the ops' policy hooks, if there are any */
+    void *policy_data;
+};
+
+struct bio_sched_swq {
+    struct spinlock lock;
+    struct list_head list;
+    uint32_t count;
+    struct bio_sched_hctx *hctx;
+
+    /* back merges done while staging */
+    uint64_t merges;
+};
+
+struct bio_scheduler {
+    struct generic_disk *disk;
+    uint32_t hctx_count;
+    struct bio_sched_hctx *hctxs;
+    struct bio_sched_swq *swqs; /* one per CPU */
 };
 
 struct bio_scheduler_ops {
@@ -142,10 +213,12 @@ struct bio_scheduler_ops {
                             const struct bio_request *a,
                             const struct bio_request *b);
 
+    /* `into` and `from` keep their own LBA and sector count, the
+     * scheduler works out the merged extent from the chain */
     void (*do_coalesce)(struct generic_disk *dev, struct bio_request *into,
                         struct bio_request *from);
 
-    void (*reorder)(struct generic_disk *dev);
+    void (*reorder)(struct generic_disk *dev, struct bio_sched_hctx *hctx);
 
     /* maximum request wait time for each queue level before first boost */
     uint32_t max_wait_time[BIO_SCHED_LEVELS];
@@ -170,6 +243,23 @@ struct bio_scheduler_ops {
      * immediately boosting at the first
      * possible opportunity */
     uint64_t min_wait_ms;
+
+    /* Optional policy hooks, all called with the context's lock held.
+     * `init_hctx` sets up `policy_data`. `select` picks what an early
+     * dispatch sends if nothing has hit its deadline yet, NULL holds
+     * everything back until the next one. `queued` and `unqueued` see
+     * every request going onto and coming off the queues, boosts and
+     * merges included. `dispatched` sees every request that leaves the
+     * queues for the disk, after `unqueued` */
+    void (*init_hctx)(struct generic_disk *dev, struct bio_sched_hctx *hctx);
+    struct bio_request *(*select)(struct generic_disk *dev,
+                                  struct bio_sched_hctx *hctx);
+    void (*queued)(struct generic_disk *dev, struct bio_sched_hctx *hctx,
+                   struct bio_request *req);
+    void (*unqueued)(struct generic_disk *dev, struct bio_sched_hctx *hctx,
+                     struct bio_request *req);
+    void (*dispatched)(struct generic_disk *dev, struct bio_sched_hctx *hctx,
+                       struct bio_request *req);
 };
 
 bool noop_should_coalesce(struct generic_disk *disk,
@@ -179,16 +269,28 @@ bool noop_should_coalesce(struct generic_disk *disk,
 void noop_do_coalesce(struct generic_disk *disk, struct bio_request *into,
                       struct bio_request *from);
 
-void noop_reorder(struct generic_disk *disk);
+void noop_reorder(struct generic_disk *disk, struct bio_sched_hctx *hctx);
+
+/* Budget fair queueing between submitting threads, see bfq_bio.c */
+void bfq_init_hctx(struct generic_disk *disk, struct bio_sched_hctx *hctx);
+void bfq_queued(struct generic_disk *disk, struct bio_sched_hctx *hctx,
+                struct bio_request *req);
+void bfq_unqueued(struct generic_disk *disk, struct bio_sched_hctx *hctx,
+                  struct bio_request *req);
+struct bio_request *bfq_select(struct generic_disk *disk,
+                               struct bio_sched_hctx *hctx);
+void bfq_dispatched(struct generic_disk *disk, struct bio_sched_hctx *hctx,
+                    struct bio_request *req);
 
 void bio_sched_enqueue(struct generic_disk *disk, struct bio_request *req);
 
 void bio_sched_dequeue(struct generic_disk *disk, struct bio_request *req,
                        bool already_locked);
 
-void bio_sched_enqueue_internal(struct bio_scheduler *sched,
+/* Returns false if `req` was urgent and went straight to the disk */
+bool bio_sched_enqueue_internal(struct bio_sched_hctx *hctx,
                                 struct bio_request *req);
-void bio_sched_dequeue_internal(struct bio_scheduler *sched,
+void bio_sched_dequeue_internal(struct bio_sched_hctx *hctx,
                                 struct bio_request *req);
 
 void bio_sched_dispatch_partial(struct generic_disk *disk,
@@ -196,40 +298,100 @@ void bio_sched_dispatch_partial(struct generic_disk *disk,
 
 void bio_sched_dispatch_all(struct generic_disk *disk);
 
-void bio_sched_try_early_dispatch(struct bio_scheduler *sched);
+void bio_sched_try_early_dispatch(struct bio_sched_hctx *hctx);
+
+/* For `should_coalesce`, whether `b` can go on `a`'s chain with everything
+ * on it still fitting in one command of `max_sectors` */
+bool bio_sched_can_merge(struct generic_disk *disk,
+                         const struct bio_request *a,
+                         const struct bio_request *b, uint64_t max_sectors);
+
+/* For drivers that coalesce. Sends `agg` and its chain through `submit` as
+ * one vectored request, and completes each of them once it is done */
+bool bio_sched_submit_aggregate(struct generic_disk *disk,
+                                struct bio_request *agg,
+                                bool (*submit)(struct generic_disk *,
+                                               struct bio_request *));
+
+bool bio_sched_coalesce_pair(struct generic_disk *disk,
+                             struct bio_request *into,
+                             struct bio_request *from);
+bool bio_sched_try_coalesce(struct bio_sched_hctx *hctx,
+                            struct bio_request *req);
+bool bio_sched_boost_starved(struct bio_sched_hctx *hctx);
+
+void bio_sched_index_init(struct bio_sched_hctx *hctx);
+void bio_sched_index_insert(struct bio_sched_hctx *hctx,
+                            struct bio_request *req);
+void bio_sched_index_remove(struct bio_sched_hctx *hctx,
+                            struct bio_request *req);
+struct bio_request *bio_sched_index_ending_at(struct bio_sched_hctx *hctx,
+                                              bool write, uint64_t lba);
+struct bio_request *bio_sched_index_starting_at(struct bio_sched_hctx *hctx,
+                                                bool write, uint64_t lba);
+struct bio_request *bio_sched_index_next(struct bio_sched_hctx *hctx);
+uint64_t bio_sched_extent_end(const struct bio_request *req);
+
+/* Summed up over every context of `disk`. `avg_io_bytes_out` is the
+ * average size of what actually got sent to the disk */
+void bio_sched_stat(struct generic_disk *disk, struct bio_sched_stats *out,
+                    uint64_t *avg_io_bytes_out);
+
+/* Returns true if the CPU's batch is full and should go out now */
+bool bio_sched_swq_stage(struct bio_sched_swq *swq, struct bio_request *req);
+void bio_sched_swq_drain(struct bio_sched_swq *swq);
+void bio_sched_drain_swqs(struct bio_sched_hctx *hctx);
+
+/* `hw_queues` is how many queues the hardware can be submitted to
+ * concurrently, CPUs get spread evenly across them */
+struct bio_scheduler *bio_sched_create(struct generic_disk *disk,
+                                       struct bio_scheduler_ops *ops,
+                                       uint32_t hw_queues);
 
-bool bio_sched_try_coalesce(struct bio_scheduler *sched);
-bool bio_sched_boost_starved(struct bio_scheduler *sched);
+static inline struct bio_sched_swq *
+bio_sched_swq_local(struct bio_scheduler *sched) {
+    return &sched->swqs[smp_core_id()];
+}
 
-struct bio_scheduler *bio_sched_create(struct generic_disk *disk,
-                                       struct bio_scheduler_ops *ops);
+/* Relative share of the disk a thread's class gets under policies
+ * that care about who submitted what */
+static inline uint32_t bio_sched_thread_weight(struct thread *t) {
+    static const uint32_t weights[THREAD_PRIO_CLASS_COUNT] = {
+        [THREAD_PRIO_CLASS_BACKGROUND] = 25,
+        [THREAD_PRIO_CLASS_TIMESHARE] = BIO_SCHED_DEFAULT_WEIGHT,
+        [THREAD_PRIO_CLASS_RT] = 400,
+        [THREAD_PRIO_CLASS_URGENT] = 1000,
+    };
+
+    return t ? weights[t->perceived_prio_class] : BIO_SCHED_DEFAULT_WEIGHT;
+}
 
 static inline void update_request_timestamp(struct bio_request *req) {
     req->enqueue_time = time_get_ms();
 }
 
-static inline bool submit_if_urgent(struct bio_scheduler *sched,
+static inline bool submit_if_urgent(struct generic_disk *disk,
                                     struct bio_request *req) {
     if (req->priority == BIO_RQ_URGENT) {
         /* VIP request - skip the queue ! */
-        sched->disk->submit_bio_async(sched->disk, req);
+        disk->submit_bio_async(disk, req);
         return true;
     }
     return false;
 }
 
-static inline bool sched_is_empty(struct bio_scheduler *sched) {
+static inline bool hctx_is_empty(struct bio_sched_hctx *hctx) {
     for (uint32_t i = 0; i < BIO_SCHED_LEVELS; i++)
-        if (!list_empty(&sched->queues[i].list))
+        if (!list_empty(&hctx->queues[i].list))
             return false;
 
     return true;
 }
 
-static inline bool submit_if_skip_sched(struct bio_scheduler *sched,
+static inline bool submit_if_skip_sched(struct generic_disk *disk,
                                         struct bio_request *req) {
-    if (disk_skip_sched(sched->disk)) {
-        sched->disk->submit_bio_async(sched->disk, req);
+    if (disk_skip_sched(disk)) {
+        disk->submit_bio_async(disk, req);
         return true;
     }
     return false;
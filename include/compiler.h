@@ -48,6 +48,10 @@
 
 #define __fallthrough __attribute__((fallthrough))
 
+/* Keeps GCC from turning copy/fill loops back into memcpy/memset calls */
+#define __no_builtin_patterns                                                  \
+    __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
 #if defined(__GNUC__)
 #define __restrict __restrict__
 #else
@@ -6,6 +6,8 @@
 #include <log.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <structures/list.h>
+#include <sync/spinlock.h>
 #include <thread/thread.h>
 
 #define AHCI_CMD_TIMEOUT_MS 5000    // Data commands (read/write)
@@ -29,6 +31,17 @@
 
 #define AHCI_MAX_PORTS 32
 #define AHCI_MAX_SLOTS 32
+#define AHCI_MAX_CMD_SECTORS 65536 // a count of 0 means this many
+
+/* PRDs that fit in the page each slot's command table gets */
+#define AHCI_CMD_TABLE_PRDS 248
+
+/* Worst case for a buffer that is scattered all over physical memory and
+ * only uses the tail end of its first page */
+#define AHCI_MAX_CMD_BYTES ((AHCI_CMD_TABLE_PRDS - 1) * PAGE_SIZE)
+
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1) // Command slots
+#define AHCI_CAP_SNCQ (1U << 30)                      // Supports NCQ
 
 #define AHCI_PORT_CLB 0x00  // Command List Base Address
 #define AHCI_PORT_CLBU 0x04 // Command List Base Address Upper
@@ -69,6 +82,13 @@
 
 #define AHCI_CMD_READ_DMA_EXT 0x25
 #define AHCI_CMD_WRITE_DMA_EXT 0x35
+#define AHCI_CMD_READ_FPDMA_QUEUED 0x60
+#define AHCI_CMD_WRITE_FPDMA_QUEUED 0x61
+
+/* IDENTIFY DEVICE words */
+#define AHCI_IDENT_QUEUE_DEPTH 75 // bits 4:0, queue depth - 1
+#define AHCI_IDENT_SATA_CAP 76    // bit 8, NCQ supported
+#define AHCI_IDENT_SATA_CAP_NCQ (1U << 8)
 
 #define AHCI_CMD_IDENTIFY 0xEC
 #define AHCI_CMD_ST (1U << 0)  // Start
@@ -173,8 +193,17 @@ struct ahci_full_port {
     struct ahci_cmd_table **cmd_tables;
     struct ahci_cmd_header **cmd_hdrs;
 
-    volatile _Atomic uint32_t slot_bitmap;
+    /* Everything below is protected by the lock, which the ISR takes */
+    struct ahci_request *requests[AHCI_MAX_SLOTS];
+    uint32_t slot_bitmap;
+    uint32_t slot_count; /* CAP.NCS, or the device queue depth with NCQ */
+    bool ncq;
+
+    /* Requests that found every slot taken, issued as slots free up */
+    struct list_head waiting;
+    struct spinlock lock;
 };
+SPINLOCK_GENERATE_LOCK_UNLOCK_FOR_STRUCT(ahci_full_port, lock);
 
 struct ahci_port {
     uint32_t clb;       // Command List Base (lower 32 bits)
@@ -207,11 +236,6 @@ struct ahci_device {
     struct ahci_controller *ctrl;
     uint64_t port_count;
 
-    struct thread *io_waiters[AHCI_MAX_PORTS][32];
-    uint16_t io_statuses[AHCI_MAX_PORTS][32];
-
-    struct ahci_request *io_requests[AHCI_MAX_PORTS][32];
-
     uint8_t irq_num;
     struct spinlock lock;
     struct ahci_full_port regs[32]; // Pointer to port registers
@@ -281,27 +305,41 @@ struct ahci_request {
     uint64_t size;
     uint64_t sector_count;
     bool write;
-    bool trigger_completion;
+
+    /* Set instead of `buffer` for vectored bios */
+    const struct bio_vec *vecs;
+    uint32_t vec_count;
 
     volatile bool done;
     int status;
 
+    /* Woken on completion, for sync requests */
+    struct thread *waiter;
+
+    /* Requests too big for one command go out as several parts, the
+     * last one to complete completes the request they came from */
+    struct ahci_request *parent;
+    _Atomic uint32_t remaining_parts;
+
     void (*on_complete)(struct ahci_request *);
     void *user_data;
+
+    /* On the port's wait queue until a slot is free */
+    struct list_head list;
 };
 
 void ahci_discover(struct ahci_controller *ctrl);
-uint32_t ahci_find_slot(struct ahci_full_port *port);
 struct ahci_disk *ahci_setup_controller(struct ahci_controller *ctrl,
                                         uint32_t *d_cnt);
 void ahci_identify(struct ahci_disk *disk);
-void ahci_prepare_command(struct ahci_full_port *port, uint32_t slot,
-                          bool write, uint8_t *buf, uint64_t size);
+void ahci_prepare_command(struct ahci_full_port *port,
+                          const struct ahci_request *req);
 void ahci_setup_fis(struct ahci_cmd_table *cmd_tbl, uint8_t command,
                     bool is_atapi);
 
-void ahci_send_command(struct ahci_disk *disk, struct ahci_full_port *port,
-                       struct ahci_request *req);
+void ahci_submit_request(struct ahci_disk *disk, struct ahci_request *req);
+void ahci_build_command(struct ahci_full_port *port, struct ahci_request *req);
+void ahci_process_completions(struct ahci_device *dev, uint32_t port);
 
 struct ahci_disk *ahci_discover_device(uint8_t bus, uint8_t device,
                                        uint8_t function,
@@ -343,7 +381,7 @@ bool ahci_should_coalesce(struct generic_disk *disk,
                           const struct bio_request *a,
                           const struct bio_request *b);
 
-void ahci_reorder(struct generic_disk *disk);
+void ahci_reorder(struct generic_disk *disk, struct bio_sched_hctx *hctx);
 
 struct generic_disk *ahci_create_generic(struct ahci_disk *disk);
 enum irq_result ahci_isr_handler(void *ctx, uint8_t vector,
@@ -57,6 +57,7 @@
 #define ATA_SECONDARY_CTRL 0x376
 
 struct pci_device;
+struct bio_sched_hctx;
 
 enum ide_type {
     IDE_TYPE_ATA,
@@ -206,6 +207,6 @@ bool atapi_identify(struct ata_drive *ide);
 void ata_init(struct pci_device *devices, uint64_t count);
 enum irq_result ide_irq_handler(void *ctx, uint8_t irq_num,
                                 struct irq_context *ct);
-void ide_reorder(struct generic_disk *disk);
+void ide_reorder(struct generic_disk *disk, struct bio_sched_hctx *hctx);
 bool ide_submit_bio_async(struct generic_disk *d, struct bio_request *b);
 struct generic_disk *atapi_create_generic(struct ata_drive *d);
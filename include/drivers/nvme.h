@@ -7,7 +7,8 @@
 #include <stdint.h>
 #include <sync/semaphore.h>
 #include <sync/spinlock.h>
-#include <thread/workqueue.h>
+#include <thread/dpc.h>
+#include <types/types.h>
 
 struct nvme_command {
     uint8_t opc;
@@ -71,9 +72,13 @@ struct nvme_regs {
     uint32_t reserved4[1018];
 } __attribute__((aligned));
 
-struct nvme_bio_data {
-    uint64_t *prps;
-    uint64_t prp_count;
+/* Polled requests only. Whoever moves it to DONE while it is SLEEPING
+ * has to wake the poller */
+enum nvme_poll_state : uint8_t {
+    NVME_POLL_NONE,
+    NVME_POLL_SPINNING,
+    NVME_POLL_SLEEPING,
+    NVME_POLL_DONE,
 };
 
 struct nvme_request {
@@ -84,14 +89,29 @@ struct nvme_request {
     uint64_t sector_count;
     bool write;
 
+    /* Set instead of `buffer` for vectored bios, the PRPs are built
+     * straight from these */
+    const struct bio_vec *vecs;
+    uint32_t vec_count;
+
     volatile bool done;
     volatile uint16_t status;
-    int32_t remaining_parts;
+    _Atomic int32_t remaining_parts;
 
     void (*on_complete)(struct nvme_request *);
-    struct nvme_bio_data *bio_data;
     struct thread *waiter;
 
+    /* Set on submission, requests parked on a queue's waiting list get
+     * resent to the namespace they were meant for */
+    struct generic_disk *disk;
+
+    /* Bios bigger than the MDTS go out as several parts, each of which
+     * completes into the request it was split from */
+    struct nvme_request *parent;
+
+    _Atomic enum nvme_poll_state poll_state;
+    struct thread *poller;
+
     void *user_data;
 
     struct list_head list_node;
@@ -102,6 +122,30 @@ struct nvme_waiting_requests {
     struct list_head list;
 };
 
+#define NVME_POLL_HIST_BUCKETS 24 /* log2(ns), so up to ~16ms */
+
+/* Latency of recent polled requests on a queue, from submission to
+ * completion, which is what the spin budget is worked out from */
+struct nvme_poll_stats {
+    _Atomic uint32_t hist[NVME_POLL_HIST_BUCKETS];
+    _Atomic uint32_t samples;
+
+    _Atomic uint64_t hits;   /* completed while the submitter spun */
+    _Atomic uint64_t misses; /* submitter ended up going to sleep */
+};
+
+#define NVME_PRP_LIST_ENTRIES (PAGE_SIZE / sizeof(uint64_t))
+
+/* One per CID, set up when the queue is created. The PRP list is big
+ * enough for max_transfer_size and is only handed to the controller if
+ * a transfer spans three or more pages, so nothing is allocated on the
+ * I/O path */
+struct nvme_cmd_ctx {
+    struct nvme_request *req;
+    uint64_t *prp_list;
+    paddr_t prp_list_phys;
+};
+
 struct nvme_queue {
     struct nvme_command *sq;    // Submission queue (virtual)
     struct nvme_completion *cq; // Completion queue (virtual)
@@ -116,9 +160,25 @@ struct nvme_queue {
     uint32_t *sq_db;
     uint32_t *cq_db;
 
-    struct nvme_request **sq_requests;
+    /* Indexed by CID. CIDs come off the free stack, so a command that
+     * completes out of order never has its CID handed out twice */
+    struct nvme_cmd_ctx *ctxs;
+    uint16_t *free_cids;
+    uint16_t free_count;
     _Atomic uint16_t outstanding;
 
+    uint32_t qid;
+    struct nvme_device *dev;
+
+    /* Requests that found the queue full, resubmitted as slots free up */
+    struct nvme_waiting_requests waiting;
+
+    /* The ISR only queues this, the CQ is reaped and the requests are
+     * completed in it, on the CPU the queue's vector is routed to */
+    struct dpc dpc;
+
+    struct nvme_poll_stats poll;
+
     struct spinlock lock;
 };
 
@@ -141,26 +201,29 @@ struct nvme_device {
     uint16_t admin_q_depth;
     uint8_t admin_cq_phase;
 
-    /* Array of pointers to queues */
+    /* Array of pointers to queues, indexed by QID, so [0] is unused */
     struct nvme_queue **io_queues;
 
-    struct nvme_waiting_requests waiting_requests;
-    struct nvme_waiting_requests finished_requests;
-    struct work work;
-
-    atomic_bool on_sem;
-    struct semaphore sem;
-
     uint8_t *isr_index;
     uint32_t queue_count;
 
-    uint32_t sector_size;
     uint64_t max_transfer_size;
-    struct generic_disk *generic_disk;
+    uint16_t io_queue_depth;
+    uint32_t prp_list_size;
+
+    struct nvme_namespace *namespaces;
+    uint32_t namespace_count;
 
     _Atomic uint64_t total_outstanding;
+};
 
-    struct workqueue *workqueue;
+/* One generic_disk each, that is what disk->driver_data points to */
+struct nvme_namespace {
+    struct nvme_device *dev;
+    uint32_t nsid;
+    uint32_t sector_size;
+    uint64_t sector_count;
+    struct generic_disk *disk;
 };
 
 struct nvme_identify {
@@ -270,18 +333,20 @@ uint16_t nvme_submit_admin_cmd(struct nvme_device *nvme,
 uint32_t nvme_set_num_queues(struct nvme_device *nvme, uint16_t desired_sq,
                              uint16_t desired_cq);
 
-void nvme_submit_io_cmd(struct nvme_device *nvme, struct nvme_command *cmd,
+bool nvme_submit_io_cmd(struct nvme_device *nvme, struct nvme_command *cmd,
                         uint32_t qid, struct nvme_request *req);
 
 uint8_t *nvme_identify_controller(struct nvme_device *nvme);
 uint8_t *nvme_identify_namespace(struct nvme_device *nvme, uint32_t nsid);
+uint32_t *nvme_identify_active_namespaces(struct nvme_device *nvme);
+void nvme_scan_namespaces(struct nvme_device *nvme);
 void nvme_enable_controller(struct nvme_device *nvme);
 void nvme_setup_admin_queues(struct nvme_device *nvme);
 void nvme_alloc_admin_queues(struct nvme_device *nvme);
 void nvme_alloc_io_queues(struct nvme_device *nvme, uint32_t qid);
 struct nvme_device *nvme_discover_device(uint8_t bus, uint8_t slot,
                                          uint8_t func);
-struct generic_disk *nvme_create_generic(struct nvme_device *nvme);
+struct generic_disk *nvme_create_generic(struct nvme_namespace *ns);
 void nvme_print_identify(const struct nvme_identify_controller *ctrl);
 void nvme_print_namespace(const struct nvme_identify_namespace *ns);
 
@@ -305,6 +370,15 @@ enum irq_result nvme_isr_handler(void *ctx, uint8_t vector,
 bool nvme_submit_bio_request(struct generic_disk *disk,
                              struct bio_request *bio);
 
+bool nvme_submit_bio_polled(struct generic_disk *disk,
+                            struct bio_request *bio);
+
+/* How many polled requests on I/O queue `qid` (1-based) completed while
+ * their submitter spun, and how many had it go to sleep. False if there
+ * is no such queue */
+bool nvme_poll_stat(struct generic_disk *disk, uint32_t qid, uint64_t *hits,
+                    uint64_t *misses);
+
 bool nvme_should_coalesce(struct generic_disk *disk,
                           const struct bio_request *a,
                           const struct bio_request *b);
@@ -312,7 +386,7 @@ bool nvme_should_coalesce(struct generic_disk *disk,
 void nvme_do_coalesce(struct generic_disk *disk, struct bio_request *into,
                       struct bio_request *from);
 
-void nvme_reorder(struct generic_disk *disk);
-void nvme_work(void *rvoid, void *dvoid);
+void nvme_reorder(struct generic_disk *disk, struct bio_sched_hctx *hctx);
+void nvme_completion_dpc(struct dpc *dpc, void *ctx);
 
 SPINLOCK_GENERATE_LOCK_UNLOCK_FOR_STRUCT(nvme_waiting_requests, lock);
@@ -17,6 +17,7 @@ extern uint64_t PTRS_PER_BLOCK;
 #define EXT2_PRIO_SBLOCK BIO_RQ_LOW
 
 #define EXT2_NBLOCKS 15
+#define EXT2_NDIR_BLOCKS 12 // direct blocks, the indirect ones come after
 #define EXT2_SUPERBLOCK_OFFSET 1024
 #define EXT2_SIGNATURE_OFFSET 0x38
 #define EXT2_SIGNATURE 0xEF53
@@ -200,10 +201,27 @@ struct ext2_inode {
     uint8_t osd2[12];
 } __packed;
 
+#define EXT2_MAP_CACHE_RUNS 4 /* mapping runs remembered per inode */
+
+/* Logical blocks [logical, logical + len) live at [physical, physical + len).
+ * Runs never cover holes, so allocating blocks never makes one stale */
+struct ext2_map_run {
+    uint32_t logical;
+    uint32_t physical;
+    uint32_t len; /* 0 is an unused slot */
+};
+
+struct ext2_map_cache {
+    struct ext2_map_run runs[EXT2_MAP_CACHE_RUNS];
+    uint32_t next; /* slot that gets replaced next */
+    struct spinlock lock;
+};
+
 struct ext2_full_inode {
     struct ext2_inode node;
     uint32_t inode_num;
     struct bcache_entry *ent;
+    struct ext2_map_cache map;
 };
 
 struct ext2_dir_entry {
@@ -275,6 +293,14 @@ uint32_t ext2_get_or_set_block(struct ext2_fs *fs, struct ext2_inode *inode,
                                uint32_t block_index, uint32_t new_block_num,
                                bool allocate, bool *was_allocated);
 
+/* Read-only mapping of a logical block. `run_len` gets how many blocks
+ * from there on are contiguous on disk, 0 for a hole */
+uint32_t ext2_map_block(struct ext2_fs *fs, struct ext2_full_inode *inode,
+                        uint32_t block_index, uint32_t *run_len);
+
+/* Anything that frees or moves blocks of the inode has to call this */
+void ext2_map_invalidate(struct ext2_full_inode *inode);
+
 //
 //
 // Util
@@ -321,6 +347,23 @@ static inline void ext2_prefetch_block(struct ext2_fs *fs, uint32_t block) {
                           fs->sectors_per_block);
 }
 
+/* Streams are per inode, so two files being read at once don't look
+ * like one reader seeking back and forth */
+static inline void ext2_readahead(struct ext2_fs *fs, uint32_t inode_num,
+                                  uint32_t block) {
+    uint32_t lba = ext2_block_to_lba(fs, block);
+    bcache_readahead(fs->drive, inode_num, lba, fs->block_size,
+                     fs->sectors_per_block);
+}
+
+/* Pulls `count` physically contiguous blocks into the cache at once */
+static inline enum errno ext2_read_blocks(struct ext2_fs *fs, uint32_t block,
+                                          uint32_t count) {
+    uint32_t lba = ext2_block_to_lba(fs, block);
+    return bcache_read_range(fs->drive, lba, count, fs->block_size,
+                             fs->sectors_per_block);
+}
+
 static inline void ext2_inode_lock(struct ext2_full_inode *ino) {
     bcache_ent_lock(ino->ent);
 }
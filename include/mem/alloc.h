@@ -258,3 +258,6 @@ void *kzalloc_aligned_internal(size_t size, size_t align,
                                enum alloc_flags flags,
                                enum alloc_behavior behavior);
 void kfree_aligned_internal(void *ptr, enum alloc_behavior behavior);
+
+/* Always backed by whole pages of its own, never by a slab */
+void *kzalloc_pages(size_t size);
@@ -8,6 +8,7 @@ void domain_buddies_init(void);
 void domain_free(paddr_t address, size_t page_count);
 paddr_t domain_alloc(size_t pages, enum alloc_flags flags);
 paddr_t domain_alloc_from_domain(struct domain *cd, size_t pages);
+paddr_t domain_alloc_hugepage(struct domain *cd);
 void domain_buddy_dump(void);
 void domain_buddies_init_late();
 struct domain *domain_for_addr(paddr_t addr);
@@ -1,6 +1,8 @@
 /* @title: Slab allocator */
 #pragma once
 #include <compiler.h>
+#include <mem/alloc.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <structures/list.h>
@@ -32,6 +34,84 @@ struct slab_size_constant {
 
 #define SLAB_OBJ_ALIGN_DEFAULT 8u
 
+/* Object caches ("kmem caches") sit on top of the slab domains and hand out
+ * objects that are already in their constructed state.
+ *
+ * The constructor runs once, when an object is first carved out of the slab
+ * heap, and the destructor runs once, when the object is finally handed back
+ * to it. In between, objects bounce between per-CPU magazines and a per-domain
+ * depot without being touched, so callers MUST give objects back to the cache
+ * in the same state that the constructor left them in. */
+
+typedef bool (*kmem_cache_ctor_t)(void *obj); /* false = construction failed */
+typedef void (*kmem_cache_dtor_t)(void *obj);
+
+/* Only the slow paths count here, the rest is kept per CPU */
+struct kmem_cache_stats {
+    atomic_size_t constructs;
+    atomic_size_t destructs;
+};
+
+struct kmem_cache_cpu;
+
+struct kmem_cache {
+    const char *name;
+    size_t size;
+    size_t align;
+    kmem_cache_ctor_t ctor;
+    kmem_cache_dtor_t dtor;
+
+    struct kmem_cache_cpu *cpus;    /* global.core_count of these */
+    struct slab_free_queue *depots; /* global.domain_count depots */
+
+    /* Until the slab domains are up, the cache passes
+     * straight through to kmalloc/kfree */
+    bool ready;
+
+    struct kmem_cache_stats stats;
+    struct list_head list;
+} __linker_aligned;
+
+#define KMEM_CACHE_DEFINE(n, s, a, c, d)                                       \
+    static struct kmem_cache n                                                 \
+        __attribute__((section(".kernel_kmem_caches"), used)) = {              \
+            .name = #n,                                                        \
+            .size = s,                                                         \
+            .align = a,                                                        \
+            .ctor = c,                                                         \
+            .dtor = d,                                                         \
+            .list = LIST_HEAD_INIT(n.list),                                    \
+    }
+
+/* convenience wrapper */
+#define KMEM_CACHE_DEFINE_FOR_STRUCT(n, sname, a, c, d)                        \
+    KMEM_CACHE_DEFINE(n, sizeof(struct sname), a, c, d)
+
+#define kmem_cache_alloc_1(c)                                                  \
+    kmem_cache_alloc_internal((c), ALLOC_BEHAVIOR_DEFAULT)
+#define kmem_cache_alloc_2(c, bh) kmem_cache_alloc_internal((c), (bh))
+#define kmem_cache_alloc(...)                                                  \
+    _DISPATCH(kmem_cache_alloc, PP_NARG(__VA_ARGS__))(__VA_ARGS__)
+
+#define kmem_cache_free_2(c, obj)                                              \
+    kmem_cache_free_internal((c), (obj), ALLOC_BEHAVIOR_DEFAULT)
+#define kmem_cache_free_3(c, obj, bh) kmem_cache_free_internal((c), (obj), (bh))
+#define kmem_cache_free(...)                                                   \
+    _DISPATCH(kmem_cache_free, PP_NARG(__VA_ARGS__))(__VA_ARGS__)
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, kmem_cache_ctor_t ctor,
+                                     kmem_cache_dtor_t dtor);
+void *kmem_cache_alloc_internal(struct kmem_cache *cache,
+                                enum alloc_behavior behavior);
+void kmem_cache_free_internal(struct kmem_cache *cache, void *obj,
+                              enum alloc_behavior behavior);
+
+/* Destroys every object sitting in the depots. Magazines are left alone */
+size_t kmem_cache_shrink(struct kmem_cache *cache);
+void kmem_caches_init(void);
+void kmem_caches_print(void);
+
 void slab_allocator_init();
 void slab_domain_init(void);
 void slab_domains_print();
@@ -39,3 +119,5 @@ void slab_domain_init_late();
 
 extern struct slab_size_constant __skernel_slab_sizes[];
 extern struct slab_size_constant __ekernel_slab_sizes[];
+extern struct kmem_cache __skernel_kmem_caches[];
+extern struct kmem_cache __ekernel_kmem_caches[];
@@ -0,0 +1,32 @@
+/* @title: Memory operations */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Below this, `rep movsb`/`rep stosb` startup cost dominates on
+ * ERMS parts without FSRM, so the word loops are used instead */
+#define MEMOPS_ERMS_MIN 128
+
+/* Non-temporal stores only pay off once the copy no longer fits in the
+ * cache, so the threshold is derived from the LLC size when it's known */
+#define MEMOPS_NT_THRESHOLD_DEFAULT (1024 * 1024)
+#define MEMOPS_NT_THRESHOLD_MIN (256 * 1024)
+
+typedef void (*memops_copy_fn_t)(void *dest, const void *src, size_t n);
+typedef void (*memops_fill_fn_t)(void *s, uint8_t c, size_t n);
+
+struct memops_impl {
+    const char *name;
+    uint64_t required_features; /* CPU_FEAT_* bits this one needs */
+    memops_copy_fn_t copy;
+    memops_fill_fn_t fill;
+};
+
+/* Picks the fastest implementation that the CPU supports and that
+ * passes the self-test. Until this runs, the word-sized fallbacks
+ * are in use, so it is fine for early boot to call memcpy and friends */
+void memops_init(uint64_t cpu_features, size_t llc_bytes);
+const char *memops_name(void);
+size_t memops_nt_threshold(void);
+bool memops_nt_enabled(void);
@@ -1,18 +1,31 @@
 /* @title: Scheduling domains */
 #pragma once
 #include <smp/domain.h>
+#include <stdatomic.h>
 #include <stdint.h>
 
+/* How long a group's cached load is trusted before someone sums it up
+ * again from the groups below it */
+#define SCHEDULER_GROUP_LOAD_TTL_MS 4
+
 /* per-group: cluster of CPUs in one domain node */
 struct scheduler_group {
     struct cpu_mask cpus; /* CPUs in this group (copy of topology_node->cpus) */
     struct cpu_mask idle; /* idle map (mirrors topology_node->idle) */
-    uint64_t load;        /* aggregated load metric for group (normalized) */
     uint32_t capacity; /* capacity hint for the group (sum of CPU capacities) */
 
+    /* aggregated load metric for group, summed up from the groups below
+     * again once `load_stamp_ms` is older than the TTL */
+    _Atomic uint64_t load;
+    _Atomic uint64_t load_stamp_ms;
+
     int32_t parent_index; /* index into sched_domain->groups for parent
                              group (-1 none) */
     int32_t topo_index;   /* index of topology_node used to build this group */
+
+    int32_t *children; /* indices into the domain one level down */
+    size_t nchildren;
+    int32_t cpu;       /* SMT groups are a single CPU, this is it */
 };
 
 /* per-domain: list of groups at same level */
@@ -0,0 +1,45 @@
+/* @title: Idle governor */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define IDLE_MAX_STATES 8
+
+enum idle_entry : uint8_t {
+    IDLE_ENTRY_HALT,  /* STI; HLT */
+    IDLE_ENTRY_MWAIT, /* MONITOR the resched flag, MWAIT with a hint */
+    IDLE_ENTRY_IO,    /* read the _CST I/O port */
+};
+
+struct idle_state {
+    char name[8];
+    enum idle_entry entry;
+    uint32_t hint; /* MWAIT hint or I/O port */
+    uint32_t exit_latency_us;
+
+    /* has to sleep at least this long for the state to pay off */
+    uint32_t target_residency_us;
+};
+
+struct idle_state_stats {
+    uint64_t usage;
+    uint64_t residency_us;
+};
+
+/* Per-CPU, lives in struct core */
+struct idle_governor_data {
+    /* running average of how long idle lasted, in us */
+    uint64_t predicted_us;
+    struct idle_state_stats stats[IDLE_MAX_STATES];
+};
+
+/* Builds the state table from _CST, or a lone C1 without one */
+void idle_init(void);
+
+/* One trip into the deepest state the governor thinks will pay off.
+ * Returns once something woke the CPU */
+void idle_enter(void);
+
+size_t idle_state_count(void);
+const struct idle_state *idle_state_get(size_t idx);
+void idle_get_stats(size_t cpu, struct idle_state_stats *out);
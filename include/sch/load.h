@@ -0,0 +1,52 @@
+/* @title: Load tracking */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Per-entity load tracking. Time is cut into ~1ms periods, and what
+ * happened in each period counts for less the older it is, halving
+ * every LOAD_AVG_HALFLIFE periods. A thread that always runs ends up
+ * at LOAD_SCALE, one that runs a quarter of the time at about a
+ * quarter of it, no matter how it got there. */
+
+#define LOAD_AVG_PERIOD_US 1024
+#define LOAD_AVG_HALFLIFE 32
+
+/* Sum of a signal that was always on, 1024 * (1 + y + y^2 + ...) */
+#define LOAD_AVG_MAX 47742
+
+/* What one always-busy thread or one fully used CPU adds up to */
+#define LOAD_SCALE 1024
+
+struct load_avg {
+    uint64_t last_update_us;
+    uint64_t runnable_sum;
+    uint64_t running_sum;
+    uint32_t period_contrib; /* us into the current period */
+
+    /* waiting or running, this can go past LOAD_SCALE on a runqueue,
+     * once for every thread that is always runnable on it */
+    uint32_t runnable_avg;
+    uint32_t util_avg; /* only running, never past LOAD_SCALE */
+
+    /* what gets accumulated until the next update */
+    uint32_t nr_runnable;
+    bool running;
+};
+
+/* Brings the averages up to `now_us` with whatever was set last */
+void load_avg_update(struct load_avg *la, uint64_t now_us);
+
+/* Same, then accumulates the new state from here on */
+void load_avg_set(struct load_avg *la, uint64_t now_us, uint32_t nr_runnable,
+                  bool running);
+
+/* Moves a thread's history between runqueues, so a migration shows up
+ * right away and not over the next few dozen periods */
+void load_avg_attach(struct load_avg *rq, const struct load_avg *t);
+void load_avg_detach(struct load_avg *rq, const struct load_avg *t);
+
+/* What the averages would read if they were updated at `now_us`, for
+ * reading another CPU's without writing to it */
+uint32_t load_avg_runnable(const struct load_avg *la, uint64_t now_us);
+uint32_t load_avg_util(const struct load_avg *la, uint64_t now_us);
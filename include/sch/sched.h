@@ -3,6 +3,7 @@
 #include <acpi/lapic.h>
 #include <global.h>
 #include <sch/domain.h>
+#include <sch/load.h>
 #include <smp/core.h>
 #include <smp/topology.h>
 #include <stdarg.h>
@@ -19,6 +20,9 @@
 
 #define SCHEDULER_DEFAULT_WORK_STEAL_MIN_DIFF 130
 
+/* Failed steals double the wait before the next try, up to this */
+#define SCHEDULER_STEAL_BACKOFF_MAX_MS 32
+
 struct idle_thread_data {
     _Atomic uint64_t last_entry_ms;
     uint64_t last_exit_ms;
@@ -66,11 +70,15 @@ struct scheduler {
 
     uint64_t core_id;
 
-    /* TODO: Rework time load balancing away from this foolery */
+    /* Decayed runnable/running average of everything on this runqueue,
+     * what balancing and stealing go by */
+    struct load_avg load;
 
     /* Work steal/migration */
     atomic_bool being_robbed;
     atomic_bool stealing_work;
+    time_t steal_backoff_ms;
+    time_t next_steal_ms;
 
     struct spinlock lock;
 
@@ -113,6 +121,9 @@ uint64_t scheduler_compute_steal_threshold();
 struct thread *scheduler_try_do_steal(struct scheduler *sched);
 
 struct scheduler *scheduler_pick_victim(struct scheduler *self);
+
+void scheduler_steal_failed(struct scheduler *sched, time_t now);
+void scheduler_steal_succeeded(struct scheduler *sched);
 struct thread *scheduler_steal_work(struct scheduler *new,
                                     struct scheduler *victim);
 
@@ -120,6 +131,7 @@ size_t scheduler_try_push_to_idle_core(struct scheduler *sched);
 
 void scheduler_tick_enable();
 void scheduler_tick_disable();
+void scheduler_tick_update_load(void);
 enum irq_result scheduler_timer_isr(void *ctx, uint8_t vector,
                                     struct irq_context *rsp);
 
@@ -203,6 +215,11 @@ static inline void scheduler_force_resched(struct scheduler *sched) {
         }
 
         scheduler_mark_core_needs_resched(other, true);
+
+        /* it's sleeping on the flag, the store already woke it up */
+        if (atomic_load(&other->idle_polling))
+            return;
+
         ipi_send(sched->core_id, IRQ_SCHEDULER);
     }
 }
@@ -0,0 +1,52 @@
+/* @title: Tick */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Each CPU has one LAPIC timer, and it's only ever armed for whichever
+ * of these is due first. Nothing armed means no interrupts at all,
+ * which is what an idle CPU with no pending timers gets */
+enum tick_event : uint8_t {
+    TICK_EVENT_SLICE, /* end of the running thread's timeslice */
+    TICK_EVENT_TIMER, /* next thing this CPU's timer wheel has to do */
+    TICK_EVENT_COUNT,
+};
+
+#define TICK_NEVER UINT64_MAX
+
+/* Longest the LAPIC is armed for in one go. Anything further out just
+ * takes an extra interrupt to get re-armed, and it keeps the TSC math
+ * from overflowing */
+#define TICK_MAX_DELTA_US 1000000ULL
+
+struct tick_state {
+    uint64_t deadline_us[TICK_EVENT_COUNT];
+
+    /* what the LAPIC is armed for, TICK_NEVER if nothing */
+    uint64_t armed_us;
+
+    /* the LAPIC timer is set up, until then deadlines are only kept */
+    bool ready;
+};
+
+static inline void tick_state_init(struct tick_state *ts) {
+    for (uint32_t i = 0; i < TICK_EVENT_COUNT; i++)
+        ts->deadline_us[i] = TICK_NEVER;
+
+    ts->armed_us = TICK_NEVER;
+    ts->ready = false;
+}
+
+static inline uint64_t tick_next_deadline(struct tick_state *ts) {
+    uint64_t next = TICK_NEVER;
+    for (uint32_t i = 0; i < TICK_EVENT_COUNT; i++)
+        if (ts->deadline_us[i] < next)
+            next = ts->deadline_us[i];
+
+    return next;
+}
+
+/* All of these work on the calling CPU's timer */
+void tick_set_deadline(enum tick_event ev, uint64_t deadline_us);
+void tick_start(void);
+void tick_handle(void);
@@ -1,6 +1,8 @@
 /* @title: Per-CPU structure */
 #pragma once
+#include <sch/idle.h>
 #include <sch/irql.h>
+#include <sch/tick.h>
 #include <smp/topology.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -13,6 +15,10 @@
 #define CPU_FEAT_AVX (1ULL << 1)
 #define CPU_FEAT_AVX2 (1ULL << 2)
 #define CPU_FEAT_AVX512F (1ULL << 3)
+#define CPU_FEAT_ERMS (1ULL << 4)         /* Enhanced REP MOVSB/STOSB */
+#define CPU_FEAT_FSRM (1ULL << 5)         /* Fast short REP MOVSB */
+#define CPU_FEAT_TSC_DEADLINE (1ULL << 6) /* LAPIC TSC-deadline mode */
+#define CPU_FEAT_MWAIT (1ULL << 7)        /* MONITOR/MWAIT, IRQs break it */
 
 enum cpu_class {
     CPU_CLASS_UNKNOWN,
@@ -47,6 +53,16 @@ struct cpu_capability {
     uint64_t feature_bits; /* ISA features, vector width, etc */
 };
 
+/* One per lock a CPU can be waiting on at once: normal code, an ISR on
+ * top of that, and whatever interrupts that ISR */
+#define SPINLOCK_QNODES 4
+
+/* Where a CPU waits in a queued spinlock, see sync/spinlock.h */
+struct spinlock_qnode {
+    _Atomic(struct spinlock_qnode *) next;
+    atomic_bool locked;
+};
+
 /* Let's put commonly accessed fields up here
  * to make the cache a bit happier */
 struct core {
@@ -72,6 +88,7 @@ struct core {
     enum dpc_event dpc_event;
 
     atomic_bool needs_resched;
+    atomic_bool idle_polling; /* in MWAIT on `needs_resched` */
     atomic_bool in_resched; /* in scheduler_yield() */
     atomic_uint scheduler_preemption_disable_depth;
 
@@ -82,6 +99,8 @@ struct core {
     struct tss *tss;
 
     uint32_t lapic_freq;
+    struct tick_state tick;
+    struct idle_governor_data idle_gov;
 
     struct topology_node *topo_node;
     struct topology_cache_info llc;
@@ -98,6 +117,9 @@ struct core {
 
     uint64_t pt_seen_epoch;
     bool reclaiming_page_tables;
+
+    struct spinlock_qnode qnodes[SPINLOCK_QNODES];
+    uint8_t qnode_depth;
 };
 
 static inline uint64_t smp_core_id() {
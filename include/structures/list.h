@@ -50,6 +50,12 @@ static inline void list_del_init(struct list_head *entry) {
     INIT_LIST_HEAD(entry);
 }
 
+static inline void list_move_tail(struct list_head *entry,
+                                  struct list_head *head) {
+    __list_del(entry->prev, entry->next);
+    list_add_tail(entry, head);
+}
+
 static inline int list_empty(const struct list_head *head) {
     return head->next == head;
 }
@@ -36,6 +36,7 @@ struct mutex {
 void mutex_init(struct mutex *mtx);
 void mutex_unlock(struct mutex *mutex);
 void mutex_lock(struct mutex *mutex);
+bool mutex_trylock(struct mutex *mutex);
 bool mutex_held(struct mutex *mtx);
 struct thread *mutex_get_owner(struct mutex *mtx);
 
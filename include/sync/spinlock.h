@@ -1,5 +1,6 @@
 #pragma once
 #include <asm.h>
+#include <compiler.h>
 #include <console/panic.h>
 #include <global.h>
 #include <irq/irq.h>
@@ -9,20 +10,36 @@
 #include <stdatomic.h>
 #include <stdbool.h>
 
+/* Queued spinlock.
+ *
+ * The low byte of `state` is the lock itself, the upper half is the tail
+ * of an MCS queue of waiting CPUs, encoded as (cpu + 1) << 2 | node. An
+ * uncontended lock is taken and released with a single atomic, same as
+ * a test-and-set lock would be. Once there is contention, every waiter
+ * spins on its own per-CPU node instead of on the lock, and the lock is
+ * handed over in the order CPUs started waiting for it.
+ *
+ * Building with SPINLOCK_TAS gets plain test-and-set locks instead */
 struct spinlock {
-    _Atomic uint8_t state;
+    _Atomic uint32_t state;
 };
 
 #define SPINLOCK_INIT {ATOMIC_VAR_INIT(0)}
 
+#define SPINLOCK_LOCKED 1u
+#define SPINLOCK_LOCKED_MASK 0xFFu
+#define SPINLOCK_TAIL_SHIFT 16
+#define SPINLOCK_TAIL_MASK 0xFFFF0000u
+
 static inline void spinlock_init(struct spinlock *lock) {
     atomic_store(&lock->state, 0);
 }
 
 static inline bool spin_trylock_raw(struct spinlock *lock) {
-    uint8_t expected = 0;
+    uint32_t expected = 0;
     return atomic_compare_exchange_strong_explicit(
-        &lock->state, &expected, 1, memory_order_acquire, memory_order_relaxed);
+        &lock->state, &expected, SPINLOCK_LOCKED, memory_order_acquire,
+        memory_order_relaxed);
 }
 
 static inline void spin_raw(struct spinlock *lock) {
@@ -30,21 +47,38 @@ static inline void spin_raw(struct spinlock *lock) {
         cpu_relax();
 }
 
+/* Contended path of `spin_lock_raw`, in sync/spinlock.c */
+void spin_lock_queued(struct spinlock *lock);
+
 static inline void spin_lock_raw(struct spinlock *lock) {
+#ifdef SPINLOCK_TAS
     while (true) {
         if (spin_trylock_raw(lock))
             return;
 
         spin_raw(lock);
     }
+#else
+    if (likely(spin_trylock_raw(lock)))
+        return;
+
+    spin_lock_queued(lock);
+#endif
 }
 
+/* Only the owner touches the lock byte, waiters only ever change the
+ * tail, so dropping the lock can't clobber anyone queueing up */
 static inline void spin_unlock_raw(struct spinlock *lock) {
+#ifdef SPINLOCK_TAS
     atomic_store_explicit(&lock->state, 0, memory_order_release);
+#else
+    atomic_fetch_and_explicit(&lock->state, ~SPINLOCK_LOCKED_MASK,
+                              memory_order_release);
+#endif
 }
 
 static inline void spin_unlock(struct spinlock *lock, enum irql old) {
-    atomic_exchange_explicit(&lock->state, 0, memory_order_release);
+    spin_unlock_raw(lock);
     irql_lower(old);
 }
 
@@ -83,7 +117,7 @@ static inline bool spin_trylock_irq_disable(struct spinlock *lock,
 }
 
 static inline bool spinlock_held(struct spinlock *lock) {
-    return atomic_load(&lock->state);
+    return atomic_load(&lock->state) & SPINLOCK_LOCKED_MASK;
 }
 #define SPINLOCK_ASSERT_HELD(l) kassert(spinlock_held(l))
 
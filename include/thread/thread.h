@@ -8,6 +8,7 @@
 #include <mem/alloc.h>
 #include <mem/page.h>
 #include <sch/climb.h>
+#include <sch/load.h>
 #include <sch/rt_sched_types.h>
 #include <stdarg.h>
 #include <stdatomic.h>
@@ -20,6 +21,7 @@
 #include <sync/spinlock.h>
 #include <thread/apc_types.h>
 #include <thread/thread_types.h>
+#include <thread/timer.h>
 #include <time.h>
 #include <types/refcount.h>
 #include <types/types.h>
@@ -209,6 +211,9 @@ struct thread {
 
     time_t run_start_time; /* When did we start running */
 
+    /* How much it runs or wants to, see sch/load.h */
+    struct load_avg load;
+
     /* Who is allowed to run us? */
     struct cpu_mask allowed_cpus;
     _Atomic int64_t migrate_to; /* -1 if no migration target */
@@ -294,6 +299,7 @@ struct thread {
     uint64_t token_ctr;
 
     struct condvar_with_cb cv_cb_object; /* wait object */
+    struct timer wait_timer;             /* sleep and wait timeouts */
     struct list_head io_wait_tokens;     /* list of tokens */
 
     struct turnstile *turnstile;            /* my turnstile */
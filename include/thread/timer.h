@@ -0,0 +1,113 @@
+/* @title: Timers */
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <structures/list.h>
+#include <sync/spinlock.h>
+#include <thread/dpc.h>
+
+/* Every CPU has a hierarchical timing wheel. Level 0 has a slot per
+ * millisecond, and every level above it has slots 64 times as wide.
+ * Timers go in the lowest level whose range covers them and get moved
+ * down a level each time the one below wraps around, so arming and
+ * cancelling are O(1) no matter how many timers are pending.
+ *
+ * Expiry is kept in microseconds. Once a timer is down to its last
+ * millisecond it sits on a short sorted list, and the CPU's timer gets
+ * armed for it exactly. */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+/* Anything further out waits in the last level and gets put back in
+ * there until it's close enough, a bit under 4.7 hours */
+#define TIMER_WHEEL_MAX_DELTA                                                  \
+    ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef void (*timer_function)(void *arg1, void *arg2);
+
+enum timer_flags : uint8_t {
+    TIMER_FLAG_NONE = 0,
+
+    /* Runs right from the expiry DPC at DISPATCH_LEVEL instead of
+     * from the timer worker thread. Only for callbacks that never
+     * block */
+    TIMER_FLAG_DPC = 1 << 0,
+};
+
+struct timer_wheel;
+
+/* Meant to be embedded in whatever it times. Nothing is allocated
+ * to arm it */
+struct timer {
+    struct list_head node;
+    uint64_t expires_us;
+
+    timer_function func;
+    void *arg1;
+    void *arg2;
+    enum timer_flags flags;
+
+    /* where it is on its wheel, TIMER_LEVEL_FIRING once expired */
+    uint8_t level;
+    uint8_t slot;
+
+    /* the wheel it is queued on, NULL once it is not pending */
+    _Atomic(struct timer_wheel *) wheel;
+};
+
+#define TIMER_LEVEL_FIRING 0xFF
+#define TIMER_LEVEL_NEAR 0xFE
+
+struct timer_wheel {
+    struct spinlock lock;
+
+    /* every slot before this has been run, in milliseconds */
+    uint64_t clk;
+
+    /* armed and not expired yet */
+    size_t count;
+
+    /* the earliest the CPU's timer was asked to go off for us, in us */
+    uint64_t next_expiry;
+
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    struct list_head slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+    /* due within a millisecond of `clk` or already late, by expiry */
+    struct list_head near;
+
+    /* expired, waiting on the DPC or the worker to get run */
+    struct list_head dpc_ready;
+    struct list_head ready;
+
+    struct dpc dpc;
+    size_t cpu;
+};
+
+/* Must not be pending, unless the caller knows nobody else touches it */
+void timer_init(struct timer *t, timer_function func, void *arg1, void *arg2,
+                enum timer_flags flags);
+
+/* Arms `t` on this CPU's wheel, moving it over if it was already
+ * pending somewhere */
+void timer_arm(struct timer *t, uint64_t delay_ms);
+void timer_arm_us(struct timer *t, uint64_t delay_us);
+
+/* True if `t` was pending and now won't run. False if it was never
+ * armed or its callback is already running */
+bool timer_cancel(struct timer *t);
+
+static inline bool timer_pending(struct timer *t) {
+    return atomic_load(&t->wheel) != NULL;
+}
+
+void timer_wheels_init(void);
+
+/* Glue to sch/tick.c and the timer workers in thread/defer.c */
+void timer_wheel_kick(size_t cpu);
+void timer_run_ready(size_t cpu);
+void defer_wake_worker(size_t cpu);
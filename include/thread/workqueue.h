@@ -21,15 +21,6 @@ struct work_args {
 };
 #define WORK_ARGS(a, b) ((struct work_args) {.arg1 = a, .arg2 = b})
 
-/* TODO: Merge this with standard workqueue infra */
-struct deferred_event {
-    size_t timer;
-    uint64_t timestamp_ms;
-    work_function callback;
-    struct work_args args;
-    struct deferred_event *next;
-};
-
 struct work {
     work_function func;
     struct work_args args;
@@ -6,8 +6,10 @@
 #include <mem/alloc.h>
 #include <mem/page.h>
 #include <mem/vmm.h>
+#include <sch/tick.h>
 #include <sleep.h>
 #include <smp/core.h>
+#include <time.h>
 
 uint32_t *lapic;
 bool x2apic_enabled = false;
@@ -20,7 +22,6 @@ void lapic_init(void) {
 
 void lapic_timer_init(cpu_id_t core_id) {
     uint32_t calibration_sleep_ms = 2;
-    uint32_t timeslice_ms = 15;
 
     lapic_write(LAPIC_REG_SVR, LAPIC_ENABLE | 0xFF);
     lapic_write(LAPIC_REG_TIMER_DIV, 0b0011);
@@ -34,21 +35,59 @@ void lapic_timer_init(cpu_id_t core_id) {
 
     uint64_t lapic_calibrated_freq = elapsed * (1000 / calibration_sleep_ms);
 
-    uint32_t timeslice_ticks = (lapic_calibrated_freq * timeslice_ms) / 1000;
+    struct core *c = global.cores[core_id];
+    c->lapic_freq = lapic_calibrated_freq;
 
-    global.cores[core_id]->lapic_freq = lapic_calibrated_freq;
-    lapic_write(LAPIC_REG_LVT_TIMER, TIMER_VECTOR | TIMER_MODE_PERIODIC);
+    /* the BSP gets here before smp_wake() calibrates its TSC */
+    if (!c->tsc_hz)
+        c->tsc_hz = tsc_calibrate();
 
-    lapic_write(LAPIC_REG_TIMER_INIT, timeslice_ticks);
-    lapic_timer_disable();
+    uint32_t mode = TIMER_MODE_ONESHOT;
+    if (c->cap.feature_bits & CPU_FEAT_TSC_DEADLINE)
+        mode = TIMER_MODE_TSC_DEADLINE;
+
+    /* Nothing is armed until the tick code asks for something */
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+    lapic_write(LAPIC_REG_LVT_TIMER, TIMER_VECTOR | mode);
+
+    /* the LVT write has to land before the deadline MSR is touched */
+    asm volatile("mfence" ::: "memory");
+    tick_start();
 }
 
-void lapic_timer_set_ms(uint32_t ms) {
-    uint32_t ticks = (smp_core()->lapic_freq * ms) / 1000;
+static inline bool tsc_deadline_mode(void) {
+    return smp_core()->cap.feature_bits & CPU_FEAT_TSC_DEADLINE;
+}
+
+void lapic_timer_arm_us(uint64_t delta_us) {
+    struct core *c = smp_core();
+
+    /* a deadline already in the past fires right away */
+    if (tsc_deadline_mode()) {
+        wrmsr(IA32_TSC_DEADLINE, rdtsc() + delta_us * c->tsc_hz / 1000000);
+        return;
+    }
+
+    uint64_t ticks = ((uint64_t) c->lapic_freq * delta_us) / 1000000;
+    if (!ticks)
+        ticks = 1;
+    if (ticks > UINT32_MAX)
+        ticks = UINT32_MAX;
 
     lapic_write(LAPIC_REG_TIMER_INIT, ticks);
 }
 
+void lapic_timer_disarm(void) {
+    if (tsc_deadline_mode())
+        wrmsr(IA32_TSC_DEADLINE, 0);
+    else
+        lapic_write(LAPIC_REG_TIMER_INIT, 0);
+}
+
+void lapic_timer_set_ms(uint32_t ms) {
+    lapic_timer_arm_us(MS_TO_US((uint64_t) ms));
+}
+
 void lapic_timer_disable() {
     uint32_t lvt = lapic_read(LAPIC_REG_LVT_TIMER);
     lvt |= LAPIC_LVT_MASK;
@@ -1,5 +1,7 @@
+#include <acpi/cst.h>
 #include <asm.h>
 #include <console/printf.h>
+#include <log.h>
 #include <mem/vmm.h>
 #include <string.h>
 #include <types/types.h>
@@ -9,29 +11,116 @@
 #include <uacpi/tables.h>
 #include <uacpi/uacpi.h>
 
+struct acpi_cpu_power acpi_cst = {0};
+static LOG_HANDLE_DECLARE_DEFAULT(cst);
+
+static bool get_integer(uacpi_object *obj, uint64_t *out) {
+    return uacpi_object_get_integer(obj, out) == UACPI_STATUS_OK;
+}
+
+/* Each state is a package of {Register, Type, Latency, Power}, where the
+ * register is a buffer holding a generic register descriptor */
+static bool parse_cst_state(uacpi_object *obj, struct acpi_cpu_context *out) {
+    uacpi_object_array pkg;
+    if (uacpi_object_get_package(obj, &pkg) != UACPI_STATUS_OK ||
+        pkg.count < 4)
+        return false;
+
+    struct uacpi_data_view view = {0};
+    if (uacpi_object_get_buffer(pkg.objects[0], &view) != UACPI_STATUS_OK ||
+        view.length < sizeof(struct acpi_power_reg))
+        return false;
+
+    uint64_t type, latency;
+    if (!get_integer(pkg.objects[1], &type) ||
+        !get_integer(pkg.objects[2], &latency))
+        return false;
+
+    struct acpi_power_reg reg;
+    memcpy(&reg, view.const_bytes, sizeof(reg));
+
+    out->type = type;
+    out->latency = latency;
+    out->addr = reg.addr;
+
+    switch (reg.space_id) {
+    case ACPI_CST_SPACE_FFH:
+        /* anything but the MWAIT class is just HLT */
+        out->entry_method = reg.bit_offset == ACPI_CST_FFH_CLASS_MWAIT
+                                ? ACPI_CSTATE_FFH
+                                : ACPI_CSTATE_HALT;
+        break;
+
+    case ACPI_CST_SPACE_SYSTEMIO:
+        out->entry_method = type == 1 ? ACPI_CSTATE_HALT : ACPI_CSTATE_SYSTEMIO;
+        break;
+
+    default: return false;
+    }
+
+    snprintf(out->desc, sizeof(out->desc), "C%u", (uint32_t) type);
+    out->valid = true;
+    return true;
+}
+
+static void parse_cst(uacpi_object *obj) {
+    uacpi_object_array pkg;
+    uint64_t count;
+    if (uacpi_object_get_package(obj, &pkg) != UACPI_STATUS_OK ||
+        !pkg.count || !get_integer(pkg.objects[0], &count))
+        return;
+
+    for (size_t i = 1; i < pkg.count && i <= count; i++) {
+        if (acpi_cst.count == ACPI_CPU_MAX_POWER)
+            break;
+
+        struct acpi_cpu_context *cx = &acpi_cst.states[acpi_cst.count];
+        memset(cx, 0, sizeof(*cx));
+        if (!parse_cst_state(pkg.objects[i], cx))
+            continue;
+
+        /* sorted by type, so deeper states come later */
+        size_t at = acpi_cst.count++;
+        while (at && acpi_cst.states[at - 1].type > cx->type) {
+            struct acpi_cpu_context tmp = acpi_cst.states[at - 1];
+            acpi_cst.states[at - 1] = acpi_cst.states[at];
+            acpi_cst.states[at] = tmp;
+            at--;
+        }
+    }
+
+    for (size_t i = 0; i < acpi_cst.count; i++)
+        acpi_cst.states[i].index = i;
+}
+
 static uacpi_iteration_decision
 walk_callback(void *, uacpi_namespace_node *node, uacpi_u32) {
-    char name[5] = {0};
-    memcpy(name, uacpi_namespace_node_name(node).text, 4);
-    printf("searching %s\n", name);
-
     struct uacpi_object *out = NULL;
     enum uacpi_status ret = uacpi_eval_simple(node, "_CST", &out);
 
-    if (ret != UACPI_STATUS_OK) {
-        return UACPI_ITERATION_DECISION_CONTINUE;
-    } else {
-        struct uacpi_data_view dview = {0};
-        printf("Found _CST on %s\n", name);
-        uacpi_object_get_string(out, &dview);
-        printf("got %s\n", dview.text);
+    if (ret != UACPI_STATUS_OK || !out)
         return UACPI_ITERATION_DECISION_CONTINUE;
-    }
+
+    parse_cst(out);
+    uacpi_object_unref(out);
+
+    return acpi_cst.count ? UACPI_ITERATION_DECISION_BREAK
+                          : UACPI_ITERATION_DECISION_CONTINUE;
 }
 
 void acpi_find_cst(void) {
-    return;
     uacpi_namespace_node *root = uacpi_namespace_root();
     uacpi_namespace_for_each_child_simple(root, walk_callback, NULL);
-    hcf();
+
+    if (!acpi_cst.count) {
+        log_info_global(LOG_HANDLE(cst), "No _CST found");
+        return;
+    }
+
+    for (size_t i = 0; i < acpi_cst.count; i++) {
+        struct acpi_cpu_context *cx = &acpi_cst.states[i];
+        log_info_global(LOG_HANDLE(cst),
+                        "%s: method %u, address 0x%x, latency %u us",
+                        cx->desc, cx->entry_method, cx->addr, cx->latency);
+    }
 }
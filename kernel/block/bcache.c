@@ -2,17 +2,56 @@
 #include <block/generic.h>
 #include <block/sched.h>
 #include <console/panic.h>
+#include <limits.h>
 #include <math/align.h>
+#include <math/min_max.h>
 #include <mem/alloc.h>
+#include <mem/slab.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <thread/workqueue.h>
 
+static bool bcache_entry_ctor(void *obj) {
+    struct bcache_entry *ent = obj;
+    memset(ent, 0, sizeof(struct bcache_entry));
+    mutex_init(&ent->lock);
+    INIT_LIST_HEAD(&ent->dirty_list);
+    return true;
+}
+
+KMEM_CACHE_DEFINE_FOR_STRUCT(bcache_entry_cache, bcache_entry,
+                             SLAB_OBJ_ALIGN_DEFAULT, bcache_entry_ctor, NULL);
+
+static struct bcache_entry *bcache_entry_alloc(uint8_t *buffer, uint64_t lba,
+                                               uint64_t size, bool no_evict) {
+    struct bcache_entry *ent = kmem_cache_alloc(&bcache_entry_cache);
+    if (!ent)
+        return NULL;
+
+    /* the lock comes back constructed, the rest is per-entry */
+    ent->buffer = buffer;
+    ent->lba = lba;
+    ent->size = size;
+    ent->dirty = false;
+    ent->no_evict = no_evict;
+    ent->request = NULL;
+    atomic_store(&ent->refcount, 0);
+    ent->dirtied_at = 0;
+    ent->wb_prio = BIO_RQ_BACKGROUND;
+    ent->writeback = false;
+    return ent;
+}
+
+static inline void bcache_entry_free(struct bcache_entry *ent) {
+    kmem_cache_free(&bcache_entry_cache, ent);
+}
+
 static bool remove(struct bcache *cache, uint64_t key, uint64_t spb);
 
 static bool insert(struct bcache *cache, uint64_t key,
-                   struct bcache_entry *value, bool already_locked);
+                   struct bcache_entry *value, uint64_t spb, bool replace);
 
 static struct bcache_entry *get(struct bcache *cache, uint64_t key);
 static bool write(struct generic_disk *d, struct bcache *cache,
@@ -20,238 +59,427 @@ static bool write(struct generic_disk *d, struct bcache *cache,
 
 /* prefetch is asynchronous */
 static enum errno prefetch(struct generic_disk *disk, struct bcache *cache,
-                           uint64_t lba, uint64_t block_size, uint64_t spb);
+                           uint64_t lba, uint64_t blocks, uint64_t block_size,
+                           uint64_t spb);
 
-/* eviction must be explicitly and separately called */
-static bool insert(struct bcache *cache, uint64_t key,
-                   struct bcache_entry *value, bool already_locked) {
-    enum irql irql;
-    if (!already_locked)
-        irql = spin_lock(&cache->lock);
+static void bcache_wrapper_free(struct rcu_cb *cb, void *arg) {
+    (void) cb;
+    struct bcache_wrapper *node = arg;
+
+    if (node->free_value) {
+        kfree_aligned(node->value->buffer);
+        bcache_entry_free(node->value);
+    }
+
+    kfree(node);
+}
+
+/* Caller must be in an RCU read-side section or hold the shard lock */
+static struct bcache_wrapper *lookup(struct bcache_shard *shard,
+                                     uint64_t key) {
+    uint64_t index = bcache_bucket_for(shard, key);
+    struct bcache_wrapper *node = rcu_dereference(shard->buckets[index]);
+
+    while (node) {
+        if (node->key == key)
+            return node;
+
+        node = rcu_dereference(node->next);
+    }
+
+    return NULL;
+}
+
+/* An entry being evicted has its refcount parked here, which refcount_inc
+ * refuses to go past, so lookups that race with the eviction miss */
+#define BCACHE_ENT_EVICTING UINT_MAX
+
+/* Caller holds the writeback lock, which is what `dirty` gets set under.
+ * Claiming the last reference means nobody can pin and dirty it anymore */
+static bool bcache_wrapper_claim(struct bcache_wrapper *node) {
+    struct bcache_entry *entry = node->value;
+    if (!entry || entry->no_evict || entry->dirty)
+        return false;
+
+    unsigned int unused = 0;
+    return atomic_compare_exchange_strong(&entry->refcount, &unused,
+                                          BCACHE_ENT_EVICTING);
+}
+
+/* Caller holds the shard lock. Entries that were looked up since the hand
+ * last went past get a second chance, so at most two laps are needed. The
+ * victim comes back claimed */
+static struct bcache_wrapper *clock_pick_victim(struct bcache *cache,
+                                                struct bcache_shard *shard) {
+    struct bcache_wrapper *victim = NULL;
+    enum irql irql = bcache_writeback_lock(&cache->wb);
+
+    for (uint64_t i = 0; i < shard->count * 2; i++) {
+        struct bcache_wrapper *node =
+            list_first_entry(&shard->clock, struct bcache_wrapper, clock);
+
+        if (atomic_exchange(&node->referenced, false) ||
+            !bcache_wrapper_claim(node)) {
+            list_move_tail(&node->clock, &shard->clock);
+            continue;
+        }
+
+        victim = node;
+        break;
+    }
+
+    bcache_writeback_unlock(&cache->wb, irql);
+    return victim;
+}
+
+/* a group is only freed once its base and none of its other lbas remain */
+static bool can_remove_lba_group(struct bcache *cache, uint64_t base_lba,
+                                 uint64_t spb) {
+    bool ret = true;
+
+    /* the other lbas may well live in other shards */
+    rcu_read_lock();
+    for (uint64_t i = 1; i < spb && ret; i++) {
+        uint64_t key = base_lba + i;
+        if (lookup(bcache_shard_for(cache, key), key))
+            ret = false; /* another lba in the group is still cached */
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/* Caller holds the shard lock, the wrapper is freed after a grace period */
+static void unlink_locked(struct bcache *cache, struct bcache_shard *shard,
+                          struct bcache_wrapper *victim, uint64_t spb) {
+    uint64_t index = bcache_bucket_for(shard, victim->key);
+    _Atomic(struct bcache_wrapper *) *link = &shard->buckets[index];
 
-    uint64_t index = bcache_hash(key, cache->capacity);
-    struct bcache_wrapper *head = cache->entries[index];
+    while (atomic_load(link) != victim)
+        link = &atomic_load(link)->next;
+
+    rcu_assign_pointer(*link, atomic_load(&victim->next));
+    list_del_init(&victim->clock);
+    shard->count--;
+
+    struct bcache_entry *val = victim->value;
+    victim->free_value = val && victim->key == val->lba && !val->no_evict &&
+                         can_remove_lba_group(cache, victim->key,
+                                              val->size / spb);
+
+    /* still in use under another key, so it can be pinned again */
+    if (val && !victim->free_value &&
+        atomic_load(&val->refcount) == BCACHE_ENT_EVICTING)
+        atomic_store(&val->refcount, 0);
+
+    rcu_defer(&victim->rcu, bcache_wrapper_free, victim);
+}
+
+/* Full shards evict one entry through the CLOCK hand first. If everything
+ * in there is pinned or dirty, the shard is allowed to go over capacity.
+ * Without `replace`, an existing key makes this fail and leaves it alone */
+static bool insert(struct bcache *cache, uint64_t key,
+                   struct bcache_entry *value, uint64_t spb, bool replace) {
+    struct bcache_shard *shard = bcache_shard_for(cache, key);
+    enum irql irql = bcache_shard_lock(shard);
 
     /* Key already exists */
-    for (struct bcache_wrapper *node = head; node; node = node->next) {
-        if (node->key == key) {
+    struct bcache_wrapper *node = lookup(shard, key);
+    if (node) {
+        if (replace) {
             node->value = value;
-            node->value->access_time = bcache_get_ticks(cache);
-            if (!already_locked)
-                spin_unlock(&cache->lock, irql);
-            return true;
+            atomic_store(&node->referenced, true);
         }
+
+        bcache_shard_unlock(shard, irql);
+        return replace;
+    }
+
+    if (shard->count >= shard->capacity) {
+        struct bcache_wrapper *victim = clock_pick_victim(cache, shard);
+        if (victim)
+            unlink_locked(cache, shard, victim, spb);
     }
 
     /* New head */
-    struct bcache_wrapper *new_node = kmalloc(sizeof(struct bcache_wrapper));
+    struct bcache_wrapper *new_node = kzalloc(sizeof(struct bcache_wrapper));
     if (!new_node) {
-        if (!already_locked)
-            spin_unlock(&cache->lock, irql);
+        bcache_shard_unlock(shard, irql);
         return false;
     }
 
+    uint64_t index = bcache_bucket_for(shard, key);
     new_node->key = key;
     new_node->value = value;
-    new_node->value->access_time = bcache_get_ticks(cache);
-    new_node->next = head;
+    atomic_store(&new_node->next, atomic_load(&shard->buckets[index]));
+    list_add_tail(&new_node->clock, &shard->clock);
 
-    cache->entries[index] = new_node;
-    cache->count++;
+    rcu_assign_pointer(shard->buckets[index], new_node);
+    shard->count++;
 
-    if (!already_locked)
-        spin_unlock(&cache->lock, irql);
+    bcache_shard_unlock(shard, irql);
     return true;
 }
 
+/* Returns the entry pinned. The pin has to be taken before leaving the
+ * read-side section, past that the entry can be evicted and freed */
 static struct bcache_entry *get(struct bcache *cache, uint64_t key) {
-    enum irql irql = spin_lock(&cache->lock);
+    struct bcache_entry *ret = NULL;
 
-    uint64_t index = bcache_hash(key, cache->capacity);
-    struct bcache_wrapper *node = cache->entries[index];
+    rcu_read_lock();
 
-    while (node) {
-        if (node->key == key) {
-            node->value->access_time = bcache_get_ticks(cache);
-            spin_unlock(&cache->lock, irql);
-            return node->value;
-        }
-        node = node->next;
+    struct bcache_wrapper *node = lookup(bcache_shard_for(cache, key), key);
+    if (node) {
+        /* avoid dirtying the line when the bit is already set */
+        if (!atomic_load_explicit(&node->referenced, memory_order_relaxed))
+            atomic_store_explicit(&node->referenced, true,
+                                  memory_order_relaxed);
+
+        ret = node->value;
+        if (ret && !refcount_inc(&ret->refcount))
+            ret = NULL; /* on its way out */
     }
 
-    spin_unlock(&cache->lock, irql);
-    return NULL;
+    rcu_read_unlock();
+    return ret;
 }
 
-static bool can_remove_lba_group(struct bcache *cache, uint64_t base_lba,
-                                 uint64_t spb) {
-    /* caller must already hold the lock */
+/* Only whether `key` is there, without pinning or referencing it */
+static bool cached(struct bcache *cache, uint64_t key) {
+    rcu_read_lock();
+    bool ret = lookup(bcache_shard_for(cache, key), key) != NULL;
+    rcu_read_unlock();
 
-    for (uint64_t i = 0; i < spb; i++) {
-        uint64_t key = base_lba + i;
-        uint64_t index = bcache_hash(key, cache->capacity);
-        struct bcache_wrapper *node = cache->entries[index];
-        bool found = false;
-
-        while (node) {
-            if (node->key == key) {
-                found = true;
-                break;
-            }
-            node = node->next;
-        }
+    return ret;
+}
 
-        if (i == 0 && !found)
-            return false; /* base_lba must exist */
-        else if (i > 0 && found)
-            return false; /* another lba in the group is still cached */
-    }
+static bool remove(struct bcache *cache, uint64_t key, uint64_t spb) {
+    struct bcache_shard *shard = bcache_shard_for(cache, key);
+    enum irql irql = bcache_shard_lock(shard);
 
-    return true;
+    struct bcache_wrapper *node = lookup(shard, key);
+    if (node)
+        unlink_locked(cache, shard, node, spb);
+
+    bcache_shard_unlock(shard, irql);
+    return node != NULL;
 }
 
-static bool remove(struct bcache *cache, uint64_t key, uint64_t spb) {
-    enum irql irql = spin_lock(&cache->lock);
-    uint64_t index = bcache_hash(key, cache->capacity);
+struct bcache_pf_data {
+    struct bcache *cache;
+    uint64_t blocks;
+    uint64_t block_size;
+    uint64_t spb;
+    uint8_t *bufs[]; /* one per block, they become the entries' buffers */
+};
 
-    struct bcache_wrapper *prev = NULL;
-    struct bcache_wrapper *node = cache->entries[index];
+/* Whatever got cached in the meantime wins, it may well be dirty already */
+static void insert_clean(struct bcache *cache, uint64_t lba, uint8_t *buf,
+                         uint64_t block_size, uint64_t spb) {
+    struct bcache_entry *ent = bcache_entry_alloc(buf, lba, block_size,
+                                                  /* no_evict = */ false);
+    if (ent && insert(cache, lba, ent, spb, /* replace = */ false))
+        return;
 
-    while (node) {
-        if (node->key == key) {
-            if (prev)
-                prev->next = node->next;
-            else
-                cache->entries[index] = node->next;
-
-            struct bcache_entry *val = node->value;
-            cache->count--;
-            kfree(node);
+    if (ent)
+        bcache_entry_free(ent);
 
-            bool should_free = false;
-            if (val && key == val->lba && !val->no_evict) {
-                if (can_remove_lba_group(cache, key, val->size / spb)) {
-                    should_free = true;
-                }
-            }
+    kfree_aligned(buf);
+}
 
-            if (should_free) {
-                kfree_aligned(val->buffer);
-                kfree(val);
-            }
+static void free_blocks(struct bcache_pf_data *data) {
+    for (uint64_t i = 0; i < data->blocks; i++)
+        kfree_aligned(data->bufs[i]);
 
-            spin_unlock(&cache->lock, irql);
-            return true;
+    kfree(data);
+}
+
+static void insert_blocks(struct bcache_pf_data *data, uint64_t lba) {
+    for (uint64_t i = 0; i < data->blocks; i++)
+        insert_clean(data->cache, lba + i * data->spb, data->bufs[i],
+                     data->block_size, data->spb);
+
+    kfree(data);
+}
+
+/* Entries own one page each, so multi-block reads are vectored
+ * and go straight into those pages rather than being copied */
+static struct bio_request *read_blocks(struct generic_disk *disk,
+                                       struct bcache_pf_data *data,
+                                       uint64_t lba,
+                                       void (*cb)(struct bio_request *)) {
+    struct bio_request *req =
+        bio_create_vectored(disk, lba, /* write = */ false, data->blocks, cb,
+                            data);
+    if (!req)
+        return NULL;
+
+    for (uint64_t i = 0; i < data->blocks; i++) {
+        if (!bio_add_buffer(req, data->bufs[i], data->block_size)) {
+            bio_request_free(req);
+            return NULL;
+        }
+    }
+
+    return req;
+}
+
+static struct bcache_pf_data *alloc_blocks(struct bcache *cache,
+                                           uint64_t blocks,
+                                           uint64_t block_size, uint64_t spb) {
+    struct bcache_pf_data *data =
+        kmalloc(sizeof(struct bcache_pf_data) + sizeof(uint8_t *) * blocks);
+    if (!data)
+        return NULL;
+
+    data->cache = cache;
+    data->block_size = block_size;
+    data->spb = spb;
+
+    for (data->blocks = 0; data->blocks < blocks; data->blocks++) {
+        uint8_t *buf = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+        if (!buf) {
+            free_blocks(data);
+            return NULL;
         }
 
-        prev = node;
-        node = node->next;
+        data->bufs[data->blocks] = buf;
     }
 
-    spin_unlock(&cache->lock, irql);
-    return false;
+    return data;
 }
 
-struct bcache_pf_data {
-    struct bcache_entry *new_entry;
-    struct bcache *cache;
-};
+/* No need to re-read existing entries at either end of a range */
+static uint64_t trim_cached(struct bcache *cache, uint64_t *lba,
+                            uint64_t blocks, uint64_t spb) {
+    while (blocks && cached(cache, *lba)) {
+        *lba += spb;
+        blocks--;
+    }
+
+    while (blocks && cached(cache, *lba + (blocks - 1) * spb))
+        blocks--;
+
+    return blocks;
+}
 
 static void prefetch_callback(struct bio_request *bio) {
     struct bcache_pf_data *data = bio->user_data;
-    insert(data->cache, bio->lba, data->new_entry, false);
 
-    kfree(data);
-    kfree(bio);
+    if (bio_request_failed(bio))
+        free_blocks(data);
+    else
+        insert_blocks(data, bio->lba);
+
+    bio_request_free(bio);
 }
 
 static enum errno prefetch(struct generic_disk *disk, struct bcache *cache,
-                           uint64_t lba, uint64_t block_size, uint64_t spb) {
+                           uint64_t lba, uint64_t blocks, uint64_t block_size,
+                           uint64_t spb) {
     uint64_t base_lba = ALIGN_DOWN(lba, spb);
-
-    /* no need to re-fetch existing entry */
-    if (get(cache, base_lba))
+    blocks = trim_cached(cache, &base_lba, blocks, spb);
+    if (!blocks)
         return ERR_EXIST;
 
-    struct bcache_pf_data *pf = kmalloc(sizeof(struct bcache_pf_data));
+    struct bcache_pf_data *pf = alloc_blocks(cache, blocks, block_size, spb);
     if (!pf)
         return ERR_NO_MEM;
 
-    struct bio_request *req = bio_create_read(disk, base_lba, spb, block_size,
-                                              prefetch_callback, pf, NULL);
-    if (!req)
+    struct bio_request *req =
+        read_blocks(disk, pf, base_lba, prefetch_callback);
+    if (!req) {
+        free_blocks(pf);
         return ERR_NO_MEM;
+    }
 
-    pf->cache = cache;
-    pf->new_entry = kzalloc(sizeof(struct bcache_entry));
-    if (!pf->new_entry)
-        return ERR_NO_MEM;
+    bio_sched_enqueue(disk, req);
+    return ERR_OK;
+}
 
-    struct bcache_entry *ent = pf->new_entry;
+/* Synchronous counterpart of `prefetch`, in chunks of at most
+ * BCACHE_MAX_IO_SECTORS so the drivers never see anything huge */
+static enum errno read_range(struct generic_disk *disk, struct bcache *cache,
+                             uint64_t lba, uint64_t blocks,
+                             uint64_t block_size, uint64_t spb) {
+    uint64_t base_lba = ALIGN_DOWN(lba, spb);
+    blocks = trim_cached(cache, &base_lba, blocks, spb);
+    if (!blocks)
+        return ERR_OK;
+
+    uint64_t max_blocks = MAX(BCACHE_MAX_IO_SECTORS / spb, 1);
+
+    while (blocks) {
+        uint64_t chunk = MIN(blocks, max_blocks);
+        struct bcache_pf_data *data =
+            alloc_blocks(cache, chunk, block_size, spb);
+        if (!data)
+            return ERR_NO_MEM;
+
+        struct bio_request *req = read_blocks(disk, data, base_lba, NULL);
+        if (!req) {
+            free_blocks(data);
+            return ERR_NO_MEM;
+        }
 
-    ent->lba = lba;
-    ent->size = block_size;
-    ent->dirty = false;
-    ent->no_evict = false;
-    ent->buffer = req->buffer;
+        if (!bio_submit_polled(req) || bio_request_failed(req)) {
+            bio_request_free(req);
+            free_blocks(data);
+            return ERR_IO;
+        }
+
+        bio_request_free(req);
+        insert_blocks(data, base_lba);
+        base_lba += chunk * spb;
+        blocks -= chunk;
+    }
 
-    bio_sched_enqueue(disk, req);
     return ERR_OK;
 }
 
+/* Runs the CLOCK hand of every shard, starting from a different one each
+ * time so that the low shards don't take all of the evictions */
 static bool evict(struct bcache *cache, uint64_t spb) {
-    enum irql irql = spin_lock(&cache->lock);
+    static _Atomic uint32_t next_shard = 0;
+    uint32_t first = atomic_fetch_add(&next_shard, 1);
 
-    uint64_t oldest = UINT64_MAX;
-    uint64_t target_key = 0;
-    bool found = false;
+    for (uint32_t i = 0; i < BCACHE_SHARDS; i++) {
+        struct bcache_shard *shard =
+            &cache->shards[(first + i) & (BCACHE_SHARDS - 1)];
 
-    for (uint64_t i = 0; i < cache->capacity; i++) {
-        struct bcache_wrapper *node = cache->entries[i];
-        while (node) {
-            struct bcache_entry *entry = node->value;
+        enum irql irql = bcache_shard_lock(shard);
+        struct bcache_wrapper *victim = clock_pick_victim(cache, shard);
+        if (victim)
+            unlink_locked(cache, shard, victim, spb);
 
-            if (!entry || entry->no_evict ||
-                atomic_load(&entry->refcount) > 0) {
-                node = node->next;
-                continue;
-            }
-
-            if (entry->access_time < oldest) {
-                oldest = entry->access_time;
-                target_key = node->key;
-                found = true;
-            }
+        bcache_shard_unlock(shard, irql);
 
-            node = node->next;
-        }
+        if (victim)
+            return true;
     }
 
-    spin_unlock(&cache->lock, irql);
-
-    if (found)
-        return remove(cache, target_key, spb);
-
     return false;
 }
 
 static void stat(struct bcache *cache, uint64_t *total_dirty_out,
                  uint64_t *total_present_out) {
-    enum irql irql = spin_lock(&cache->lock);
-
     uint64_t total_dirty = 0;
     uint64_t total_present = 0;
 
-    for (uint64_t i = 0; i < cache->capacity; i++) {
-        struct bcache_wrapper *node = cache->entries[i];
-        while (node) {
+    for (uint32_t i = 0; i < BCACHE_SHARDS; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+        enum irql irql = bcache_shard_lock(shard);
+
+        struct bcache_wrapper *node;
+        list_for_each_entry(node, &shard->clock, clock) {
             if (node->value) {
                 total_present++;
                 if (node->value->dirty)
                     total_dirty++;
             }
-            node = node->next;
         }
+
+        bcache_shard_unlock(shard, irql);
     }
 
     if (total_dirty_out)
@@ -259,69 +487,46 @@ static void stat(struct bcache *cache, uint64_t *total_dirty_out,
 
     if (total_present_out)
         *total_present_out = total_present;
-
-    spin_unlock(&cache->lock, irql);
 }
 
-/* TODO: writeback */
 static bool write(struct generic_disk *d, struct bcache *cache,
                   struct bcache_entry *ent, uint64_t spb) {
-    enum irql irql = spin_lock(&cache->lock);
+    (void) cache;
 
     bool ret = d->write_sector(d, ent->lba, ent->buffer, spb);
     uint64_t aligned = ALIGN_DOWN(ent->lba, spb);
     if (aligned != ent->lba)
-        kfree(ent);
+        bcache_entry_free(ent);
 
-    spin_unlock(&cache->lock, irql);
     return ret;
 }
 
-static void write_enqueue_cb(struct bio_request *req) {
-    struct bcache_entry *ent = req->user_data;
-
-    ent->dirty = false;
-    ent->request = NULL;
-    bcache_ent_unpin(ent);
-
-    kfree(req);
-}
-
-static void write_queue(struct generic_disk *d, struct bcache_entry *ent,
-                        uint64_t spb, enum bio_request_priority prio) {
-
-    ent->dirty = true;
-
-    struct bio_request *req = bio_create_write(
-        d, ent->lba, spb, ent->size, write_enqueue_cb, ent, ent->buffer);
-
-    req->priority = prio;
-    ent->request = req;
+void bcache_destroy(struct bcache *cache) {
+    bcache_writeback_destroy(cache);
 
-    bcache_ent_pin(ent);
-    bio_sched_enqueue(d, req);
-}
+    for (uint32_t i = 0; i < BCACHE_SHARDS; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
 
-void bcache_destroy(struct bcache *cache) {
-    for (uint64_t i = 0; i < cache->capacity; i++) {
-        struct bcache_wrapper *node = cache->entries[i];
-        while (node) {
-            struct bcache_wrapper *next = node->next;
+        struct bcache_wrapper *node, *tmp;
+        list_for_each_entry_safe(node, tmp, &shard->clock, clock) {
             if (node->value) {
                 kfree_aligned(node->value->buffer);
-                kfree(node->value);
+                bcache_entry_free(node->value);
             }
             kfree(node);
-            node = next;
         }
+
+        kfree(shard->buckets);
+        shard->buckets = NULL;
+        shard->bucket_count = 0;
+        shard->count = 0;
+        INIT_LIST_HEAD(&shard->clock);
     }
 
-    kfree(cache->entries);
-    cache->entries = NULL;
     cache->capacity = 0;
-    cache->count = 0;
 }
 
+/* The entry comes back pinned, bcache_ent_release drops that pin */
 void *bcache_get(struct generic_disk *disk, uint64_t lba, uint64_t block_size,
                  uint64_t spb, bool no_evict, struct bcache_entry **out_entry) {
     uint64_t base_lba = ALIGN_DOWN(lba, spb);
@@ -339,11 +544,11 @@ void *bcache_get(struct generic_disk *disk, uint64_t lba, uint64_t block_size,
 
 bool bcache_insert(struct generic_disk *disk, uint64_t lba,
                    struct bcache_entry *ent, uint64_t spb) {
-    if (insert(disk->cache, lba, ent, false)) {
+    if (insert(disk->cache, lba, ent, spb, /* replace = */ true)) {
         return true;
     } else {
         evict(disk->cache, spb);
-        return insert(disk->cache, lba, ent, false);
+        return insert(disk->cache, lba, ent, spb, /* replace = */ true);
     }
 }
 
@@ -356,9 +561,15 @@ bool bcache_writethrough(struct generic_disk *disk, struct bcache_entry *ent,
     return write(disk, disk->cache, ent, spb);
 }
 
+/* The write itself happens later, merged with its neighbours by the
+ * writeback daemon of this disk */
 void bcache_write_queue(struct generic_disk *disk, struct bcache_entry *ent,
                         uint64_t spb, enum bio_request_priority prio) {
-    write_queue(disk, ent, spb, prio);
+    (void) spb;
+
+    /* an unpinned clean entry can be evicted from under us */
+    kassert(refcount_read(&ent->refcount) > 0);
+    bcache_writeback_mark_dirty(disk, ent, prio);
 }
 
 void bcache_stat(struct generic_disk *disk, uint64_t *total_dirty_out,
@@ -366,7 +577,7 @@ void bcache_stat(struct generic_disk *disk, uint64_t *total_dirty_out,
     stat(disk->cache, total_dirty_out, total_present_out);
 }
 
-/* TODO: error code here */
+/* TODO: error code here. Like bcache_get, the entry comes back pinned */
 void *bcache_create_ent(struct generic_disk *disk, uint64_t lba,
                         uint64_t block_size, uint64_t sectors_per_block,
                         bool no_evict, struct bcache_entry **out_entry) {
@@ -385,18 +596,28 @@ void *bcache_create_ent(struct generic_disk *disk, uint64_t lba,
             return NULL;
         }
 
-        ent = kzalloc(sizeof(struct bcache_entry));
-        if (!ent)
+        ent = bcache_entry_alloc(buf, base_lba, block_size, no_evict);
+        if (!ent) {
+            kfree_aligned(buf);
+            *out_entry = NULL;
             return NULL;
+        }
 
-        mutex_init(&ent->lock);
+        refcount_init(&ent->refcount, 1);
 
-        ent->buffer = buf;
-        ent->lba = base_lba;
-        ent->size = block_size;
-        ent->no_evict = no_evict;
+        /* someone else may have read it in meanwhile, theirs wins since it
+         * could well be dirty by now */
+        if (!insert(disk->cache, base_lba, ent, sectors_per_block,
+                    /* replace = */ false)) {
+            bcache_entry_free(ent);
+            kfree_aligned(buf);
 
-        bcache_insert(disk, base_lba, ent, sectors_per_block);
+            ent = get(disk->cache, base_lba);
+            if (!ent) {
+                *out_entry = NULL;
+                return NULL;
+            }
+        }
     }
 
     *out_entry = ent;
@@ -407,14 +628,38 @@ void *bcache_create_ent(struct generic_disk *disk, uint64_t lba,
 
 enum errno bcache_prefetch_async(struct generic_disk *disk, uint64_t lba,
                                  uint64_t block_size, uint64_t spb) {
-    return prefetch(disk, disk->cache, ALIGN_DOWN(lba, spb), block_size, spb);
+    return prefetch(disk, disk->cache, lba, 1, block_size, spb);
+}
+
+enum errno bcache_read_range(struct generic_disk *disk, uint64_t lba,
+                             uint64_t blocks, uint64_t block_size,
+                             uint64_t spb) {
+    return read_range(disk, disk->cache, lba, blocks, block_size, spb);
+}
+
+enum errno bcache_prefetch_range_async(struct generic_disk *disk, uint64_t lba,
+                                       uint64_t blocks, uint64_t block_size,
+                                       uint64_t spb) {
+    return prefetch(disk, disk->cache, lba, blocks, block_size, spb);
 }
 
 void bcache_init(struct bcache *cache, uint64_t capacity) {
-    spinlock_init(&cache->lock);
+    uint64_t per_shard = capacity / BCACHE_SHARDS;
+    if (per_shard == 0)
+        per_shard = 1;
+
     cache->capacity = capacity;
-    cache->count = 0;
-    cache->entries = kzalloc(sizeof(struct bcache_wrapper *) * capacity);
-    if (!cache->entries)
-        panic("Block cache initialization allocation failed\n");
+    bcache_writeback_init(&cache->wb, capacity);
+    bcache_readahead_init(&cache->ra);
+    for (uint32_t i = 0; i < BCACHE_SHARDS; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+        spinlock_init(&shard->lock);
+        INIT_LIST_HEAD(&shard->clock);
+        shard->count = 0;
+        shard->capacity = per_shard;
+        shard->bucket_count = per_shard;
+        shard->buckets = kzalloc(sizeof(*shard->buckets) * per_shard);
+        if (!shard->buckets)
+            panic("Block cache initialization allocation failed\n");
+    }
 }
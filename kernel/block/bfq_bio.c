@@ -0,0 +1,271 @@
+/* Budget fair queueing between the threads submitting I/O.
+ *
+ * Every thread with requests queued on a context is an entity. Whatever
+ * an entity gets dispatched is charged to its virtual time, scaled down
+ * by its weight, and the backlogged entity with the least virtual time
+ * gets the disk next. Once it has it, it keeps it until it has used up
+ * a budget worth of sectors or runs out of requests, so a streaming
+ * reader or writer still gets to be sequential for a while.
+ *
+ * A reader that runs out of requests is usually just waiting for the
+ * last one to come back before sending the next, so the disk is kept
+ * idle for it for a little while instead of being handed straight to
+ * whoever is writing in the background. Requests past their deadline
+ * go out before any of this, which bounds how long anything can wait. */
+
+#include <block/generic.h>
+#include <block/sched.h>
+#include <console/panic.h>
+#include <kassert.h>
+#include <math/min_max.h>
+#include <mem/alloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BFQ_ENTITIES 32
+
+/* sectors an entity can have dispatched in a row */
+#define BFQ_MAX_BUDGET 2048
+
+/* how long the disk is held for a reader that just went quiet */
+#define BFQ_IDLE_WINDOW_MS 8
+
+/* keeps the vtime charge of small requests on heavy weights above 0 */
+#define BFQ_VTIME_SCALE 1024
+
+struct bfq_entity {
+    bool used;
+    uint64_t issuer;
+    uint32_t weight;
+    uint64_t vtime;
+    uint64_t budget_left;
+    uint64_t last_dispatch_ms;
+
+    /* requests it has on the queues, kept by the queued hooks */
+    size_t queued;
+
+    /* the last thing it had dispatched was a read */
+    bool sync;
+
+    /* scan it last had requests queued in */
+    uint64_t seen_scan;
+};
+
+struct bfq_hctx {
+    struct bfq_entity entities[BFQ_ENTITIES];
+    struct bfq_entity *active;
+
+    /* bumped every time the queues get looked through */
+    uint64_t scan;
+
+    /* least vtime among backlogged entities, where new ones start */
+    uint64_t vtime_floor;
+};
+
+void bfq_init_hctx(struct generic_disk *disk, struct bio_sched_hctx *hctx) {
+    (void) disk;
+    hctx->policy_data = kzalloc(sizeof(struct bfq_hctx));
+    if (!hctx->policy_data)
+        panic("Could not allocate space for BFQ state\n");
+}
+
+static inline bool bfq_backlogged(struct bfq_hctx *bfq,
+                                  struct bfq_entity *e) {
+    return e->seen_scan == bfq->scan;
+}
+
+/* Nothing queued at the last scan, nor the one before */
+static inline bool bfq_was_idle(struct bfq_hctx *bfq, struct bfq_entity *e) {
+    return e->seen_scan + 1 < bfq->scan;
+}
+
+/* ...and still nothing queued, so the slot can be handed to someone else */
+static inline bool bfq_idle(struct bfq_hctx *bfq, struct bfq_entity *e) {
+    return !e->queued && bfq_was_idle(bfq, e);
+}
+
+/* Takes over a free slot, or whichever idle one went unused the longest.
+ * With none of those left, the issuer shares the stalest slot. Slots with
+ * requests queued are never taken over, those requests point at them */
+static struct bfq_entity *bfq_entity_get(struct bfq_hctx *bfq,
+                                         uint64_t issuer) {
+    struct bfq_entity *free = NULL, *idle = NULL, *stale = NULL;
+
+    for (size_t i = 0; i < BFQ_ENTITIES; i++) {
+        struct bfq_entity *e = &bfq->entities[i];
+        if (e->used && e->issuer == issuer)
+            return e;
+
+        if (!e->used) {
+            free = free ? free : e;
+            continue;
+        }
+
+        if (e == bfq->active)
+            continue;
+
+        if (bfq_idle(bfq, e) &&
+            (!idle || e->last_dispatch_ms < idle->last_dispatch_ms))
+            idle = e;
+
+        if (!stale || e->last_dispatch_ms < stale->last_dispatch_ms)
+            stale = e;
+    }
+
+    struct bfq_entity *victim = free ? free : idle;
+    if (!victim)
+        return stale;
+
+    *victim = (struct bfq_entity) {
+        .used = true,
+        .issuer = issuer,
+        .weight = BIO_SCHED_DEFAULT_WEIGHT,
+        .vtime = bfq->vtime_floor,
+    };
+    return victim;
+}
+
+static inline uint64_t request_sectors(const struct bio_request *req) {
+    uint64_t sectors = 0;
+    for (const struct bio_request *c = req; c; c = c->next_coalesced)
+        sectors += c->sector_count;
+
+    return sectors;
+}
+
+/* How far the elevator has to go to get to `req` */
+static inline uint64_t seek_distance(struct bio_sched_hctx *hctx,
+                                     const struct bio_request *req) {
+    if (req->write == hctx->next_write && req->lba >= hctx->next_lba)
+        return req->lba - hctx->next_lba;
+
+    return UINT64_MAX / 2 + req->lba / 2;
+}
+
+void bfq_queued(struct generic_disk *disk, struct bio_sched_hctx *hctx,
+                struct bio_request *req) {
+    (void) disk;
+    struct bfq_entity *e = bfq_entity_get(hctx->policy_data, req->issuer);
+    if (req->io_weight)
+        e->weight = req->io_weight;
+
+    e->queued++;
+    req->policy_data = e;
+}
+
+void bfq_unqueued(struct generic_disk *disk, struct bio_sched_hctx *hctx,
+                  struct bio_request *req) {
+    (void) disk;
+    (void) hctx;
+    struct bfq_entity *e = req->policy_data;
+    kassert(e && e->queued);
+    e->queued--;
+}
+
+/* Marks who has requests queued, returns how many do */
+static size_t bfq_mark_backlogged(struct bfq_hctx *bfq) {
+    size_t count = 0;
+    uint64_t floor = UINT64_MAX;
+    bfq->scan++;
+
+    for (size_t i = 0; i < BFQ_ENTITIES; i++) {
+        struct bfq_entity *e = &bfq->entities[i];
+        if (!e->used || !e->queued)
+            continue;
+
+        /* coming back from being idle doesn't earn any credit */
+        if (bfq_was_idle(bfq, e))
+            e->vtime = MAX(e->vtime, bfq->vtime_floor);
+
+        e->seen_scan = bfq->scan;
+        floor = MIN(floor, e->vtime);
+        count++;
+    }
+
+    if (count)
+        bfq->vtime_floor = floor;
+
+    return count;
+}
+
+static struct bfq_entity *bfq_pick_entity(struct bfq_hctx *bfq) {
+    struct bfq_entity *best = NULL;
+
+    for (size_t i = 0; i < BFQ_ENTITIES; i++) {
+        struct bfq_entity *e = &bfq->entities[i];
+        if (e->used && bfq_backlogged(bfq, e) &&
+            (!best || e->vtime < best->vtime))
+            best = e;
+    }
+
+    if (best)
+        best->budget_left = BFQ_MAX_BUDGET;
+
+    return best;
+}
+
+static struct bio_request *bfq_entity_next(struct bio_sched_hctx *hctx,
+                                           struct bfq_entity *e) {
+    struct bio_request *best = NULL;
+    uint64_t best_dist = UINT64_MAX;
+
+    for (size_t prio = 0; prio < BIO_SCHED_LEVELS; prio++) {
+        struct bio_request *req;
+        list_for_each_entry(req, &hctx->queues[prio].list, list) {
+            if (req->policy_data != e)
+                continue;
+
+            uint64_t dist = seek_distance(hctx, req);
+            if (dist < best_dist) {
+                best = req;
+                best_dist = dist;
+            }
+        }
+    }
+
+    return best;
+}
+
+struct bio_request *bfq_select(struct generic_disk *disk,
+                               struct bio_sched_hctx *hctx) {
+    (void) disk;
+    struct bfq_hctx *bfq = hctx->policy_data;
+
+    if (!bfq_mark_backlogged(bfq))
+        return NULL;
+
+    struct bfq_entity *active = bfq->active;
+    if (active && !bfq_backlogged(bfq, active)) {
+        uint64_t idle = time_get_ms() - active->last_dispatch_ms;
+        if (active->sync && idle < BFQ_IDLE_WINDOW_MS)
+            return NULL;
+
+        active = NULL;
+    }
+
+    if (active && !active->budget_left)
+        active = NULL;
+
+    if (!active)
+        active = bfq_pick_entity(bfq);
+
+    bfq->active = active;
+    if (!active)
+        return NULL;
+
+    return bfq_entity_next(hctx, active);
+}
+
+void bfq_dispatched(struct generic_disk *disk, struct bio_sched_hctx *hctx,
+                    struct bio_request *req) {
+    (void) disk;
+    (void) hctx;
+    struct bfq_entity *e = req->policy_data;
+    uint64_t sectors = request_sectors(req);
+
+    e->vtime += sectors * BFQ_VTIME_SCALE / e->weight;
+    e->budget_left -= MIN(e->budget_left, sectors);
+    e->last_dispatch_ms = time_get_ms();
+    e->sync = !req->write;
+}
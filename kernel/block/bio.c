@@ -1,39 +1,72 @@
 #include <block/bio.h>
 #include <block/generic.h>
 #include <block/sched.h>
+#include <global.h>
+#include <kassert.h>
+#include <math/min_max.h>
 #include <mem/alloc.h>
 #include <mem/slab.h>
+#include <mem/vmm.h>
+#include <sch/sched.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 SLAB_SIZE_REGISTER_FOR_STRUCT(bio_request, SLAB_OBJ_ALIGN_DEFAULT);
 
+static bool bio_request_ctor(void *obj) {
+    struct bio_request *req = obj;
+    memset(req, 0, sizeof(struct bio_request));
+    INIT_LIST_HEAD(&req->list);
+    return true;
+}
+
+KMEM_CACHE_DEFINE_FOR_STRUCT(bio_request_cache, bio_request,
+                             SLAB_OBJ_ALIGN_DEFAULT, bio_request_ctor, NULL);
+
 static struct bio_request *create(struct generic_disk *d, uint64_t lba,
                                   uint64_t sec, uint64_t size,
                                   enum bio_request_priority p,
                                   void (*cb)(struct bio_request *), bool write,
-                                  void *user, void *buffer) {
+                                  void *user, void *buffer, bool vectored) {
 
-    struct bio_request *req = kzalloc(sizeof(struct bio_request));
+    struct bio_request *req = kmem_cache_alloc(&bio_request_cache);
     if (!req)
         return NULL;
 
+    /* cached requests come back constructed, but everything
+     * that a previous I/O may have touched is set here */
     req->disk = d;
     req->lba = lba;
     req->size = size;
     req->sector_count = sec;
     req->priority = p;
     req->on_complete = cb;
-    req->buffer = buffer ? buffer : kmalloc_aligned(size, PAGE_SIZE);
-    if (!req->buffer) {
-        kfree(req);
-        return NULL;
+    req->vecs = NULL;
+    req->vec_count = 0;
+    req->vec_cap = 0;
+    req->buffer = NULL;
+    if (!vectored) {
+        req->buffer = buffer ? buffer : kmalloc_aligned(size, PAGE_SIZE);
+        if (!req->buffer) {
+            kmem_cache_free(&bio_request_cache, req);
+            return NULL;
+        }
     }
 
-    INIT_LIST_HEAD(&req->list);
     req->write = write;
     req->user_data = user;
+    req->done = false;
     req->status = -1;
+    req->driver_private = NULL;
+    req->driver_private2 = NULL;
+    req->skip = false;
+    req->is_aggregate = false;
+    req->next_coalesced = NULL;
+    req->enqueue_time = 0;
+    req->boost_count = 0;
+    req->issuer = 0;
+    req->io_weight = 0;
 
     return req;
 }
@@ -43,16 +76,104 @@ struct bio_request *bio_create_read(struct generic_disk *d, uint64_t lba,
                                     void (*cb)(struct bio_request *),
                                     void *user, void *buffer) {
     return create(d, lba, sectors, size, BIO_RQ_MEDIUM, cb, false, user,
-                  buffer);
+                  buffer, false);
 }
 
 struct bio_request *bio_create_write(struct generic_disk *d, uint64_t lba,
                                      uint64_t sectors, uint64_t size,
                                      void (*cb)(struct bio_request *),
                                      void *user, void *buffer) {
-    return create(d, lba, sectors, size, BIO_RQ_MEDIUM, cb, true, user, buffer);
+    return create(d, lba, sectors, size, BIO_RQ_MEDIUM, cb, true, user, buffer,
+                  false);
+}
+
+struct bio_request *bio_create_vectored(struct generic_disk *d, uint64_t lba,
+                                        bool write, uint32_t max_vecs,
+                                        void (*cb)(struct bio_request *),
+                                        void *user) {
+    struct bio_vec *vecs = kmalloc(sizeof(struct bio_vec) * max_vecs);
+    if (!vecs)
+        return NULL;
+
+    struct bio_request *req =
+        create(d, lba, 0, 0, BIO_RQ_MEDIUM, cb, write, user, NULL, true);
+    if (!req) {
+        kfree(vecs);
+        return NULL;
+    }
+
+    req->vecs = vecs;
+    req->vec_cap = max_vecs;
+    return req;
+}
+
+bool bio_add_page(struct bio_request *req, paddr_t page, uint32_t offset,
+                  uint32_t len) {
+    kassert(offset + len <= PAGE_SIZE && len % req->disk->sector_size == 0);
+
+    /* picking up right where the last one ended, on the same page */
+    if (req->vec_count) {
+        struct bio_vec *last = &req->vecs[req->vec_count - 1];
+        if (last->page == page && last->offset + last->len == offset) {
+            last->len += len;
+            goto grow;
+        }
+    }
+
+    if (req->vec_count == req->vec_cap)
+        return false;
+
+    req->vecs[req->vec_count++] =
+        (struct bio_vec) {.page = page, .offset = offset, .len = len};
+
+grow:
+    req->size += len;
+    req->sector_count += len / req->disk->sector_size;
+    return true;
+}
+
+bool bio_add_buffer(struct bio_request *req, const void *buf, uint64_t len) {
+    uintptr_t vaddr = (uintptr_t) buf;
+
+    while (len) {
+        uint32_t offset = vaddr & (PAGE_SIZE - 1);
+        uint32_t chunk = MIN(len, PAGE_SIZE - offset);
+        paddr_t page = PAGE_ALIGN_DOWN(vmm_get_phys(vaddr, VMM_FLAG_NONE));
+
+        if (!bio_add_page(req, page, offset, chunk))
+            return false;
+
+        vaddr += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+void *bio_vec_virt(const struct bio_vec *vec) {
+    return (void *) (vec->page + vec->offset + global.hhdm_offset);
+}
+
+bool bio_submit_polled(struct bio_request *req) {
+    struct generic_disk *disk = req->disk;
+
+    if (disk->submit_bio_polled)
+        return disk->submit_bio_polled(disk, req);
+
+    if (!disk->submit_bio_async(disk, req))
+        return false;
+
+    while (!req->done)
+        scheduler_yield();
+
+    return true;
 }
 
 void bio_request_free(struct bio_request *req) {
-    kfree(req);
+    /* the dispatcher unlinks with a plain `list_del` */
+    INIT_LIST_HEAD(&req->list);
+    if (req->vecs)
+        kfree(req->vecs);
+
+    kmem_cache_free(&bio_request_cache, req);
 }
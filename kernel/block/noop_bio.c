@@ -12,6 +12,6 @@ void noop_do_coalesce(struct generic_disk *disk, struct bio_request *into,
     (void) disk, (void) into, (void) from;
 }
 
-void noop_reorder(struct generic_disk *disk) {
-    (void) disk;
+void noop_reorder(struct generic_disk *disk, struct bio_sched_hctx *hctx) {
+    (void) disk, (void) hctx;
 }
@@ -2,12 +2,25 @@
 #include <block/sched.h>
 #include <drivers/nvme.h>
 #include <kassert.h>
+#include <math/min_max.h>
 #include <mem/alloc.h>
+#include <mem/slab.h>
 #include <mem/vmm.h>
+#include <string.h>
 #include <thread/workqueue.h>
 
 #include "drivers/nvme/internal.h"
 
+static bool nvme_request_ctor(void *obj) {
+    struct nvme_request *req = obj;
+    memset(req, 0, sizeof(struct nvme_request));
+    INIT_LIST_HEAD(&req->list_node);
+    return true;
+}
+
+KMEM_CACHE_DEFINE_FOR_STRUCT(nvme_request_cache, nvme_request,
+                             SLAB_OBJ_ALIGN_DEFAULT, nvme_request_ctor, NULL);
+
 static void nvme_on_bio_complete(struct nvme_request *req) {
     struct bio_request *bio = (struct bio_request *) req->user_data;
 
@@ -20,32 +33,229 @@ static void nvme_on_bio_complete(struct nvme_request *req) {
     if (bio->on_complete)
         bio->on_complete(bio);
 
-    kfree(req);
+    INIT_LIST_HEAD(&req->list_node);
+    kmem_cache_free(&nvme_request_cache, req);
 }
 
-bool nvme_submit_bio_request(struct generic_disk *disk,
-                             struct bio_request *bio) {
-    struct nvme_request *req = kzalloc(sizeof(struct nvme_request));
-    if (!req)
+static void nvme_put_part(struct nvme_request *req) {
+    if (atomic_fetch_sub(&req->remaining_parts, 1) != 1)
+        return;
+
+    req->done = true;
+    req->on_complete(req);
+}
+
+static void nvme_on_part_complete(struct nvme_request *part) {
+    struct nvme_request *req = part->parent;
+
+    /* any part failing fails the whole bio */
+    if (part->status != BIO_STATUS_OK)
+        req->status = part->status;
+
+    kmem_cache_free(&nvme_request_cache, part);
+    nvme_put_part(req);
+}
+
+static bool nvme_send_one(struct generic_disk *disk, struct nvme_request *r) {
+    if (r->write)
+        return nvme_write_sector_async_wrapper(disk, r);
+
+    return nvme_read_sector_async_wrapper(disk, r);
+}
+
+/* Vectors can only share a command if the PRPs can describe them, so
+ * every one but the first starts on a page and every one but the last
+ * ends on a page. Returns how many of `vecs` fit in one */
+static uint32_t nvme_vecs_fit(struct nvme_device *nvme,
+                              const struct bio_vec *vecs, uint32_t count) {
+    uint32_t max_vecs = nvme->prp_list_size / sizeof(uint64_t) + 1;
+    uint64_t bytes = vecs[0].len;
+    uint32_t n = 1;
+
+    while (n < count && n < max_vecs) {
+        const struct bio_vec *prev = &vecs[n - 1];
+        if (prev->offset + prev->len != PAGE_SIZE || vecs[n].offset ||
+            bytes + vecs[n].len > nvme->max_transfer_size)
+            break;
+
+        bytes += vecs[n].len;
+        n++;
+    }
+
+    return n;
+}
+
+/* Fills in the data of the part that starts `off` sectors into `req`,
+ * and at vector `*vec` if it's vectored. Returns its sector count */
+static uint64_t nvme_carve_part(struct generic_disk *disk,
+                                struct nvme_request *req,
+                                struct nvme_request *part, uint64_t off,
+                                uint32_t *vec) {
+    struct nvme_namespace *ns = disk->driver_data;
+    uint64_t max_sectors = ns->dev->max_transfer_size / disk->sector_size;
+
+    part->buffer = NULL;
+    part->vecs = NULL;
+    part->vec_count = 0;
+
+    if (!req->vec_count) {
+        part->buffer = (uint8_t *) req->buffer + off * disk->sector_size;
+        return MIN(max_sectors, req->sector_count - off);
+    }
+
+    part->vecs = &req->vecs[*vec];
+    part->vec_count = nvme_vecs_fit(ns->dev, part->vecs, req->vec_count - *vec);
+    *vec += part->vec_count;
+
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < part->vec_count; i++)
+        bytes += part->vecs[i].len;
+
+    return bytes / disk->sector_size;
+}
+
+/* `req` is never sent itself, it only collects the status of its parts
+ * and completes the bio once all of them are back. It holds one extra
+ * part count until every part is out so it can't complete early */
+static bool nvme_submit_split(struct generic_disk *disk,
+                              struct nvme_request *req) {
+    uint64_t off = 0;
+    uint64_t sent = 0;
+    uint32_t vec = 0;
+
+    req->remaining_parts = 1;
+
+    while (off < req->sector_count) {
+        struct nvme_request *part = kmem_cache_alloc(&nvme_request_cache);
+        if (!part)
+            break;
+
+        uint64_t sectors = nvme_carve_part(disk, req, part, off, &vec);
+        part->lba = req->lba + off;
+        part->sector_count = sectors;
+        part->size = sectors * disk->sector_size;
+        part->write = req->write;
+        part->qid = req->qid;
+        part->status = 0;
+        part->waiter = NULL;
+        part->parent = req;
+        part->on_complete = nvme_on_part_complete;
+
+        atomic_fetch_add(&req->remaining_parts, 1);
+        if (!nvme_send_one(disk, part)) {
+            atomic_fetch_sub(&req->remaining_parts, 1);
+            kmem_cache_free(&nvme_request_cache, part);
+            break;
+        }
+
+        sent++;
+        off += sectors;
+    }
+
+    if (!sent) {
+        kmem_cache_free(&nvme_request_cache, req);
         return false;
+    }
+
+    if (off < req->sector_count)
+        req->status = BIO_STATUS_INVAL_INTERNAL;
+
+    nvme_put_part(req);
+    return true;
+}
+
+static struct nvme_request *nvme_request_from_bio(struct generic_disk *disk,
+                                                  struct bio_request *bio) {
+    struct nvme_request *req = kmem_cache_alloc(&nvme_request_cache);
+    if (!req)
+        return NULL;
 
     req->buffer = bio->buffer;
+    req->vecs = bio->vecs;
+    req->vec_count = bio->vec_count;
     req->done = false;
+    req->status = 0;
+    req->remaining_parts = 0;
+    req->waiter = NULL;
+    req->parent = NULL;
+    req->poll_state = NVME_POLL_NONE;
+    req->poller = NULL;
+    req->disk = disk;
     req->lba = bio->lba;
 
-    struct nvme_device *dev = disk->driver_data;
-    req->qid = THIS_QID(dev);
+    struct nvme_namespace *ns = disk->driver_data;
+    req->qid = THIS_QID(ns->dev);
     req->sector_count = bio->sector_count;
     req->size = bio->size;
     req->write = bio->write;
     req->user_data = bio;
-    INIT_LIST_HEAD(&req->list_node);
 
     req->on_complete = nvme_on_bio_complete;
+    return req;
+}
 
-    if (bio->write) {
-        return nvme_write_sector_async_wrapper(disk, req);
-    } else {
-        return nvme_read_sector_async_wrapper(disk, req);
-    }
+static bool nvme_send_bio(struct generic_disk *disk, struct nvme_request *req) {
+    struct nvme_namespace *ns = disk->driver_data;
+    uint64_t max_sectors = ns->dev->max_transfer_size / disk->sector_size;
+
+    if (req->sector_count > max_sectors ||
+        (req->vec_count &&
+         nvme_vecs_fit(ns->dev, req->vecs, req->vec_count) < req->vec_count))
+        return nvme_submit_split(disk, req);
+
+    return nvme_send_one(disk, req);
+}
+
+bool nvme_should_coalesce(struct generic_disk *disk,
+                          const struct bio_request *a,
+                          const struct bio_request *b) {
+    struct nvme_namespace *ns = disk->driver_data;
+    uint64_t max_sectors = ns->dev->max_transfer_size / disk->sector_size;
+    return bio_sched_can_merge(disk, a, b, max_sectors);
+}
+
+bool nvme_submit_bio_request(struct generic_disk *disk,
+                             struct bio_request *bio) {
+    if (bio->is_aggregate)
+        return bio_sched_submit_aggregate(disk, bio, nvme_submit_bio_request);
+
+    struct nvme_request *req = nvme_request_from_bio(disk, bio);
+    if (!req)
+        return false;
+
+    return nvme_send_bio(disk, req);
+}
+
+/* The poller frees the request, completion only hands it back */
+static void nvme_on_polled_bio_complete(struct nvme_request *req) {
+    struct bio_request *bio = req->user_data;
+
+    bio->done = true;
+    bio->status = req->status;
+
+    if (bio->on_complete)
+        bio->on_complete(bio);
+
+    nvme_poll_complete(req);
+}
+
+bool nvme_submit_bio_polled(struct generic_disk *disk,
+                            struct bio_request *bio) {
+    struct nvme_request *req = nvme_request_from_bio(disk, bio);
+    if (!req)
+        return false;
+
+    req->on_complete = nvme_on_polled_bio_complete;
+    req->poll_state = NVME_POLL_SPINNING;
+
+    /* a split that never got a part out has already freed `req` */
+    if (!nvme_send_bio(disk, req))
+        return false;
+
+    struct nvme_namespace *ns = disk->driver_data;
+    nvme_poll_wait(ns->dev, req);
+
+    INIT_LIST_HEAD(&req->list_node);
+    kmem_cache_free(&nvme_request_cache, req);
+    return true;
 }
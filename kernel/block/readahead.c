@@ -0,0 +1,87 @@
+/* Sequential readahead for the block cache.
+ *
+ * Every reader that wants readahead passes a stream id along with the LBA it
+ * is about to read. If it keeps reading where it left off, the window of
+ * blocks read ahead of it doubles each time it gets into the second half of
+ * what has already been prefetched. Jumping around halves the window. The
+ * reads themselves go out as a few large requests through the scheduler. */
+
+#include <block/bcache.h>
+#include <block/generic.h>
+#include <math/align.h>
+#include <math/min_max.h>
+#include <time.h>
+
+/* Caller holds the readahead lock. Unknown streams take over a free
+ * slot, or the one that has gone unused for the longest */
+static struct bcache_ra_stream *ra_stream_get(struct bcache_readahead *ra,
+                                              uint64_t id) {
+    struct bcache_ra_stream *victim = &ra->streams[0];
+
+    for (size_t i = 0; i < BCACHE_RA_STREAMS; i++) {
+        struct bcache_ra_stream *s = &ra->streams[i];
+        if (s->id == id)
+            return s;
+
+        if (victim->id && (!s->id || s->last_used < victim->last_used))
+            victim = s;
+    }
+
+    victim->id = id;
+    victim->next_lba = UINT64_MAX;
+    victim->ra_end = 0;
+    victim->window = BCACHE_RA_MIN_WINDOW;
+    return victim;
+}
+
+void bcache_readahead(struct generic_disk *disk, uint64_t stream,
+                      uint64_t lba, uint64_t block_size, uint64_t spb) {
+    struct bcache_readahead *ra = &disk->cache->ra;
+    uint64_t base_lba = ALIGN_DOWN(lba, spb);
+    uint64_t from = 0, to = 0;
+
+    enum irql irql = bcache_readahead_lock(ra);
+    struct bcache_ra_stream *s = ra_stream_get(ra, stream);
+    s->last_used = time_get_ms();
+
+    if (base_lba == s->next_lba) {
+        s->next_lba = base_lba + spb;
+
+        /* less than half a window left in front of the reader? */
+        uint64_t ahead = s->ra_end > s->next_lba ? s->ra_end - s->next_lba : 0;
+        if (ahead < (s->window / 2) * spb) {
+            if (s->ra_end)
+                s->window = MIN(s->window * 2, BCACHE_RA_MAX_WINDOW);
+
+            from = MAX(s->ra_end, s->next_lba);
+            to = s->next_lba + s->window * spb;
+            s->ra_end = to;
+        }
+    } else if (base_lba + spb != s->next_lba) {
+        /* re-reading the same block is fine, anything else is a seek */
+        s->window = MAX(s->window / 2, BCACHE_RA_MIN_WINDOW);
+        s->next_lba = base_lba + spb;
+        s->ra_end = 0;
+    }
+
+    bcache_readahead_unlock(ra, irql);
+
+    to = MIN(to, ALIGN_DOWN(disk->total_sectors, spb));
+    uint64_t max_blocks = MAX(BCACHE_MAX_IO_SECTORS / spb, 1);
+
+    while (from < to) {
+        uint64_t blocks = MIN((to - from) / spb, max_blocks);
+        if (!blocks)
+            break;
+
+        bcache_prefetch_range_async(disk, from, blocks, block_size, spb);
+        from += blocks * spb;
+    }
+}
+
+void bcache_readahead_init(struct bcache_readahead *ra) {
+    for (size_t i = 0; i < BCACHE_RA_STREAMS; i++)
+        ra->streams[i] = (struct bcache_ra_stream) {0};
+
+    spinlock_init(&ra->lock);
+}
@@ -43,16 +43,16 @@ static bool should_boost(struct bio_request *req) {
     return curr_timestamp > (req->enqueue_time + adjusted_wait);
 }
 
-static bool do_boost_prio(struct bio_scheduler *sched,
+static bool do_boost_prio(struct bio_sched_hctx *hctx,
                           struct bio_request *req) {
     enum bio_request_priority new_prio = get_boosted_prio(req);
 
-    struct bio_scheduler_ops *ops = sched->disk->ops;
+    struct bio_scheduler_ops *ops = hctx->disk->ops;
 
     if (req->priority == new_prio)
         return false;
 
-    uint64_t target_request_count = sched->queues[new_prio].request_count;
+    uint64_t target_request_count = hctx->queues[new_prio].request_count;
     uint64_t target_occupance_limit = ops->boost_occupance_limit[new_prio];
 
     /* update the timestamp so we don't try to
@@ -62,30 +62,30 @@ static bool do_boost_prio(struct bio_scheduler *sched,
         return false;
     }
 
-    bio_sched_dequeue_internal(sched, req);
+    bio_sched_dequeue_internal(hctx, req);
     req->priority = new_prio;
     req->boost_count++;
 
     /* re-insert to new level */
-    bio_sched_enqueue_internal(sched, req);
+    bio_sched_enqueue_internal(hctx, req);
     return true;
 }
 
-static inline bool try_boost(struct bio_scheduler *sched,
+static inline bool try_boost(struct bio_sched_hctx *hctx,
                              struct bio_request *req) {
     if (should_boost(req))
-        return do_boost_prio(sched, req);
+        return do_boost_prio(hctx, req);
 
     return false;
 }
 
 /* this will be called with the lock already acquired */
-bool bio_sched_boost_starved(struct bio_scheduler *sched) {
-    MUTEX_ASSERT_HELD(&sched->lock);
+bool bio_sched_boost_starved(struct bio_sched_hctx *hctx) {
+    MUTEX_ASSERT_HELD(&hctx->lock);
     bool boosted_any = false;
 
     for (int64_t i = BIO_RQ_HIGH; i >= 0; i--) {
-        struct bio_rqueue *queue = &sched->queues[i];
+        struct bio_rqueue *queue = &hctx->queues[i];
 
         uint64_t checks_left = queue->request_count;
 
@@ -96,7 +96,7 @@ bool bio_sched_boost_starved(struct bio_scheduler *sched) {
 
         list_for_each_safe(iter, temp, &queue->list) {
             struct bio_request *rq = bio_request_from_list_node(iter);
-            if (!rq->skip && try_boost(sched, rq)) {
+            if (!rq->skip && try_boost(hctx, rq)) {
                 boosted_any = true;
                 goto next_level;
             }
@@ -1,6 +1,7 @@
 #include <block/generic.h>
 #include <block/sched.h>
 #include <console/printf.h>
+#include <kassert.h>
 #include <mem/alloc.h>
 #include <stdint.h>
 #include <sync/spinlock.h>
@@ -9,12 +10,35 @@
 
 static inline void set_coalesced(struct bio_request *into,
                                  struct bio_request *from) {
+    struct bio_request **tail = &into->next_coalesced;
+    while (*tail)
+        tail = &(*tail)->next_coalesced;
+
+    *tail = from;
     into->is_aggregate = true;
     from->skip = true;
 }
 
-static bool try_do_coalesce(struct generic_disk *disk, struct bio_request *into,
-                            struct bio_request *from) {
+static inline bool sector_aligned(struct generic_disk *disk,
+                                  const struct bio_request *req) {
+    return req->vec_count || (uintptr_t) req->buffer % disk->sector_size == 0;
+}
+
+bool bio_sched_can_merge(struct generic_disk *disk,
+                         const struct bio_request *a,
+                         const struct bio_request *b, uint64_t max_sectors) {
+    if (a->write != b->write || bio_sched_extent_end(a) != b->lba)
+        return false;
+
+    if (bio_sched_extent_end(b) - a->lba > max_sectors)
+        return false;
+
+    return sector_aligned(disk, a) && sector_aligned(disk, b);
+}
+
+bool bio_sched_coalesce_pair(struct generic_disk *disk,
+                             struct bio_request *into,
+                             struct bio_request *from) {
     if (disk->ops->should_coalesce(disk, into, from)) {
         disk->ops->do_coalesce(disk, into, from);
         set_coalesced(into, from);
@@ -23,134 +47,116 @@ static bool try_do_coalesce(struct generic_disk *disk, struct bio_request *into,
     return false;
 }
 
-/* Try to merge candidates in the same queue */
-static bool try_merge_candidates(struct generic_disk *disk,
-                                 struct bio_request *iter,
-                                 struct bio_request *start,
-                                 struct bio_rqueue *queue) {
-    struct bio_request *candidate = NULL, *tmp;
-    bool merged = false;
-    uint8_t coalesces_left = BIO_SCHED_MAX_COALESCES;
-
-    list_for_each_entry_safe_continue(candidate, tmp, &queue->list, list) {
-        if (candidate == start)
-            break;
-
-        if (candidate->skip || candidate->priority != iter->priority)
-            continue;
-
-        if (try_do_coalesce(disk, iter, candidate)) {
-            coalesces_left--;
-            merged = true;
-        }
-
-        if (!coalesces_left)
-            break;
-    }
-
-    return merged;
+static inline bool prio_close(const struct bio_request *a,
+                              const struct bio_request *b) {
+    return a->priority <= b->priority + 1 && b->priority <= a->priority + 1;
 }
 
-/* Try to coalesce candidate from lower queue with higher queue */
-static bool check_higher_queue(struct bio_scheduler *sched,
-                               struct bio_rqueue *higher,
-                               struct bio_request *candidate) {
-    struct generic_disk *disk = sched->disk;
-    struct bio_request *iter, *tmp;
+/* Caller holds the context's lock and `req` was just queued on it.
+ * Merges `req` with whatever ends where it starts, then with whatever
+ * starts where the result ends */
+bool bio_sched_try_coalesce(struct bio_sched_hctx *hctx,
+                            struct bio_request *req) {
+    struct generic_disk *disk = hctx->disk;
+    if (disk_skip_coalesce(disk))
+        return false;
 
-    list_for_each_entry_safe(iter, tmp, &higher->list, list) {
-        if (iter->skip)
-            continue;
+    bool coalesced = false;
 
-        if (try_do_coalesce(disk, iter, candidate))
-            return true; /* only one coalesce per candidate */
+    struct bio_request *prev =
+        bio_sched_index_ending_at(hctx, req->write, req->lba);
+    if (prev && prev != req && prio_close(prev, req) &&
+        bio_sched_coalesce_pair(disk, prev, req)) {
+        bio_sched_dequeue_internal(hctx, req);
+        hctx->stats.back_merges++;
+        coalesced = true;
+        req = prev;
     }
 
-    return false;
-}
-
-/* Cross-priority coalescing between two adjacent queues */
-static bool coalesce_adjacent_queues(struct generic_disk *disk,
-                                     struct bio_rqueue *lower,
-                                     struct bio_rqueue *higher) {
-    if (list_empty(&lower->list) || list_empty(&higher->list))
-        return false;
+    struct bio_request *next = bio_sched_index_starting_at(
+        hctx, req->write, bio_sched_extent_end(req));
+    if (next && next != req && prio_close(req, next) &&
+        bio_sched_coalesce_pair(disk, req, next)) {
+        bio_sched_dequeue_internal(hctx, next);
+        hctx->stats.front_merges++;
+        coalesced = true;
+    }
 
-    if (!lower->dirty || !higher->dirty)
-        return false;
+    return coalesced;
+}
 
-    struct bio_scheduler *sched = disk->scheduler;
-    struct bio_request *candidate, *tmp;
-    bool coalesced = false;
-    uint8_t coalesces_left = BIO_SCHED_MAX_COALESCES;
+/* Completes everything on the chain with the status of the merged request */
+static void aggregate_complete(struct bio_request *merged) {
+    struct bio_request *c = merged->user_data;
 
-    list_for_each_entry_safe(candidate, tmp, &lower->list, list) {
-        if (candidate->skip)
-            continue;
+    while (c) {
+        /* `c` can be freed by its callback */
+        struct bio_request *next = c->next_coalesced;
 
-        if (check_higher_queue(sched, higher, candidate)) {
-            coalesces_left--;
-            coalesced = true;
-        }
+        c->status = merged->status;
+        c->done = true;
+        if (c->on_complete)
+            c->on_complete(c);
 
-        if (!coalesces_left)
-            break;
+        c = next;
     }
 
-    lower->dirty = false;
-    higher->dirty = false;
-    return coalesced;
+    bio_request_free(merged);
 }
 
-/* Coalesce requests inside a single priority queue */
-static bool coalesce_priority_queue(struct generic_disk *disk,
-                                    struct bio_rqueue *queue) {
-    if (list_empty(&queue->list))
-        return false;
+static struct bio_request *aggregate_build(struct generic_disk *disk,
+                                           struct bio_request *agg) {
+    uint32_t max_vecs = 0;
+    for (struct bio_request *c = agg; c; c = c->next_coalesced) {
+        /* a buffer that doesn't start on a page touches one more */
+        uint64_t bytes = c->sector_count * disk->sector_size;
+        max_vecs += c->vec_count ? c->vec_count : bytes / PAGE_SIZE + 2;
+    }
 
-    if (!queue->dirty)
-        return false;
+    struct bio_request *merged = bio_create_vectored(
+        disk, agg->lba, agg->write, max_vecs, aggregate_complete, agg);
+    if (!merged)
+        return NULL;
 
-    struct bio_request *start =
-        list_first_entry(&queue->list, struct bio_request, list);
-    struct bio_request *rq, *tmp;
-    bool coalesced = false;
-    uint8_t coalesces_left = BIO_SCHED_MAX_COALESCES;
+    merged->priority = agg->priority;
+    for (struct bio_request *c = agg; c; c = c->next_coalesced) {
+        bool added = true;
+        for (uint32_t i = 0; i < c->vec_count && added; i++)
+            added = bio_add_page(merged, c->vecs[i].page, c->vecs[i].offset,
+                                 c->vecs[i].len);
 
-    list_for_each_entry_safe(rq, tmp, &queue->list, list) {
-        if (!rq->skip && try_merge_candidates(disk, rq, start, queue)) {
-            coalesces_left--;
-            coalesced = true;
-        }
+        if (!c->vec_count)
+            added = bio_add_buffer(merged, c->buffer,
+                                   c->sector_count * disk->sector_size);
 
-        if (!coalesces_left)
-            break;
+        /* the vectors were counted for the worst case */
+        kassert(added);
     }
 
-    queue->dirty = false;
-    return coalesced;
+    return merged;
 }
 
-/* Try to coalesce across all queues and priorities */
-bool bio_sched_try_coalesce(struct bio_scheduler *sched) {
-    struct generic_disk *disk = sched->disk;
-    if (disk_skip_coalesce(disk))
-        return false;
-
-    bool coalesced_any = false;
-
-    /* coalesce within each priority queue */
-    for (int prio = 0; prio < BIO_SCHED_LEVELS; prio++) {
-        if (coalesce_priority_queue(disk, &sched->queues[prio]))
-            coalesced_any = true;
-    }
+bool bio_sched_submit_aggregate(struct generic_disk *disk,
+                                struct bio_request *agg,
+                                bool (*submit)(struct generic_disk *,
+                                               struct bio_request *)) {
+    struct bio_request *merged = aggregate_build(disk, agg);
+    if (merged && submit(disk, merged))
+        return true;
 
-    /* cross-priority coalescing */
-    for (int prio = 0; prio < BIO_SCHED_LEVELS - 1; prio++) {
-        if (coalesce_adjacent_queues(disk, &sched->queues[prio],
-                                     &sched->queues[prio + 1]))
-            coalesced_any = true;
+    if (merged)
+        bio_request_free(merged);
+
+    /* they go out one at a time if they can't go out together */
+    bool ok = true;
+    struct bio_request *c = agg;
+    while (c) {
+        struct bio_request *next = c->next_coalesced;
+        c->next_coalesced = NULL;
+        c->is_aggregate = false;
+        ok = submit(disk, c) && ok;
+        c = next;
     }
 
-    return coalesced_any;
+    return ok;
 }
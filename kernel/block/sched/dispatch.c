@@ -6,75 +6,121 @@
 #include <structures/dll.h>
 #include <sync/spinlock.h>
 #include <thread/workqueue.h>
+#include <time.h>
 
 /* enqueuing skips enqueuing if the req is URGENT */
 
-static inline bool should_early_dispatch(struct bio_scheduler *sched) {
-    return sched->total_requests > sched->disk->ops->dispatch_threshold;
+static inline bool should_early_dispatch(struct bio_sched_hctx *hctx) {
+    return hctx->total_requests > hctx->disk->ops->dispatch_threshold;
 }
 
-static bool try_dispatch_queue_head(struct bio_scheduler *sched,
-                                    struct bio_rqueue *q) {
-    if (list_empty(&q->list))
-        return false;
+/* Caller holds the context's lock and took `req` off the queues */
+static void account_dispatch(struct bio_sched_hctx *hctx,
+                             struct bio_request *req) {
+    struct generic_disk *disk = hctx->disk;
+    hctx->stats.dispatched++;
 
-    struct bio_request *head =
-        list_first_entry(&q->list, struct bio_request, list);
+    for (struct bio_request *c = req; c; c = c->next_coalesced)
+        hctx->stats.dispatched_sectors += c->sector_count;
 
-    if (head) {
-        bio_sched_dequeue_internal(sched, head);
-        sched->disk->submit_bio_async(sched->disk, head);
-        return true;
-    }
-    return false;
+    if (disk->ops->dispatched)
+        disk->ops->dispatched(disk, hctx, req);
 }
 
-static void dispatch_queue(struct generic_disk *disk, struct bio_rqueue *q) {
-    struct mutex *lock = &disk->scheduler->lock;
+static void dispatch_queue(struct bio_sched_hctx *hctx, struct bio_rqueue *q) {
+    struct generic_disk *disk = hctx->disk;
+    struct mutex *lock = &hctx->lock;
     mutex_lock(lock);
 
+    struct bio_request *req, *tmp;
+    list_for_each_entry(req, &q->list, list) {
+        bio_sched_index_remove(hctx, req);
+        if (disk->ops->unqueued)
+            disk->ops->unqueued(disk, hctx, req);
+
+        account_dispatch(hctx, req);
+    }
+
     /* Move the entire list out of the queue under lock */
     struct list_head tmp_list;
     INIT_LIST_HEAD(&tmp_list);
-    if (!list_empty(&q->list)) {
-        tmp_list.next = q->list.next;
-        tmp_list.prev = q->list.prev;
-        tmp_list.next->prev = &tmp_list;
-        tmp_list.prev->next = &tmp_list;
-    }
+    list_splice_init(&q->list, &tmp_list);
 
     /* Reset the queue */
-    INIT_LIST_HEAD(&q->list);
-    disk->scheduler->total_requests -= q->request_count;
+    hctx->total_requests -= q->request_count;
     q->request_count = 0;
 
     mutex_unlock(lock);
 
     /* Dispatch requests from the copied list */
-    struct bio_request *req, *tmp;
     list_for_each_entry_safe(req, tmp, &tmp_list, list) {
         list_del(&req->list); /* remove from tmp_list */
         disk->submit_bio_async(disk, req);
     }
 }
 
-static void do_early_dispatch(struct bio_scheduler *sched) {
-    for (int prio = 0; prio < BIO_SCHED_LEVELS; prio++)
-        if (try_dispatch_queue_head(sched, &sched->queues[prio]))
-            return;
+/* Oldest head that has gone past its level's wait time, highest level
+ * first. Heads are the oldest of their level unless boosting moved
+ * something in, which only makes that one look younger */
+static struct bio_request *expired_head(struct bio_sched_hctx *hctx) {
+    struct bio_scheduler_ops *ops = hctx->disk->ops;
+    uint64_t now = time_get_ms();
+
+    for (int prio = BIO_SCHED_LEVELS - 1; prio >= 0; prio--) {
+        struct bio_rqueue *q = &hctx->queues[prio];
+        if (list_empty(&q->list))
+            continue;
+
+        struct bio_request *head =
+            list_first_entry(&q->list, struct bio_request, list);
+        if (now > head->enqueue_time + ops->max_wait_time[prio])
+            return head;
+    }
+
+    return NULL;
+}
+
+static void do_early_dispatch(struct bio_sched_hctx *hctx) {
+    struct generic_disk *disk = hctx->disk;
+    struct bio_request *req = expired_head(hctx);
+
+    if (!req && disk->ops->select)
+        req = disk->ops->select(disk, hctx);
+    else if (!req)
+        req = bio_sched_index_next(hctx);
+
+    if (!req)
+        return;
+
+    bio_sched_dequeue_internal(hctx, req);
+    account_dispatch(hctx, req);
+
+    hctx->next_lba = bio_sched_extent_end(req);
+    hctx->next_write = req->write;
+    disk->submit_bio_async(disk, req);
 }
 
-void bio_sched_try_early_dispatch(struct bio_scheduler *sched) {
-    MUTEX_ASSERT_HELD(&sched->lock);
-    if (should_early_dispatch(sched))
-        do_early_dispatch(sched);
+void bio_sched_try_early_dispatch(struct bio_sched_hctx *hctx) {
+    MUTEX_ASSERT_HELD(&hctx->lock);
+    if (should_early_dispatch(hctx))
+        do_early_dispatch(hctx);
 }
 
+/* Whatever CPUs still have staged goes out as well */
 void bio_sched_dispatch_partial(struct generic_disk *d,
                                 enum bio_request_priority p) {
-    /* no one in urgent queue */
-    for (uint32_t i = BIO_RQ_HIGH; i > p; i--) {
-        dispatch_queue(d, &d->scheduler->queues[i]);
+    struct bio_scheduler *sched = d->scheduler;
+
+    for (uint32_t h = 0; h < sched->hctx_count; h++) {
+        struct bio_sched_hctx *hctx = &sched->hctxs[h];
+
+        mutex_lock(&hctx->lock);
+        bio_sched_drain_swqs(hctx);
+        mutex_unlock(&hctx->lock);
+
+        /* no one in urgent queue */
+        for (uint32_t i = BIO_RQ_HIGH; i > p; i--)
+            dispatch_queue(hctx, &hctx->queues[i]);
     }
 }
 
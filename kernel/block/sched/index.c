@@ -0,0 +1,103 @@
+/* LBA index of a hardware context.
+ *
+ * Next to the priority queues, every queued request sits in one of two
+ * rbts, for reads and for writes, keyed by its starting LBA. Merging looks
+ * up neighbours in it, and the elevator walks it in LBA order. Coalesced
+ * requests leave the queues, so they aren't in here either, and an
+ * aggregate covers everything up to the end of its chain. */
+
+#include <block/generic.h>
+#include <block/sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <structures/rbt.h>
+
+static size_t index_get_data(struct rbt_node *n) {
+    return rbt_entry(n, struct bio_request, lba_node)->lba;
+}
+
+static int32_t index_cmp(const struct rbt_node *a, const struct rbt_node *b) {
+    uint64_t la = index_get_data((struct rbt_node *) a);
+    uint64_t lb = index_get_data((struct rbt_node *) b);
+    return (la > lb) - (la < lb);
+}
+
+void bio_sched_index_init(struct bio_sched_hctx *hctx) {
+    rbt_init(&hctx->lba_index[0], index_get_data, index_cmp);
+    rbt_init(&hctx->lba_index[1], index_get_data, index_cmp);
+}
+
+void bio_sched_index_insert(struct bio_sched_hctx *hctx,
+                            struct bio_request *req) {
+    rbt_init_node(&req->lba_node);
+    rbt_insert(&hctx->lba_index[req->write], &req->lba_node);
+}
+
+void bio_sched_index_remove(struct bio_sched_hctx *hctx,
+                            struct bio_request *req) {
+    rbt_delete(&hctx->lba_index[req->write], &req->lba_node);
+}
+
+uint64_t bio_sched_extent_end(const struct bio_request *req) {
+    uint64_t end = req->lba + req->sector_count;
+
+    for (struct bio_request *c = req->next_coalesced; c; c = c->next_coalesced)
+        if (c->lba + c->sector_count > end)
+            end = c->lba + c->sector_count;
+
+    return end;
+}
+
+/* Last request starting at or below `lba`, or with `above`, the
+ * first one starting at or above it */
+static struct rbt_node *index_bound(struct rbt *tree, uint64_t lba,
+                                    bool above) {
+    struct rbt_node *node = tree->root, *best = NULL;
+
+    while (node) {
+        uint64_t key = tree->get_data(node);
+        if (above ? key >= lba : key <= lba) {
+            best = node;
+            node = above ? node->left : node->right;
+        } else {
+            node = above ? node->right : node->left;
+        }
+    }
+
+    return best;
+}
+
+struct bio_request *bio_sched_index_ending_at(struct bio_sched_hctx *hctx,
+                                              bool write, uint64_t lba) {
+    if (!lba)
+        return NULL;
+
+    struct rbt_node *n = index_bound(&hctx->lba_index[write], lba - 1, false);
+    if (!n)
+        return NULL;
+
+    struct bio_request *req = rbt_entry(n, struct bio_request, lba_node);
+    return bio_sched_extent_end(req) == lba ? req : NULL;
+}
+
+struct bio_request *bio_sched_index_starting_at(struct bio_sched_hctx *hctx,
+                                                bool write, uint64_t lba) {
+    struct rbt_node *n = rbt_search(&hctx->lba_index[write], lba);
+    return n ? rbt_entry(n, struct bio_request, lba_node) : NULL;
+}
+
+/* One way sweep. Stays in the current direction while there is anything
+ * further up, then tries the other one, and wraps around once both are
+ * done */
+struct bio_request *bio_sched_index_next(struct bio_sched_hctx *hctx) {
+    struct rbt_node *n = NULL;
+
+    for (int i = 0; !n && i < 2; i++)
+        n = index_bound(&hctx->lba_index[hctx->next_write ^ i],
+                        hctx->next_lba, true);
+
+    for (int i = 0; !n && i < 2; i++)
+        n = rbt_first(&hctx->lba_index[hctx->next_write ^ i]);
+
+    return n ? rbt_entry(n, struct bio_request, lba_node) : NULL;
+}
@@ -10,32 +10,45 @@
 
 /* enqueuing skips enqueuing if the req is URGENT */
 
-void bio_sched_enqueue_internal(struct bio_scheduler *sched,
+bool bio_sched_enqueue_internal(struct bio_sched_hctx *hctx,
                                 struct bio_request *req) {
-    if (submit_if_urgent(sched, req))
-        return;
+    if (submit_if_urgent(hctx->disk, req))
+        return false;
 
-    MUTEX_ASSERT_HELD(&sched->lock);
+    MUTEX_ASSERT_HELD(&hctx->lock);
     update_request_timestamp(req);
     enum bio_request_priority prio = req->priority;
-    struct bio_rqueue *q = &sched->queues[prio];
+    struct bio_rqueue *q = &hctx->queues[prio];
 
     list_add_tail(&req->list, &q->list);
+    bio_sched_index_insert(hctx, req);
+    req->hctx = hctx;
 
     q->dirty = true;
     q->request_count++;
-    sched->total_requests++;
+    hctx->total_requests++;
+
+    struct generic_disk *disk = hctx->disk;
+    if (disk->ops->queued)
+        disk->ops->queued(disk, hctx, req);
+
+    return true;
 }
 
-void bio_sched_dequeue_internal(struct bio_scheduler *sched,
+void bio_sched_dequeue_internal(struct bio_sched_hctx *hctx,
                                 struct bio_request *req) {
-    MUTEX_ASSERT_HELD(&sched->lock);
+    MUTEX_ASSERT_HELD(&hctx->lock);
     enum bio_request_priority prio = req->priority;
-    struct bio_rqueue *q = &sched->queues[prio];
+    struct bio_rqueue *q = &hctx->queues[prio];
 
     list_del_init(&req->list);
+    bio_sched_index_remove(hctx, req);
 
     q->dirty = true;
     q->request_count--;
-    sched->total_requests--;
+    hctx->total_requests--;
+
+    struct generic_disk *disk = hctx->disk;
+    if (disk->ops->unqueued)
+        disk->ops->unqueued(disk, hctx, req);
 }
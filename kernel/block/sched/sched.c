@@ -1,45 +1,54 @@
 #include <block/generic.h>
 #include <block/sched.h>
 #include <console/printf.h>
+#include <global.h>
 #include <mem/alloc.h>
 #include <sync/spinlock.h>
-#include <thread/workqueue.h>
+#include <thread/timer.h>
 
-static void try_rq_reorder(struct bio_scheduler *sched) {
-    struct generic_disk *disk = sched->disk;
+static void try_rq_reorder(struct bio_sched_hctx *hctx) {
+    struct generic_disk *disk = hctx->disk;
     if (disk_skip_reorder(disk))
         return;
 
-    disk->ops->reorder(disk);
+    disk->ops->reorder(disk, hctx);
+}
+
+static void bio_sched_tick(void *ctx, void *unused);
+
+static void arm_tick(struct bio_sched_hctx *hctx) {
+    if (!atomic_exchange(&hctx->tick_pending, true))
+        timer_arm(&hctx->tick_timer, hctx->disk->ops->tick_ms);
 }
 
 static void bio_sched_tick(void *ctx, void *unused) {
     (void) unused;
-    struct bio_scheduler *sched = ctx;
+    struct bio_sched_hctx *hctx = ctx;
 
-    mutex_lock(&sched->lock);
+    /* anything staged or queued from here on arms another tick */
+    atomic_store(&hctx->tick_pending, false);
 
-    bio_sched_boost_starved(sched);
-    try_rq_reorder(sched);
-    bio_sched_try_early_dispatch(sched);
+    mutex_lock(&hctx->lock);
 
-    if (!sched_is_empty(sched)) {
-        mutex_unlock(&sched->lock);
-        defer_enqueue(bio_sched_tick, WORK_ARGS(sched, NULL),
-                      sched->disk->ops->tick_ms);
-    } else {
-        sched->defer_pending = false;
-        mutex_unlock(&sched->lock);
-    }
+    bio_sched_drain_swqs(hctx);
+    bio_sched_boost_starved(hctx);
+    try_rq_reorder(hctx);
+    bio_sched_try_early_dispatch(hctx);
+
+    bool empty = hctx_is_empty(hctx);
+    mutex_unlock(&hctx->lock);
+
+    if (!empty)
+        arm_tick(hctx);
 }
 
-static bool try_early_submit(struct bio_scheduler *sched,
+static bool try_early_submit(struct generic_disk *disk,
                              struct bio_request *req) {
     /* disk does not support/need IO scheduling */
-    if (submit_if_skip_sched(sched, req))
+    if (submit_if_skip_sched(disk, req))
         return true;
 
-    if (submit_if_urgent(sched, req))
+    if (submit_if_urgent(disk, req))
         return true;
 
     return false;
@@ -48,55 +57,122 @@ static bool try_early_submit(struct bio_scheduler *sched,
 void bio_sched_enqueue(struct generic_disk *disk, struct bio_request *req) {
     kassert(req->disk == disk);
 
-    struct bio_scheduler *sched = disk->scheduler;
+    struct thread *curr = thread_get_current();
+    req->issuer = curr ? curr->id : 0;
+    req->io_weight = bio_sched_thread_weight(curr);
 
-    if (try_early_submit(sched, req))
+    if (try_early_submit(disk, req))
         return;
 
-    mutex_lock(&sched->lock);
+    struct bio_sched_swq *swq = bio_sched_swq_local(disk->scheduler);
+    struct bio_sched_hctx *hctx = swq->hctx;
+    bool flush = bio_sched_swq_stage(swq, req);
 
-    bio_sched_enqueue_internal(sched, req);
+    /* someone else is in there, they or the tick will pick it up */
+    if (!flush && !mutex_trylock(&hctx->lock)) {
+        arm_tick(hctx);
+        return;
+    }
 
-    bio_sched_try_early_dispatch(sched);
-    bio_sched_boost_starved(sched);
+    if (flush)
+        mutex_lock(&hctx->lock);
 
-    bio_sched_try_coalesce(sched);
+    bio_sched_swq_drain(swq);
 
-    try_rq_reorder(sched);
+    bio_sched_try_early_dispatch(hctx);
+    bio_sched_boost_starved(hctx);
+    try_rq_reorder(hctx);
 
-    if (!sched->defer_pending) {
-        sched->defer_pending = true;
-        mutex_unlock(&sched->lock);
-        defer_enqueue(bio_sched_tick, WORK_ARGS(sched, NULL),
-                      disk->ops->tick_ms);
-    } else {
-        mutex_unlock(&sched->lock);
-    }
+    mutex_unlock(&hctx->lock);
+    arm_tick(hctx);
 }
 
 void bio_sched_dequeue(struct generic_disk *disk, struct bio_request *req,
                        bool already_locked) {
-    struct bio_scheduler *sched = disk->scheduler;
+    (void) disk;
+    struct bio_sched_hctx *hctx = req->hctx;
     if (!already_locked)
-        mutex_lock(&sched->lock);
+        mutex_lock(&hctx->lock);
 
-    bio_sched_dequeue_internal(sched, req);
+    bio_sched_dequeue_internal(hctx, req);
 
     if (!already_locked)
-        mutex_unlock(&sched->lock);
+        mutex_unlock(&hctx->lock);
 }
 
 struct bio_scheduler *bio_sched_create(struct generic_disk *disk,
-                                       struct bio_scheduler_ops *ops) {
+                                       struct bio_scheduler_ops *ops,
+                                       uint32_t hw_queues) {
     struct bio_scheduler *sched = kzalloc(sizeof(struct bio_scheduler));
     if (!sched)
         panic("Could not allocate space for block device IO scheduler\n");
 
-    for (size_t i = 0; i < BIO_SCHED_LEVELS; i++) {
-        INIT_LIST_HEAD(&sched->queues[i].list);
+    sched->hctx_count = hw_queues ? hw_queues : 1;
+    sched->hctxs = kzalloc(sizeof(struct bio_sched_hctx) * sched->hctx_count);
+    sched->swqs = kzalloc(sizeof(struct bio_sched_swq) * global.core_count);
+    if (!sched->hctxs || !sched->swqs)
+        panic("Could not allocate space for block device IO queues\n");
+
+    for (size_t h = 0; h < sched->hctx_count; h++) {
+        struct bio_sched_hctx *hctx = &sched->hctxs[h];
+        hctx->disk = disk;
+        mutex_init(&hctx->lock);
+        bio_sched_index_init(hctx);
+
+        /* the tick takes the mutex, so it runs from the timer worker */
+        timer_init(&hctx->tick_timer, bio_sched_tick, hctx, NULL,
+                   TIMER_FLAG_NONE);
+
+        for (size_t i = 0; i < BIO_SCHED_LEVELS; i++)
+            INIT_LIST_HEAD(&hctx->queues[i].list);
     }
+
+    /* same spread as the drivers use to pick their hardware queue */
+    for (size_t cpu = 0; cpu < global.core_count; cpu++) {
+        struct bio_sched_swq *swq = &sched->swqs[cpu];
+        spinlock_init(&swq->lock);
+        INIT_LIST_HEAD(&swq->list);
+        swq->hctx = &sched->hctxs[cpu % sched->hctx_count];
+    }
+
     sched->disk = disk;
     disk->ops = ops;
 
+    if (ops->init_hctx)
+        for (size_t h = 0; h < sched->hctx_count; h++)
+            ops->init_hctx(disk, &sched->hctxs[h]);
+
     return sched;
 }
+
+void bio_sched_stat(struct generic_disk *disk, struct bio_sched_stats *out,
+                    uint64_t *avg_io_bytes_out) {
+    struct bio_scheduler *sched = disk->scheduler;
+    *out = (struct bio_sched_stats) {0};
+
+    for (size_t h = 0; h < sched->hctx_count; h++) {
+        struct bio_sched_hctx *hctx = &sched->hctxs[h];
+
+        mutex_lock(&hctx->lock);
+        out->front_merges += hctx->stats.front_merges;
+        out->back_merges += hctx->stats.back_merges;
+        out->dispatched += hctx->stats.dispatched;
+        out->dispatched_sectors += hctx->stats.dispatched_sectors;
+        mutex_unlock(&hctx->lock);
+    }
+
+    /* staging merges are always back merges */
+    for (size_t cpu = 0; cpu < global.core_count; cpu++) {
+        struct bio_sched_swq *swq = &sched->swqs[cpu];
+
+        enum irql irql = spin_lock(&swq->lock);
+        out->back_merges += swq->merges;
+        spin_unlock(&swq->lock, irql);
+    }
+
+    if (avg_io_bytes_out)
+        *avg_io_bytes_out =
+            out->dispatched
+                ? out->dispatched_sectors * disk->sector_size / out->dispatched
+                : 0;
+}
@@ -0,0 +1,72 @@
+/* Per-CPU staging in front of the hardware contexts.
+ *
+ * Submitters only take the lock of their own CPU's software queue, which
+ * nobody else touches except to drain it, so that enqueueing from a bunch
+ * of CPUs at once doesn't serialize on the lock of a single context. */
+
+#include <block/generic.h>
+#include <block/sched.h>
+#include <global.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <structures/list.h>
+#include <sync/spinlock.h>
+
+bool bio_sched_swq_stage(struct bio_sched_swq *swq, struct bio_request *req) {
+    struct generic_disk *disk = swq->hctx->disk;
+    enum irql irql = spin_lock(&swq->lock);
+
+    /* back merge with whatever this CPU staged right before, `req`
+     * then rides along on its chain and isn't staged itself */
+    if (!list_empty(&swq->list) && !disk_skip_coalesce(disk)) {
+        struct bio_request *last =
+            list_entry(swq->list.prev, struct bio_request, list);
+
+        if (last->priority == req->priority && last->write == req->write &&
+            bio_sched_extent_end(last) == req->lba &&
+            bio_sched_coalesce_pair(disk, last, req)) {
+            swq->merges++;
+            spin_unlock(&swq->lock, irql);
+            return false;
+        }
+    }
+
+    list_add_tail(&req->list, &swq->list);
+    bool full = ++swq->count >= BIO_SCHED_SWQ_BATCH;
+
+    spin_unlock(&swq->lock, irql);
+    return full || req->priority >= BIO_RQ_HIGH;
+}
+
+/* Caller holds the lock of the context `swq` maps to */
+void bio_sched_swq_drain(struct bio_sched_swq *swq) {
+    struct bio_sched_hctx *hctx = swq->hctx;
+    MUTEX_ASSERT_HELD(&hctx->lock);
+
+    struct list_head batch;
+    INIT_LIST_HEAD(&batch);
+
+    enum irql irql = spin_lock(&swq->lock);
+    list_splice_init(&swq->list, &batch);
+    swq->count = 0;
+    spin_unlock(&swq->lock, irql);
+
+    struct bio_request *req, *tmp;
+    list_for_each_entry_safe(req, tmp, &batch, list) {
+        list_del_init(&req->list);
+        if (bio_sched_enqueue_internal(hctx, req))
+            bio_sched_try_coalesce(hctx, req);
+    }
+}
+
+/* Caller holds the context's lock. Racy peeks are fine, whoever stages
+ * something after we looked arms another tick */
+void bio_sched_drain_swqs(struct bio_sched_hctx *hctx) {
+    struct bio_scheduler *sched = hctx->disk->scheduler;
+
+    for (size_t cpu = 0; cpu < global.core_count; cpu++) {
+        struct bio_sched_swq *swq = &sched->swqs[cpu];
+        if (swq->hctx == hctx && swq->count)
+            bio_sched_swq_drain(swq);
+    }
+}
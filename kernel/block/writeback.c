@@ -0,0 +1,413 @@
+/* Background writeback for the block cache.
+ *
+ * Writers only mark their entry dirty and put it at the tail of the dirty
+ * list. A daemon per disk comes around every so often, grabs everything
+ * that has been dirty for too long (or everything it can, if there is too
+ * much dirty data), sorts it by LBA and writes runs of adjacent blocks out
+ * as one request. Once the dirty ratio goes past the throttle limit the
+ * writers themselves wait for some of that writeback to finish. */
+
+#include <block/bcache.h>
+#include <block/generic.h>
+#include <block/sched.h>
+#include <console/printf.h>
+#include <global.h>
+#include <math/sort.h>
+#include <mem/alloc.h>
+#include <smp/topology.h>
+#include <thread/daemon.h>
+#include <time.h>
+
+struct bcache_wb_run {
+    struct generic_disk *disk;
+    size_t count;
+    struct bcache_entry *ents[];
+};
+
+static inline struct bcache_writeback *disk_wb(struct generic_disk *disk) {
+    return &disk->cache->wb;
+}
+
+static inline uint64_t ent_sectors(struct generic_disk *disk,
+                                   struct bcache_entry *ent) {
+    return ent->size / disk->sector_size;
+}
+
+static uint64_t wb_outstanding(struct bcache_writeback *wb) {
+    return wb->nr_dirty + atomic_load(&wb->nr_writing);
+}
+
+/* Caller holds the writeback lock */
+static void wb_enlist_locked(struct bcache_writeback *wb,
+                             struct bcache_entry *ent, bool front) {
+    if (!list_empty(&ent->dirty_list))
+        return;
+
+    if (front) {
+        list_add(&ent->dirty_list, &wb->dirty);
+    } else {
+        ent->dirtied_at = time_get_ms();
+        list_add_tail(&ent->dirty_list, &wb->dirty);
+    }
+
+    ent->dirty = true;
+    wb->nr_dirty++;
+}
+
+/* Hands an entry we could not write back to the list, at the front,
+ * since it was one of the oldest ones to begin with */
+static void wb_requeue(struct bcache_writeback *wb, struct bcache_entry *ent) {
+    enum irql irql = bcache_writeback_lock(wb);
+    ent->writeback = false;
+    wb_enlist_locked(wb, ent, /* front = */ true);
+    bcache_writeback_unlock(wb, irql);
+
+    bcache_ent_unpin(ent);
+}
+
+/* The list is in dirtying order, so we can stop at the first entry that is
+ * young enough, unless there is simply too much dirty data around */
+static size_t wb_collect(struct bcache_writeback *wb,
+                         struct bcache_entry **ents, bool all) {
+    time_t now = time_get_ms();
+    size_t n = 0;
+
+    enum irql irql = bcache_writeback_lock(wb);
+
+    struct bcache_entry *ent, *tmp;
+    list_for_each_entry_safe(ent, tmp, &wb->dirty, dirty_list) {
+        if (n == BCACHE_WB_BATCH)
+            break;
+
+        bool expired = now - ent->dirtied_at >= BCACHE_WB_EXPIRE_MS;
+        bool over = wb->nr_dirty > wb->background_limit;
+        if (!all && !expired && !over)
+            break;
+
+        /* the previous write of this block has to land first */
+        if (ent->writeback)
+            continue;
+
+        list_del_init(&ent->dirty_list);
+        wb->nr_dirty--;
+        ent->writeback = true;
+        bcache_ent_pin(ent);
+        ents[n++] = ent;
+    }
+
+    bcache_writeback_unlock(wb, irql);
+    return n;
+}
+
+static int wb_cmp_lba(const void *a, const void *b) {
+    const struct bcache_entry *ea = *(struct bcache_entry *const *) a;
+    const struct bcache_entry *eb = *(struct bcache_entry *const *) b;
+
+    if (ea->lba < eb->lba)
+        return -1;
+
+    return ea->lba > eb->lba;
+}
+
+static void wb_end_io(struct bio_request *req) {
+    struct bcache_wb_run *run = req->user_data;
+    struct bcache_writeback *wb = disk_wb(run->disk);
+
+    bool failed = bio_request_failed(req);
+
+    enum irql irql = bcache_writeback_lock(wb);
+    for (size_t i = 0; i < run->count; i++) {
+        struct bcache_entry *ent = run->ents[i];
+        ent->writeback = false;
+        ent->request = NULL;
+
+        if (failed)
+            wb_enlist_locked(wb, ent, /* front = */ true);
+        else if (list_empty(&ent->dirty_list))
+            ent->dirty = false; /* not redirtied while we were writing */
+    }
+    bcache_writeback_unlock(wb, irql);
+
+    for (size_t i = 0; i < run->count; i++)
+        bcache_ent_unpin(run->ents[i]);
+
+    atomic_fetch_sub(&wb->nr_writing, run->count);
+    semaphore_post(&wb->throttle);
+
+    bio_request_free(req);
+    kfree(run);
+}
+
+/* Sends ents[0..count) off as one vectored write straight out of their
+ * buffers, which stay pinned until it's done. The entries are locked by
+ * the caller and unlocked here, anything written to them in the meantime
+ * redirties them and they just go out again */
+static bool wb_submit_run(struct generic_disk *disk, struct bcache_entry **ents,
+                          size_t count) {
+    struct bcache_writeback *wb = disk_wb(disk);
+    struct bcache_wb_run *run =
+        kmalloc(sizeof(struct bcache_wb_run) + sizeof(*ents) * count);
+    if (!run)
+        goto fail;
+
+    /* entries are at most a page, but needn't start on one */
+    struct bio_request *req = bio_create_vectored(
+        disk, ents[0]->lba, /* write = */ true, count * 2, wb_end_io, run);
+    if (!req) {
+        kfree(run);
+        goto fail;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!bio_add_buffer(req, ents[i]->buffer, ents[i]->size)) {
+            bio_request_free(req);
+            kfree(run);
+            goto fail;
+        }
+    }
+
+    run->disk = disk;
+    run->count = count;
+
+    enum bio_request_priority prio = BIO_RQ_BACKGROUND;
+    for (size_t i = 0; i < count; i++) {
+        struct bcache_entry *ent = ents[i];
+        if (ent->wb_prio > prio)
+            prio = ent->wb_prio;
+
+        ent->wb_prio = BIO_RQ_BACKGROUND;
+        ent->request = req;
+        run->ents[i] = ent;
+        bcache_ent_unlock(ent);
+    }
+
+    req->priority = prio;
+    atomic_fetch_add(&wb->nr_writing, count);
+    bio_sched_enqueue(disk, req);
+    return true;
+
+fail:
+    for (size_t i = 0; i < count; i++) {
+        bcache_ent_unlock(ents[i]);
+        wb_requeue(wb, ents[i]);
+    }
+
+    return false;
+}
+
+/* One pass over the dirty list. Returns how many entries went out */
+static size_t wb_pass(struct generic_disk *disk, bool all) {
+    struct bcache_writeback *wb = disk_wb(disk);
+    struct bcache_entry *ents[BCACHE_WB_BATCH];
+
+    size_t n = wb_collect(wb, ents, all);
+    if (!n)
+        return 0;
+
+    /* Whoever holds an entry is most likely still writing to it, and
+     * it'll be dirtied again anyways, so don't wait around for them */
+    size_t locked = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (mutex_trylock(&ents[i]->lock))
+            ents[locked++] = ents[i];
+        else
+            wb_requeue(wb, ents[i]);
+    }
+
+    qsort(ents, locked, sizeof(*ents), wb_cmp_lba);
+
+    size_t written = 0;
+    size_t start = 0;
+    while (start < locked) {
+        uint64_t sectors = ent_sectors(disk, ents[start]);
+        size_t end = start + 1;
+
+        while (end < locked) {
+            struct bcache_entry *prev = ents[end - 1];
+            struct bcache_entry *next = ents[end];
+            uint64_t next_sectors = ent_sectors(disk, next);
+
+            if (prev->lba + ent_sectors(disk, prev) != next->lba ||
+                sectors + next_sectors > BCACHE_MAX_IO_SECTORS)
+                break;
+
+            sectors += next_sectors;
+            end++;
+        }
+
+        if (wb_submit_run(disk, &ents[start], end - start))
+            written += end - start;
+
+        start = end;
+    }
+
+    return written;
+}
+
+size_t bcache_writeback_flush(struct generic_disk *disk, bool all) {
+    struct bcache_writeback *wb = disk_wb(disk);
+    size_t total = 0;
+    size_t written;
+
+    mutex_lock(&wb->flush_lock);
+
+    /* Failed writes go right back on the list, so stop once we've
+     * written about as much as there was to begin with */
+    uint64_t budget = wb->nr_dirty;
+    while (total <= budget && (written = wb_pass(disk, all)))
+        total += written;
+
+    mutex_unlock(&wb->flush_lock);
+    return total;
+}
+
+static enum daemon_thread_command wb_work(struct daemon_work *work,
+                                          struct daemon_thread *thread,
+                                          void *a, void *b) {
+    (void) work, (void) b;
+    struct generic_disk *disk = a;
+
+    bcache_writeback_flush(disk, /* all = */ false);
+
+    /* either the interval passes or a writer kicks us */
+    semaphore_timedwait(&thread->daemon->bg_sem, BCACHE_WB_INTERVAL_MS);
+    return DAEMON_THREAD_COMMAND_RESTART;
+}
+
+static void wb_start_daemon(struct generic_disk *disk) {
+    struct bcache_writeback *wb = disk_wb(disk);
+    enum bcache_wb_state expected = BCACHE_WB_STATE_OFF;
+
+    if (!atomic_compare_exchange_strong(&wb->state, &expected,
+                                        BCACHE_WB_STATE_STARTING))
+        return;
+
+    struct cpu_mask mask;
+    if (!cpu_mask_init(&mask, global.core_count))
+        goto fail;
+
+    cpu_mask_set_all(&mask);
+    struct daemon_attributes attrs = {
+        .max_timesharing_threads = 0,
+        .thread_cpu_mask = mask,
+        .flags = DAEMON_FLAG_NO_TS_THREADS | DAEMON_FLAG_HAS_NAME,
+    };
+
+    wb->work = kmalloc(sizeof(struct daemon_work));
+    if (!wb->work)
+        goto fail;
+
+    *wb->work = DAEMON_WORK_FROM(wb_work, WORK_ARGS(disk, NULL));
+    wb->daemon = daemon_create(
+        /* fmt = */ "bcache_wb_%s",
+        /* attrs = */ &attrs,
+        /* timesharing_work = */ NULL,
+        /* background_work = */ wb->work,
+        /* wq_attrs = */ NULL,
+        /* ... = */ disk->name);
+
+    if (!wb->daemon)
+        goto fail;
+
+    atomic_store(&wb->state, BCACHE_WB_STATE_RUNNING);
+    daemon_wake_background_worker(wb->daemon);
+    return;
+
+fail:
+    kfree(wb->work);
+    wb->work = NULL;
+    printf("bcache: no writeback daemon for %s, writers flush instead\n",
+           disk->name);
+    atomic_store(&wb->state, BCACHE_WB_STATE_FAILED);
+}
+
+/* Past the throttle limit, writers give the daemon a few chances to
+ * catch up. If there is no daemon they do the work themselves */
+static void wb_throttle(struct generic_disk *disk) {
+    struct bcache_writeback *wb = disk_wb(disk);
+
+    for (size_t i = 0; i < BCACHE_WB_THROTTLE_TRIES; i++) {
+        if (wb_outstanding(wb) <= wb->throttle_limit)
+            return;
+
+        if (atomic_load(&wb->state) != BCACHE_WB_STATE_RUNNING) {
+            bcache_writeback_flush(disk, /* all = */ false);
+            continue;
+        }
+
+        daemon_wake_background_worker(wb->daemon);
+        semaphore_timedwait(&wb->throttle, BCACHE_WB_THROTTLE_MS);
+    }
+}
+
+void bcache_writeback_mark_dirty(struct generic_disk *disk,
+                                 struct bcache_entry *ent,
+                                 enum bio_request_priority prio) {
+    struct bcache_writeback *wb = disk_wb(disk);
+
+    enum irql irql = bcache_writeback_lock(wb);
+    wb->disk = disk;
+    wb_enlist_locked(wb, ent, /* front = */ false);
+    if (prio > ent->wb_prio)
+        ent->wb_prio = prio;
+
+    bool over = wb->nr_dirty > wb->background_limit;
+    bool throttle = wb_outstanding(wb) > wb->throttle_limit;
+    bcache_writeback_unlock(wb, irql);
+
+    enum bcache_wb_state state = atomic_load(&wb->state);
+    if (state == BCACHE_WB_STATE_OFF)
+        wb_start_daemon(disk);
+    else if (over && state == BCACHE_WB_STATE_RUNNING)
+        daemon_wake_background_worker(wb->daemon);
+
+    if (throttle)
+        wb_throttle(disk);
+}
+
+/* Writes out everything and waits for it to land */
+void bcache_sync(struct generic_disk *disk) {
+    struct bcache_writeback *wb = disk_wb(disk);
+
+    bcache_writeback_flush(disk, /* all = */ true);
+    while (atomic_load(&wb->nr_writing))
+        semaphore_timedwait(&wb->throttle, BCACHE_WB_THROTTLE_MS);
+}
+
+/* The daemon goes first so nothing else starts runs, then whatever is
+ * still dirty goes out and every run in flight has to land before the
+ * cache they point into can go away */
+void bcache_writeback_destroy(struct bcache *cache) {
+    struct bcache_writeback *wb = &cache->wb;
+
+    if (wb->daemon)
+        daemon_destroy(wb->daemon);
+
+    kfree(wb->work);
+    wb->daemon = NULL;
+    wb->work = NULL;
+
+    if (wb->disk)
+        bcache_sync(wb->disk);
+
+    atomic_store(&wb->state, BCACHE_WB_STATE_OFF);
+}
+
+void bcache_writeback_init(struct bcache_writeback *wb, uint64_t capacity) {
+    INIT_LIST_HEAD(&wb->dirty);
+    wb->nr_dirty = 0;
+    wb->disk = NULL;
+    atomic_store(&wb->nr_writing, 0);
+
+    wb->background_limit = capacity * BCACHE_WB_BACKGROUND_PCT / 100;
+    wb->throttle_limit = capacity * BCACHE_WB_THROTTLE_PCT / 100;
+    if (wb->throttle_limit <= wb->background_limit)
+        wb->throttle_limit = wb->background_limit + 1;
+
+    mutex_init(&wb->flush_lock);
+    semaphore_init(&wb->throttle, 0, SEMAPHORE_INIT_NORMAL);
+    atomic_store(&wb->state, BCACHE_WB_STATE_OFF);
+    wb->daemon = NULL;
+    wb->work = NULL;
+    spinlock_init(&wb->lock);
+}
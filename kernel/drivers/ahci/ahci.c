@@ -63,7 +63,7 @@ void ahci_print_wrapper(struct generic_disk *d) {
 }
 
 static struct bio_scheduler_ops ahci_sata_ssd_ops = {
-    .should_coalesce = noop_should_coalesce,
+    .should_coalesce = ahci_should_coalesce,
     .reorder = noop_reorder,
     .do_coalesce = noop_do_coalesce,
     .max_wait_time =
@@ -85,6 +85,12 @@ static struct bio_scheduler_ops ahci_sata_ssd_ops = {
         },
     .min_wait_ms = 2,
     .tick_ms = 25,
+
+    .init_hctx = bfq_init_hctx,
+    .queued = bfq_queued,
+    .unqueued = bfq_unqueued,
+    .select = bfq_select,
+    .dispatched = bfq_dispatched,
 };
 
 struct generic_disk *ahci_create_generic(struct ahci_disk *disk) {
@@ -94,7 +100,7 @@ struct generic_disk *ahci_create_generic(struct ahci_disk *disk) {
 
     ahci_identify(disk);
 
-    d->flags = DISK_FLAG_NO_COALESCE | DISK_FLAG_NO_REORDER;
+    d->flags = DISK_FLAG_NO_REORDER;
     d->driver_data = disk;
     d->sector_size = disk->sector_size;
     d->read_sector = ahci_read_sector_wrapper;
@@ -104,7 +110,7 @@ struct generic_disk *ahci_create_generic(struct ahci_disk *disk) {
     if (!d->cache)
         panic("Could not allocate space for AHCI device block cache\n");
 
-    d->scheduler = bio_sched_create(d, &ahci_sata_ssd_ops);
+    d->scheduler = bio_sched_create(d, &ahci_sata_ssd_ops, 1);
     bcache_init(d->cache, DEFAULT_BLOCK_CACHE_SIZE);
     d->type = G_AHCI_DRIVE;
     return d;
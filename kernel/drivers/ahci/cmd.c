@@ -5,6 +5,8 @@
 #include <drivers/ahci.h>
 #include <drivers/ata.h>
 #include <irq/idt.h>
+#include <kassert.h>
+#include <math/min_max.h>
 #include <mem/alloc.h>
 #include <mem/vmm.h>
 #include <sch/sched.h>
@@ -13,43 +15,94 @@
 #include <stdint.h>
 #include <string.h>
 #include <thread/thread.h>
+#include <time.h>
 
 #define MAX_PRDT_ENTRY_SIZE (4 * 1024 * 1024) // 4MB
 
-/* TODO: horrible code - bit-op spam */
+/* Caller holds the port lock */
+static bool slot_get(struct ahci_full_port *p, uint32_t *out) {
+    uint32_t usable = p->slot_count == 32 ? ~0U : (1U << p->slot_count) - 1;
+    uint32_t free = ~p->slot_bitmap & usable;
+    if (!free)
+        return false;
+
+    *out = __builtin_ctz(free);
+    p->slot_bitmap |= 1U << *out;
+    return true;
+}
+
+/* Caller holds the port lock and has filled in the slot's command */
+static void send_command(struct ahci_full_port *port, struct ahci_request *req,
+                         bool queued) {
+    uint32_t mask = 1U << req->slot;
+    port->requests[req->slot] = req;
+
+    /* SACT has to be set before CI for queued commands */
+    if (queued)
+        mmio_write_32(&port->port->sact, mask);
+
+    mmio_write_32(&port->port->ci, mask);
+}
+
+static void complete_one(struct ahci_device *dev, struct ahci_request *req) {
+    struct thread *t = req->waiter;
+
+    req->done = true;
+    req->status = 0;
+
+    /* `req` may be gone after this */
+    if (req->on_complete)
+        req->on_complete(req);
+
+    if (t)
+        thread_wake_from_io_block(t, dev);
+}
+
+/* Slots come off CI (and SACT with NCQ) as their commands finish, so
+ * anything we issued that has neither bit set anymore is done */
 void ahci_process_completions(struct ahci_device *dev, uint32_t port) {
     struct ahci_full_port *fp = &dev->regs[port];
     struct ahci_port *p = fp->port;
+    LIST_HEAD(done);
 
-    uint32_t ci = mmio_read_32(&p->ci);
-    uint32_t sact = mmio_read_32(&p->sact);
-    uint32_t completed = ~(ci | sact);
+    mmio_write_32(&p->is, mmio_read_32(&p->is));
 
-    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
-        uint32_t mask = 1U << slot;
-        if (!(completed & mask))
-            continue;
+    enum irql irql = ahci_full_port_lock_irq_disable(fp);
 
-        struct ahci_request *req = dev->io_requests[port][slot];
+    uint32_t active = mmio_read_32(&p->ci) | mmio_read_32(&p->sact);
+    uint32_t completed = fp->slot_bitmap & ~active;
 
-        if (req && req->trigger_completion) {
-            req->done = true;
-            req->status = 0;
+    while (completed) {
+        uint32_t slot = __builtin_ctz(completed);
+        completed &= completed - 1;
 
-            if (req->on_complete)
-                req->on_complete(req);
-            atomic_store(&fp->slot_bitmap,
-                         atomic_load(&fp->slot_bitmap) & ~mask);
-        }
+        struct ahci_request *req = fp->requests[slot];
+        fp->requests[slot] = NULL;
+        fp->slot_bitmap &= ~(1U << slot);
 
-        struct thread *t = dev->io_waiters[port][slot];
-        if (t)
-            thread_wake_from_io_block(t, dev);
+        if (req)
+            list_add_tail(&req->list, &done);
+    }
 
-        dev->io_requests[port][slot] = NULL;
+    /* Hand the freed slots straight to whoever is waiting on them */
+    uint32_t slot;
+    while (!list_empty(&fp->waiting) && slot_get(fp, &slot)) {
+        struct ahci_request *req =
+            list_first_entry(&fp->waiting, struct ahci_request, list);
+        list_del_init(&req->list);
+
+        req->slot = slot;
+        ahci_build_command(fp, req);
+        send_command(fp, req, fp->ncq);
     }
 
-    mmio_write_32(&p->is, p->is);
+    ahci_full_port_unlock(fp, irql);
+
+    struct ahci_request *req, *tmp;
+    list_for_each_entry_safe(req, tmp, &done, list) {
+        list_del_init(&req->list);
+        complete_one(dev, req);
+    }
 }
 
 enum irq_result ahci_isr_handler(void *ctx, uint8_t vector,
@@ -67,90 +120,88 @@ enum irq_result ahci_isr_handler(void *ctx, uint8_t vector,
     return IRQ_HANDLED;
 }
 
-void ahci_send_command(struct ahci_disk *disk, struct ahci_full_port *port,
-                       struct ahci_request *req) {
-    uint32_t slot = req->slot;
+/* Never blocks. With every slot taken `req` waits on the port and gets
+ * issued by the completion path once one frees up */
+void ahci_submit_request(struct ahci_disk *disk, struct ahci_request *req) {
+    struct ahci_full_port *port = &disk->device->regs[disk->port];
+    uint32_t slot;
 
-    mmio_write_32(&port->port->is, 0xFFFFFFFF);
-    disk->device->io_requests[disk->port][slot] = req;
+    req->port = disk->port;
+    req->done = false;
+    req->status = -1;
 
-    uint32_t command_issue = mmio_read_32(&port->port->ci);
-    command_issue |= (1U << slot);
-    mmio_write_32(&port->port->ci, command_issue);
-}
+    enum irql irql = ahci_full_port_lock_irq_disable(port);
 
-static uint32_t try_find_slot(struct ahci_full_port *p) {
-    while (true) {
-        uint32_t old = atomic_load(&p->slot_bitmap);
-        for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
-            uint32_t mask = 1U << slot;
-            if (!(old & mask)) {
-                uint32_t new_bitmap = old | mask;
-                if (atomic_compare_exchange_weak(&p->slot_bitmap, &old,
-                                                 new_bitmap)) {
-                    return slot;
-                }
-                break;
-            }
-        }
-        return (uint32_t) -1; // no free slot found
+    if (!slot_get(port, &slot)) {
+        list_add_tail(&req->list, &port->waiting);
+    } else {
+        req->slot = slot;
+        ahci_build_command(port, req);
+        send_command(port, req, port->ncq);
     }
-}
-
-uint32_t ahci_find_slot(struct ahci_full_port *p) {
 
-    uint32_t slot = try_find_slot(p);
+    ahci_full_port_unlock(port, irql);
+}
 
-    while (slot == (uint32_t) -1)
-        slot = try_find_slot(p);
+/* Where the next `*len` bytes at `done` bytes into the request are. Never
+ * more than a page, kernel buffers aren't always physically contiguous */
+static paddr_t request_chunk(const struct ahci_request *req, uint64_t done,
+                             uint32_t *vec, uint64_t *len) {
+    if (req->vec_count) {
+        const struct bio_vec *v = &req->vecs[(*vec)++];
+        *len = v->len;
+        return v->page + v->offset;
+    }
 
-    return slot;
+    uintptr_t vaddr = (uintptr_t) req->buffer + done;
+    *len = MIN(PAGE_SIZE - (vaddr & (PAGE_SIZE - 1)), req->size - done);
+    return vmm_get_phys(vaddr, VMM_FLAG_NONE);
 }
 
-/* TODO: BUG here when there are too many concurrent requests
- * eating up all the available slots */
-void ahci_prepare_command(struct ahci_full_port *port, uint32_t slot,
-                          bool write, uint8_t *buf, uint64_t size) {
+/* Caller holds the port lock. Physically contiguous chunks share a PRD */
+void ahci_prepare_command(struct ahci_full_port *port,
+                          const struct ahci_request *req) {
+    struct ahci_cmd_header *hdr = port->cmd_hdrs[req->slot];
+    struct ahci_cmd_table *cmd_tbl = port->cmd_tables[req->slot];
 
-    struct ahci_cmd_header *hdr = port->cmd_hdrs[slot];
-    struct ahci_cmd_table *cmd_tbl = port->cmd_tables[slot];
-
-    if (!hdr || !cmd_tbl || size == 0)
+    if (!hdr || !cmd_tbl || req->size == 0)
         return;
 
-    uint64_t prdt_count =
-        (size + MAX_PRDT_ENTRY_SIZE - 1) / MAX_PRDT_ENTRY_SIZE;
+    struct ahci_prdt_entry *prd = NULL;
+    uint64_t prd_end = 0;
+    uint32_t prdt_count = 0;
+    uint64_t done = 0;
+    uint32_t vec = 0;
+
+    while (done < req->size) {
+        uint64_t len;
+        paddr_t phys = request_chunk(req, done, &vec, &len);
+
+        if (prd && phys == prd_end &&
+            prd->dbc + 1 + len <= MAX_PRDT_ENTRY_SIZE) {
+            prd->dbc += len;
+        } else {
+            kassert(prdt_count < AHCI_CMD_TABLE_PRDS);
+            prd = &cmd_tbl->prdt_entry[prdt_count++];
+            prd->dba = (uint32_t) (phys & 0xFFFFFFFF);
+            prd->dbau = (uint32_t) (phys >> 32);
+            prd->dbc = (uint32_t) (len - 1); // size - 1
+            prd->i = 0;
+        }
 
-    if (prdt_count > 65535)
-        return;
+        prd_end = phys + len;
+        done += len;
+    }
+
+    prd->i = 1;
 
     hdr->cfl = sizeof(struct ahci_fis_reg_h2d) / sizeof(uint32_t);
-    hdr->w = write ? 1 : 0;
+    hdr->w = req->write ? 1 : 0;
     hdr->p = 0;
     hdr->a = 0;
     hdr->c = 1;
     hdr->prdtl = prdt_count;
     hdr->prdbc = 0;
-
-    uint64_t remaining = size;
-    uint64_t offset = 0;
-    uint64_t phys_base =
-        vmm_get_phys((uint64_t) buf, VMM_FLAG_NONE) & ~(PAGE_SIZE - 1);
-
-    for (uint32_t i = 0; i < prdt_count; i++) {
-        uint64_t chunk =
-            (remaining > MAX_PRDT_ENTRY_SIZE) ? MAX_PRDT_ENTRY_SIZE : remaining;
-
-        uint64_t phys_addr = phys_base + offset;
-
-        cmd_tbl->prdt_entry[i].dba = (uint32_t) (phys_addr & 0xFFFFFFFF);
-        cmd_tbl->prdt_entry[i].dbau = (uint32_t) (phys_addr >> 32);
-        cmd_tbl->prdt_entry[i].dbc = (uint32_t) (chunk - 1); // size - 1
-        cmd_tbl->prdt_entry[i].i = (i == prdt_count - 1) ? 1 : 0;
-
-        offset += chunk;
-        remaining -= chunk;
-    }
 }
 
 void ahci_setup_fis(struct ahci_cmd_table *cmd_tbl, uint8_t command,
@@ -167,24 +218,60 @@ void ahci_setup_fis(struct ahci_cmd_table *cmd_tbl, uint8_t command,
     }
 }
 
+/* Grabs a slot for a non-queued command, which can't be mixed with
+ * queued ones, so this waits for the port to go idle first */
+static void identify_issue(struct ahci_device *dev, struct ahci_disk *disk,
+                           struct ahci_request *req) {
+    struct ahci_full_port *port = &dev->regs[disk->port];
+    uint32_t slot;
+
+    while (true) {
+        enum irql irql = ahci_full_port_lock_irq_disable(port);
+        if (!port->slot_bitmap && slot_get(port, &slot)) {
+            req->slot = slot;
+            ahci_prepare_command(port, req);
+            ahci_setup_fis(port->cmd_tables[slot], AHCI_CMD_IDENTIFY, false);
+            send_command(port, req, false);
+            ahci_full_port_unlock(port, irql);
+            return;
+        }
+
+        ahci_full_port_unlock(port, irql);
+        ahci_process_completions(dev, disk->port);
+        cpu_relax();
+    }
+}
+
+/* Only used at setup and for printing, so it just polls the port */
 void ahci_identify(struct ahci_disk *disk) {
-    struct ahci_full_port *port = &disk->device->regs[disk->port];
-    uint32_t slot = ahci_find_slot(port);
+    struct ahci_device *dev = disk->device;
+    struct ahci_full_port *port = &dev->regs[disk->port];
 
-    uint8_t *buffer = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+    uint16_t *buffer = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
     if (!buffer)
         return;
 
-    ahci_prepare_command(port, slot, false, buffer, PAGE_SIZE);
+    struct ahci_request req = {
+        .port = disk->port, .buffer = buffer, .size = 512};
+    INIT_LIST_HEAD(&req.list);
 
-    if (!buffer)
-        return;
+    identify_issue(dev, disk, &req);
 
-    ahci_setup_fis(port->cmd_tables[slot], AHCI_CMD_IDENTIFY, false);
+    time_t deadline = time_get_ms() + AHCI_IDENT_TIMEOUT_MS;
+    while (!req.done && time_get_ms() < deadline) {
+        ahci_process_completions(dev, disk->port);
+        cpu_relax();
+    }
 
-    struct ahci_request req = {
-        .slot = slot, .port = disk->port, .buffer = buffer};
-    ahci_send_command(disk, port, &req);
+    if (!req.done) {
+        /* the slot stays taken, the device might still write to it */
+        enum irql irql = ahci_full_port_lock_irq_disable(port);
+        port->requests[req.slot] = NULL;
+        ahci_full_port_unlock(port, irql);
+
+        ahci_log(LOG_ERROR, "IDENTIFY timed out on port %u", disk->port);
+        return;
+    }
 
     uint32_t logical_sector_size = 512;
 
@@ -198,6 +285,20 @@ void ahci_identify(struct ahci_disk *disk) {
 
     ahci_log(LOG_INFO, "Sector size is %u bytes", disk->sector_size);
 
+    uint32_t cap = mmio_read_32(&dev->ctrl->cap);
+    if ((cap & AHCI_CAP_SNCQ) &&
+        (buffer[AHCI_IDENT_SATA_CAP] & AHCI_IDENT_SATA_CAP_NCQ)) {
+        uint32_t depth = (buffer[AHCI_IDENT_QUEUE_DEPTH] & 0x1F) + 1;
+
+        enum irql irql = ahci_full_port_lock_irq_disable(port);
+        port->slot_count = MIN(AHCI_CAP_NCS(cap), depth);
+        port->ncq = true;
+        ahci_full_port_unlock(port, irql);
+
+        ahci_log(LOG_INFO, "Port %u uses NCQ with %u slots", disk->port,
+                 port->slot_count);
+    }
+
     kfree_aligned(buffer);
 }
 
@@ -215,21 +316,24 @@ static void ahci_on_bio_complete(struct ahci_request *req) {
 
 bool ahci_submit_bio_request(struct generic_disk *disk,
                              struct bio_request *bio) {
+    if (bio->is_aggregate)
+        return bio_sched_submit_aggregate(disk, bio, ahci_submit_bio_request);
+
     struct ahci_disk *ahci_disk = (struct ahci_disk *) disk->driver_data;
     struct ahci_request *ahci_req = kzalloc(sizeof(struct ahci_request));
     if (!ahci_req)
         return false;
 
-    struct ahci_full_port *p = &ahci_disk->device->regs[ahci_disk->port];
-
     ahci_req->port = ahci_disk->port;
-    ahci_req->slot = ahci_find_slot(p);
     ahci_req->lba = bio->lba;
     ahci_req->buffer = bio->buffer;
+    ahci_req->vecs = bio->vecs;
+    ahci_req->vec_count = bio->vec_count;
     ahci_req->sector_count = bio->sector_count;
     ahci_req->size = bio->size;
     ahci_req->write = bio->write;
     ahci_req->done = false;
+    INIT_LIST_HEAD(&ahci_req->list);
 
     ahci_req->on_complete = ahci_on_bio_complete;
     ahci_req->user_data = bio;
@@ -63,6 +63,12 @@ static void allocate_port(struct ahci_device *dev, struct ahci_port *port,
                                .cmd_tables = arr,
                                .cmd_hdrs = hdr};
     dev->regs[port_num] = p;
+
+    /* NCQ, if the device has it, is only turned on after IDENTIFY */
+    struct ahci_full_port *fp = &dev->regs[port_num];
+    fp->slot_count = AHCI_CAP_NCS(mmio_read_32(&dev->ctrl->cap));
+    INIT_LIST_HEAD(&fp->waiting);
+    spinlock_init(&fp->lock);
 }
 
 static struct ahci_disk *device_setup(struct ahci_device *dev,
@@ -1,14 +1,18 @@
 #include <block/generic.h>
+#include <block/sched.h>
 #include <drivers/ahci.h>
+#include <math/min_max.h>
+#include <mem/alloc.h>
+#include <sch/irql.h>
 #include <sch/sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <thread/io_wait.h>
 #include <thread/thread.h>
 
-static void ahci_set_lba_cmd(struct ahci_fis_reg_h2d *fis, uint64_t lba,
-                             uint16_t sector_count) {
+static void ahci_set_lba(struct ahci_fis_reg_h2d *fis, uint64_t lba) {
     fis->device = 1 << 6;
 
     fis->lba0 = (uint8_t) (lba & 0xFF);
@@ -17,11 +21,65 @@ static void ahci_set_lba_cmd(struct ahci_fis_reg_h2d *fis, uint64_t lba,
     fis->lba3 = (uint8_t) ((lba >> 24) & 0xFF);
     fis->lba4 = (uint8_t) ((lba >> 32) & 0xFF);
     fis->lba5 = (uint8_t) ((lba >> 40) & 0xFF);
+}
+
+static void ahci_set_lba_cmd(struct ahci_fis_reg_h2d *fis, uint64_t lba,
+                             uint16_t sector_count) {
+    ahci_set_lba(fis, lba);
 
     fis->countl = (uint8_t) (sector_count & 0xFF);
     fis->counth = (uint8_t) ((sector_count >> 8) & 0xFF);
 }
 
+/* FPDMA QUEUED moves the sector count to the features field,
+ * and the count field carries the tag, which is the slot */
+static void ahci_set_ncq_cmd(struct ahci_fis_reg_h2d *fis, uint64_t lba,
+                             uint16_t sector_count, uint32_t slot) {
+    ahci_set_lba(fis, lba);
+
+    fis->featurel = (uint8_t) (sector_count & 0xFF);
+    fis->featureh = (uint8_t) ((sector_count >> 8) & 0xFF);
+    fis->countl = (uint8_t) (slot << 3);
+    fis->counth = 0;
+}
+
+/* Caller holds the port lock, `req->slot` is the slot it got */
+void ahci_build_command(struct ahci_full_port *port, struct ahci_request *req) {
+    uint32_t slot = req->slot;
+    uint16_t count = req->sector_count == AHCI_MAX_CMD_SECTORS
+                         ? 0
+                         : (uint16_t) req->sector_count;
+
+    ahci_prepare_command(port, req);
+
+    struct ahci_cmd_table *tbl = port->cmd_tables[slot];
+    struct ahci_fis_reg_h2d *fis = (struct ahci_fis_reg_h2d *) tbl->cfis;
+    bool is_atapi = false;
+
+    if (port->ncq) {
+        uint8_t cmd = req->write ? AHCI_CMD_WRITE_FPDMA_QUEUED
+                                 : AHCI_CMD_READ_FPDMA_QUEUED;
+        ahci_setup_fis(tbl, cmd, is_atapi);
+        ahci_set_ncq_cmd(fis, req->lba, count, slot);
+    } else {
+        uint8_t cmd =
+            req->write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT;
+        ahci_setup_fis(tbl, cmd, is_atapi);
+        ahci_set_lba_cmd(fis, req->lba, count);
+    }
+}
+
+/* Whatever the buffer looks like physically, this always fits the PRDT */
+static uint64_t max_cmd_sectors(struct generic_disk *disk) {
+    return MIN(AHCI_MAX_CMD_SECTORS, AHCI_MAX_CMD_BYTES / disk->sector_size);
+}
+
+bool ahci_should_coalesce(struct generic_disk *disk,
+                          const struct bio_request *a,
+                          const struct bio_request *b) {
+    return bio_sched_can_merge(disk, a, b, max_cmd_sectors(disk));
+}
+
 typedef bool (*async_fn)(struct generic_disk *, uint64_t, uint8_t *, uint16_t,
                          struct ahci_request *);
 
@@ -31,28 +89,15 @@ typedef bool (*sync_fn)(struct generic_disk *, uint64_t, uint8_t *, uint16_t,
 static bool rw_async(struct generic_disk *disk, uint64_t lba, uint8_t *buf,
                      uint16_t count, struct ahci_request *req, bool write) {
     struct ahci_disk *ahci_disk = (struct ahci_disk *) disk->driver_data;
-    struct ahci_full_port *port = &ahci_disk->device->regs[ahci_disk->port];
-
-    uint32_t slot = req->slot;
-    ahci_prepare_command(port, slot, write, buf, count * disk->sector_size);
-
-    struct ahci_cmd_table *tbl = port->cmd_tables[slot];
-    uint8_t cmd = write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT;
-    bool is_atapi = false;
-
-    ahci_setup_fis(tbl, cmd, is_atapi);
-
-    ahci_set_lba_cmd((struct ahci_fis_reg_h2d *) tbl->cfis, lba, count);
+    uint64_t sectors = count ? count : AHCI_MAX_CMD_SECTORS;
 
-    req->port = ahci_disk->port;
     req->lba = lba;
     req->buffer = buf;
-    req->sector_count = count;
+    req->sector_count = sectors;
+    req->size = sectors * disk->sector_size;
     req->write = write;
-    req->done = false;
-    req->status = -1;
 
-    ahci_send_command(ahci_disk, port, req);
+    ahci_submit_request(ahci_disk, req);
     return true;
 }
 
@@ -62,44 +107,39 @@ static bool rw_sync(struct generic_disk *disk, uint64_t lba, uint8_t *buf,
     struct ahci_request req = {0};
     struct ahci_disk *ahci_disk = (struct ahci_disk *) disk->driver_data;
     struct ahci_device *dev = ahci_disk->device;
-    struct ahci_full_port *port = &dev->regs[ahci_disk->port];
 
-    enum irql irql = spin_lock(&dev->lock);
-    req.slot = ahci_find_slot(port);
+    INIT_LIST_HEAD(&req.list);
+    req.waiter = thread_get_current();
 
-    /* tells ISR handler to mark status properly */
-    req.trigger_completion = true;
-
-    struct thread *curr = thread_get_current();
+    /* the ISR can't get to the wakeup before we're marked as blocked */
+    enum irql irql = irql_raise(IRQL_DISPATCH_LEVEL);
 
     if (io_wait_token_active(io_wait_tok))
         io_wait_end(io_wait_tok, IO_WAIT_END_NO_OP);
 
     io_wait_begin(io_wait_tok, dev);
 
-    dev->io_waiters[ahci_disk->port][req.slot] = curr;
-
     if (!function(disk, lba, buf, count, &req)) {
-        spin_unlock(&dev->lock, irql);
+        irql_lower(irql);
         return false;
     }
 
-    spin_unlock(&dev->lock, irql);
+    irql_lower(irql);
     thread_wait_for_wake_match();
 
-    dev->io_waiters[ahci_disk->port][req.slot] = NULL;
-
     return req.status == 0;
 }
 
 static bool rw_sync_wrapper(struct generic_disk *disk, uint64_t lba,
                             uint8_t *buf, uint64_t cnt, sync_fn function) {
     struct io_wait_token wt = IO_WAIT_TOKEN_EMPTY;
+    uint64_t max_sectors = max_cmd_sectors(disk);
+
     while (cnt > 0) {
-        uint16_t chunk = (cnt > 65535) ? 0 : (uint16_t) cnt;
-        uint64_t sectors = (chunk == 0) ? 65536 : chunk;
+        uint64_t sectors = MIN(cnt, max_sectors);
 
-        if (!function(disk, lba, buf, chunk, &wt)) {
+        /* AHCI_MAX_CMD_SECTORS wraps to 0, which is what it's sent as */
+        if (!function(disk, lba, buf, (uint16_t) sectors, &wt)) {
             io_wait_end(&wt, IO_WAIT_END_YIELD);
             return false;
         }
@@ -113,22 +153,97 @@ static bool rw_sync_wrapper(struct generic_disk *disk, uint64_t lba,
     return true;
 }
 
+static void rw_put_part(struct ahci_request *req) {
+    if (atomic_fetch_sub(&req->remaining_parts, 1) != 1)
+        return;
+
+    req->done = true;
+    if (req->on_complete)
+        req->on_complete(req);
+}
+
+static void rw_on_part_complete(struct ahci_request *part) {
+    struct ahci_request *req = part->parent;
+
+    if (part->status)
+        req->status = part->status;
+
+    kfree(part);
+    rw_put_part(req);
+}
+
+/* How much of `req` the part starting at vector `vec` takes. Vectors are
+ * at most a page each, so one PRD each covers the worst case */
+static uint64_t rw_vec_part(struct generic_disk *disk,
+                            const struct ahci_request *req, uint32_t vec,
+                            uint32_t *nvecs) {
+    uint64_t bytes = 0;
+
+    *nvecs = MIN(req->vec_count - vec, AHCI_CMD_TABLE_PRDS);
+    for (uint32_t i = 0; i < *nvecs; i++)
+        bytes += req->vecs[vec + i].len;
+
+    return bytes / disk->sector_size;
+}
+
+/* Anything bigger than one command is split into parts that each get
+ * their own slot, `req` itself is only completed once they are all done */
 static bool rw_async_wrapper(struct generic_disk *disk, uint64_t lba,
                              uint8_t *buf, uint64_t cnt,
                              struct ahci_request *req, async_fn function) {
+    uint64_t max_sectors = max_cmd_sectors(disk);
+    bool fits = req->vec_count ? req->vec_count <= AHCI_CMD_TABLE_PRDS
+                               : cnt <= max_sectors;
+    if (fits)
+        return function(disk, lba, buf, (uint16_t) cnt, req);
+
+    uint64_t sent = 0;
+    uint32_t vec = 0;
+
+    /* one extra so nothing completes `req` before every part is out */
+    req->remaining_parts = 1;
+    req->status = 0;
+
     while (cnt > 0) {
-        uint16_t chunk = (cnt > 65535) ? 0 : (uint16_t) cnt;
-        uint64_t sectors = (chunk == 0) ? 65536 : chunk;
+        uint64_t sectors = MIN(cnt, max_sectors);
+        uint32_t nvecs = 0;
 
-        req->trigger_completion = (cnt == sectors);
+        struct ahci_request *part = kzalloc(sizeof(struct ahci_request));
+        if (!part)
+            break;
 
-        if (!function(disk, lba, buf, chunk, req))
-            return false;
+        INIT_LIST_HEAD(&part->list);
+        part->parent = req;
+        part->on_complete = rw_on_part_complete;
+
+        if (req->vec_count) {
+            sectors = rw_vec_part(disk, req, vec, &nvecs);
+            part->vecs = &req->vecs[vec];
+            part->vec_count = nvecs;
+        }
 
+        atomic_fetch_add(&req->remaining_parts, 1);
+        if (!function(disk, lba, buf, (uint16_t) sectors, part)) {
+            atomic_fetch_sub(&req->remaining_parts, 1);
+            kfree(part);
+            break;
+        }
+
+        sent++;
         lba += sectors;
-        buf += sectors * disk->sector_size;
         cnt -= sectors;
+        vec += nvecs;
+        if (buf)
+            buf += sectors * disk->sector_size;
     }
+
+    if (!sent)
+        return false;
+
+    if (cnt)
+        req->status = -1;
+
+    rw_put_part(req);
     return true;
 }
 
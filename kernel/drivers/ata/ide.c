@@ -133,6 +133,12 @@ static struct bio_scheduler_ops ide_bio_ops = {
         },
     .min_wait_ms = 1,
     .tick_ms = 25,
+
+    .init_hctx = bfq_init_hctx,
+    .queued = bfq_queued,
+    .unqueued = bfq_unqueued,
+    .select = bfq_select,
+    .dispatched = bfq_dispatched,
 };
 
 struct generic_disk *ide_create_generic(struct ata_drive *ide) {
@@ -165,7 +171,7 @@ struct generic_disk *ide_create_generic(struct ata_drive *ide) {
     if (!d->cache)
         panic("Could not allocate space for IDE drive block cache\n");
 
-    d->scheduler = bio_sched_create(d, &ide_bio_ops);
+    d->scheduler = bio_sched_create(d, &ide_bio_ops, 1);
 
     bcache_init(d->cache, DEFAULT_BLOCK_CACHE_SIZE);
 
@@ -3,6 +3,7 @@
 #include <block/generic.h>
 #include <console/printf.h>
 #include <drivers/ata.h>
+#include <math/min_max.h>
 #include <mem/alloc.h>
 #include <sleep.h>
 #include <stdbool.h>
@@ -77,21 +78,32 @@ enum irq_result ide_irq_handler(void *ctx, uint8_t irq_num,
         goto out;
     }
 
+    /* completion can free `req` */
+    struct thread *waiter = req->waiter;
+    chan->head = req->next;
+
     if (req->trigger_completion) {
         req->status = translate_status(status, error);
         req->done = true;
 
         if (req->on_complete)
             req->on_complete(req);
+    } else if (req->user_data) {
+        /* one of the earlier chunks of a bio, only the last completes it */
+        kfree(req);
     }
 
-    if (req->waiter)
-        thread_wake_from_io_block(req->waiter, d);
+    if (waiter)
+        thread_wake_from_io_block(waiter, d);
+
+    goto start_next;
 
 next_request:
 
     chan->head = chan->head->next;
 
+start_next:
+
     if (chan->head) {
         ide_start_next(chan, true);
     } else {
@@ -207,6 +219,19 @@ static struct ide_request *request_init(uint64_t lba, uint8_t *buffer,
     return req;
 }
 
+static void submit_bio_chunk(struct ata_drive *ide, struct bio_request *bio,
+                             uint64_t lba, uint8_t *buf, uint64_t sectors,
+                             bool last) {
+    uint8_t chunk = (sectors == 256) ? 0 : (uint8_t) sectors;
+    struct ide_request *req = request_init(lba, buf, chunk, bio->write);
+    req->size = sectors * 512;
+    req->user_data = bio;
+    req->on_complete = ide_on_complete;
+    req->trigger_completion = last;
+
+    submit_async(ide, req);
+}
+
 bool ide_submit_bio_async(struct generic_disk *disk, struct bio_request *bio) {
     struct ata_drive *ide = disk->driver_data;
     uint64_t lba = bio->lba;
@@ -214,18 +239,25 @@ bool ide_submit_bio_async(struct generic_disk *disk, struct bio_request *bio) {
     uint64_t cnt = bio->sector_count;
 
     bio->status = BIO_STATUS_INFLIGHT;
-    while (cnt > 0) {
-        uint8_t chunk = (cnt >= 256) ? 0 : (uint8_t) cnt;
-        uint64_t sectors = (chunk == 0) ? 256 : chunk;
 
-        struct ide_request *req = request_init(lba, buf, chunk, bio->write);
-        req->size = sectors * 512;
-        req->user_data = bio;
-        req->on_complete = ide_on_complete;
+    /* PIO copies through the CPU anyways, so every vector just becomes
+     * a request of its own pointing at the page through the HHDM */
+    for (uint32_t i = 0; i < bio->vec_count; i++) {
+        const struct bio_vec *v = &bio->vecs[i];
+        uint64_t sectors = v->len / 512;
+
+        submit_bio_chunk(ide, bio, lba, bio_vec_virt(v), sectors,
+                         i == bio->vec_count - 1);
+        lba += sectors;
+    }
+
+    if (bio->vec_count)
+        return true;
 
-        req->trigger_completion = (cnt == sectors);
+    while (cnt > 0) {
+        uint64_t sectors = MIN(cnt, 256);
 
-        submit_async(ide, req);
+        submit_bio_chunk(ide, bio, lba, buf, sectors, cnt == sectors);
 
         lba += sectors;
         buf += sectors * 512;
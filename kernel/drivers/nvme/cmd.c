@@ -14,7 +14,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
-#include <thread/workqueue.h>
+#include <thread/dpc.h>
 
 #include "internal.h"
 
@@ -28,32 +28,29 @@ static enum bio_request_status nvme_to_bio_status(uint16_t status) {
     return BIO_STATUS_OK;
 }
 
-static void nvme_send_waiters(struct nvme_device *dev) {
-    struct nvme_waiting_requests *waiters = &dev->waiting_requests;
-    struct nvme_request *next = NULL;
+/* Called with as many slots as were just freed up on `queue` */
+static void nvme_send_waiters(struct nvme_queue *queue, size_t budget) {
+    struct nvme_waiting_requests *waiters = &queue->waiting;
 
-    enum irql irql = nvme_waiting_requests_lock_irq_disable(waiters);
+    while (budget--) {
+        enum irql irql = nvme_waiting_requests_lock_irq_disable(waiters);
+        struct list_head *pop = list_pop_front_init(&waiters->list);
+        nvme_waiting_requests_unlock(waiters, irql);
 
-    struct list_head *pop = list_pop_front_init(&waiters->list);
-    if (!pop)
-        goto done;
-
-    next = container_of(pop, struct nvme_request, list_node);
-
-done:
-    nvme_waiting_requests_unlock(waiters, irql);
+        if (!pop)
+            break;
 
-    if (next)
-        nvme_send_nvme_req(dev->generic_disk, next);
+        struct nvme_request *req =
+            container_of(pop, struct nvme_request, list_node);
+        nvme_send_nvme_req(req->disk, req);
+    }
 }
 
 static void nvme_process_one(struct nvme_device *dev,
                              struct nvme_request *req) {
     struct thread *t = req->waiter;
 
-    if (--req->remaining_parts == 0) {
-        kfree(req->bio_data->prps);
-        kfree(req->bio_data);
+    if (atomic_fetch_sub(&req->remaining_parts, 1) == 1) {
         req->done = true;
         req->status = nvme_to_bio_status(req->status);
         if (req->on_complete)
@@ -64,39 +61,11 @@ static void nvme_process_one(struct nvme_device *dev,
         thread_wake_from_io_block(t, dev);
 }
 
-static struct nvme_request *nvme_finished_pop_front(struct nvme_device *dev) {
-    enum irql irql =
-        nvme_waiting_requests_lock_irq_disable(&dev->finished_requests);
-
-    struct list_head *lh = list_pop_front_init(&dev->finished_requests.list);
-
-    nvme_waiting_requests_unlock(&dev->finished_requests, irql);
-
-    if (!lh)
-        return NULL;
-
-    return container_of(lh, struct nvme_request, list_node);
-}
-
-void nvme_work(void *dvoid, void *nothing) {
-    (void) nothing;
-
-    struct nvme_device *dev = dvoid;
-    struct nvme_request *req;
-    while (true) {
-        while ((req = nvme_finished_pop_front(dev)) != NULL) {
-            nvme_process_one(dev, req);
-            nvme_send_waiters(dev);
-        }
-
-        atomic_store(&dev->on_sem, true);
-        semaphore_wait(&dev->sem);
-    }
-}
-
-void nvme_process_completions(struct nvme_device *dev, uint32_t qid) {
-    struct nvme_queue *queue = dev->io_queues[qid];
-
+/* Reaps everything the controller has posted to the CQ, then tells it
+ * about the new head once instead of once per entry */
+static size_t nvme_reap_completions(struct nvme_queue *queue,
+                                    struct list_head *out) {
+    size_t reaped = 0;
     enum irql irql = nvme_queue_lock_irq_disable(queue);
 
     while (true) {
@@ -108,64 +77,151 @@ void nvme_process_completions(struct nvme_device *dev, uint32_t qid) {
         uint16_t status = mmio_read_32(&entry->status) & 0xFFFE;
         uint16_t cid = mmio_read_32(&entry->cid);
 
-        struct nvme_request *req = queue->sq_requests[cid];
+        struct nvme_cmd_ctx *ctx = &queue->ctxs[cid];
+        struct nvme_request *req = ctx->req;
+        ctx->req = NULL;
+        queue->free_cids[queue->free_count++] = cid;
 
         req->status = status;
-
-        enum irql irql2 =
-            nvme_waiting_requests_lock_irq_disable(&dev->finished_requests);
-
-        list_add_tail(&req->list_node, &dev->finished_requests.list);
-
-        nvme_waiting_requests_unlock(&dev->finished_requests, irql2);
-
-        atomic_fetch_sub(&queue->outstanding, 1);
-        atomic_fetch_sub(&dev->total_outstanding, 1);
+        list_add_tail(&req->list_node, out);
+        reaped++;
 
         queue->cq_head = (queue->cq_head + 1) % queue->cq_depth;
         if (queue->cq_head == 0)
             queue->cq_phase ^= 1;
+    }
 
+    if (reaped)
         mmio_write_32(queue->cq_db, queue->cq_head);
-    }
 
     nvme_queue_unlock(queue, irql);
 
-    semaphore_post(&dev->sem);
+    atomic_fetch_sub(&queue->outstanding, reaped);
+    atomic_fetch_sub(&queue->dev->total_outstanding, reaped);
+    return reaped;
+}
+
+/* Completes whatever is on the CQ right now. Called from the DPC, and
+ * by polled submitters while they spin */
+size_t nvme_poll_queue(struct nvme_queue *queue) {
+    LIST_HEAD(done);
+    size_t reaped = nvme_reap_completions(queue, &done);
+    if (!reaped)
+        return 0;
+
+    struct nvme_request *req, *tmp;
+    list_for_each_entry_safe(req, tmp, &done, list_node) {
+        list_del_init(&req->list_node);
+        nvme_process_one(queue->dev, req);
+    }
+
+    nvme_send_waiters(queue, reaped);
+    return reaped;
+}
+
+void nvme_completion_dpc(struct dpc *dpc, void *ctx) {
+    (void) dpc;
+    struct nvme_queue *queue = ctx;
+
+    while (nvme_poll_queue(queue))
+        ;
 }
 
 enum irq_result nvme_isr_handler(void *ctx, uint8_t vector,
                                  struct irq_context *rsp) {
     (void) vector, (void) rsp;
-    struct nvme_device *dev = ctx;
-    nvme_process_completions(dev, THIS_QID(dev));
+    struct nvme_queue *queue = ctx;
+
+    /* already queued? it'll pick up these completions as well */
+    dpc_enqueue_local(&queue->dpc, DPC_NONE);
     return IRQ_HANDLED;
 }
 
-void nvme_submit_io_cmd(struct nvme_device *nvme, struct nvme_command *cmd,
+/* PRP1 carries the offset into the first page. The rest are page aligned
+ * and either fit in PRP2 or go in the CID's preallocated list page */
+static void nvme_setup_prps(struct nvme_device *nvme, struct nvme_command *cmd,
+                            struct nvme_cmd_ctx *ctx,
+                            const struct nvme_request *req) {
+    uint64_t size = req->sector_count * req->disk->sector_size;
+    uint64_t offset = (uintptr_t) req->buffer & (PAGE_SIZE - 1);
+    uint64_t num_pages = PAGES_NEEDED_FOR(offset + size);
+    uintptr_t vaddr = PAGE_ALIGN_DOWN(req->buffer);
+
+    /* vectors are split up so that each is exactly one PRP */
+    if (req->vec_count)
+        num_pages = req->vec_count;
+
+    kassert(num_pages > 0 &&
+            num_pages - 1 <= nvme->prp_list_size / sizeof(uint64_t));
+
+    cmd->prp2 = 0;
+
+    for (size_t i = 0; i < num_pages; i++) {
+        paddr_t prp;
+        if (req->vec_count)
+            prp = req->vecs[i].page + req->vecs[i].offset;
+        else if (i == 0)
+            prp = vmm_get_phys((uintptr_t) req->buffer, VMM_FLAG_NONE);
+        else
+            prp = vmm_get_phys(vaddr + i * PAGE_SIZE, VMM_FLAG_NONE);
+
+        if (i == 0)
+            cmd->prp1 = prp;
+        else if (num_pages == 2)
+            cmd->prp2 = prp;
+        else
+            ctx->prp_list[i - 1] = prp;
+    }
+
+    if (num_pages > 2)
+        cmd->prp2 = ctx->prp_list_phys;
+}
+
+/* Parks `req` on the queue's waiting list if every CID is in use, and
+ * returns false without touching the SQ. That happens under the same
+ * lock completions give CIDs back under, so a completion either sees
+ * `req` waiting or leaves a CID for us to take */
+bool nvme_submit_io_cmd(struct nvme_device *nvme, struct nvme_command *cmd,
                         uint32_t qid, struct nvme_request *req) {
     struct nvme_queue *this_queue = nvme->io_queues[qid];
 
+    enum irql irql = nvme_queue_lock_irq_disable(this_queue);
+    if (!this_queue->free_count) {
+        struct nvme_waiting_requests *q = &this_queue->waiting;
+        enum irql wirql = nvme_waiting_requests_lock_irq_disable(q);
+        list_add_tail(&req->list_node, &q->list);
+        nvme_waiting_requests_unlock(q, wirql);
+
+        nvme_queue_unlock(this_queue, irql);
+        return false;
+    }
+
+    uint16_t cid = this_queue->free_cids[--this_queue->free_count];
+    nvme_queue_unlock(this_queue, irql);
+
+    struct nvme_cmd_ctx *ctx = &this_queue->ctxs[cid];
+    ctx->req = req;
+
+    nvme_setup_prps(nvme, cmd, ctx, req);
+    cmd->cid = cid;
+
+    req->status = BIO_STATUS_INFLIGHT; /* In flight */
+
     atomic_fetch_add(&this_queue->outstanding, 1);
     atomic_fetch_add(&nvme->total_outstanding, 1);
 
-    enum irql irql = nvme_queue_lock_irq_disable(this_queue);
+    irql = nvme_queue_lock_irq_disable(this_queue);
 
     uint16_t tail = this_queue->sq_tail;
     uint16_t next_tail = (tail + 1) % this_queue->sq_depth;
 
-    cmd->cid = tail;
-
     this_queue->sq[tail] = *cmd;
-    this_queue->sq_requests[tail] = req;
-
-    req->status = BIO_STATUS_INFLIGHT; /* In flight */
-
     this_queue->sq_tail = next_tail;
 
     mmio_write_32(this_queue->sq_db, next_tail);
 
     nvme_queue_unlock(this_queue, irql);
+    return true;
 }
 
 uint16_t nvme_submit_admin_cmd(struct nvme_device *nvme,
@@ -220,7 +276,7 @@ uint8_t *nvme_identify_controller(struct nvme_device *nvme) {
     cmd.fuse = 0;                  // normal
     cmd.nsid = 1;                  // not used for controller ID
     cmd.prp1 = buffer_phys;
-    cmd.cdw10 = 1; // identify controller
+    cmd.cdw10 = NVME_IDENT_CNS_CONTROLLER;
 
     uint16_t status = nvme_submit_admin_cmd(nvme, &cmd, NULL);
 
@@ -270,7 +326,7 @@ uint8_t *nvme_identify_namespace(struct nvme_device *nvme, uint32_t nsid) {
     cmd.fuse = 0;                  // normal
     cmd.nsid = nsid;               // namespace ID to identify
     cmd.prp1 = buffer_phys;
-    cmd.cdw10 = 0; // Identify Namespace (CNS=0)
+    cmd.cdw10 = NVME_IDENT_CNS_NAMESPACE;
 
     uint16_t status = nvme_submit_admin_cmd(nvme, &cmd, NULL);
 
@@ -280,12 +336,31 @@ uint8_t *nvme_identify_namespace(struct nvme_device *nvme, uint32_t nsid) {
         return NULL;
     }
 
-    struct nvme_identify_namespace *ns = (void *) buffer;
-    uint8_t flbas_index = ns->flbas & 0xF; // lower 4 bits = selected format
-    uint8_t lbads = ns->lbaf[flbas_index].lbads;
-    uint32_t sector_size = 1U << lbads;
-    nvme_log(LOG_INFO, "Device sector size is %u bytes", sector_size);
-
-    nvme->sector_size = sector_size;
     return (uint8_t *) buffer;
 }
+
+/* Zero terminated list of up to 1024 active NSIDs, in increasing order */
+uint32_t *nvme_identify_active_namespaces(struct nvme_device *nvme) {
+    uint64_t buffer_phys = pmm_alloc_page();
+
+    void *buffer =
+        vmm_map_phys(buffer_phys, PAGE_SIZE, PAGE_UNCACHABLE, VMM_FLAG_NONE);
+
+    memset(buffer, 0, PAGE_SIZE);
+
+    struct nvme_command cmd = {0};
+    cmd.opc = NVME_OP_ADMIN_IDENT;
+    cmd.nsid = 0; // list NSIDs greater than this
+    cmd.prp1 = buffer_phys;
+    cmd.cdw10 = NVME_IDENT_CNS_ACTIVE_NSIDS;
+
+    uint16_t status = nvme_submit_admin_cmd(nvme, &cmd, NULL);
+
+    if (status) {
+        nvme_log(LOG_ERROR, "IDENTIFY active NSIDs failed! Status: 0x%04X",
+                 status);
+        return NULL;
+    }
+
+    return buffer;
+}
@@ -101,8 +101,10 @@ void nvme_alloc_io_queues(struct nvme_device *nvme, uint32_t qid) {
 
     struct nvme_queue *this_queue = nvme->io_queues[qid];
 
-    uint64_t sq_pages = 2;
-    uint64_t cq_pages = 2;
+    uint16_t depth = nvme->io_queue_depth;
+    uint64_t sq_pages = PAGES_NEEDED_FOR(depth * sizeof(struct nvme_command));
+    uint64_t cq_pages =
+        PAGES_NEEDED_FOR(depth * sizeof(struct nvme_completion));
 
     uint64_t sq_phys = pmm_alloc_pages(sq_pages);
 
@@ -121,8 +123,8 @@ void nvme_alloc_io_queues(struct nvme_device *nvme, uint32_t qid) {
     this_queue->sq_tail = 0;
     this_queue->cq_head = 0;
     this_queue->cq_phase = 1;
-    this_queue->sq_depth = 64; // TODO: #define these or something
-    this_queue->cq_depth = 16;
+    this_queue->sq_depth = depth;
+    this_queue->cq_depth = depth;
     this_queue->sq_db =
         (uint32_t *) ((uint8_t *) nvme->regs + NVME_DOORBELL_BASE +
                       (2 * qid * nvme->doorbell_stride));
@@ -132,22 +134,50 @@ void nvme_alloc_io_queues(struct nvme_device *nvme, uint32_t qid) {
 
     uint8_t this_isr = nvme->isr_index[qid];
 
-    this_queue->sq_requests =
-        kzalloc(sizeof(struct nvme_request *) * this_queue->sq_depth);
-    if (!this_queue->sq_requests)
+    /* A full SQ still has one empty slot, so that is one CID less */
+    uint16_t cids = this_queue->sq_depth - 1;
+    this_queue->ctxs = kzalloc(sizeof(struct nvme_cmd_ctx) * cids);
+    this_queue->free_cids = kzalloc(sizeof(uint16_t) * cids);
+    if (!this_queue->ctxs || !this_queue->free_cids)
         panic("OOM\n");
 
+    /* The list size is a power of two no bigger than a page, so packing
+     * them back to back never has one straddle a page boundary */
+    uint64_t prp_size = nvme->prp_list_size;
+    uint64_t prp_pages = PAGES_NEEDED_FOR(cids * prp_size);
+    paddr_t prp_phys = pmm_alloc_pages(prp_pages);
+    uint8_t *prp_virt = vmm_map_phys(prp_phys, prp_pages * PAGE_SIZE,
+                                     PAGE_NO_FLAGS, VMM_FLAG_NONE);
+    if (!prp_phys || !prp_virt)
+        panic("OOM\n");
+
+    for (uint16_t i = 0; i < cids; i++) {
+        struct nvme_cmd_ctx *ctx = &this_queue->ctxs[i];
+        ctx->prp_list = (uint64_t *) (prp_virt + i * prp_size);
+        ctx->prp_list_phys = prp_phys + i * prp_size;
+        this_queue->free_cids[i] = cids - 1 - i;
+    }
+
+    this_queue->free_count = cids;
+
+    this_queue->qid = qid;
+    this_queue->dev = nvme;
+    spinlock_init(&this_queue->waiting.lock);
+    INIT_LIST_HEAD(&this_queue->waiting.list);
+    dpc_init(&this_queue->dpc, nvme_completion_dpc, this_queue);
+
     // complete queue
     struct nvme_command cq_cmd = {0};
     cq_cmd.opc = NVME_OP_ADMIN_CREATE_IOCQ;
     cq_cmd.prp1 = cq_phys;
 
-    cq_cmd.cdw10 = (15) << 16 | qid;
+    cq_cmd.cdw10 = (uint32_t) (depth - 1) << 16 | qid;
 
     /* isr enabled, physicall contiguous */
     cq_cmd.cdw11 = this_isr << 16 | 0b11;
 
-    irq_register("nvme", this_isr, nvme_isr_handler, nvme, IRQ_FLAG_NONE);
+    irq_register("nvme", this_isr, nvme_isr_handler, this_queue,
+                 IRQ_FLAG_NONE);
     irq_set_chip(this_isr, lapic_get_chip(), NULL);
 
     if (nvme_submit_admin_cmd(nvme, &cq_cmd, NULL) != 0) {
@@ -161,7 +191,7 @@ void nvme_alloc_io_queues(struct nvme_device *nvme, uint32_t qid) {
     sq_cmd.opc = NVME_OP_ADMIN_CREATE_IOSQ;
     sq_cmd.prp1 = sq_phys;
 
-    sq_cmd.cdw10 = (63) << 16 | qid;
+    sq_cmd.cdw10 = (uint32_t) (depth - 1) << 16 | qid;
     sq_cmd.cdw11 = qid << 16 | 1;
 
     if (nvme_submit_admin_cmd(nvme, &sq_cmd, NULL) != 0) {
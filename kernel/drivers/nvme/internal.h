@@ -6,6 +6,18 @@
 #define NVME_RESET_TIMEOUT_MS 30000 // Controller reset or format NVM
 SPINLOCK_GENERATE_LOCK_UNLOCK_FOR_STRUCT(nvme_queue, lock);
 #define DIV_ROUND_UP(x, y) (((x) + (y) - 1) / (y))
+
+/* Per I/O queue, for every core that shares it. Capped by CAP.MQES */
+#define NVME_IO_QUEUE_DEPTH_PER_CORE 256
+#define NVME_IO_QUEUE_DEPTH_MAX 1024
+
+/* Polled requests spin for as long as this share of recent ones took to
+ * complete. Queues whose requests take longer than the max go straight
+ * to sleep, and with no history yet the default is used */
+#define NVME_POLL_PERCENTILE 90
+#define NVME_POLL_MAX_SPIN_NS US_TO_NS(100)
+#define NVME_POLL_DEFAULT_SPIN_NS US_TO_NS(20)
+#define NVME_POLL_DECAY_SAMPLES 256 /* halve the histogram this often */
 #define THIS_QID(nvme) (1 + (smp_core_id() % (nvme->queue_count)))
 
 LOG_SITE_EXTERN(nvme);
@@ -27,6 +39,9 @@ LOG_HANDLE_EXTERN(nvme);
 #define NVME_OP_ADMIN_CREATE_IOCQ 0x5
 
 #define NVME_OP_ADMIN_IDENT 0x6
+#define NVME_IDENT_CNS_NAMESPACE 0x0
+#define NVME_IDENT_CNS_CONTROLLER 0x1
+#define NVME_IDENT_CNS_ACTIVE_NSIDS 0x2
 #define NVME_OP_ADMIN_SET_FEATS 0x9
 #define NVME_OP_ADMIN_GET_FEATS 0x10
 
@@ -36,13 +51,12 @@ LOG_HANDLE_EXTERN(nvme);
 #define NVME_STATUS_CONFLICTING_ATTRIBUTES 0x80
 #define NVME_STATUS_INVALID_PROT_INFO 0x81
 
+size_t nvme_poll_queue(struct nvme_queue *queue);
+void nvme_poll_wait(struct nvme_device *nvme, struct nvme_request *req);
+void nvme_poll_complete(struct nvme_request *req);
+
 bool nvme_read_sector_async(struct generic_disk *disk,
                             struct nvme_request *req);
 
 bool nvme_write_sector_async(struct generic_disk *disk,
                              struct nvme_request *req);
-
-static inline enum workqueue_error nvme_work_enqueue(struct nvme_device *dev,
-                                                     struct work *work) {
-    return workqueue_enqueue(dev->workqueue, work);
-}
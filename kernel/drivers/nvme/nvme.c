@@ -7,6 +7,7 @@
 #include <drivers/nvme.h>
 #include <drivers/pci.h>
 #include <irq/idt.h>
+#include <math/min_max.h>
 #include <mem/alloc.h>
 #include <mem/vmm.h>
 #include <registry.h>
@@ -85,7 +86,6 @@ struct nvme_device *nvme_discover_device(uint8_t bus, uint8_t slot,
     nvme_alloc_admin_queues(nvme);
     nvme_setup_admin_queues(nvme);
     nvme_enable_controller(nvme);
-    nvme_identify_namespace(nvme, 1);
     struct nvme_identify_controller *c =
         (void *) nvme_identify_controller(nvme);
 
@@ -99,12 +99,33 @@ struct nvme_device *nvme_discover_device(uint8_t bus, uint8_t slot,
 
     uint32_t sqs_to_make = core_count > total_sq ? total_sq : core_count;
 
-    nvme->max_transfer_size = (1 << c->mdts) * PAGE_SIZE;
+    /* MDTS is in units of CAP.MPSMIN, 0 means no limit. Past a page
+     * worth of entries a command's PRPs no longer fit in its list */
+    uint64_t prp_limit = NVME_PRP_LIST_ENTRIES * PAGE_SIZE;
+    uint64_t mps_min = 1ULL << (12 + ((cap >> 48) & 0xF));
+    nvme->max_transfer_size = c->mdts ? mps_min << c->mdts : prp_limit;
+    if (nvme->max_transfer_size > prp_limit)
+        nvme->max_transfer_size = prp_limit;
+
+    nvme->prp_list_size =
+        nvme->max_transfer_size / PAGE_SIZE * sizeof(uint64_t);
+
     nvme_log(LOG_INFO, "Controller max transfer size is %u bytes",
              nvme->max_transfer_size);
 
-    nvme->isr_index = kzalloc(sizeof(uint8_t) * sqs_to_make);
-    nvme->io_queues = kzalloc(sizeof(struct nvme_queue *) * sqs_to_make);
+    /* Cores that share a queue get its depth between them */
+    uint64_t cores_per_queue = DIV_ROUND_UP(core_count, sqs_to_make);
+    uint64_t depth = NVME_IO_QUEUE_DEPTH_PER_CORE * cores_per_queue;
+    depth = MIN(depth, NVME_IO_QUEUE_DEPTH_MAX);
+    depth = MIN(depth, (cap & 0xFFFF) + 1);
+    nvme->io_queue_depth = depth;
+
+    nvme_log(LOG_INFO, "Using I/O queues %u entries deep", depth);
+
+    /* QIDs start at 1 */
+    nvme->isr_index = kzalloc(sizeof(uint8_t) * (sqs_to_make + 1));
+    nvme->io_queues =
+        kzalloc(sizeof(struct nvme_queue *) * (sqs_to_make + 1));
     if (unlikely(!nvme->isr_index || !nvme->io_queues))
         panic("Could not allocate space for NVMe structures");
 
@@ -120,53 +141,62 @@ struct nvme_device *nvme_discover_device(uint8_t bus, uint8_t slot,
         nvme_alloc_io_queues(nvme, i);
     }
 
-    INIT_LIST_HEAD(&nvme->finished_requests.list);
-    INIT_LIST_HEAD(&nvme->waiting_requests.list);
-    INIT_LIST_HEAD(&nvme->work.list_node);
-    nvme->work.args = WORK_ARGS(nvme, NULL);
-    nvme->work.func = nvme_work;
-
-    struct cpu_mask mask;
-    if (!cpu_mask_init(&mask, global.core_count))
-        panic("Could not initialize CPU mask\n");
-
-    cpu_mask_set_all(&mask);
-
-    struct workqueue_attributes attrs = {
-        .capacity = 64, /* small, oneshots are rare */
-        .idle_check =
-            {
-                .max = WORKQUEUE_DEFAULT_MAX_IDLE_CHECK,
-                .min = WORKQUEUE_DEFAULT_MIN_IDLE_CHECK,
-            },
-        .max_workers = 1,
-        .spawn_delay = WORKQUEUE_DEFAULT_SPAWN_DELAY,
-        .flags = WORKQUEUE_FLAG_DEFAULTS | WORKQUEUE_FLAG_NO_WORKER_GC |
-                 WORKQUEUE_FLAG_ISR_SAFE,
-        .worker_cpu_mask = mask,
-    };
-
-    nvme->workqueue = workqueue_create("nvme_wq", &attrs);
-    if (!nvme->workqueue)
-        panic("Could not allocate workqueue\n");
-
-    semaphore_init(&nvme->sem, 0, SEMAPHORE_INIT_IRQ_DISABLE);
-    nvme_work_enqueue(nvme, &nvme->work);
-    workqueue_kick(nvme->workqueue);
-
+    nvme_scan_namespaces(nvme);
     return nvme;
 }
 
+static void nvme_add_namespace(struct nvme_device *nvme, uint32_t nsid) {
+    struct nvme_identify_namespace *id =
+        (void *) nvme_identify_namespace(nvme, nsid);
+    if (!id || !id->nsze)
+        return;
+
+    uint8_t flbas_index = id->flbas & 0xF; // lower 4 bits = selected format
+    uint8_t lbads = id->lbaf[flbas_index].lbads;
+
+    struct nvme_namespace *ns = &nvme->namespaces[nvme->namespace_count++];
+    ns->dev = nvme;
+    ns->nsid = nsid;
+    ns->sector_size = 1U << lbads;
+    ns->sector_count = id->nsze;
+
+    nvme_log(LOG_INFO, "Namespace %u has %u byte sectors, %u sectors", nsid,
+             ns->sector_size, ns->sector_count);
+}
+
+/* Falls back to NSID 1 on controllers that can't list active NSIDs */
+void nvme_scan_namespaces(struct nvme_device *nvme) {
+    uint32_t *nsids = nvme_identify_active_namespaces(nvme);
+    uint32_t count = 0;
+
+    if (nsids)
+        while (count < PAGE_SIZE / sizeof(uint32_t) && nsids[count])
+            count++;
+
+    nvme->namespaces = kzalloc(sizeof(struct nvme_namespace) * MAX(count, 1));
+    if (!nvme->namespaces)
+        panic("Could not allocate space for NVMe namespaces\n");
+
+    if (!count) {
+        nvme_add_namespace(nvme, 1);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        nvme_add_namespace(nvme, nsids[i]);
+}
+
 void nvme_print_wrapper(struct generic_disk *d) {
-    struct nvme_device *dev = (struct nvme_device *) d->driver_data;
-    uint8_t *n = nvme_identify_namespace(dev, 1);
+    struct nvme_namespace *ns = d->driver_data;
+    struct nvme_device *dev = ns->dev;
+    uint8_t *n = nvme_identify_namespace(dev, ns->nsid);
     nvme_print_namespace((struct nvme_identify_namespace *) n);
     uint8_t *i = nvme_identify_controller(dev);
     nvme_print_identify((struct nvme_identify_controller *) i);
 }
 
 static struct bio_scheduler_ops nvme_bio_sched_ops = {
-    .should_coalesce = noop_should_coalesce,
+    .should_coalesce = nvme_should_coalesce,
     .reorder = noop_reorder,
     .do_coalesce = noop_do_coalesce,
     .max_wait_time =
@@ -190,26 +220,30 @@ static struct bio_scheduler_ops nvme_bio_sched_ops = {
     .tick_ms = 20,
 };
 
-struct generic_disk *nvme_create_generic(struct nvme_device *nvme) {
+struct generic_disk *nvme_create_generic(struct nvme_namespace *ns) {
     struct generic_disk *d = kzalloc(sizeof(struct generic_disk));
     if (!d)
         panic("Could not allocate space for NVMe device\n");
 
-    d->driver_data = nvme;
-    d->sector_size = nvme->sector_size;
+    d->driver_data = ns;
+    d->sector_size = ns->sector_size;
+    d->total_sectors = ns->sector_count;
     d->read_sector = nvme_read_sector_wrapper;
     d->write_sector = nvme_write_sector_wrapper;
     d->submit_bio_async = nvme_submit_bio_request;
-    d->flags = DISK_FLAG_NO_REORDER | DISK_FLAG_NO_COALESCE;
+    d->submit_bio_polled = nvme_submit_bio_polled;
+    d->flags = DISK_FLAG_NO_REORDER;
     d->cache = kzalloc(sizeof(struct bcache));
     if (unlikely(!d->cache))
         panic("Could not allocate space for NVMe block cache\n");
 
-    d->scheduler = bio_sched_create(d, &nvme_bio_sched_ops);
+    /* one context per I/O queue, mapped the same way THIS_QID maps CPUs */
+    d->scheduler =
+        bio_sched_create(d, &nvme_bio_sched_ops, ns->dev->queue_count);
 
     bcache_init(d->cache, DEFAULT_BLOCK_CACHE_SIZE);
     d->type = G_NVME_DRIVE;
-    nvme->generic_disk = d;
+    ns->disk = d;
     return d;
 }
 
@@ -220,10 +254,13 @@ static void nvme_pci_init(uint8_t bus, uint8_t device, uint8_t function,
     (void) dev;
 
     struct nvme_device *d = nvme_discover_device(bus, device, function);
-    struct generic_disk *disk = nvme_create_generic(d);
-    registry_mkname(disk, "nvme", nvme_cnt++);
-    registry_register(disk);
-    k_print_register(disk->name);
+
+    for (uint32_t i = 0; i < d->namespace_count; i++) {
+        struct generic_disk *disk = nvme_create_generic(&d->namespaces[i]);
+        registry_mkname(disk, "nvme", nvme_cnt++);
+        registry_register(disk);
+        k_print_register(disk->name);
+    }
 }
 
 PCI_DEV_REGISTER(nvme, PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_NVM,
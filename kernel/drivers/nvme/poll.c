@@ -0,0 +1,138 @@
+/* Hybrid polling for latency sensitive requests.
+ *
+ * The submitter spins on its queue's CQ, completing whatever shows up,
+ * for about as long as most recent polled requests on that queue took.
+ * If its request still isn't back by then it goes to sleep and gets
+ * woken by whoever completes it, usually the completion DPC. */
+
+#include <asm.h>
+#include <drivers/nvme.h>
+#include <sch/irql.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <thread/io_wait.h>
+#include <thread/thread.h>
+#include <time.h>
+
+#include "internal.h"
+
+static uint32_t poll_bucket(time_t ns) {
+    uint32_t b = ns ? 63 - __builtin_clzll(ns) : 0;
+    return b < NVME_POLL_HIST_BUCKETS ? b : NVME_POLL_HIST_BUCKETS - 1;
+}
+
+static void poll_record(struct nvme_poll_stats *st, time_t ns) {
+    atomic_fetch_add(&st->hist[poll_bucket(ns)], 1);
+
+    /* Racy, but a sample or two getting lost doesn't matter here */
+    if (atomic_fetch_add(&st->samples, 1) % NVME_POLL_DECAY_SAMPLES)
+        return;
+
+    for (size_t i = 0; i < NVME_POLL_HIST_BUCKETS; i++)
+        atomic_store(&st->hist[i], atomic_load(&st->hist[i]) / 2);
+}
+
+/* Upper end of the bucket the percentile falls in, or 0 if that
+ * is too long to be worth spinning for */
+static time_t poll_budget(struct nvme_poll_stats *st) {
+    uint64_t total = 0;
+    uint32_t hist[NVME_POLL_HIST_BUCKETS];
+
+    for (size_t i = 0; i < NVME_POLL_HIST_BUCKETS; i++) {
+        hist[i] = atomic_load(&st->hist[i]);
+        total += hist[i];
+    }
+
+    if (!total)
+        return NVME_POLL_DEFAULT_SPIN_NS;
+
+    uint64_t target = (total * NVME_POLL_PERCENTILE + 99) / 100;
+    uint64_t seen = 0;
+    time_t budget = 0;
+
+    for (size_t i = 0; i < NVME_POLL_HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= target) {
+            budget = 2LL << i;
+            break;
+        }
+    }
+
+    return budget <= NVME_POLL_MAX_SPIN_NS ? budget : 0;
+}
+
+void nvme_poll_complete(struct nvme_request *req) {
+    /* Past this `req` may be freed unless the poller is asleep. Acquire
+     * pairs with the release in poll_sleep(), so `poller` is published */
+    if (atomic_exchange_explicit(&req->poll_state, NVME_POLL_DONE,
+                                 memory_order_acq_rel) != NVME_POLL_SLEEPING)
+        return;
+
+    struct nvme_namespace *ns = req->disk->driver_data;
+    thread_wake_from_io_block(req->poller, ns->dev);
+}
+
+static void poll_sleep(struct nvme_device *nvme, struct nvme_request *req) {
+    struct io_wait_token iowt = IO_WAIT_TOKEN_EMPTY;
+    enum nvme_poll_state expect = NVME_POLL_SPINNING;
+
+    req->poller = thread_get_current();
+
+    enum irql irql = irql_raise(IRQL_DISPATCH_LEVEL);
+    io_wait_begin(&iowt, nvme);
+
+    /* Completed after we stopped spinning, nobody is going to wake us */
+    if (!atomic_compare_exchange_strong_explicit(
+            &req->poll_state, &expect, NVME_POLL_SLEEPING,
+            memory_order_release, memory_order_acquire))
+        thread_wake_from_io_block(req->poller, nvme);
+
+    irql_lower(irql);
+
+    thread_wait_for_wake_match();
+    io_wait_end(&iowt, IO_WAIT_END_NO_OP);
+}
+
+/* `req` must have been submitted with its poll state set to SPINNING */
+void nvme_poll_wait(struct nvme_device *nvme, struct nvme_request *req) {
+    struct nvme_queue *queue = nvme->io_queues[req->qid];
+    struct nvme_poll_stats *st = &queue->poll;
+    time_t start = time_get_ns();
+    time_t budget = poll_budget(st);
+
+    while (time_get_ns() - start < budget) {
+        nvme_poll_queue(queue);
+        if (atomic_load(&req->poll_state) == NVME_POLL_DONE) {
+            atomic_fetch_add(&st->hits, 1);
+            poll_record(st, time_get_ns() - start);
+            return;
+        }
+
+        cpu_relax();
+    }
+
+    atomic_fetch_add(&st->misses, 1);
+    poll_sleep(nvme, req);
+
+    /* Slow completions count too, that is what stops queues that can't
+     * make it within the max spin from spinning at all */
+    poll_record(st, time_get_ns() - start);
+}
+
+bool nvme_poll_stat(struct generic_disk *disk, uint32_t qid, uint64_t *hits,
+                    uint64_t *misses) {
+    struct nvme_namespace *ns = disk->driver_data;
+    struct nvme_device *nvme = ns->dev;
+    if (qid == 0 || qid > nvme->queue_count)
+        return false;
+
+    struct nvme_poll_stats *st = &nvme->io_queues[qid]->poll;
+    if (hits)
+        *hits = atomic_load(&st->hits);
+
+    if (misses)
+        *misses = atomic_load(&st->misses);
+
+    return true;
+}
@@ -2,6 +2,7 @@
 #include <block/generic.h>
 #include <block/sched.h>
 #include <drivers/nvme.h>
+#include <kassert.h>
 #include <mem/alloc.h>
 #include <mem/vmm.h>
 #include <stdbool.h>
@@ -9,7 +10,6 @@
 #include <stdint.h>
 #include <structures/sll.h>
 #include <thread/io_wait.h>
-#include <thread/workqueue.h>
 
 #include "internal.h"
 
@@ -17,105 +17,32 @@ typedef bool (*sync_fn)(struct generic_disk *, uint64_t, uint8_t *, uint16_t,
                         struct io_wait_token *iowt);
 typedef bool (*async_fn)(struct generic_disk *, struct nvme_request *);
 
-static void enqueue_request(struct nvme_device *dev, struct nvme_request *req) {
-    struct nvme_waiting_requests *q = &dev->waiting_requests;
-
-    enum irql irql = nvme_waiting_requests_lock_irq_disable(q);
-
-    list_add_tail(&req->list_node, &q->list);
-
-    nvme_waiting_requests_unlock(q, irql);
-}
-
-static bool nvme_bio_fill_prps(struct nvme_bio_data *data, const void *buffer,
-                               uint64_t size) {
-    uint64_t offset = (uintptr_t) buffer & (PAGE_SIZE - 1);
-    uint64_t num_pages = PAGES_NEEDED_FOR(offset + size);
-
-    data->prps = kmalloc(sizeof(uint64_t) * num_pages);
-    if (!data->prps)
-        return false;
-
-    uintptr_t vaddr = PAGE_ALIGN_DOWN(buffer);
-
-    for (size_t i = 0; i < num_pages; i++) {
-        data->prps[i] = vmm_get_phys(vaddr, VMM_FLAG_NONE);
-        vaddr += PAGE_SIZE;
-    }
-
-    data->prp_count = num_pages;
-
-    return true;
-}
-
-static void nvme_setup_prps(struct nvme_command *cmd,
-                            struct nvme_bio_data *data) {
-    kassert(data->prp_count > 0);
-
-    cmd->prp1 = data->prps[0];
-
-    if (data->prp_count == 1) {
-        cmd->prp2 = 0;
-        goto free_prps;
-    } else if (data->prp_count == 2) {
-        cmd->prp2 = data->prps[1];
-        goto free_prps;
-    } else {
-        cmd->prp2 = vmm_get_phys((uint64_t) (&data->prps[1]), VMM_FLAG_NONE);
-    }
-
-    return;
-
-    /* For when there is no need for multiple PRPs */
-free_prps:
-    kfree(data->prps);
-    data->prps = NULL;
-    return;
-}
-
 static bool rw_send_command(struct generic_disk *disk, struct nvme_request *req,
                             uint8_t opc) {
-    struct nvme_device *nvme = disk->driver_data;
+    struct nvme_namespace *ns = disk->driver_data;
+    struct nvme_device *nvme = ns->dev;
     uint16_t qid = THIS_QID(nvme);
     uint64_t lba = req->lba;
     uint64_t count = req->sector_count;
     void *buffer = req->buffer;
 
-    struct nvme_queue *q = nvme->io_queues[qid];
-
-    if (atomic_load(&q->outstanding) >= q->sq_depth) {
-        enqueue_request(nvme, req);
-
-        /* No room */
-        return true;
-    }
-
-    struct nvme_bio_data *data = kzalloc(sizeof(struct nvme_bio_data));
-    if (!data)
-        return false;
-
-    if (!nvme_bio_fill_prps(data, buffer, count * disk->sector_size)) {
-        kfree(data);
-        return false;
-    }
-
-    req->bio_data = data;
-
     struct nvme_command cmd = {0};
     cmd.opc = opc;
-    cmd.nsid = 1;
+    cmd.nsid = ns->nsid;
     cmd.cdw10 = lba & 0xFFFFFFFFULL;
     cmd.cdw11 = lba >> 32ULL;
     cmd.cdw12 = count - 1;
 
-    nvme_setup_prps(&cmd, data);
-
     req->lba = lba;
     req->buffer = buffer;
     req->sector_count = count;
+    req->qid = qid;
+    req->write = opc == NVME_OP_IO_WRITE;
+    req->disk = disk;
     req->done = false;
     req->status = -1;
 
+    /* No free CID parks it, it gets sent once a completion hands one back */
     nvme_submit_io_cmd(nvme, &cmd, qid, req);
 
     return true;
@@ -139,7 +66,8 @@ static bool rw_sync(struct generic_disk *disk, uint64_t lba, uint8_t *buffer,
     if (io_wait_token_active(iowt))
         io_wait_end(iowt, IO_WAIT_END_NO_OP);
 
-    io_wait_begin(iowt, disk->driver_data);
+    struct nvme_namespace *ns = disk->driver_data;
+    io_wait_begin(iowt, ns->dev);
 
     function(disk, &req);
     irql_lower(irql);
@@ -152,8 +80,8 @@ static bool rw_sync(struct generic_disk *disk, uint64_t lba, uint8_t *buffer,
 
 static bool rw_wrapper(struct generic_disk *disk, uint64_t lba, uint8_t *buf,
                        uint64_t cnt, sync_fn function) {
-    struct nvme_device *nvme = (struct nvme_device *) disk->driver_data;
-    uint16_t max_sectors = nvme->max_transfer_size / disk->sector_size;
+    struct nvme_namespace *ns = disk->driver_data;
+    uint16_t max_sectors = ns->dev->max_transfer_size / disk->sector_size;
     struct io_wait_token iowt = IO_WAIT_TOKEN_EMPTY;
 
     while (cnt > 0) {
@@ -173,33 +101,15 @@ static bool rw_wrapper(struct generic_disk *disk, uint64_t lba, uint8_t *buf,
     return true;
 }
 
+/* Bios bigger than the MDTS are split up before they get here */
 static bool rw_async_wrapper(struct generic_disk *disk,
                              struct nvme_request *req, async_fn function) {
-    struct nvme_device *nvme = (struct nvme_device *) disk->driver_data;
-    uint16_t max_sectors = nvme->max_transfer_size / disk->sector_size;
-    uint16_t chunk;
-
-    uint64_t cnt = req->sector_count;
-
-    int part_count = 0;
-    uint64_t tmp_cnt = cnt;
-    while (tmp_cnt > 0) {
-        chunk = (tmp_cnt > max_sectors) ? max_sectors : (uint16_t) tmp_cnt;
-        tmp_cnt -= chunk;
-        part_count++;
-    }
-
-    req->remaining_parts = part_count;
-
-    while (cnt > 0) {
-        chunk = (cnt > max_sectors) ? max_sectors : (uint16_t) cnt;
-        cnt -= chunk;
+    struct nvme_namespace *ns = disk->driver_data;
+    kassert(req->sector_count * disk->sector_size <=
+            ns->dev->max_transfer_size);
 
-        if (!function(disk, req))
-            return false;
-    }
-
-    return true;
+    req->remaining_parts = 1;
+    return function(disk, req);
 }
 
 bool nvme_read_sector(struct generic_disk *disk, uint64_t lba, uint8_t *buffer,
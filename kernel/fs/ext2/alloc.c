@@ -35,9 +35,10 @@ static uint32_t alloc_from_bitmap(struct ext2_fs *fs, uint32_t bitmap_block,
     }
 
     bitmap[byte_pos] |= (1 << bit_pos);
+    bool written = ext2_block_write(fs, ent, EXT2_PRIO_BITMAPS);
     bcache_ent_release(ent);
 
-    if (!ext2_block_write(fs, ent, EXT2_PRIO_BITMAPS))
+    if (!written)
         return -1;
 
     update_counts(fs, group);
@@ -101,8 +102,8 @@ bool ext2_free_block(struct ext2_fs *fs, uint32_t block_num) {
     }
 
     bitmap[byte] &= ~bit;
-    bcache_ent_release(ent);
     ext2_block_write(fs, ent, EXT2_PRIO_BITMAPS);
+    bcache_ent_release(ent);
 
     fs->group_desc[group].free_blocks_count++;
     fs->sblock->free_blocks_count++;
@@ -151,8 +152,8 @@ bool ext2_free_inode(struct ext2_fs *fs, uint32_t inode_num) {
     }
 
     bitmap[byte] &= ~bit;
-    bcache_ent_release(ent);
     ext2_block_write(fs, ent, EXT2_PRIO_BITMAPS);
+    bcache_ent_release(ent);
 
     fs->group_desc[group].free_inodes_count++;
     fs->sblock->free_inodes_count++;
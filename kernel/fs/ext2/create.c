@@ -80,7 +80,9 @@ enum errno ext2_link_file(struct ext2_fs *fs, struct ext2_full_inode *dir,
 
     ext2_init_dirent(fs, new_entry, inode->inode_num, name, type);
 
-    if (!ext2_block_write(fs, ent, EXT2_PRIO_DIRENT))
+    bool written = ext2_block_write(fs, ent, EXT2_PRIO_DIRENT);
+    bcache_ent_unpin(ent);
+    if (!written)
         return ERR_IO;
 
     /* this sets the first available block to our new block */
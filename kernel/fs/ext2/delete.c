@@ -96,9 +96,10 @@ enum errno ext2_unlink_file(struct ext2_fs *fs,
         return ERR_IO;
 
     unlink_adjust_neighbors(fs, block, ctx.entry_offset, ctx.prev_offset);
+    bool written = ext2_block_write(fs, ent, EXT2_PRIO_DIRENT);
     bcache_ent_release(ent);
 
-    if (!ext2_block_write(fs, ent, EXT2_PRIO_DIRENT))
+    if (!written)
         return ERR_IO;
 
     struct ext2_inode *target_inode = NULL;
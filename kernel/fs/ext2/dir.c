@@ -65,9 +65,9 @@ enum errno ext2_mkdir(struct ext2_fs *fs, struct ext2_full_inode *parent_dir,
         return ERR_IO;
     }
 
-    bcache_ent_acquire(ent);
+    bcache_ent_lock(ent);
     init_dot_ents(fs, block, parent_dir, dir);
-    bcache_ent_release(ent);
+    bcache_ent_unlock(ent);
 
     ext2_inode_lock(dir);
     init_dir(fs, dir, new_block);
@@ -76,6 +76,7 @@ enum errno ext2_mkdir(struct ext2_fs *fs, struct ext2_full_inode *parent_dir,
     ext2_inode_write(fs, dir->inode_num, &dir->node);
     ext2_inode_write(fs, parent_dir->inode_num, &parent_dir->node);
     ext2_block_write(fs, ent, EXT2_PRIO_DIRENT);
+    bcache_ent_unpin(ent);
 
     ext2_dealloc_inode(dir);
     return ERR_OK;
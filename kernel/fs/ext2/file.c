@@ -20,9 +20,12 @@ enum errno ext2_write_file(struct ext2_fs *fs, struct ext2_full_inode *inode,
         uint32_t block_index = file_offset / fs->block_size;
         uint32_t block_offset = file_offset % fs->block_size;
 
+        /* only holes need to go through the allocating path */
         bool allocate = (size - bytes_written > 0);
-        uint32_t block_num = ext2_get_or_set_block(
-            fs, &inode->node, block_index, 0, allocate, &new_block);
+        uint32_t block_num = ext2_map_block(fs, inode, block_index, NULL);
+        if (!block_num)
+            block_num = ext2_get_or_set_block(fs, &inode->node, block_index,
+                                              0, allocate, &new_block);
 
         if (new_block)
             new_block_counter += 1;
@@ -46,9 +49,8 @@ enum errno ext2_write_file(struct ext2_fs *fs, struct ext2_full_inode *inode,
             return ERR_IO;
 
         memcpy(block_buf + block_offset, src + bytes_written, to_write);
-        bcache_ent_release(ent);
-
         ext2_block_write(fs, ent, EXT2_PRIO_DATA);
+        bcache_ent_release(ent);
 
         bytes_written += to_write;
     }
@@ -64,50 +66,33 @@ enum errno ext2_write_file(struct ext2_fs *fs, struct ext2_full_inode *inode,
     return status ? ERR_OK : ERR_IO;
 }
 
-struct file_read_ctx {
-    struct ext2_fs *fs;
-    struct ext2_inode *inode;
-    uint32_t offset;
-    uint32_t length;
-    uint8_t *buffer;
-    uint32_t bytes_read;
-};
-
-static void file_read_visitor(struct ext2_fs *fs, struct ext2_inode *inode,
-                              uint32_t depth, uint32_t *block_ptr,
-                              void *user_data) {
-    (void) depth;
-    struct file_read_ctx *ctx = (struct file_read_ctx *) user_data;
-
-    if (ctx->bytes_read >= ctx->length)
-        return;
+/* Copies out of `count` blocks that are contiguous on disk. The ones that
+ * aren't cached yet are read in with a single request first */
+static enum errno read_run(struct ext2_fs *fs, struct ext2_full_inode *inode,
+                           uint32_t block_num, uint32_t count,
+                           uint32_t block_offset, uint8_t *dst,
+                           uint64_t *remaining) {
+    if (count > 1)
+        ext2_read_blocks(fs, block_num, count);
 
-    if (*block_ptr == 0)
-        return;
+    for (uint32_t i = 0; i < count && *remaining; i++) {
+        ext2_readahead(fs, inode->inode_num, block_num + i);
 
-    uint32_t block_size = fs->block_size;
-    struct bcache_entry *ent;
-    uint8_t *block_buf = ext2_block_read(fs, *block_ptr, &ent);
-    if (!block_buf)
-        return;
+        struct bcache_entry *ent;
+        uint8_t *block_buf = ext2_block_read(fs, block_num + i, &ent);
+        if (!block_buf)
+            return ERR_IO;
 
-    uint32_t file_offset = ctx->bytes_read + ctx->offset;
-    uint32_t block_offset = file_offset % block_size;
+        uint32_t to_copy = MIN(fs->block_size - block_offset, *remaining);
+        memcpy(dst, block_buf + block_offset, to_copy);
+        bcache_ent_release(ent);
 
-    if ((ctx->bytes_read + ctx->offset) >= inode->size) {
-        return;
+        dst += to_copy;
+        *remaining -= to_copy;
+        block_offset = 0;
     }
 
-    uint32_t remaining = ctx->length - ctx->bytes_read;
-    uint32_t in_block = block_size - block_offset;
-    uint32_t to_copy = (remaining < in_block) ? remaining : in_block;
-
-    if ((ctx->bytes_read + ctx->offset + to_copy) > inode->size)
-        to_copy = inode->size - (ctx->bytes_read + ctx->offset);
-
-    memcpy(ctx->buffer + ctx->bytes_read, block_buf + block_offset, to_copy);
-    ctx->bytes_read += to_copy;
-    bcache_ent_release(ent);
+    return ERR_OK;
 }
 
 enum errno ext2_read_file(struct ext2_fs *fs, struct ext2_full_inode *inode,
@@ -121,14 +106,36 @@ enum errno ext2_read_file(struct ext2_fs *fs, struct ext2_full_inode *inode,
     if (offset + length > inode->node.size)
         length = inode->node.size - offset;
 
-    struct file_read_ctx ctx = {.fs = fs,
-                                .inode = &inode->node,
-                                .offset = offset,
-                                .length = length,
-                                .buffer = buffer,
-                                .bytes_read = 0};
+    uint32_t block_size = fs->block_size;
+    uint64_t remaining = length;
+
+    while (remaining) {
+        uint64_t file_offset = offset + (length - remaining);
+        uint32_t block_index = file_offset / block_size;
+        uint32_t block_offset = file_offset % block_size;
+        uint8_t *dst = buffer + (length - remaining);
+
+        uint32_t run;
+        uint32_t block_num = ext2_map_block(fs, inode, block_index, &run);
+
+        /* holes read back as zeroes */
+        if (!block_num) {
+            uint32_t to_zero = MIN(block_size - block_offset, remaining);
+            memset(dst, 0, to_zero);
+            remaining -= to_zero;
+            continue;
+        }
+
+        uint64_t wanted = (block_offset + remaining + block_size - 1) /
+                          block_size;
+        run = MIN(run, wanted);
+
+        enum errno err = read_run(fs, inode, block_num, run, block_offset,
+                                  dst, &remaining);
+        if (err != ERR_OK)
+            return err;
+    }
 
-    ext2_traverse_inode_blocks(fs, &inode->node, file_read_visitor, &ctx, true);
     inode->node.atime = time_get_unix();
     ext2_inode_write(fs, inode->inode_num, &inode->node);
     return ERR_OK;
@@ -29,7 +29,8 @@ uint8_t *ext2_block_read(struct ext2_fs *fs, uint32_t block_num,
     if (!buf)
         return NULL;
 
-    bcache_ent_acquire(*out);
+    /* bcache_get already pinned it */
+    bcache_ent_lock(*out);
     return buf;
 }
 
@@ -98,8 +99,8 @@ bool ext2_inode_write(struct ext2_fs *fs, uint32_t inode_num,
         return false;
 
     memcpy(block_buf + block_offset, inode, fs->inode_size);
+    bool status = ext2_block_write(fs, ent, EXT2_PRIO_INODE);
     bcache_ent_release(ent);
 
-    bool status = ext2_block_write(fs, ent, EXT2_PRIO_INODE);
     return status;
 }
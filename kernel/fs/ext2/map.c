@@ -0,0 +1,129 @@
+/* Logical to physical block mapping.
+ *
+ * Instead of walking the whole block tree, the indirect chain for a single
+ * logical block is computed straight from its index, which costs one block
+ * read per level. Whatever is found is remembered per inode as a run of
+ * blocks that are contiguous on disk, so sequential accesses only go down
+ * the chain once per run. */
+
+#include <fs/ext2.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EXT2_MAP_MAX_RUN 1024
+
+static bool map_cache_lookup(struct ext2_map_cache *mc, uint32_t block_index,
+                             uint32_t *phys, uint32_t *len) {
+    bool found = false;
+    enum irql irql = spin_lock(&mc->lock);
+
+    for (uint32_t i = 0; i < EXT2_MAP_CACHE_RUNS; i++) {
+        struct ext2_map_run *r = &mc->runs[i];
+        if (r->len && block_index >= r->logical &&
+            block_index - r->logical < r->len) {
+            uint32_t off = block_index - r->logical;
+            *phys = r->physical + off;
+            *len = r->len - off;
+            found = true;
+            break;
+        }
+    }
+
+    spin_unlock(&mc->lock, irql);
+    return found;
+}
+
+static void map_cache_insert(struct ext2_map_cache *mc, uint32_t logical,
+                             uint32_t physical, uint32_t len) {
+    enum irql irql = spin_lock(&mc->lock);
+
+    struct ext2_map_run *r = &mc->runs[mc->next];
+    r->logical = logical;
+    r->physical = physical;
+    r->len = len;
+    mc->next = (mc->next + 1) % EXT2_MAP_CACHE_RUNS;
+
+    spin_unlock(&mc->lock, irql);
+}
+
+/* Runs stop at the end of the pointer array they start in */
+static uint32_t run_length(const uint32_t *ptrs, uint32_t idx,
+                           uint32_t count) {
+    uint32_t len = 1;
+    while (idx + len < count && len < EXT2_MAP_MAX_RUN &&
+           ptrs[idx + len] == ptrs[idx] + len)
+        len++;
+
+    return len;
+}
+
+/* Goes down the chain for one block. Nothing gets written back */
+static uint32_t map_uncached(struct ext2_fs *fs, struct ext2_inode *inode,
+                             uint32_t block_index, uint32_t *run_len) {
+    uint64_t ppb = fs->block_size / sizeof(uint32_t);
+
+    if (block_index < EXT2_NDIR_BLOCKS) {
+        uint32_t bnum = inode->block[block_index];
+        if (bnum)
+            *run_len = run_length(inode->block, block_index, EXT2_NDIR_BLOCKS);
+
+        return bnum;
+    }
+
+    uint64_t idx = block_index - EXT2_NDIR_BLOCKS;
+    uint64_t span = ppb;
+    uint32_t depth = 1;
+
+    while (idx >= span) {
+        idx -= span;
+        span *= ppb;
+        if (++depth > 3)
+            return 0;
+    }
+
+    uint32_t bnum = inode->block[EXT2_NDIR_BLOCKS + depth - 1];
+    uint64_t divisor = span / ppb;
+
+    for (uint32_t level = depth; level > 0 && bnum; level--) {
+        struct bcache_entry *ent;
+        uint32_t *ptrs = (uint32_t *) ext2_block_read(fs, bnum, &ent);
+        if (!ptrs)
+            return 0;
+
+        uint32_t slot = idx / divisor;
+        bnum = ptrs[slot];
+        if (level == 1 && bnum)
+            *run_len = run_length(ptrs, slot, ppb);
+
+        bcache_ent_release(ent);
+        idx %= divisor;
+        divisor /= ppb;
+    }
+
+    return bnum;
+}
+
+uint32_t ext2_map_block(struct ext2_fs *fs, struct ext2_full_inode *inode,
+                        uint32_t block_index, uint32_t *run_len) {
+    uint32_t phys = 0, len = 0;
+
+    if (!map_cache_lookup(&inode->map, block_index, &phys, &len)) {
+        phys = map_uncached(fs, &inode->node, block_index, &len);
+        if (phys)
+            map_cache_insert(&inode->map, block_index, phys, len);
+    }
+
+    if (run_len)
+        *run_len = phys ? len : 0;
+
+    return phys;
+}
+
+void ext2_map_invalidate(struct ext2_full_inode *inode) {
+    enum irql irql = spin_lock(&inode->map.lock);
+
+    for (uint32_t i = 0; i < EXT2_MAP_CACHE_RUNS; i++)
+        inode->map.runs[i].len = 0;
+
+    spin_unlock(&inode->map.lock, irql);
+}
@@ -34,11 +34,10 @@ enum errno ext2_symlink_file(struct ext2_fs *fs,
         if (!buffer)
             return ERR_IO;
 
-        bcache_ent_acquire(ent);
+        bcache_ent_lock(ent);
         memcpy(buffer, target, strlen(target) + 1);
-        bcache_ent_release(ent);
-
         ext2_block_write(fs, ent, EXT2_PRIO_DIRENT);
+        bcache_ent_release(ent);
 
         new_inode.block[0] = block;
         new_inode.blocks = fs->block_size / fs->drive->sector_size;
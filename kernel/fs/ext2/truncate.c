@@ -4,7 +4,6 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define EXT2_NDIR_BLOCKS 12
 #define EXT2_IND_BLOCK EXT2_NDIR_BLOCKS
 #define EXT2_DIND_BLOCK (EXT2_IND_BLOCK + 1)
 #define EXT2_TIND_BLOCK (EXT2_DIND_BLOCK + 1)
@@ -32,9 +31,8 @@ static void clear_block_pointer(struct ext2_fs *fs, struct ext2_inode *inode,
                 return;
 
             ind[block_index - EXT2_NDIR_BLOCKS] = 0;
-            bcache_ent_release(ent);
-
             ext2_block_write(fs, ent, EXT2_PRIO_INODE);
+            bcache_ent_release(ent);
         }
     } else if (block_index < EXT2_NDIR_BLOCKS + bpi + bpi * bpi) {
         uint32_t dbl_index = block_index - EXT2_NDIR_BLOCKS - bpi;
@@ -54,9 +52,8 @@ static void clear_block_pointer(struct ext2_fs *fs, struct ext2_inode *inode,
                     return;
 
                 ind[ind2] = 0;
-                bcache_ent_release(ent);
-
                 ext2_block_write(fs, ent, EXT2_PRIO_INODE);
+                bcache_ent_release(ent);
             }
             bcache_ent_release(i2);
         }
@@ -88,9 +85,8 @@ static void clear_block_pointer(struct ext2_fs *fs, struct ext2_inode *inode,
                         (uint32_t *) ext2_block_read(fs, dind[ind2], &ent);
 
                     ind[ind3] = 0;
-                    bcache_ent_release(ent);
-
                     ext2_block_write(fs, ent, EXT2_PRIO_INODE);
+                    bcache_ent_release(ent);
                 }
                 bcache_ent_release(i2);
             }
@@ -106,6 +102,7 @@ enum errno ext2_truncate_file(struct ext2_fs *fs, struct ext2_full_inode *inode,
     uint32_t new_block_count = (new_size + fs->block_size - 1) / fs->block_size;
     uint32_t bpi = blocks_per_indirection(fs);
 
+    ext2_map_invalidate(inode);
     for (uint32_t i = new_block_count; i < old_block_count; i++) {
         uint32_t block_num =
             ext2_get_or_set_block(fs, &inode->node, i, 1, false, NULL);
@@ -45,20 +45,18 @@ static uint32_t ext2_get_block(struct ext2_fs *fs, uint32_t block_num,
     uint32_t entry_index = index / divisor;
     uint32_t entry_offset = index % divisor;
     uint32_t bnum = block[entry_index];
-    bcache_ent_release(ent);
+
+    /* keep the pin across the walk down, an unpinned entry can be evicted */
+    bcache_ent_unlock(ent);
 
     uint32_t result;
     result = ext2_get_block(fs, bnum, depth - 1, entry_offset, new_block_num,
                             allocate, was_allocated);
-    bcache_ent_acquire(ent);
+    bcache_ent_lock(ent);
 
     if (result && block[entry_index] == 0 && allocate) {
         block[entry_index] = result;
-        bcache_ent_release(ent);
-
         ext2_block_write(fs, ent, EXT2_PRIO_DIRENT);
-
-        bcache_ent_acquire(ent);
     } else if (allocated_this_level && result == 0) {
         ext2_free_block(fs, block_num);
     }
@@ -399,8 +399,10 @@ enum errno ext2_mount(struct generic_partition *p, struct ext2_fs *fs,
     out_node->fs_type = FS_EXT2;
     out_node->ops = &ext2_vfs_ops;
 
-    bcache_ent_release(fs->gdesc_cache_ent);
-    bcache_ent_release(fs->sbcache_ent);
+    /* these stay pinned for as long as the fs is mounted, fs->sblock and
+     * fs->group_desc point right into them */
+    bcache_ent_unlock(fs->gdesc_cache_ent);
+    bcache_ent_unlock(fs->sbcache_ent);
     bcache_ent_release(root_ent);
     return ERR_OK;
 }
@@ -27,11 +27,10 @@ static bool walk_dir(struct ext2_fs *fs, uint32_t block_num,
         offset += entry->rec_len;
     }
 
-    bcache_ent_release(ent);
-
     if (modified)
         ext2_block_write(fs, ent, EXT2_PRIO_DIRENT);
 
+    bcache_ent_release(ent);
     return modified;
 }
 
@@ -73,10 +72,9 @@ static bool walk_indirect(struct ext2_fs *fs, uint32_t block_num, int level,
             inode->node.blocks += fs->block_size / fs->drive->sector_size;
             inode->node.size += fs->block_size;
 
+            bool written = ext2_block_write(fs, ent, EXT2_PRIO_DIRENT);
             bcache_ent_release(ent);
-            if (!ext2_block_write(fs, ent, EXT2_PRIO_DIRENT))
-                return false;
-            return true;
+            return written;
         }
 
         if (!ptrs[i])
@@ -160,8 +158,8 @@ static void traverse_indirect(struct ext2_fs *fs, struct ext2_inode *inode,
         }
     }
 
-    bcache_ent_release(ent);
     ext2_block_write(fs, ent, EXT2_PRIO_DIRENT);
+    bcache_ent_release(ent);
 }
 
 void ext2_traverse_inode_blocks(struct ext2_fs *fs, struct ext2_inode *inode,
@@ -27,9 +27,11 @@
 #include <mem/slab.h>
 #include <mem/tlb.h>
 #include <mem/vmm.h>
+#include <memops.h>
 #include <registry.h>
 #include <requests.h>
 #include <sch/domain.h>
+#include <sch/idle.h>
 #include <sch/periodic_work.h>
 #include <sch/sched.h>
 #include <smp/core.h>
@@ -72,6 +74,7 @@ __no_sanitize_address void k_main(void) {
     gdt_install();
     syscall_setup(syscall_entry);
     smp_setup_bsp();
+    memops_init(smp_core()->cap.feature_bits, smp_core()->llc.size_kb * 1024);
 
     irq_init();
     uacpi_init(rsdp_request.response->address);
@@ -80,6 +83,7 @@ __no_sanitize_address void k_main(void) {
     hpet_init();
     ioapic_init();
     acpi_find_cst();
+    idle_init();
     bootstage_advance(BOOTSTAGE_EARLY_DEVICES);
 
     srat_init();
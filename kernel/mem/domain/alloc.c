@@ -32,18 +32,14 @@ static void flush_freequeue_into_local_arena(struct domain_buddy *domain,
         if (!domain_free_queue_dequeue(fq, &addr, &page_count))
             break; /* queue drained */
 
-        /* arenas only store single pages */
-        if (page_count > 1) {
+        /* arenas only store the low orders */
+        size_t order = domain_arena_order(page_count);
+        if (order >= DOMAIN_ARENA_ORDERS) {
             free_from_buddy_internal(domain, addr, page_count);
             continue;
         }
 
-        struct buddy_page *bp = buddy_page_for_addr(addr);
-
-        if (!domain_arena_push(local_arena, bp)) {
-            /* arena is full, fall back */
-            free_from_buddy_internal(domain, addr, page_count);
-        }
+        domain_arena_free(domain, local_arena, addr, order);
     }
 }
 
@@ -67,12 +63,13 @@ static paddr_t alloc_from_buddy_internal(struct domain_buddy *this,
 
 static paddr_t try_alloc_from_remote_arenas(struct domain_buddy *owner,
                                             size_t pages, bool remote) {
-    if (pages > 1)
-        return 0x0; /* Arenas only cache single pages */
+    size_t order = domain_arena_order(pages);
+    if (order >= DOMAIN_ARENA_ORDERS)
+        return 0x0; /* Arenas only cache the low orders */
 
     struct domain_arena *try_from;
     domain_for_each_arena(owner, try_from) {
-        struct buddy_page *bp = domain_arena_pop(try_from);
+        struct buddy_page *bp = domain_arena_pop(try_from, order);
         if (bp) {
             struct domain_buddy *local = domain_buddy_on_this_core();
             domain_stat_alloc(local, /*remote*/ remote, /*interleaved*/ false);
@@ -103,14 +100,15 @@ static paddr_t alloc_from_remote_domain(struct domain_buddy *remote,
 
 static paddr_t try_alloc_from_free_queue(struct domain_free_queue *fq,
                                          struct domain_buddy *this,
-                                         struct domain_arena *this_arena) {
+                                         struct domain_arena *this_arena,
+                                         size_t order) {
     if (domain_free_queue_available(fq, this)) {
         size_t quota = domain_freequeue_flush_quota(fq, this);
 
         flush_freequeue_into_local_arena(this, fq, quota);
 
         /* retry after flush */
-        struct buddy_page *bp = domain_arena_pop(this_arena);
+        struct buddy_page *bp = domain_arena_pop(this_arena, order);
         if (bp) {
             domain_stat_alloc(this, /*remote*/ false, /*interleaved*/ false);
             return PFN_TO_PAGE(buddy_page_get_pfn(bp));
@@ -120,26 +118,34 @@ static paddr_t try_alloc_from_free_queue(struct domain_free_queue *fq,
     return 0x0;
 }
 
+/* Local arena, then the freequeue, then a batched refill from our
+ * own buddy, and only then the other arenas on this domain */
 static paddr_t try_alloc_from_arenas(size_t pages) {
-    if (pages > 1) /* Can't do it, arenas only cache single-pages */
+    size_t order = domain_arena_order(pages);
+    if (order >= DOMAIN_ARENA_ORDERS) /* Can't do it, too big for arenas */
         return 0x0;
 
     struct domain_arena *this_arena = domain_arena_on_this_core();
-    struct buddy_page *bp = domain_arena_pop(this_arena);
+    struct domain_buddy *this = domain_buddy_on_this_core();
+    struct buddy_page *bp = domain_arena_pop(this_arena, order);
 
     if (bp) {
-        struct domain_buddy *local = domain_buddy_on_this_core();
-        domain_stat_alloc(local, /*remote*/ false, /*interleaved*/ false);
+        domain_stat_alloc(this, /*remote*/ false, /*interleaved*/ false);
         return PFN_TO_PAGE(buddy_page_get_pfn(bp));
     }
 
-    struct domain_buddy *this = domain_buddy_on_this_core();
     struct domain_free_queue *fq = domain_free_queue_on_this_core();
 
-    paddr_t ret = try_alloc_from_free_queue(fq, this, this_arena);
+    paddr_t ret = try_alloc_from_free_queue(fq, this, this_arena, order);
     if (ret)
         return ret;
 
+    ret = domain_arena_alloc(this, this_arena, order);
+    if (ret) {
+        domain_stat_alloc(this, /*remote*/ false, /*interleaved*/ false);
+        return ret;
+    }
+
     return try_alloc_from_remote_arenas(this, pages, /*remote*/ false);
 }
 
@@ -306,6 +312,8 @@ static paddr_t alloc_with_locality(size_t pages, bool flexible_locality,
 
 paddr_t domain_alloc(size_t pages, enum alloc_flags flags) {
     kassert(pages != 0);
+    pages = domain_round_pages(pages);
+
     /* pin our core and disable preemption */
     enum irql irql = irql_raise(IRQL_DISPATCH_LEVEL);
 
@@ -343,12 +351,39 @@ done:
 
 paddr_t domain_alloc_from_domain(struct domain *cd, size_t pages) {
     paddr_t ret = 0x0;
+    pages = domain_round_pages(pages);
     if ((ret = try_alloc_from_arenas(pages)))
         return ret;
 
     return alloc_from_remote_domain(cd->domain_buddy, pages);
 }
 
+/* Unlike the other paths, this one never falls back to another domain
+ * or to smaller blocks, and it checks the free lists before asking the
+ * buddy so that running out of order-9 blocks is a failure, not a panic */
+paddr_t domain_alloc_hugepage(struct domain *cd) {
+    struct domain_buddy *buddy = cd->domain_buddy;
+    size_t pages = 1ULL << DOMAIN_HUGEPAGE_ORDER;
+    size_t order = DOMAIN_HUGEPAGE_ORDER;
+    paddr_t ret = 0x0;
+
+    enum irql irql = domain_buddy_lock(buddy);
+
+    while (order < MAX_ORDER && buddy->free_area[order].nr_free == 0)
+        order++;
+
+    if (order < MAX_ORDER)
+        ret = buddy_alloc_pages(buddy->free_area, pages);
+
+    if (ret) {
+        atomic_fetch_add(&buddy->pages_used, pages);
+        domain_stat_alloc(buddy, /*remote*/ false, /*interleaved*/ false);
+    }
+
+    domain_buddy_unlock(buddy, irql);
+    return ret;
+}
+
 struct domain *domain_for_addr(paddr_t addr) {
     struct domain_buddy *dbd = domain_buddy_for_addr(addr);
     if (!dbd)
@@ -1,3 +1,4 @@
+#include <kassert.h>
 #include <math/align.h>
 #include <mem/alloc.h>
 #include <mem/buddy.h>
@@ -6,37 +7,230 @@
 #include <string.h>
 
 #include "internal.h"
+#include "mem/buddy/internal.h"
 
-bool domain_arena_push(struct domain_arena *arena, struct buddy_page *page) {
+static inline paddr_t arena_page_to_addr(struct buddy_page *bp) {
+    return PFN_TO_PAGE(buddy_page_get_pfn(bp));
+}
+
+bool domain_arena_push(struct domain_arena *arena, struct buddy_page *page,
+                       size_t order) {
+    kassert(order < DOMAIN_ARENA_ORDERS);
+    struct domain_arena_list *list = &arena->lists[order];
     bool success = false;
     enum irql irql = domain_arena_lock(arena);
 
-    size_t next = (arena->tail + 1) % arena->capacity;
-    if (next != arena->head) {
-        arena->pages[arena->tail] = page;
-        arena->tail = next;
+    if (list->count < list->capacity) {
+        list->pages[list->count++] = page;
         success = true;
     }
 
     if (success)
-        atomic_fetch_add_explicit(&arena->num_pages, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&arena->num_pages, 1ULL << order,
+                                  memory_order_relaxed);
 
     domain_arena_unlock(arena, irql);
     return success;
 }
 
-struct buddy_page *domain_arena_pop(struct domain_arena *arena) {
+struct buddy_page *domain_arena_pop(struct domain_arena *arena, size_t order) {
+    kassert(order < DOMAIN_ARENA_ORDERS);
+    struct domain_arena_list *list = &arena->lists[order];
     struct buddy_page *page = NULL;
     enum irql irql = domain_arena_lock(arena);
 
-    if (arena->head != arena->tail) {
-        page = arena->pages[arena->head];
-        arena->head = (arena->head + 1) % arena->capacity;
-    }
+    if (list->count)
+        page = list->pages[--list->count];
 
     if (page)
-        atomic_fetch_sub_explicit(&arena->num_pages, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&arena->num_pages, 1ULL << order,
+                                  memory_order_relaxed);
 
     domain_arena_unlock(arena, irql);
     return page;
 }
+
+static void domain_arena_tune(struct domain_buddy *domain,
+                              struct domain_arena *arena) {
+    size_t allocs = atomic_load(&domain->stats.alloc_count);
+    size_t failed = atomic_load(&domain->stats.failed_alloc_count);
+    size_t total = atomic_load(&domain->total_pages);
+    size_t used = atomic_load(&domain->pages_used);
+
+    size_t core_allocs = (allocs - arena->last_alloc_count) /
+                         (domain->core_count ? domain->core_count : 1);
+    size_t free_pct = total && used < total ? (total - used) * 100 / total : 0;
+
+    bool pressure = failed != arena->last_failed_count ||
+                    free_pct < DOMAIN_ARENA_LOW_FREE_PCT;
+    bool missing = arena->refills * 100 > core_allocs * DOMAIN_ARENA_MISS_PCT;
+
+    for (size_t i = 0; i < DOMAIN_ARENA_ORDERS; i++) {
+        struct domain_arena_list *list = &arena->lists[i];
+        size_t batch = list->batch;
+        size_t high = list->high;
+
+        if (pressure) {
+            batch /= 2;
+            high /= 2;
+        } else if (missing) {
+            batch *= 2;
+            high *= 2;
+        }
+
+        if (batch > DOMAIN_ARENA_BATCH_MAX)
+            batch = DOMAIN_ARENA_BATCH_MAX;
+
+        if (batch < DOMAIN_ARENA_BATCH_MIN)
+            batch = DOMAIN_ARENA_BATCH_MIN;
+
+        if (high > list->capacity)
+            high = list->capacity;
+
+        if (high < batch)
+            high = batch;
+
+        list->batch = batch;
+        list->high = high;
+    }
+
+    arena->refills = 0;
+    arena->last_alloc_count = allocs;
+    arena->last_failed_count = failed;
+}
+
+/* The buddy lock is never held together with the arena lock, blocks
+ * are collected on the stack first and then moved over */
+static size_t domain_arena_refill(struct domain_buddy *domain,
+                                  struct domain_arena *arena, size_t order) {
+    struct domain_arena_list *list = &arena->lists[order];
+    paddr_t blocks[DOMAIN_ARENA_BATCH_MAX];
+    size_t want = list->batch;
+    size_t got = 0;
+
+    enum irql irql = domain_buddy_lock(domain);
+    for (; got < want; got++) {
+        size_t free = domain->total_pages - domain->pages_used;
+        if (free < (1ULL << order))
+            break;
+
+        blocks[got] = buddy_alloc_pages(domain->free_area, 1ULL << order);
+        if (!blocks[got])
+            break;
+
+        atomic_fetch_add(&domain->pages_used, 1ULL << order);
+    }
+    domain_buddy_unlock(domain, irql);
+
+    size_t pushed = 0;
+    irql = domain_arena_lock(arena);
+    for (; pushed < got && list->count < list->capacity; pushed++)
+        list->pages[list->count++] = buddy_page_for_addr(blocks[pushed]);
+
+    atomic_fetch_add_explicit(&arena->num_pages, pushed << order,
+                              memory_order_relaxed);
+
+    if (++arena->refills >= DOMAIN_ARENA_TUNE_INTERVAL)
+        domain_arena_tune(domain, arena);
+
+    domain_arena_unlock(arena, irql);
+
+    /* Someone else filled the list while we were at the buddy */
+    for (size_t i = pushed; i < got; i++)
+        free_from_buddy_internal(domain, blocks[i], 1ULL << order);
+
+    return pushed;
+}
+
+static void domain_arena_drain(struct domain_buddy *domain,
+                               struct domain_arena *arena, size_t order) {
+    struct domain_arena_list *list = &arena->lists[order];
+    paddr_t blocks[DOMAIN_ARENA_BATCH_MAX];
+    size_t n = 0;
+
+    enum irql irql = domain_arena_lock(arena);
+    while (n < list->batch && list->count > list->high - list->batch)
+        blocks[n++] = arena_page_to_addr(list->pages[--list->count]);
+
+    atomic_fetch_sub_explicit(&arena->num_pages, n << order,
+                              memory_order_relaxed);
+    domain_arena_unlock(arena, irql);
+
+    if (!n)
+        return;
+
+    irql = domain_buddy_lock(domain);
+    for (size_t i = 0; i < n; i++)
+        buddy_free_pages(blocks[i], 1ULL << order, domain->free_area,
+                         domain->total_pages);
+
+    atomic_fetch_sub(&domain->pages_used, n << order);
+    domain_buddy_unlock(domain, irql);
+}
+
+paddr_t domain_arena_alloc(struct domain_buddy *domain,
+                           struct domain_arena *arena, size_t order) {
+    struct buddy_page *bp = domain_arena_pop(arena, order);
+    if (bp)
+        return arena_page_to_addr(bp);
+
+    if (!domain_arena_refill(domain, arena, order))
+        return 0x0;
+
+    bp = domain_arena_pop(arena, order);
+    return bp ? arena_page_to_addr(bp) : 0x0;
+}
+
+void domain_arena_free(struct domain_buddy *domain, struct domain_arena *arena,
+                       paddr_t addr, size_t order) {
+    struct domain_arena_list *list = &arena->lists[order];
+
+    if (!domain_arena_push(arena, buddy_page_for_addr(addr), order)) {
+        free_from_buddy_internal(domain, addr, 1ULL << order);
+        return;
+    }
+
+    /* Racy read, the drain itself re-checks under the lock */
+    if (list->count > list->high)
+        domain_arena_drain(domain, arena, order);
+}
+
+/* How many more blocks could go in before we'd start draining */
+size_t domain_arena_free_slots(struct domain_arena *arena) {
+    size_t slots = 0;
+    for (size_t i = 0; i < DOMAIN_ARENA_ORDERS; i++) {
+        struct domain_arena_list *list = &arena->lists[i];
+        size_t count = list->count;
+        if (count < list->high)
+            slots += list->high - count;
+    }
+
+    return slots;
+}
+
+void domain_arena_init(struct domain_arena *arena, size_t capacity) {
+    for (size_t i = 0; i < DOMAIN_ARENA_ORDERS; i++) {
+        struct domain_arena_list *list = &arena->lists[i];
+
+        size_t cap = capacity >> i;
+        if (cap < DOMAIN_ARENA_BATCH_MIN * 4)
+            cap = DOMAIN_ARENA_BATCH_MIN * 4;
+
+        list->pages = kzalloc_pages(sizeof(struct buddy_page *) * cap);
+        if (!list->pages)
+            panic("Failed to allocate domain arena pages\n");
+
+        list->count = 0;
+        list->capacity = cap;
+        list->batch = DOMAIN_ARENA_BATCH_DEFAULT;
+        if (list->batch > cap / 4)
+            list->batch = cap / 4;
+
+        list->high = list->batch * 4;
+    }
+
+    arena->refills = 0;
+    arena->last_alloc_count = 0;
+    arena->last_failed_count = 0;
+    spinlock_init(&arena->lock);
+}
@@ -3,54 +3,39 @@
 
 #include "internal.h"
 
-static bool try_push_page_onto_arena(struct domain_arena *arena,
-                                     paddr_t address) {
-    struct buddy_page *buddy = buddy_page_for_addr(address);
-    return domain_arena_push(arena, buddy);
-}
-
 static bool try_push_page_onto_domain_arenas(struct domain_buddy *domain,
-                                             paddr_t address) {
+                                             paddr_t address, size_t order) {
     struct domain_arena *arena;
     struct buddy_page *this_page = buddy_page_for_addr(address);
 
     domain_for_each_arena(domain, arena) {
-        if (domain_arena_push(arena, this_page))
+        if (domain_arena_push(arena, this_page, order))
             return true;
     }
 
     return false;
 }
 
-/* First we try and add to our arena cache. If that fails,
- * we try the next one, until an arena cache is able to
- * hold the freed page. If none of these succeed, we give up and just free it */
+/* Low orders go onto our own arena, which drains a batch back into
+ * the buddy once it goes over its high watermark. Anything bigger
+ * goes straight to the buddy */
 static void free_from_local_domain_buddy(struct domain_buddy *local,
                                          paddr_t address, size_t page_count) {
-    if (page_count > 1)
+    size_t order = domain_arena_order(page_count);
+    if (order >= DOMAIN_ARENA_ORDERS)
         return free_from_buddy_internal(local, address, page_count);
 
     struct domain_arena *local_arena = domain_arena_on_this_core();
-
-    /* Try local core first */
-    if (try_push_page_onto_arena(local_arena, address))
-        return;
-
-    /* Try putting the page on other cores */
-    if (try_push_page_onto_domain_arenas(local, address))
-        return;
-
-    /* No success? Let's flush it from the buddy */
-    free_from_buddy_internal(local, address, page_count);
+    domain_arena_free(local, local_arena, address, order);
 }
 
 /* First, we try and enqueue it onto the remote freequeue.
  *
- * If this fails, and we have a multi-page free, then we flush it to
- * their buddy. If this fails, and we have a single-page free, then
- * we first try to push the page onto the remote arenas.
+ * If this fails, and we have a high-order free, then we flush it to
+ * their buddy. If this fails, and we have a low-order free, then
+ * we first try to push the block onto the remote arenas.
  *
- * If that fails, (on single-page frees), then we flush it to their buddy
+ * If that fails, (on low-order frees), then we flush it to their buddy
  */
 static void free_from_remote_domain_buddy(struct domain_buddy *remote,
                                           paddr_t address, size_t page_count) {
@@ -59,10 +44,11 @@ static void free_from_remote_domain_buddy(struct domain_buddy *remote,
     if (domain_free_queue_enqueue(remote_freequeue, address, page_count))
         return;
 
-    if (page_count > 1)
+    size_t order = domain_arena_order(page_count);
+    if (order >= DOMAIN_ARENA_ORDERS)
         return free_from_buddy_internal(remote, address, page_count);
 
-    if (try_push_page_onto_domain_arenas(remote, address))
+    if (try_push_page_onto_domain_arenas(remote, address, order))
         return;
 
     free_from_buddy_internal(remote, address, page_count);
@@ -83,14 +69,16 @@ static struct domain_arena *get_next_domain_arena(struct domain_buddy *domain,
 }
 
 static struct domain_arena *find_non_full_arena(struct domain_buddy *domain,
-                                                size_t *current_arena_idx) {
+                                                size_t *current_arena_idx,
+                                                size_t order) {
     while (true) {
         struct domain_arena *ret =
             get_next_domain_arena(domain, current_arena_idx);
         if (!ret)
             return NULL;
 
-        if (atomic_load(&ret->num_pages) < ret->capacity)
+        struct domain_arena_list *list = &ret->lists[order];
+        if (list->count < list->high)
             return ret;
     }
 }
@@ -102,7 +90,7 @@ static size_t compute_min_elements_to_free(struct domain_buddy *domain,
     struct domain_arena *curr;
 
     domain_for_each_arena(domain, curr) {
-        total_slots_available += curr->capacity - atomic_load(&curr->num_pages);
+        total_slots_available += domain_arena_free_slots(curr);
     }
 
     size_t target = atomic_load(&queue->num_elements) / 2;
@@ -126,22 +114,20 @@ static void flush_free_queue_internal(struct domain_buddy *domain,
         if (addr == 0)
             return;
 
-        if (page_count > 1 || current_arena == NULL) {
+        size_t order = domain_arena_order(page_count);
+        if (order >= DOMAIN_ARENA_ORDERS || current_arena == NULL) {
             free_from_buddy_internal(domain, addr, page_count);
             continue;
         }
 
         struct buddy_page *this = buddy_page_for_addr(addr);
-        if (domain_arena_push(current_arena, this)) /* Pushed it onto arena */
+        if (domain_arena_push(current_arena, this, order)) /* Pushed it */
             continue;
 
         /* Arena was full. Let's move onto the next one */
-        current_arena = find_non_full_arena(domain, &current_arena_idx);
-        if (!current_arena) {
+        current_arena = find_non_full_arena(domain, &current_arena_idx, order);
+        if (!current_arena || !domain_arena_push(current_arena, this, order))
             free_from_buddy_internal(domain, addr, page_count);
-        } else {
-            domain_arena_push(current_arena, this);
-        }
     }
 }
 
@@ -155,12 +141,12 @@ static void flush_free_queue_internal(struct domain_buddy *domain,
  *
  * As we flush the freequeue, we set a target arena to fill.
  *
- * If we are flushing single pages, we try and enqueue onto
+ * If we are flushing low orders, we try and enqueue onto
  * this arena. If the arena is full, then we move onto the
  * next arena. If all arenas are full, then we actually
  * start flushing to the main buddy.
  *
- * For frees of more than one page, we don't bother with
+ * For frees above DOMAIN_ARENA_ORDERS, we don't bother with
  * the arenas, and we just flush to the main buddy.
  */
 void domain_flush_free_queue(struct domain_buddy *domain,
@@ -177,6 +163,7 @@ void domain_flush_free_queue(struct domain_buddy *domain,
 }
 
 void domain_free(paddr_t address, size_t page_count) {
+    page_count = domain_round_pages(page_count);
     enum irql irql = irql_raise(IRQL_DISPATCH_LEVEL);
 
     struct domain_buddy *local = domain_buddy_on_this_core();
@@ -184,7 +184,7 @@ static void domain_buddy_init(struct domain_buddy *dom) {
 }
 
 static void *alloc_up(size_t size) {
-    return kzalloc(PAGE_ALIGN_UP(size));
+    return kzalloc_pages(size);
 }
 
 static void domain_structs_init(struct domain_buddy *dom, size_t arena_capacity,
@@ -211,14 +211,7 @@ static void domain_structs_init(struct domain_buddy *dom, size_t arena_capacity,
             panic("Failed to allocate domain arena\n");
 
         struct domain_arena *this = dom->arenas[i];
-        this->pages = alloc_up(sizeof(struct page *) * arena_capacity);
-        if (!this->pages)
-            panic("Failed to allocate domain arena pages\n");
-
-        this->head = 0;
-        this->tail = 0;
-        this->capacity = arena_capacity;
-        spinlock_init(&this->lock);
+        domain_arena_init(this, arena_capacity);
 
         /* NOTE: Special case because CPU0 will call allocations
          * later on after this is initialized and needs to be
@@ -400,7 +393,9 @@ static void move_buddy(struct domain_buddy *buddy) {
     movealloc(domain, buddy->arenas, VMM_FLAG_NONE);
     for (size_t i = 0; i < buddy->core_count; i++) {
         movealloc(domain, buddy->arenas[i], VMM_FLAG_NONE);
-        movealloc(domain, buddy->arenas[i]->pages, VMM_FLAG_NONE);
+        for (size_t o = 0; o < DOMAIN_ARENA_ORDERS; o++)
+            movealloc(domain, buddy->arenas[i]->lists[o].pages,
+                      VMM_FLAG_NONE);
     }
 }
 
@@ -20,14 +20,46 @@
 #define MAX_ARENA_PAGES 4096      /* absolute cap per-core arena */
 #define MAX_FREEQUEUE_PAGES 16384 /* absolute cap per-domain freequeue */
 
+/* Per-core arenas cache orders 0 through DOMAIN_ARENA_ORDERS - 1 */
+#define DOMAIN_ARENA_ORDERS 4
+#define DOMAIN_ARENA_BATCH_MIN 4
+#define DOMAIN_ARENA_BATCH_DEFAULT 16
+#define DOMAIN_ARENA_BATCH_MAX 64
+
+/* Every DOMAIN_ARENA_TUNE_INTERVAL refills, an arena looks at the domain
+ * stats. Failed allocations or less than DOMAIN_ARENA_LOW_FREE_PCT free
+ * pages means it halves its watermarks and gives pages back. Otherwise,
+ * if more than DOMAIN_ARENA_MISS_PCT of this core's share of allocations
+ * had to refill, the watermarks grow */
+#define DOMAIN_ARENA_TUNE_INTERVAL 32
+#define DOMAIN_ARENA_LOW_FREE_PCT 5
+#define DOMAIN_ARENA_MISS_PCT 25
+
+#define DOMAIN_HUGEPAGE_ORDER 9 /* 2 MiB */
+
 struct page;
 struct buddy_page;
-struct domain_arena {
+
+/* A stack of free blocks of one order. Misses pull `batch` blocks out of
+ * the buddy under one lock hold, and once a free takes `count` over `high`,
+ * `batch` blocks go back the same way */
+struct domain_arena_list {
     struct buddy_page **pages;
-    size_t head;
-    size_t tail;
+    size_t count;
     size_t capacity;
-    atomic_size_t num_pages;
+    size_t high;
+    size_t batch;
+};
+
+struct domain_arena {
+    struct domain_arena_list lists[DOMAIN_ARENA_ORDERS];
+    atomic_size_t num_pages; /* In pages, summed over every order */
+
+    /* Tuning inputs, reset on every tune */
+    size_t refills;
+    size_t last_alloc_count;
+    size_t last_failed_count;
+
     struct spinlock lock;
 };
 
@@ -112,8 +144,15 @@ bool domain_free_queue_enqueue(struct domain_free_queue *fq, paddr_t addr,
                                size_t pages);
 bool domain_free_queue_dequeue(struct domain_free_queue *fq, paddr_t *addr_out,
                                size_t *pages_out);
-bool domain_arena_push(struct domain_arena *arena, struct buddy_page *page);
-struct buddy_page *domain_arena_pop(struct domain_arena *arena);
+bool domain_arena_push(struct domain_arena *arena, struct buddy_page *page,
+                       size_t order);
+struct buddy_page *domain_arena_pop(struct domain_arena *arena, size_t order);
+paddr_t domain_arena_alloc(struct domain_buddy *domain,
+                           struct domain_arena *arena, size_t order);
+void domain_arena_free(struct domain_buddy *domain, struct domain_arena *arena,
+                       paddr_t addr, size_t order);
+size_t domain_arena_free_slots(struct domain_arena *arena);
+void domain_arena_init(struct domain_arena *arena, size_t capacity);
 
 void domain_flush_free_queue(struct domain_buddy *domain,
                              struct domain_free_queue *queue);
@@ -144,6 +183,23 @@ static inline struct domain_buddy *domain_buddy_on_this_core(void) {
     return smp_core()->domain->domain_buddy;
 }
 
+/* Returns DOMAIN_ARENA_ORDERS if the arenas can't hold `pages` */
+static inline size_t domain_arena_order(size_t pages) {
+    size_t order = 0;
+    while ((1ULL << order) < pages && order < DOMAIN_ARENA_ORDERS)
+        order++;
+
+    return order;
+}
+
+/* The buddy hands out and takes back whole blocks anyways, so small
+ * requests are rounded up to keep `pages_used` the same no matter
+ * whether a block went through an arena or not */
+static inline size_t domain_round_pages(size_t pages) {
+    size_t order = domain_arena_order(pages);
+    return order < DOMAIN_ARENA_ORDERS ? 1ULL << order : pages;
+}
+
 static inline struct domain_arena *domain_arena_on_this_core(void) {
     return smp_core()->domain_arena;
 }
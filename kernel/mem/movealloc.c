@@ -37,7 +37,7 @@ static vaddr_t phys_get_virt(paddr_t phys) {
 }
 
 static void change_slab_backing_page(void *ptr) {
-    if (slab_size_to_index(ksize(ptr)) != -1)
+    if (!slab_addr_is_page_alloc(ptr))
         panic("Moved allocations cannot come from slab\n");
 }
 
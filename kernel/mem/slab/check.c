@@ -37,6 +37,8 @@ bool slab_check_bitmap(struct slab *slab) {
 bool slab_check_meta(struct slab *slab) {
     slab_check_assert_return_false(slab->mem);
     slab_check_assert_return_false(slab->parent_cache->pages_per_slab > 0);
+    slab_check_assert_return_false(slab->pages ==
+                                   slab->parent_cache->pages_per_slab);
     return true;
 }
 
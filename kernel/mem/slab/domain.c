@@ -161,6 +161,7 @@ void slab_domain_init(void) {
         domain->slab_domain = sdomain;
 
         slab_gc_init(sdomain);
+        slab_hugechunks_init(sdomain);
         slab_free_queue_init(sdomain, &sdomain->free_queue,
                              SLAB_FREE_QUEUE_CAPACITY);
         slab_domain_percpu_init(sdomain);
@@ -173,6 +174,7 @@ void slab_domain_init(void) {
 
     slab_domain_move_slabs();
     slab_switch_to_domain_allocations();
+    kmem_caches_init();
 }
 
 void slab_domain_init_late() {
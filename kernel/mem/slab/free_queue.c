@@ -109,7 +109,7 @@ static inline bool page_is_pageable(struct page *page) {
 }
 
 void slab_free_queue_free(struct slab_domain *d, void *ptr) {
-    int32_t class = slab_size_to_index(slab_allocation_size((vaddr_t) ptr));
+    int32_t class = slab_class_for_addr(ptr);
     bool fits_in_slab = class >= 0;
 
     if (fits_in_slab)
@@ -152,7 +152,7 @@ size_t slab_free_queue_drain(struct slab_percpu_cache *cache,
             break;
 
         /* What class? */
-        int32_t class = slab_size_to_index(slab_allocation_size(addr));
+        int32_t class = slab_class_for_addr((void *) addr);
         if (class < 0)
             goto flush;
 
@@ -162,8 +162,7 @@ size_t slab_free_queue_drain(struct slab_percpu_cache *cache,
             goto flush;
 
         /* Push it onto the magazine */
-        struct slab_magazine *mag = &cache->mag[class];
-        if (!slab_magazine_push(mag, addr))
+        if (!slab_percpu_free(cache->domain, class, addr))
             goto flush;
 
         /* Success - pushed onto magazine */
@@ -160,6 +160,9 @@ void slab_gc_recycle(struct slab_domain *domain, struct slab *slab,
     int64_t best_score = INT64_MIN;
 
     for (size_t i = 0; i < slab_num_sizes; i++) {
+        if (caches->caches[i].pages_per_slab != slab->pages)
+            continue;
+
         int64_t score = score_order(total_free, bias_bitmap, i, free_per_order,
                                     slabs_recycled, original_order);
 
@@ -326,14 +329,14 @@ void slab_gc_dequeue(struct slab_domain *domain, struct slab *slab) {
 
 static struct slab *gc_do_op(struct slab_domain *domain,
                              struct rbt_node *(*op)(const struct rbt *tree,
-                                                    enum slab_type),
-                             enum slab_type t) {
+                                                    enum slab_type, size_t),
+                             enum slab_type t, size_t pages) {
     struct slab *ret = NULL;
 
     struct slab_gc *gc = &domain->slab_gc;
     enum irql irql = slab_gc_lock(gc);
 
-    struct rbt_node *rb = op(&gc->rbt, t);
+    struct rbt_node *rb = op(&gc->rbt, t, pages);
     if (!rb)
         goto out;
 
@@ -346,12 +349,13 @@ out:
     return ret;
 }
 
+/* Multi-page slabs can only ever be reused by caches of the same size */
 static struct rbt_node *gc_search_for_first(const struct rbt *rbt,
-                                            enum slab_type type) {
+                                            enum slab_type type, size_t pages) {
     struct rbt_node *iter = rbt_first(rbt);
     while (iter) {
         struct slab *slab = slab_from_rbt_node(iter);
-        if (slab->type == type)
+        if (slab->type == type && slab->pages == pages)
             break;
 
         iter = rbt_next(iter);
@@ -360,18 +364,18 @@ static struct rbt_node *gc_search_for_first(const struct rbt *rbt,
 }
 
 static struct rbt_node *rbt_first_wrapper(const struct rbt *rbt,
-                                          enum slab_type type) {
-    (void) type;
+                                          enum slab_type type, size_t pages) {
+    (void) type, (void) pages;
     return rbt_first(rbt);
 }
 
 struct slab *slab_gc_get_newest(struct slab_domain *domain,
-                                enum slab_type type) {
-    return gc_do_op(domain, gc_search_for_first, type);
+                                enum slab_type type, size_t pages) {
+    return gc_do_op(domain, gc_search_for_first, type, pages);
 }
 
 struct slab *slab_gc_get_oldest(struct slab_domain *domain) {
-    return gc_do_op(domain, rbt_first_wrapper, SLAB_TYPE_NONE);
+    return gc_do_op(domain, rbt_first_wrapper, SLAB_TYPE_NONE, 0);
 }
 
 size_t slab_gc_num_slabs(struct slab_domain *domain) {
@@ -0,0 +1,151 @@
+/* 2MiB chunks for multi-page slabs.
+ *
+ * A chunk is one order-9 block from the domain buddy, mapped with a single
+ * PDE. Its first page is the `struct slab_hugechunk`, and the rest is cut
+ * into slabs of one size, so every slab in a chunk belongs to caches with
+ * the same `pages_per_slab`. Chunks go back to the buddy once their last
+ * slab is destroyed. */
+
+#include <mem/domain.h>
+#include <mem/pmm.h>
+#include <mem/vaddr_alloc.h>
+#include <mem/vmm.h>
+#include <string.h>
+
+#include "internal.h"
+
+struct vas_space *slab_huge_vas = NULL;
+
+void slab_hugechunks_init(struct slab_domain *dom) {
+    struct slab_hugechunks *hc = &dom->hugechunks;
+    INIT_LIST_HEAD(&hc->partial);
+    spinlock_init(&hc->lock);
+    hc->count = 0;
+}
+
+static struct slab_hugechunk *slab_hugechunk_create(struct slab_domain *dom,
+                                                    size_t pages) {
+    paddr_t phys = domain_alloc_hugepage(dom->domain);
+    if (!phys)
+        return NULL;
+
+    vaddr_t virt = vas_alloc(slab_huge_vas, PAGE_2MB, PAGE_2MB);
+    if (!virt)
+        goto err;
+
+    if (vmm_map_2mb_page(virt, phys, PAGE_PRESENT | PAGE_WRITE,
+                         VMM_FLAG_NONE) < 0) {
+        vas_free(slab_huge_vas, virt, PAGE_2MB);
+        goto err;
+    }
+
+    struct slab_hugechunk *chunk = (struct slab_hugechunk *) virt;
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->magic = SLAB_HUGE_CHUNK_MAGIC;
+    chunk->pages_per_slab = pages;
+    chunk->slabs = (SLAB_HUGE_CHUNK_PAGES - 1) / pages;
+    chunk->phys = phys;
+    chunk->domain = dom;
+    INIT_LIST_HEAD(&chunk->list);
+
+    /* bits past `slabs` are marked taken so they never get handed out */
+    for (size_t i = chunk->slabs; i < sizeof(chunk->bitmap) * 8; i++)
+        chunk->bitmap[i / 64] |= 1ULL << (i % 64);
+
+    atomic_fetch_add(&dom->hugechunks.count, 1);
+    return chunk;
+
+err:
+    pmm_free_pages(phys, SLAB_HUGE_CHUNK_PAGES);
+    return NULL;
+}
+
+static void slab_hugechunk_destroy(struct slab_hugechunk *chunk) {
+    vaddr_t virt = (vaddr_t) chunk;
+    paddr_t phys = chunk->phys;
+
+    atomic_fetch_sub(&chunk->domain->hugechunks.count, 1);
+    chunk->magic = 0;
+
+    vmm_unmap_2mb_page(virt, VMM_FLAG_NONE);
+    pmm_free_pages(phys, SLAB_HUGE_CHUNK_PAGES);
+    vas_free(slab_huge_vas, virt, PAGE_2MB);
+}
+
+static size_t slab_hugechunk_take(struct slab_hugechunk *chunk) {
+    size_t words = sizeof(chunk->bitmap) / sizeof(chunk->bitmap[0]);
+    for (size_t w = 0; w < words; w++) {
+        if (chunk->bitmap[w] == UINT64_MAX)
+            continue;
+
+        size_t idx = w * 64 + __builtin_ctzll(~chunk->bitmap[w]);
+        kassert(idx < chunk->slabs);
+
+        chunk->bitmap[w] |= 1ULL << (idx % 64);
+        chunk->used++;
+        return idx;
+    }
+
+    panic("Slab hugechunk %p has no free slabs\n", chunk);
+}
+
+void *slab_hugechunk_alloc(struct slab_domain *dom, size_t pages,
+                           paddr_t *phys_out) {
+    struct slab_hugechunks *hc = &dom->hugechunks;
+    struct slab_hugechunk *chunk = NULL, *iter;
+
+    enum irql irql = slab_hugechunks_lock(hc);
+    list_for_each_entry(iter, &hc->partial, list) {
+        if (iter->pages_per_slab == pages) {
+            chunk = iter;
+            break;
+        }
+    }
+
+    if (!chunk) {
+        slab_hugechunks_unlock(hc, irql);
+        chunk = slab_hugechunk_create(dom, pages);
+        if (!chunk)
+            return NULL;
+
+        irql = slab_hugechunks_lock(hc);
+        list_add(&chunk->list, &hc->partial);
+    }
+
+    size_t idx = slab_hugechunk_take(chunk);
+    if (chunk->used == chunk->slabs)
+        list_del_init(&chunk->list);
+
+    slab_hugechunks_unlock(hc, irql);
+
+    vaddr_t virt = slab_hugechunk_slab_addr(chunk, idx);
+    *phys_out = chunk->phys + (virt - (vaddr_t) chunk);
+    return (void *) virt;
+}
+
+void slab_hugechunk_free(vaddr_t virt) {
+    struct slab_hugechunk *chunk = slab_hugechunk_for_addr((void *) virt);
+    kassert(chunk->magic == SLAB_HUGE_CHUNK_MAGIC);
+
+    struct slab_hugechunks *hc = &chunk->domain->hugechunks;
+    size_t idx = (virt - slab_hugechunk_slab_addr(chunk, 0)) /
+                 (chunk->pages_per_slab * PAGE_SIZE);
+
+    enum irql irql = slab_hugechunks_lock(hc);
+    kassert(chunk->bitmap[idx / 64] & (1ULL << (idx % 64)));
+
+    bool was_full = chunk->used == chunk->slabs;
+    chunk->bitmap[idx / 64] &= ~(1ULL << (idx % 64));
+    chunk->used--;
+
+    if (chunk->used == 0) {
+        list_del_init(&chunk->list);
+        slab_hugechunks_unlock(hc, irql);
+        return slab_hugechunk_destroy(chunk);
+    }
+
+    if (was_full)
+        list_add(&chunk->list, &hc->partial);
+
+    slab_hugechunks_unlock(hc, irql);
+}
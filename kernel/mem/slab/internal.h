@@ -2,6 +2,7 @@
 #include <containerof.h>
 #include <kassert.h>
 #include <math/align.h>
+#include <math/div.h>
 #include <mem/alloc.h>
 #include <mem/page.h>
 #include <mem/simple_alloc.h>
@@ -29,26 +30,68 @@ LOG_HANDLE_EXTERN(slab);
 
 /* Lock ordering:
  *
- * Slab GC -> Slab cache -> Freequeue -> Slab -> Mag
+ * Slab GC -> Slab cache -> Freequeue -> Slab -> Depot
  *
+ * Hugechunk locks are leaves, nothing else is taken under them
+ *
+ * Per-CPU magazines have no lock, they are only ever
+ * touched by their own CPU at IRQL_DISPATCH_LEVEL
  */
 
 #define KMALLOC_PAGE_MAGIC 0xC0FFEE42
 #define SLAB_ALLOC_BEHAVIOR_FROM_ALLOC (1 << ALLOC_BEHAVIOR_AVAILABLE_SHIFT)
-#define SLAB_ELCM_DEFAULT_MAX_PAGES 64
+#define SLAB_ELCM_DEFAULT_MAX_PAGES 32
 
 #define SLAB_HEAP_START 0xFFFFF00000000000ULL
 #define SLAB_HEAP_END 0xFFFFF10000000000ULL
 
+/* Multi-page slabs get the upper half of the slab heap. Each one sits at
+ * the bottom of its own SLAB_LARGE_SLOT_SIZE aligned slot, so the slab for
+ * any pointer in there is found by aligning down to the slot, and the
+ * unmapped rest of the slot acts as the guard region */
+#define SLAB_LARGE_HEAP_START 0xFFFFF08000000000ULL
+#define SLAB_LARGE_SLOT_PAGES (SLAB_ELCM_DEFAULT_MAX_PAGES * 2)
+#define SLAB_LARGE_SLOT_SIZE (SLAB_LARGE_SLOT_PAGES * PAGE_SIZE)
+
+/* The top quarter of the slab heap holds multi-page slabs packed into
+ * chunks that are mapped with a single 2MiB page. The first page of every
+ * chunk is a `struct slab_hugechunk`, and the slabs follow back to back.
+ * When the domain has no order-9 block left, slabs go in the slot window
+ * above with 4KiB pages instead */
+#define SLAB_HUGE_HEAP_START 0xFFFFF0C000000000ULL
+#define SLAB_HUGE_CHUNK_PAGES (PAGE_2MB / PAGE_SIZE)
+#define SLAB_HUGE_CHUNK_MAGIC 0x48554745
+#define SLAB_HUGE_CHUNK_MAX_SLABS ((SLAB_HUGE_CHUNK_PAGES - 1) / 2)
+#define SLAB_ELCM_MAX_WASTAGE_PCT 12
+
 #define SLAB_BITMAP_TEST(__bitmap, __idx) (__bitmap & __idx)
 
-#define SLAB_MAG_ENTRIES 32
+/* Magazines start out at SLAB_MAG_DEFAULT_ENTRIES and get resized per class
+ * by the depot. The storage is always SLAB_MAG_MAX_ENTRIES so that resizing
+ * is just a matter of moving `capacity` - see `slab_depot_tune` */
+#define SLAB_MAG_DEFAULT_ENTRIES 32
+#define SLAB_MAG_MIN_ENTRIES 8
+#define SLAB_MAG_MAX_ENTRIES 124 /* struct slab_magazine is exactly 1 KiB */
+#define SLAB_MAG_RESIZE_STEP 8
 #define SLAB_MAG_WATERMARK_PCT                                                 \
     15 /* Leave 15% of magazine entries for nonpageable requests */
-#define SLAB_MAG_WATERMARK (SLAB_MAG_ENTRIES * SLAB_MAG_WATERMARK_PCT / 100)
+#define SLAB_MAG_WATERMARK(mag) ((mag)->capacity * SLAB_MAG_WATERMARK_PCT / 100)
+
+/* Depot tuning. Every SLAB_DEPOT_TUNE_INTERVAL exchanges, the depot looks at
+ * how often its lock was contended and how often CPUs had to go all the way
+ * down to the slab layer to refill, and grows the magazines if either is
+ * high. If neither happened and full magazines are piling up, it shrinks */
+#define SLAB_DEPOT_TUNE_INTERVAL 64
+#define SLAB_DEPOT_CONTENTION_PCT 5
+#define SLAB_DEPOT_REFILL_PCT 25
+#define SLAB_DEPOT_SURPLUS_PER_CORE 2 /* full mags per core before shrinking */
+
+/* Large classes get fewer entries, otherwise a single CPU could
+ * sit on a couple of megabytes worth of 32 KiB objects */
+#define SLAB_MAG_BYTES_MAX (256 * 1024)
 
 #define SLAB_MIN_SIZE (sizeof(vaddr_t))
-#define SLAB_MAX_SIZE (PAGE_SIZE / 4)
+#define SLAB_MAX_SIZE (PAGE_SIZE * 8)
 
 /* Bitmap */
 #define SLAB_BITMAP_BYTES_FOR(x) ((x + 7ull) / 8ull)
@@ -58,7 +101,8 @@ LOG_HANDLE_EXTERN(slab);
 #define SLAB_ALIGN_UP(x, a) ALIGN_UP(x, a)
 
 static const size_t slab_class_sizes_const[] = {
-    SLAB_MIN_SIZE, 16, 32, 64, 96, 128, 192, 256, 512, SLAB_MAX_SIZE};
+    SLAB_MIN_SIZE, 16, 32, 64, 96, 128, 192, 256, 512, 1024, 2048, 4096, 8192,
+    16384, SLAB_MAX_SIZE};
 
 #define SLAB_CLASS_CONST_COUNT                                                 \
     (sizeof(slab_class_sizes_const) / sizeof(*slab_class_sizes_const))
@@ -152,11 +196,9 @@ enum slab_type {
 };
 
 struct slab {
-    struct slab *self; /* We need this field because multi-page slabs
-                        * will keep a pointer to the parent slab at
-                        * the start of each page, and if we add this
-                        * to the actual slab itself, we can branchlessly
-                        * retrieve the slab for any given pointer.
+    struct slab *self; /* We need this field so that `slab_for_ptr` can
+                        * just load whatever is at the start of the page
+                        * (or multi-page slot) that a pointer lives in.
                         *
                         * MUST be first element in structure  */
 
@@ -170,7 +212,7 @@ struct slab {
     enum slab_state state;
     struct spinlock lock;
 
-    struct page *backing_page; /* TODO: array */
+    struct page *backing_page; /* First page, the rest are contiguous */
     size_t pages;
 
     /* Sorted by gc_enqueue_time_ms */
@@ -186,25 +228,68 @@ SPINLOCK_GENERATE_LOCK_UNLOCK_FOR_STRUCT(slab, lock);
 
 #define slab_from_rbt_node(n) (container_of(n, struct slab, rb))
 #define slab_from_list_node(ln) (container_of(ln, struct slab, list))
-#define PAGE_NON_SLAB_SPACE (PAGE_SIZE - sizeof(struct slab))
+#define SLAB_NON_META_SPACE(pages) ((pages) * PAGE_SIZE - sizeof(struct slab))
 
 _Static_assert(offsetof(struct slab, self) == 0,
                "self pointer not at start of struct");
 
 /* Just a simple stack */
 struct slab_magazine {
-    vaddr_t objs[SLAB_MAG_ENTRIES];
+    struct list_head list; /* On the depot's full or empty list */
     size_t count;
-    struct spinlock lock;
+    size_t capacity; /* Never above SLAB_MAG_MAX_ENTRIES */
+    vaddr_t objs[SLAB_MAG_MAX_ENTRIES];
+};
+
+_Static_assert(sizeof(struct slab_magazine) <= PAGE_SIZE / 4,
+               "magazines must fit in a single-page slab class");
+
+/* The magazine of one kmem_cache on one CPU, along with its counters, so
+ * that the alloc/free fast path never writes to a shared line */
+struct kmem_cache_cpu {
+    struct slab_magazine mag;
+    size_t allocs;
+    size_t frees;
+    size_t magazine_hits;
+    size_t depot_hits;
+} __cache_aligned;
+
+#define slab_magazine_from_list_node(ln)                                       \
+    (container_of(ln, struct slab_magazine, list))
+
+/* Allocations come out of `loaded`. When it runs dry and `previous` is full,
+ * the two swap, so a CPU that ping-pongs around a magazine boundary never
+ * has to go to the depot. Only when both are unusable do we go to the depot */
+struct slab_magazine_pair {
+    struct slab_magazine *loaded;
+    struct slab_magazine *previous;
 };
-SPINLOCK_GENERATE_LOCK_UNLOCK_FOR_STRUCT(slab_magazine, lock);
 
 struct slab_percpu_cache {
     /* Magazines are always nonpageable */
-    struct slab_magazine *mag; /* the size of this is slab_num_sizes */
+    struct slab_magazine_pair *mag; /* the size of this is slab_num_sizes */
     struct slab_domain *domain;
 };
 
+/* Per-domain, per-class pool of full and empty magazines */
+struct slab_depot {
+    struct list_head full;
+    struct list_head empty;
+    size_t full_count;
+    size_t empty_count;
+
+    size_t mag_size; /* capacity given to empties on their way out */
+    size_t mag_max;  /* see SLAB_MAG_BYTES_MAX */
+
+    /* Tuning inputs, reset on every tune */
+    size_t exchanges;
+    size_t contended;
+    atomic_size_t refills;
+
+    struct spinlock lock;
+};
+SPINLOCK_GENERATE_LOCK_UNLOCK_FOR_STRUCT(slab_depot, lock);
+
 struct slab_free_slot {
     _Atomic uint64_t seq;
     vaddr_t addr;
@@ -390,6 +475,21 @@ struct slab_domain_bucket {
     atomic_size_t free_to_remote_domain; /* Freed to other domain's freelist */
     atomic_size_t free_to_percpu;
 
+    /* ---- Depot stats ---- */
+    atomic_size_t alloc_depot_hits; /* Swapped in a full magazine */
+    atomic_size_t free_to_depot;    /* Swapped out a full magazine */
+    atomic_size_t depot_contention; /* Depot lock was already held */
+    atomic_size_t magazine_resizes; /* Depot changed its magazine size */
+
+    /* ---- Object cache stats ---- */
+    atomic_size_t objcache_alloc_calls;     /* calls to `kmem_cache_alloc` */
+    atomic_size_t objcache_magazine_hits;   /* Served by a cache magazine */
+    atomic_size_t objcache_depot_hits;      /* Served by the domain depot */
+    atomic_size_t objcache_constructs;      /* Had to construct a new object */
+    atomic_size_t objcache_free_calls;      /* calls to `kmem_cache_free` */
+    atomic_size_t objcache_free_to_depot;   /* Magazine full, went to depot */
+    atomic_size_t objcache_destructs;       /* Destructed and sent to kfree */
+
     /* Other */
     atomic_size_t freequeue_enqueues;
     atomic_size_t freequeue_dequeues;
@@ -397,6 +497,25 @@ struct slab_domain_bucket {
     atomic_size_t gc_objects_reclaimed; /* Objects GC returned to free state */
 };
 
+struct slab_hugechunk {
+    uint32_t magic;
+    uint32_t pages_per_slab;
+    size_t slabs;
+    size_t used;
+    paddr_t phys;
+    struct slab_domain *domain;
+    struct list_head list; /* On the domain's list while not full */
+    uint64_t bitmap[DIV_ROUND_UP(SLAB_HUGE_CHUNK_MAX_SLABS, 64)];
+};
+_Static_assert(sizeof(struct slab_hugechunk) <= PAGE_SIZE, "");
+
+struct slab_hugechunks {
+    struct list_head partial;
+    struct spinlock lock;
+    atomic_size_t count;
+};
+SPINLOCK_GENERATE_LOCK_UNLOCK_FOR_STRUCT(slab_hugechunks, lock);
+
 struct slab_domain {
     /* Actual domain that this corresponds to */
     struct domain *domain;
@@ -414,6 +533,9 @@ struct slab_domain {
     /* # CPUs determined by the domain struct */
     struct slab_percpu_cache **percpu_caches;
 
+    /* Full/empty magazines shared by the per CPU caches, one per class */
+    struct slab_depot *depots;
+
     /* Freequeue for remote frees */
     struct slab_free_queue free_queue;
 
@@ -421,6 +543,9 @@ struct slab_domain {
      * garbage collected safely/kept here */
     struct slab_gc slab_gc;
 
+    /* 2MiB chunks that multi-page slabs are carved out of */
+    struct slab_hugechunks hugechunks;
+
     struct daemon *daemon;
 
     struct workqueue *workqueue;
@@ -470,9 +595,11 @@ void *slab_alloc(struct slab_cache *cache, enum alloc_behavior behavior);
 
 /* Magazine + percpu */
 bool slab_magazine_push(struct slab_magazine *mag, vaddr_t obj);
-bool slab_magazine_push_internal(struct slab_magazine *mag, vaddr_t obj);
 vaddr_t slab_magazine_pop(struct slab_magazine *mag);
-void slab_percpu_free(struct slab_domain *dom, size_t class_idx, vaddr_t obj);
+vaddr_t slab_percpu_alloc(size_t class_idx, enum alloc_flags flags);
+bool slab_percpu_free(struct slab_domain *owner, size_t class_idx,
+                      vaddr_t obj);
+size_t slab_depot_trim(struct slab_domain *dom);
 void slab_free_addr_to_cache(void *addr);
 void slab_domain_percpu_init(struct slab_domain *domain);
 void slab_percpu_refill(struct slab_domain *dom,
@@ -502,10 +629,15 @@ bool slab_check(struct slab *slab);
 size_t slab_gc_run(struct slab_gc *gc, enum slab_gc_flags flags);
 struct slab *slab_reset(struct slab *slab);
 void slab_gc_init(struct slab_domain *dom);
+
+void slab_hugechunks_init(struct slab_domain *dom);
+void *slab_hugechunk_alloc(struct slab_domain *dom, size_t pages,
+                           paddr_t *phys_out);
+void slab_hugechunk_free(vaddr_t virt);
 void slab_gc_enqueue(struct slab_domain *domain, struct slab *slab);
 void slab_gc_dequeue(struct slab_domain *domain, struct slab *slab);
 struct slab *slab_gc_get_newest(struct slab_domain *domain,
-                                enum slab_type type);
+                                enum slab_type type, size_t pages);
 struct slab *slab_gc_get_oldest(struct slab_domain *domain);
 size_t slab_gc_num_slabs(struct slab_domain *domain);
 bool slab_should_enqueue_gc(struct slab *slab);
@@ -516,6 +648,8 @@ void slab_switch_to_domain_allocations(void);
 struct slab_elcm_candidate slab_elcm(size_t object_size, struct slab_elcm_params sep);
 
 extern struct vas_space *slab_vas;
+extern struct vas_space *slab_large_vas;
+extern struct vas_space *slab_huge_vas;
 extern struct slab_caches slab_caches;
 extern struct slab_size_constant *slab_class_sizes;
 extern size_t slab_num_sizes;
@@ -550,6 +684,44 @@ static inline struct slab_page_hdr *slab_page_hdr_for_addr(void *ptr) {
     return (struct slab_page_hdr *) PAGE_ALIGN_DOWN(ptr);
 }
 
+static inline bool slab_addr_is_huge(void *ptr) {
+    vaddr_t v = (vaddr_t) ptr;
+    return v >= SLAB_HUGE_HEAP_START && v < SLAB_HEAP_END;
+}
+
+static inline struct slab_hugechunk *slab_hugechunk_for_addr(void *ptr) {
+    return (struct slab_hugechunk *) ALIGN_DOWN((vaddr_t) ptr, PAGE_2MB);
+}
+
+static inline vaddr_t slab_hugechunk_slab_addr(struct slab_hugechunk *chunk,
+                                               size_t idx) {
+    size_t slab_bytes = chunk->pages_per_slab * PAGE_SIZE;
+    return (vaddr_t) chunk + PAGE_SIZE + idx * slab_bytes;
+}
+
+static inline bool slab_addr_is_multipage(void *ptr) {
+    vaddr_t v = (vaddr_t) ptr;
+    return v >= SLAB_LARGE_HEAP_START && v < SLAB_HEAP_END;
+}
+
+/* Page allocations never come out of the multi-page window, and in there
+ * the start of a page may well be in the middle of some object */
+static inline bool slab_addr_is_page_alloc(void *ptr) {
+    if (slab_addr_is_multipage(ptr))
+        return false;
+
+    return slab_page_hdr_for_addr(ptr)->magic == KMALLOC_PAGE_MAGIC;
+}
+
+/* Going by `ksize` alone is not enough, single-page allocations from
+ * `kzalloc_pages` are small enough to look like one of the big classes */
+static inline int32_t slab_class_for_addr(void *ptr) {
+    if (slab_addr_is_page_alloc(ptr))
+        return -1;
+
+    return slab_size_to_index(ksize(ptr));
+}
+
 static inline size_t slab_object_count(struct slab *slab) {
     return slab->parent_cache->objs_per_slab;
 }
@@ -560,9 +732,20 @@ static inline size_t slab_object_size(struct slab *slab) {
 
 /* The parent slab object has a pointer
  * to itself at the start of the structure,
- * and following pages all contain a backpointer
- * to the slab at the start of every page */
+ * and multi-page slabs sit at the start of
+ * their slot, so aligning down finds them */
 static inline struct slab *slab_for_ptr(void *ptr) {
+    if (slab_addr_is_huge(ptr)) {
+        struct slab_hugechunk *chunk = slab_hugechunk_for_addr(ptr);
+        size_t off = (vaddr_t) ptr - (vaddr_t) chunk - PAGE_SIZE;
+        size_t idx = off / (chunk->pages_per_slab * PAGE_SIZE);
+        return *(struct slab **) slab_hugechunk_slab_addr(chunk, idx);
+    }
+
+    if (slab_addr_is_multipage(ptr))
+        return *(struct slab **) ALIGN_DOWN((vaddr_t) ptr,
+                                            SLAB_LARGE_SLOT_SIZE);
+
     return *(struct slab **) PAGE_ALIGN_DOWN(ptr);
 }
 
@@ -570,6 +753,18 @@ static inline struct slab_domain *slab_domain_local(void) {
     return smp_core()->domain->slab_domain;
 }
 
+/* Magazines are only safe to touch while we can't be preempted or migrated.
+ * Before BOOTSTAGE_LATE, `irql_raise` is a no-op that can't promise that,
+ * so this fails and callers skip the magazines altogether */
+static inline bool slab_percpu_enter(enum irql *out) {
+    *out = irql_raise(IRQL_DISPATCH_LEVEL);
+    return *out != IRQL_NONE;
+}
+
+static inline void slab_percpu_exit(enum irql irql) {
+    irql_lower(irql);
+}
+
 static inline struct slab_percpu_cache *slab_percpu_cache_local(void) {
     return slab_domain_local()->percpu_caches[smp_core()->domain_cpu_id];
 }
@@ -639,9 +834,6 @@ static inline size_t
 slab_cache_wasted_space_per_slab(struct slab_cache *cache) {
     size_t raw = PAGE_SIZE * cache->pages_per_slab;
     size_t metadata = cache->slab_metadata_size;
-
-    /* Backpointers on non-base pages: */
-    metadata += (cache->pages_per_slab - 1) * sizeof(struct slab *);
     metadata = SLAB_ALIGN_UP(metadata, cache->obj_align);
 
     size_t usable = raw - metadata;
@@ -0,0 +1,273 @@
+/* Object caches built on top of the slab domains.
+ *
+ * Each cache keeps a magazine per CPU and a depot per slab domain. Objects
+ * only ever get constructed when both of those are empty, and only get
+ * destructed when both of those are full, so in the steady state an
+ * alloc/free pair is a magazine pop and a magazine push. */
+
+#include <console/printf.h>
+#include <mem/slab.h>
+#include <string.h>
+
+#include "internal.h"
+#include "stat_internal.h"
+
+#define KMEM_CACHE_DEPOT_CAPACITY 256
+
+static LIST_HEAD(kmem_cache_list);
+static struct spinlock kmem_cache_list_lock = SPINLOCK_INIT;
+
+static inline bool kmem_cache_needs_alignment(struct kmem_cache *cache) {
+    return cache->align > SLAB_OBJ_ALIGN_DEFAULT;
+}
+
+/* Same rules as the slab magazines - only touched by their own CPU
+ * at IRQL_DISPATCH_LEVEL, so there is no lock. The counters go along */
+static inline struct kmem_cache_cpu *
+kmem_cache_cpu_local(struct kmem_cache *c) {
+    return &c->cpus[smp_core()->id];
+}
+
+static vaddr_t kmem_cache_mag_pop(struct kmem_cache *c) {
+    enum irql irql;
+    if (!slab_percpu_enter(&irql))
+        return 0x0;
+
+    struct kmem_cache_cpu *cpu = kmem_cache_cpu_local(c);
+    vaddr_t ret = slab_magazine_pop(&cpu->mag);
+    cpu->allocs++;
+    if (ret)
+        cpu->magazine_hits++;
+
+    slab_percpu_exit(irql);
+    return ret;
+}
+
+static bool kmem_cache_mag_push(struct kmem_cache *c, vaddr_t obj) {
+    enum irql irql;
+    if (!slab_percpu_enter(&irql))
+        return false;
+
+    struct kmem_cache_cpu *cpu = kmem_cache_cpu_local(c);
+    bool ret = slab_magazine_push(&cpu->mag, obj);
+    cpu->frees++;
+
+    slab_percpu_exit(irql);
+    return ret;
+}
+
+static void kmem_cache_count_depot_hit(struct kmem_cache *c) {
+    enum irql irql;
+    if (!slab_percpu_enter(&irql))
+        return;
+
+    kmem_cache_cpu_local(c)->depot_hits++;
+    slab_percpu_exit(irql);
+}
+
+static inline struct slab_free_queue *
+kmem_cache_depot_local(struct kmem_cache *c) {
+    return &c->depots[domain_local_id()];
+}
+
+static void *kmem_cache_construct(struct kmem_cache *cache,
+                                  enum alloc_behavior behavior) {
+    void *obj;
+    if (kmem_cache_needs_alignment(cache))
+        obj = kmalloc_aligned(cache->size, cache->align, ALLOC_FLAGS_DEFAULT,
+                              behavior);
+    else
+        obj = kmalloc(cache->size, ALLOC_FLAGS_DEFAULT, behavior);
+
+    if (!obj)
+        return NULL;
+
+    if (cache->ctor && !cache->ctor(obj)) {
+        if (kmem_cache_needs_alignment(cache))
+            kfree_aligned(obj, behavior);
+        else
+            kfree(obj, behavior);
+
+        return NULL;
+    }
+
+    atomic_fetch_add(&cache->stats.constructs, 1);
+    return obj;
+}
+
+static void kmem_cache_destruct(struct kmem_cache *cache, void *obj,
+                                enum alloc_behavior behavior) {
+    if (cache->dtor)
+        cache->dtor(obj);
+
+    if (kmem_cache_needs_alignment(cache))
+        kfree_aligned(obj, behavior);
+    else
+        kfree(obj, behavior);
+
+    atomic_fetch_add(&cache->stats.destructs, 1);
+}
+
+static void kmem_cache_setup(struct kmem_cache *cache) {
+    cache->cpus = kzalloc_aligned(
+        sizeof(struct kmem_cache_cpu) * global.core_count,
+        _Alignof(struct kmem_cache_cpu));
+    cache->depots =
+        kzalloc(sizeof(struct slab_free_queue) * global.domain_count);
+    if (!cache->cpus || !cache->depots)
+        panic("Could not allocate kmem cache '%s'\n", cache->name);
+
+    for (size_t i = 0; i < global.core_count; i++) {
+        INIT_LIST_HEAD(&cache->cpus[i].mag.list);
+        cache->cpus[i].mag.capacity = SLAB_MAG_DEFAULT_ENTRIES;
+    }
+
+    for (size_t i = 0; i < global.domain_count; i++)
+        slab_free_queue_init(global.domains[i]->slab_domain,
+                             &cache->depots[i], KMEM_CACHE_DEPOT_CAPACITY);
+
+    atomic_thread_fence(memory_order_release);
+    cache->ready = true;
+}
+
+static bool kmem_caches_online = false;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, kmem_cache_ctor_t ctor,
+                                     kmem_cache_dtor_t dtor) {
+    kassert(size != 0);
+    struct kmem_cache *cache = kzalloc(sizeof(struct kmem_cache));
+    if (!cache)
+        return NULL;
+
+    cache->name = name;
+    cache->size = size;
+    cache->align = align ? align : SLAB_OBJ_ALIGN_DEFAULT;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    INIT_LIST_HEAD(&cache->list);
+
+    /* created before the domains exist? `kmem_caches_init` will pick it up */
+    enum irql irql = spin_lock(&kmem_cache_list_lock);
+    list_add_tail(&cache->list, &kmem_cache_list);
+    bool online = kmem_caches_online;
+    spin_unlock(&kmem_cache_list_lock, irql);
+
+    if (online)
+        kmem_cache_setup(cache);
+
+    return cache;
+}
+
+void *kmem_cache_alloc_internal(struct kmem_cache *cache,
+                                enum alloc_behavior behavior) {
+    if (unlikely(!cache->ready))
+        return kmem_cache_construct(cache, behavior);
+
+    struct slab_domain *dom = slab_domain_local();
+    slab_stat_objcache_alloc_call(dom);
+
+    void *obj = (void *) kmem_cache_mag_pop(cache);
+    if (obj) {
+        slab_stat_objcache_magazine_hit(dom);
+        return obj;
+    }
+
+    obj = (void *) slab_free_queue_dequeue(kmem_cache_depot_local(cache));
+    if (obj) {
+        kmem_cache_count_depot_hit(cache);
+        slab_stat_objcache_depot_hit(dom);
+        return obj;
+    }
+
+    obj = kmem_cache_construct(cache, behavior);
+    if (obj)
+        slab_stat_objcache_construct(dom);
+
+    return obj;
+}
+
+void kmem_cache_free_internal(struct kmem_cache *cache, void *obj,
+                              enum alloc_behavior behavior) {
+    if (!obj)
+        return;
+
+    if (unlikely(!cache->ready))
+        return kmem_cache_destruct(cache, obj, behavior);
+
+    struct slab_domain *dom = slab_domain_local();
+    slab_stat_objcache_free_call(dom);
+
+    if (kmem_cache_mag_push(cache, (vaddr_t) obj))
+        return;
+
+    if (slab_free_queue_ringbuffer_enqueue(kmem_cache_depot_local(cache),
+                                           (vaddr_t) obj)) {
+        slab_stat_objcache_free_to_depot(dom);
+        return;
+    }
+
+    slab_stat_objcache_destruct(dom);
+    kmem_cache_destruct(cache, obj, behavior);
+}
+
+size_t kmem_cache_shrink(struct kmem_cache *cache) {
+    if (!cache->ready)
+        return 0;
+
+    size_t destroyed = 0;
+    for (size_t i = 0; i < global.domain_count; i++) {
+        vaddr_t obj;
+        while ((obj = slab_free_queue_dequeue(&cache->depots[i]))) {
+            kmem_cache_destruct(cache, (void *) obj, ALLOC_BEHAVIOR_NORMAL);
+            destroyed++;
+        }
+    }
+
+    return destroyed;
+}
+
+void kmem_caches_init(void) {
+    for (struct kmem_cache *c = __skernel_kmem_caches;
+         c < __ekernel_kmem_caches; c++) {
+        kassert(c->size != 0);
+        if (!c->align)
+            c->align = SLAB_OBJ_ALIGN_DEFAULT;
+
+        list_add_tail(&c->list, &kmem_cache_list);
+    }
+
+    enum irql irql = spin_lock(&kmem_cache_list_lock);
+    kmem_caches_online = true;
+    spin_unlock(&kmem_cache_list_lock, irql);
+
+    struct kmem_cache *iter;
+    list_for_each_entry(iter, &kmem_cache_list, list) {
+        if (!iter->ready)
+            kmem_cache_setup(iter);
+    }
+}
+
+void kmem_caches_print(void) {
+    struct kmem_cache *c;
+    list_for_each_entry(c, &kmem_cache_list, list) {
+        /* racy against the owners, close enough for a dump */
+        size_t allocs = 0, frees = 0, magazine_hits = 0, depot_hits = 0;
+        for (size_t i = 0; c->ready && i < global.core_count; i++) {
+            allocs += c->cpus[i].allocs;
+            frees += c->cpus[i].frees;
+            magazine_hits += c->cpus[i].magazine_hits;
+            depot_hits += c->cpus[i].depot_hits;
+        }
+
+        printf("kmem_cache %s (size %zu, align %zu) {\n", c->name, c->size,
+               c->align);
+        printf("    allocs: %zu,\n", allocs);
+        printf("    frees: %zu,\n", frees);
+        printf("    magazine_hits: %zu,\n", magazine_hits);
+        printf("    depot_hits: %zu,\n", depot_hits);
+        printf("    constructs: %zu,\n", c->stats.constructs);
+        printf("    destructs: %zu\n", c->stats.destructs);
+        printf("}\n");
+    }
+}
@@ -1,40 +1,258 @@
+#include <mem/slab.h>
 #include <sch/sched.h>
 #include <smp/domain.h>
 
 #include "internal.h"
 #include "mem/domain/internal.h"
+#include "stat_internal.h"
 
-bool slab_magazine_push_internal(struct slab_magazine *mag, vaddr_t obj) {
-    if (mag->count < SLAB_MAG_ENTRIES) {
+/* Magazines are only ever touched by their own CPU with preemption
+ * disabled, so none of these need a lock */
+bool slab_magazine_push(struct slab_magazine *mag, vaddr_t obj) {
+    if (mag->count < mag->capacity) {
         mag->objs[mag->count++] = obj;
         return true;
     }
     return false;
 }
 
-bool slab_magazine_push(struct slab_magazine *mag, vaddr_t obj) {
-    enum irql irql = slab_magazine_lock(mag);
-
-    bool ret = slab_magazine_push_internal(mag, obj);
+vaddr_t slab_magazine_pop(struct slab_magazine *mag) {
+    if (mag->count == 0)
+        return 0x0;
 
-    slab_magazine_unlock(mag, irql);
+    vaddr_t ret = mag->objs[--mag->count];
+    mag->objs[mag->count] = 0x0; /* Reset it */
     return ret;
 }
 
-vaddr_t slab_magazine_pop(struct slab_magazine *mag) {
-    enum irql irql = slab_magazine_lock(mag);
+static struct slab_magazine *slab_magazine_create(size_t capacity) {
+    struct slab_magazine *mag = kzalloc(sizeof(struct slab_magazine));
+    if (!mag)
+        return NULL;
+
+    INIT_LIST_HEAD(&mag->list);
+    mag->capacity = capacity;
+    return mag;
+}
+
+static inline void slab_magazine_pair_swap(struct slab_magazine_pair *pair) {
+    struct slab_magazine *tmp = pair->loaded;
+    pair->loaded = pair->previous;
+    pair->previous = tmp;
+}
+
+static enum irql slab_depot_lock_counted(struct slab_domain *dom,
+                                         struct slab_depot *depot) {
+    enum irql irql;
+    if (slab_depot_trylock(depot, &irql))
+        return irql;
+
+    slab_stat_depot_contention(dom);
+    irql = slab_depot_lock(depot);
+    depot->contended++;
+    return irql;
+}
+
+/* Called with the depot lock held after every exchange */
+static void slab_depot_tune(struct slab_domain *dom, struct slab_depot *depot) {
+    if (++depot->exchanges < SLAB_DEPOT_TUNE_INTERVAL)
+        return;
+
+    size_t contended_pct = depot->contended * 100 / depot->exchanges;
+    size_t refill_pct =
+        atomic_exchange(&depot->refills, 0) * 100 / depot->exchanges;
+    size_t surplus = dom->domain->num_cores * SLAB_DEPOT_SURPLUS_PER_CORE;
+    size_t size = depot->mag_size;
+
+    if (contended_pct > SLAB_DEPOT_CONTENTION_PCT ||
+        refill_pct > SLAB_DEPOT_REFILL_PCT) {
+        size += SLAB_MAG_RESIZE_STEP;
+    } else if (depot->contended == 0 && refill_pct == 0 &&
+               depot->full_count > surplus && size > SLAB_MAG_MIN_ENTRIES) {
+        size -= SLAB_MAG_RESIZE_STEP;
+    }
+
+    if (size > depot->mag_max)
+        size = depot->mag_max;
+
+    if (size < SLAB_MAG_MIN_ENTRIES)
+        size = SLAB_MAG_MIN_ENTRIES;
+
+    if (size != depot->mag_size) {
+        depot->mag_size = size;
+        slab_stat_magazine_resize(dom);
+    }
+
+    depot->exchanges = 0;
+    depot->contended = 0;
+}
+
+static inline struct slab_magazine *slab_depot_pop(struct list_head *list,
+                                                   size_t *count) {
+    struct list_head *ln = list_pop_front_init(list);
+    if (!ln)
+        return NULL;
+
+    (*count)--;
+    return slab_magazine_from_list_node(ln);
+}
+
+/* Hands an empty magazine to the depot in exchange for a full one.
+ * Returns NULL and keeps `empty` if the depot has no full magazines */
+static struct slab_magazine *
+slab_depot_exchange_empty(struct slab_domain *dom, size_t class_idx,
+                          struct slab_magazine *empty) {
+    struct slab_depot *depot = &dom->depots[class_idx];
+    enum irql irql = slab_depot_lock_counted(dom, depot);
+
+    struct slab_magazine *full = slab_depot_pop(&depot->full,
+                                                &depot->full_count);
+    if (full) {
+        /* empties pick up the current size on their way into the depot */
+        empty->capacity = depot->mag_size;
+        list_add(&empty->list, &depot->empty);
+        depot->empty_count++;
+    }
+
+    slab_depot_tune(dom, depot);
+    slab_depot_unlock(depot, irql);
+    return full;
+}
+
+/* Hands a full magazine to the depot in exchange for an empty one.
+ * Returns NULL and keeps `full` if the depot has no empty magazines */
+static struct slab_magazine *
+slab_depot_exchange_full(struct slab_domain *dom, size_t class_idx,
+                         struct slab_magazine *full) {
+    struct slab_depot *depot = &dom->depots[class_idx];
+    enum irql irql = slab_depot_lock_counted(dom, depot);
+
+    struct slab_magazine *empty = slab_depot_pop(&depot->empty,
+                                                 &depot->empty_count);
+    if (empty) {
+        empty->capacity = depot->mag_size;
+        list_add(&full->list, &depot->full);
+        depot->full_count++;
+    }
+
+    slab_depot_tune(dom, depot);
+    slab_depot_unlock(depot, irql);
+    return empty;
+}
+
+/* The lockless fast path. Raising to DISPATCH keeps us on this CPU and keeps
+ * DPCs from running on top of us, which is all we need, since nothing else
+ * ever touches this CPU's magazines */
+vaddr_t slab_percpu_alloc(size_t class_idx, enum alloc_flags flags) {
+    enum irql irql;
+    if (!slab_percpu_enter(&irql))
+        return 0x0;
 
+    struct slab_percpu_cache *pc = slab_percpu_cache_local();
+    struct slab_magazine_pair *pair = &pc->mag[class_idx];
     vaddr_t ret = 0x0;
 
-    if (mag->count > 0) {
-        ret = mag->objs[--mag->count];
-        mag->objs[mag->count] = 0x0; /* Reset it */
+    if (pair->loaded->count == 0 && pair->previous->count > 0)
+        slab_magazine_pair_swap(pair);
+
+    if (pair->loaded->count == 0) {
+        struct slab_magazine *full =
+            slab_depot_exchange_empty(pc->domain, class_idx, pair->loaded);
+        if (!full)
+            goto out;
+
+        pair->loaded = full;
+        slab_stat_alloc_depot_hit(pc->domain);
     }
 
-    slab_magazine_unlock(mag, irql);
+    /* Reserve SLAB_MAG_WATERMARK_PCT% entries for nonpageable requests */
+    if (flags & ALLOC_FLAG_PAGEABLE &&
+        pair->loaded->count < SLAB_MAG_WATERMARK(pair->loaded))
+        goto out;
+
+    ret = slab_magazine_pop(pair->loaded);
+    if (ret)
+        slab_stat_alloc_magazine_hit(pc->domain);
+
+out:
+    slab_percpu_exit(irql);
     return ret;
 }
 
+/* Magazines only ever hold memory from their own domain, so this
+ * fails if `owner` isn't the domain of the CPU we end up running on */
+bool slab_percpu_free(struct slab_domain *owner, size_t class_idx,
+                      vaddr_t obj) {
+    enum irql irql;
+    if (!slab_percpu_enter(&irql))
+        return false;
+
+    struct slab_percpu_cache *pc = slab_percpu_cache_local();
+    struct slab_magazine_pair *pair = &pc->mag[class_idx];
+    bool ret = false;
+
+    if (pc->domain != owner)
+        goto out;
+
+    struct slab_magazine *loaded = pair->loaded;
+    if (loaded->count >= loaded->capacity &&
+        pair->previous->count < pair->previous->capacity)
+        slab_magazine_pair_swap(pair);
+
+    loaded = pair->loaded;
+    if (loaded->count >= loaded->capacity) {
+        struct slab_magazine *empty =
+            slab_depot_exchange_full(pc->domain, class_idx, loaded);
+        if (!empty)
+            goto out;
+
+        pair->loaded = empty;
+        slab_stat_free_to_depot(pc->domain);
+    }
+
+    ret = slab_magazine_push(pair->loaded, obj);
+
+out:
+    slab_percpu_exit(irql);
+    return ret;
+}
+
+/* Gives objects in surplus full magazines back to the slabs so that an idle
+ * depot doesn't sit on memory forever. Keeps one full magazine per core */
+size_t slab_depot_trim(struct slab_domain *dom) {
+    size_t keep = dom->domain->num_cores;
+    size_t freed = 0;
+
+    for (size_t class = 0; class < slab_num_sizes; class++) {
+        struct slab_depot *depot = &dom->depots[class];
+
+        while (true) {
+            enum irql irql = slab_depot_lock(depot);
+            struct slab_magazine *mag = NULL;
+            if (depot->full_count > keep)
+                mag = slab_depot_pop(&depot->full, &depot->full_count);
+
+            slab_depot_unlock(depot, irql);
+            if (!mag)
+                break;
+
+            vaddr_t obj;
+            while ((obj = slab_magazine_pop(mag))) {
+                slab_free(dom, (void *) obj);
+                freed++;
+            }
+
+            irql = slab_depot_lock(depot);
+            mag->capacity = depot->mag_size;
+            list_add(&mag->list, &depot->empty);
+            depot->empty_count++;
+            slab_depot_unlock(depot, irql);
+        }
+    }
+
+    return freed;
+}
+
 bool slab_cache_available(struct slab_cache *cache) {
     if (SLAB_CACHE_COUNT_FOR(cache, SLAB_FREE) > 0 ||
         SLAB_CACHE_COUNT_FOR(cache, SLAB_PARTIAL) > 0)
@@ -78,71 +296,50 @@ void slab_cache_bulk_free(struct slab_domain *domain, vaddr_t *addr_array,
     return;
 }
 
-void slab_percpu_flush(struct slab_domain *dom, struct slab_percpu_cache *pc,
-                       size_t class_idx, vaddr_t overflow_obj) {
-    struct slab_magazine *mag = &pc->mag[class_idx];
+static void slab_percpu_refill_class(struct slab_domain *dom,
+                                     size_t class_idx,
+                                     enum alloc_behavior behavior) {
+    struct slab_cache *cache = &dom->local_nonpageable_cache->caches[class_idx];
 
-    /* capture how many valid items we have */
-    enum irql irql = slab_magazine_lock(mag);
-    size_t valid = mag->count;
+    /* Only a hint - by the time we insert, things may have changed */
+    enum irql irql;
+    if (!slab_percpu_enter(&irql))
+        return;
 
-    /* copy only valid objects */
-    vaddr_t objs[SLAB_MAG_ENTRIES + 1];
-    for (size_t i = 0; i < valid; i++)
-        objs[i] = mag->objs[i];
+    struct slab_magazine *mag = slab_percpu_cache_local()->mag[class_idx].loaded;
+    size_t space = mag->capacity - mag->count;
+    slab_percpu_exit(irql);
 
-    /* reset magazine */
-    mag->count = 0;
-    for (size_t i = 0; i < valid; i++)
-        mag->objs[i] = 0x0;
-    slab_magazine_unlock(mag, irql);
+    /* Up to what the depot sizes magazines at right now */
+    size_t mag_size = dom->depots[class_idx].mag_size;
+    if (space > mag_size)
+        space = mag_size;
 
-    /* add overflow object to the end and free (valid + 1) objects */
-    objs[valid] = overflow_obj;
-    slab_cache_bulk_free(dom, objs, valid + 1);
-}
+    if (space > SLAB_MAG_MAX_ENTRIES)
+        space = SLAB_MAG_MAX_ENTRIES;
 
-vaddr_t slab_percpu_refill_class(struct slab_domain *dom,
-                                 struct slab_percpu_cache *pc, size_t class_idx,
-                                 enum alloc_behavior behavior) {
-    struct slab_cache *cache = &dom->local_nonpageable_cache->caches[class_idx];
-    struct slab_magazine *mag = &pc->mag[class_idx];
-
-    /* Determine how many we can safely take into the magazine under the lock.
-     */
-    enum irql irql = slab_magazine_lock(mag);
-    size_t space = SLAB_MAG_ENTRIES - mag->count;
-    slab_magazine_unlock(mag, irql);
-
-    if (space == 0)
-        space = 1; /* we still want 1 so we can return an object */
-
-    /* Bound space to a reasonable maximum to avoid huge VLAs */
-    if (space > SLAB_MAG_ENTRIES)
-        space = SLAB_MAG_ENTRIES;
-
-    vaddr_t objs[/* compile-time max */ SLAB_MAG_ENTRIES];
-    size_t want = space;
-    size_t got = slab_cache_bulk_alloc(cache, objs, want, behavior);
-    if (got == 0) {
-        /* if nothing returned, try to pop from magazine (safe path) */
-        return slab_magazine_pop(mag);
-    }
+    vaddr_t objs[/* compile-time max */ SLAB_MAG_MAX_ENTRIES];
+    size_t got = slab_cache_bulk_alloc(cache, objs, space, behavior);
+    if (got == 0)
+        return;
 
-    /* Insert (got - 1) items into magazine but re-check capacity under lock */
-    enum irql irql2 = slab_magazine_lock(mag);
-    size_t can_insert = SLAB_MAG_ENTRIES - mag->count;
-    size_t to_insert = (got > 0) ? (got - 1) : 0;
-    if (to_insert > can_insert)
-        to_insert = can_insert;
+    atomic_fetch_add(&dom->depots[class_idx].refills, 1);
 
-    for (size_t i = 1; i <= to_insert; i++)
-        mag->objs[mag->count++] = objs[i];
+    size_t inserted = 0;
+    if (slab_percpu_enter(&irql)) {
+        /* We may have been migrated before raising */
+        struct slab_percpu_cache *pc = slab_percpu_cache_local();
+        if (pc->domain == dom) {
+            mag = pc->mag[class_idx].loaded;
+            while (inserted < got && slab_magazine_push(mag, objs[inserted]))
+                inserted++;
+        }
 
-    slab_magazine_unlock(mag, irql2);
+        slab_percpu_exit(irql);
+    }
 
-    /* return first object (objs[0]) */
-    return objs[0];
+    /* Whatever didn't fit goes back */
+    slab_cache_bulk_free(dom, objs + inserted, got - inserted);
 }
 
 void slab_percpu_refill(struct slab_domain *dom,
@@ -151,38 +348,71 @@ void slab_percpu_refill(struct slab_domain *dom,
     /* This flushes a portion of the freequeue into the percpu cache */
     slab_free_queue_drain_limited(cache, dom, /* pct = */ 100);
     for (size_t class = 0; class < slab_num_sizes; class++)
-        slab_percpu_refill_class(dom, cache, class, behavior);
+        slab_percpu_refill_class(dom, class, behavior);
 }
 
-void slab_percpu_free(struct slab_domain *dom, size_t class_idx, vaddr_t obj) {
-    struct slab_percpu_cache *pc = slab_percpu_cache_local();
-    struct slab_magazine *mag = &pc->mag[class_idx];
+static size_t slab_mag_max_entries(size_t class) {
+    size_t entries = SLAB_MAG_BYTES_MAX / slab_class_sizes[class].size;
+    if (entries > SLAB_MAG_MAX_ENTRIES)
+        entries = SLAB_MAG_MAX_ENTRIES;
 
-    if (slab_magazine_push(mag, obj))
-        return;
+    if (entries < SLAB_MAG_MIN_ENTRIES)
+        entries = SLAB_MAG_MIN_ENTRIES;
+
+    return entries;
+}
 
-    slab_percpu_flush(dom, pc, class_idx, obj);
+static void slab_depot_init(struct slab_depot *depot, size_t class,
+                            size_t spares) {
+    INIT_LIST_HEAD(&depot->full);
+    INIT_LIST_HEAD(&depot->empty);
+    spinlock_init(&depot->lock);
+    depot->mag_max = slab_mag_max_entries(class);
+    depot->mag_size = SLAB_MAG_DEFAULT_ENTRIES;
+    if (depot->mag_size > depot->mag_max)
+        depot->mag_size = depot->mag_max;
+
+    for (size_t i = 0; i < spares; i++) {
+        struct slab_magazine *mag = slab_magazine_create(depot->mag_size);
+        if (!mag)
+            panic("Could not allocate slab depot magazines\n");
+
+        list_add(&mag->list, &depot->empty);
+        depot->empty_count++;
+    }
 }
 
 void slab_domain_percpu_init(struct slab_domain *domain) {
     size_t cpus = domain->domain->num_cores;
     domain->percpu_caches = kzalloc(sizeof(struct slab_percpu_cache *) * cpus);
-    if (!domain->percpu_caches)
+    domain->depots = kzalloc(sizeof(struct slab_depot) * slab_num_sizes);
+    if (!domain->percpu_caches || !domain->depots)
         panic("Could not allocate domain's percpu caches\n");
 
+    /* One spare empty per core, so the first round of
+     * full magazines has somewhere to go */
+    for (size_t j = 0; j < slab_num_sizes; j++)
+        slab_depot_init(&domain->depots[j], j, /* spares = */ cpus);
+
     for (size_t i = 0; i < cpus; i++) {
         domain->percpu_caches[i] = kzalloc(sizeof(struct slab_percpu_cache));
+        if (!domain->percpu_caches[i])
+            panic("Could not allocate domain's percpu caches\n");
+
         domain->percpu_caches[i]->mag =
-            kzalloc(sizeof(struct slab_magazine) * slab_num_sizes);
+            kzalloc(sizeof(struct slab_magazine_pair) * slab_num_sizes);
 
-        if (!domain->percpu_caches[i] || !domain->percpu_caches[i]->mag)
+        if (!domain->percpu_caches[i]->mag)
             panic("Could not allocate domain's percpu caches\n");
 
         domain->percpu_caches[i]->domain = domain;
         for (size_t j = 0; j < slab_num_sizes; j++) {
-            struct slab_magazine *mag = &domain->percpu_caches[i]->mag[j];
-            mag->count = 0;
-            spinlock_init(&mag->lock);
+            struct slab_magazine_pair *pair = &domain->percpu_caches[i]->mag[j];
+            size_t entries = domain->depots[j].mag_size;
+            pair->loaded = slab_magazine_create(entries);
+            pair->previous = slab_magazine_create(entries);
+            if (!pair->loaded || !pair->previous)
+                panic("Could not allocate domain's percpu caches\n");
         }
     }
 }
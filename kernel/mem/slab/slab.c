@@ -160,15 +160,49 @@ struct slab_caches slab_caches = {0};
 LOG_HANDLE_DECLARE_DEFAULT(slab);
 LOG_SITE_DECLARE_DEFAULT(slab);
 
-static void *slab_map_new_page(struct slab_domain *domain, paddr_t *phys_out,
-                               enum slab_type type) {
+struct vas_space *slab_large_vas = NULL;
+
+static vaddr_t slab_alloc_virt(size_t pages) {
+    if (pages > 1)
+        return vas_alloc(slab_large_vas, SLAB_LARGE_SLOT_SIZE,
+                         SLAB_LARGE_SLOT_SIZE);
+
+    /* map three pages for the slab so that OOB writes are caught */
+    vaddr_t virt = vas_alloc(slab_vas, PAGE_SIZE * 3, PAGE_SIZE);
+    if (unlikely(!virt))
+        return 0x0;
+
+    /* go one page up so that the memory is as follows
+     *
+     * [unmapped] [mapped] [unmapped] */
+    return virt + PAGE_SIZE;
+}
+
+static void slab_free_virt(vaddr_t virt, size_t pages) {
+    if (pages > 1)
+        return vas_free(slab_large_vas, virt, SLAB_LARGE_SLOT_SIZE);
+
+    /* go back down a PAGE_SIZE for our virt allocation */
+    vas_free(slab_vas, virt - PAGE_SIZE, PAGE_SIZE * 3);
+}
+
+static void *slab_map_new_pages(struct slab_domain *domain, paddr_t *phys_out,
+                                enum slab_type type, size_t pages) {
     paddr_t phys = 0x0;
     vaddr_t virt = 0x0;
+    size_t mapped = 0;
+
+    /* Pageable slabs stay on 4KiB pages so they can go out one at a time */
+    if (pages > 1 && domain && type == SLAB_TYPE_NONPAGEABLE) {
+        void *ret = slab_hugechunk_alloc(domain, pages, phys_out);
+        if (ret)
+            return ret;
+    }
 
     if (domain) {
-        phys = domain_alloc_from_domain(domain->domain, 1);
+        phys = domain_alloc_from_domain(domain->domain, pages);
     } else {
-        phys = pmm_alloc_page();
+        phys = pmm_alloc_pages(pages);
     }
 
     *phys_out = phys;
@@ -176,46 +210,70 @@ static void *slab_map_new_page(struct slab_domain *domain, paddr_t *phys_out,
     if (unlikely(!phys))
         goto err;
 
-    /* map three pages for the slab so that OOB writes are caught */
-    /* TODO: three pages change... */
-    virt = vas_alloc(slab_vas, PAGE_SIZE * 3, PAGE_SIZE);
+    virt = slab_alloc_virt(pages);
     if (unlikely(!virt))
         goto err;
 
-    /* go one page up so that the memory is as follows
-     *
-     * [unmapped] [mapped] [unmapped] */
-    virt += PAGE_SIZE;
-
     uint64_t pflags = PAGE_PRESENT | PAGE_WRITE;
 
     kassert(type != SLAB_TYPE_NONE);
     if (type == SLAB_TYPE_PAGEABLE)
         pflags |= PAGE_PAGEABLE;
 
-    enum errno e = vmm_map_page(virt, phys, pflags, VMM_FLAG_NONE);
-    if (unlikely(e < 0))
-        goto err;
+    for (; mapped < pages; mapped++) {
+        vaddr_t v = virt + mapped * PAGE_SIZE;
+        paddr_t p = phys + mapped * PAGE_SIZE;
+        enum errno e = vmm_map_page(v, p, pflags, VMM_FLAG_NONE);
+        if (unlikely(e < 0))
+            goto err;
+    }
 
     return (void *) virt;
 
 err:
+    for (size_t i = 0; i < mapped; i++)
+        vmm_unmap_page(virt + i * PAGE_SIZE, VMM_FLAG_NONE);
+
     if (phys)
-        pmm_free_page(phys);
+        pmm_free_pages(phys, pages);
 
     if (virt)
-        vas_free(slab_vas, virt, PAGE_SIZE * 3);
+        slab_free_virt(virt, pages);
 
     return NULL;
 }
 
-static void slab_free_virt_and_phys(vaddr_t virt, paddr_t phys) {
-    vmm_unmap_page(virt, VMM_FLAG_NONE);
-    pmm_free_page(phys);
+static void slab_free_virt_and_phys(vaddr_t virt, paddr_t phys, size_t pages) {
+    if (slab_addr_is_huge((void *) virt))
+        return slab_hugechunk_free(virt);
 
-    /* go back down a PAGE_SIZE for our virt allocation */
-    virt -= PAGE_SIZE;
-    vas_free(slab_vas, virt, PAGE_SIZE * 3);
+    for (size_t i = 0; i < pages; i++)
+        vmm_unmap_page(virt + i * PAGE_SIZE, VMM_FLAG_NONE);
+
+    pmm_free_pages(phys, pages);
+    slab_free_virt(virt, pages);
+}
+
+/* Objects that leave too much of a single page on the floor get a
+ * multi-page slab, sized by the ELCM wastage optimizer */
+static size_t slab_cache_pick_pages(uint64_t obj_size, uint64_t align) {
+    uint64_t stride = SLAB_ALIGN_UP(obj_size, align);
+    if (stride <= SLAB_NON_META_SPACE(1)) {
+        size_t wasted = SLAB_NON_META_SPACE(1) % stride;
+        if (wasted * 100 <= PAGE_SIZE * SLAB_ELCM_MAX_WASTAGE_PCT)
+            return 1;
+    }
+
+    struct slab_elcm_params sep = {
+        .max_wastage_pct = SLAB_ELCM_MAX_WASTAGE_PCT,
+        .max_pages = SLAB_ELCM_DEFAULT_MAX_PAGES,
+    };
+
+    struct slab_elcm_candidate c = slab_elcm(stride, sep);
+    if (c.pages == 0 || c.pages > SLAB_ELCM_DEFAULT_MAX_PAGES)
+        return DIV_ROUND_UP(stride + sizeof(struct slab) + 1, PAGE_SIZE);
+
+    return c.pages;
 }
 
 void slab_cache_init(size_t order, struct slab_cache *cache, uint64_t obj_size,
@@ -224,8 +282,10 @@ void slab_cache_init(size_t order, struct slab_cache *cache, uint64_t obj_size,
     cache->obj_size = obj_size;
     cache->obj_align = align;
     cache->obj_stride = SLAB_ALIGN_UP(obj_size, align);
-    cache->pages_per_slab = 1;
-    uint64_t available = PAGE_NON_SLAB_SPACE;
+    cache->pages_per_slab = slab_cache_pick_pages(obj_size, align);
+
+    uint64_t available = SLAB_NON_META_SPACE(cache->pages_per_slab);
+    uint64_t slab_bytes = cache->pages_per_slab * PAGE_SIZE;
 
     if (cache->obj_size > available)
         panic("Slab class too large, object size is %u with %u available "
@@ -233,13 +293,13 @@ void slab_cache_init(size_t order, struct slab_cache *cache, uint64_t obj_size,
               cache->obj_size, available);
 
     uint64_t n;
-    for (n = PAGE_NON_SLAB_SPACE / obj_size; n > 0; n--) {
+    for (n = available / cache->obj_stride; n > 0; n--) {
         uint64_t bitmap_bytes = SLAB_BITMAP_BYTES_FOR(n);
         uintptr_t data_start = sizeof(struct slab) + bitmap_bytes;
         data_start = SLAB_ALIGN_UP(data_start, align);
         uintptr_t data_end = data_start + n * cache->obj_stride;
 
-        if (data_end <= PAGE_SIZE)
+        if (data_end <= slab_bytes)
             break;
     }
 
@@ -284,7 +344,8 @@ struct slab *slab_init(struct slab *slab, struct slab_cache *parent) {
 static struct slab *slab_create_new(struct slab_domain *domain,
                                     struct slab_cache *cache) {
     paddr_t phys;
-    void *page = slab_map_new_page(domain, &phys, cache->type);
+    void *page =
+        slab_map_new_pages(domain, &phys, cache->type, cache->pages_per_slab);
     if (!page)
         return NULL;
 
@@ -305,7 +366,8 @@ struct slab *slab_create(struct slab_cache *cache,
      * iteration through GC slabs may touch pageable slabs and
      * trigger a page fault, so we must be careful here */
     if (alloc_behavior_may_fault(behavior))
-        slab = slab_gc_get_newest(cache->parent_domain, cache->type);
+        slab = slab_gc_get_newest(cache->parent_domain, cache->type,
+                                  cache->pages_per_slab);
 
     if (slab) {
         slab_stat_gc_object_reclaimed(local);
@@ -354,7 +416,8 @@ static void *slab_alloc_from(struct slab_cache *cache, struct slab *slab) {
             }
 
             vaddr_t ret = slab->mem + i * cache->obj_stride;
-            kassert(ret > (vaddr_t) slab && ret < (vaddr_t) slab + PAGE_SIZE);
+            kassert(ret > (vaddr_t) slab &&
+                    ret < (vaddr_t) slab + slab->pages * PAGE_SIZE);
 
             slab_check_assert(slab);
             slab_unlock(slab, irql);
@@ -371,7 +434,7 @@ void slab_destroy(struct slab *slab) {
     slab_list_del(slab);
     uintptr_t virt = (uintptr_t) slab;
     paddr_t phys = vmm_get_phys(virt, VMM_FLAG_NONE);
-    slab_free_virt_and_phys(virt, phys);
+    slab_free_virt_and_phys(virt, phys, slab->pages);
 }
 
 static void slab_bitmap_free(struct slab *slab, void *obj) {
@@ -405,7 +468,7 @@ void slab_free_old(struct slab *slab, void *obj) {
 
             uintptr_t virt = (uintptr_t) slab;
             paddr_t phys = PFN_TO_PAGE(page_get_pfn(slab->backing_page));
-            slab_free_virt_and_phys(virt, phys);
+            slab_free_virt_and_phys(virt, phys, slab->pages);
             return;
         }
     } else if (slab->state == SLAB_FULL) {
@@ -513,8 +576,11 @@ static void log_dupes(const char *keep, const char *discard, size_t size) {
 
 void slab_allocator_init() {
     /* bootstrap VAS */
-    slab_vas = vas_space_bootstrap(SLAB_HEAP_START, SLAB_HEAP_END);
-    if (!slab_vas)
+    slab_vas = vas_space_bootstrap(SLAB_HEAP_START, SLAB_LARGE_HEAP_START);
+    slab_large_vas =
+        vas_space_bootstrap(SLAB_LARGE_HEAP_START, SLAB_HUGE_HEAP_START);
+    slab_huge_vas = vas_space_bootstrap(SLAB_HUGE_HEAP_START, SLAB_HEAP_END);
+    if (!slab_vas || !slab_large_vas || !slab_huge_vas)
         panic("Could not initialize slab VAS\n");
 
     struct slab_size_constant *start = __skernel_slab_sizes;
@@ -576,9 +642,10 @@ void slab_allocator_init() {
         slab_caches.caches[i].type = SLAB_TYPE_NONPAGEABLE;
         slab_caches.caches[i].parent = &slab_caches;
 
-        slab_info("Slab cache s=%u a=%u \"%s\", o=%u, w=%u",
+        slab_info("Slab cache s=%u a=%u \"%s\", o=%u, p=%u, w=%u",
                   slab_class_sizes[i].size, slab_class_sizes[i].align,
                   slab_class_sizes[i].name, slab_caches.caches[i].objs_per_slab,
+                  slab_caches.caches[i].pages_per_slab,
                   slab_cache_wasted_space_per_slab(&slab_caches.caches[i]));
     }
 }
@@ -592,10 +659,10 @@ size_t ksize(void *ptr) {
     if (!(vp >= SLAB_HEAP_START && vp <= SLAB_HEAP_END))
         panic("%p out of bounds\n", vp);
 
-    struct slab_page_hdr *hdr = slab_page_hdr_for_addr(ptr);
-
-    if (hdr->magic == KMALLOC_PAGE_MAGIC)
+    if (slab_addr_is_page_alloc(ptr)) {
+        struct slab_page_hdr *hdr = slab_page_hdr_for_addr(ptr);
         return hdr->pages * PAGE_SIZE - sizeof(struct slab_page_hdr);
+    }
 
     return slab_for_ptr(ptr)->parent_cache->obj_size;
 }
@@ -604,38 +671,85 @@ size_t slab_allocation_size(vaddr_t addr) {
     return ksize((void *) addr);
 }
 
+/* Unmaps and frees whatever backs [virt, virt + pages * PAGE_SIZE), which
+ * may be a mix of 2MiB and 4KiB pages, and stops at the first hole */
+static void slab_unmap_page_range(vaddr_t virt, size_t pages) {
+    vaddr_t end = virt + pages * PAGE_SIZE;
+
+    while (virt < end) {
+        size_t size = vmm_get_mapping_size(virt);
+        if (!size)
+            return;
+
+        paddr_t phys = (paddr_t) vmm_get_phys(virt, VMM_FLAG_NONE);
+        if (size == PAGE_2MB) {
+            vmm_unmap_2mb_page(virt, VMM_FLAG_NONE);
+            pmm_free_pages(phys, SLAB_HUGE_CHUNK_PAGES);
+        } else {
+            vmm_unmap_page(virt, VMM_FLAG_NONE);
+            pmm_free_page(phys);
+        }
+
+        virt += size;
+    }
+}
+
+/* Big nonpageable allocations get 2MiB pages for every 2MiB stretch that
+ * the domain can back with an order-9 block, and 4KiB pages elsewhere */
+static bool slab_page_alloc_wants_huge(struct slab_domain *parent,
+                                       size_t pages, enum alloc_flags flags) {
+    return parent && pages >= SLAB_HUGE_CHUNK_PAGES &&
+           !(flags & ALLOC_FLAG_PAGEABLE);
+}
+
 void *kmalloc_pages_raw(struct slab_domain *parent, size_t size,
                         enum alloc_flags flags) {
     uint64_t total_size = size + sizeof(struct slab_page_hdr);
     uint64_t pages = PAGES_NEEDED_FOR(total_size);
+    bool huge = slab_page_alloc_wants_huge(parent, pages, flags);
 
-    uintptr_t virt = vas_alloc(slab_vas, pages * PAGE_SIZE, PAGE_SIZE);
-    uintptr_t phys_pages[pages];
-    uint64_t allocated = 0;
+    size_t align = huge ? PAGE_2MB : PAGE_SIZE;
+    uintptr_t virt = vas_alloc(slab_vas, pages * PAGE_SIZE, align);
+    if (!virt)
+        return NULL;
+
+    huge = huge && IS_ALIGNED(virt, PAGE_2MB);
 
     page_flags_t page_flags = PAGE_PRESENT | PAGE_WRITE;
     if (flags & ALLOC_FLAG_PAGEABLE)
         page_flags |= PAGE_PAGEABLE;
 
-    for (uint64_t i = 0; i < pages; i++) {
-        uintptr_t phys = pmm_alloc_page(flags);
-        if (!phys) {
-            for (uint64_t j = 0; j < allocated; j++)
-                pmm_free_page(phys_pages[j]);
-            return NULL;
+    for (uint64_t i = 0; i < pages;) {
+        uintptr_t v = virt + i * PAGE_SIZE;
+
+        /* once a 4KiB page goes in, nothing after it is 2MiB aligned */
+        if (huge && pages - i >= SLAB_HUGE_CHUNK_PAGES) {
+            kassert(IS_ALIGNED(i, SLAB_HUGE_CHUNK_PAGES));
+            paddr_t phys = domain_alloc_hugepage(parent->domain);
+            if (phys) {
+                if (vmm_map_2mb_page(v, phys, page_flags, VMM_FLAG_NONE) < 0) {
+                    pmm_free_pages(phys, SLAB_HUGE_CHUNK_PAGES);
+                    goto err;
+                }
+
+                i += SLAB_HUGE_CHUNK_PAGES;
+                continue;
+            }
+
+            /* the domain is out of order-9 blocks, don't keep asking */
+            huge = false;
         }
 
-        enum errno e =
-            vmm_map_page(virt + i * PAGE_SIZE, phys, page_flags, VMM_FLAG_NONE);
-        if (e < 0) {
-            pmm_free_page(phys);
-            for (uint64_t j = 0; j < allocated; j++)
-                pmm_free_page(phys_pages[j]);
+        uintptr_t phys = pmm_alloc_page(flags);
+        if (!phys)
+            goto err;
 
-            return NULL;
+        if (vmm_map_page(v, phys, page_flags, VMM_FLAG_NONE) < 0) {
+            pmm_free_page(phys);
+            goto err;
         }
 
-        phys_pages[allocated++] = phys;
+        i++;
     }
 
     struct slab_page_hdr *hdr = (struct slab_page_hdr *) virt;
@@ -649,6 +763,11 @@ void *kmalloc_pages_raw(struct slab_domain *parent, size_t size,
         return ((uint8_t *) hdr + 64);
 
     return (void *) (hdr + 1);
+
+err:
+    slab_unmap_page_range(virt, pages);
+    vas_free(slab_vas, virt, pages * PAGE_SIZE);
+    return NULL;
 }
 
 void *kmalloc_old(size_t size) {
@@ -669,13 +788,8 @@ void slab_free_page_hdr(struct slab_page_hdr *hdr) {
     uintptr_t virt = (uintptr_t) hdr;
     uint32_t pages = hdr->pages;
     hdr->magic = 0;
-    for (uint32_t i = 0; i < pages; i++) {
-        uintptr_t vaddr = virt + i * PAGE_SIZE;
-        paddr_t phys = (paddr_t) vmm_get_phys(vaddr, VMM_FLAG_NONE);
-        vmm_unmap_page(vaddr, VMM_FLAG_NONE);
-        pmm_free_page(phys);
-    }
 
+    slab_unmap_page_range(virt, pages);
     vas_free(slab_vas, virt, pages * PAGE_SIZE);
 }
 
@@ -683,9 +797,8 @@ void slab_free_addr_to_cache(void *addr) {
     vaddr_t vaddr = (vaddr_t) addr;
     kassert(vaddr >= SLAB_HEAP_START && vaddr <= SLAB_HEAP_END);
 
-    struct slab_page_hdr *hdr_candidate = slab_page_hdr_for_addr(addr);
-    if (hdr_candidate->magic == KMALLOC_PAGE_MAGIC)
-        return slab_free_page_hdr(hdr_candidate);
+    if (slab_addr_is_page_alloc(addr))
+        return slab_free_page_hdr(slab_page_hdr_for_addr(addr));
 
     struct slab *slab = slab_for_ptr(addr);
     if (!slab)
@@ -724,21 +837,19 @@ void *kmalloc_pages(struct slab_domain *domain, size_t size,
     return ret;
 }
 
-void *kmalloc_try_from_magazine(struct slab_domain *domain,
-                                struct slab_percpu_cache *pcpu, size_t size,
-                                enum alloc_flags flags) {
-    size_t class_idx = slab_size_to_index(size);
-    struct slab_magazine *mag = &pcpu->mag[class_idx];
-
-    /* Reserve SLAB_MAG_WATERMARK_PCT% entries for nonpageable requests */
-    if (flags & ALLOC_FLAG_PAGEABLE && mag->count < SLAB_MAG_WATERMARK)
+/* These go straight to the page path no matter how small they are. Big
+ * slab classes are multi-page now, so anything that wants its own pages
+ * (e.g. so `movealloc` can move it later) has to come through here */
+void *kzalloc_pages(size_t size) {
+    void *ret = kmalloc_pages_raw(NULL, size, ALLOC_FLAGS_DEFAULT);
+    if (!ret)
         return NULL;
 
-    void *ret = (void *) slab_magazine_pop(mag);
-    if (ret)
-        slab_stat_alloc_magazine_hit(domain);
+    return memset(ret, 0, size);
+}
 
-    return ret;
+void *kmalloc_try_from_magazine(size_t size, enum alloc_flags flags) {
+    return (void *) slab_percpu_alloc(slab_size_to_index(size), flags);
 }
 
 static size_t slab_free_queue_drain_on_alloc(struct slab_domain *dom,
@@ -944,7 +1055,7 @@ void *kmalloc_new(size_t size, enum alloc_flags flags,
     }
 
     /* alloc fits in slab - TODO: scale size if cache alignment is requested */
-    ret = kmalloc_try_from_magazine(local_dom, pcpu, size, flags);
+    ret = kmalloc_try_from_magazine(size, flags);
 
     /* if the mag alloc fails, drain our full portion of the freequeue */
     size_t pct = ret ? SLAB_FREE_QUEUE_ALLOC_PCT : 100;
@@ -953,7 +1064,7 @@ void *kmalloc_new(size_t size, enum alloc_flags flags,
 
     /* did the initial allocation fail but we drained something? go again... */
     if (!ret && drained) {
-        ret = kmalloc_try_from_magazine(local_dom, pcpu, size, flags);
+        ret = kmalloc_try_from_magazine(size, flags);
     }
 
     /* found something -- all done, this is the fastpath.
@@ -1079,55 +1190,22 @@ void kfree_pages(void *ptr, size_t size, enum alloc_behavior behavior) {
     slab_free_page_hdr(header);
 }
 
-static bool kfree_try_free_to_magazine(struct slab_percpu_cache *pcpu,
-                                       void *ptr, size_t size) {
+static bool kfree_try_free_to_magazine(void *ptr, size_t size) {
     struct slab *slab = slab_for_ptr(ptr);
-
-    /* wrong domain */
-    if (slab->parent_cache->parent_domain != pcpu->domain)
-        return false;
+    struct slab_domain *owner = slab->parent_cache->parent_domain;
 
     kassert(slab->type != SLAB_TYPE_NONE);
     if (slab->type == SLAB_TYPE_PAGEABLE)
         return false;
 
     int32_t idx = slab_size_to_index(size);
-    struct slab_magazine *mag = &pcpu->mag[idx];
-    bool ret = slab_magazine_push(mag, (vaddr_t) ptr);
+    bool ret = slab_percpu_free(owner, idx, (vaddr_t) ptr);
     if (ret)
-        slab_stat_free_to_percpu(pcpu->domain);
-
-    return ret;
-}
-
-static bool kfree_magazine_push_trylock(struct slab_magazine *mag, void *ptr) {
-    vaddr_t vptr = (vaddr_t) ptr;
-    enum irql irql;
-    if (!slab_magazine_trylock(mag, &irql))
-        return false;
-
-    bool ret = slab_magazine_push_internal(mag, vptr);
-
-    slab_magazine_unlock(mag, irql);
+        slab_stat_free_to_percpu(owner);
 
     return ret;
 }
 
-static bool kfree_try_put_on_percpu_caches(struct slab_domain *domain,
-                                           void *ptr, size_t size) {
-    int32_t idx = slab_size_to_index(size);
-    for (size_t i = 0; i < domain->domain->num_cores; i++) {
-        struct slab_percpu_cache *try = domain->percpu_caches[i];
-        struct slab_magazine *mag = &try->mag[idx];
-        if (kfree_magazine_push_trylock(mag, ptr)) {
-            slab_stat_free_to_percpu(domain);
-            return true;
-        }
-    }
-
-    return false;
-}
-
 void slab_free(struct slab_domain *domain, void *obj) {
     struct slab *slab = slab_for_ptr(obj);
     struct slab_cache *cache = slab->parent_cache;
@@ -1169,7 +1247,7 @@ void kfree_new(void *ptr, enum alloc_behavior behavior) {
         return;
 
     size_t size = ksize(ptr);
-    int32_t idx = slab_size_to_index(size);
+    int32_t idx = slab_addr_is_page_alloc(ptr) ? -1 : slab_size_to_index(size);
     struct slab_domain *local_domain = slab_domain_local();
     struct slab_percpu_cache *pcpu = slab_percpu_cache_local();
 
@@ -1182,18 +1260,15 @@ void kfree_new(void *ptr, enum alloc_behavior behavior) {
 
     /* nice, we freed it to the magazine and we are all good now -- fastpath,
      * so we don't try GC or any funny business */
-    if (kfree_try_free_to_magazine(pcpu, ptr, size))
+    if (kfree_try_free_to_magazine(ptr, size))
         return;
 
     /* did not free to magazine - this is an alloc from a slab */
     struct slab *slab = slab_for_ptr(ptr);
     struct slab_domain *owner = slab->parent_cache->parent_domain;
 
-    /* did not enqueue into the freequeue... try putting it on
-     * any magazine... we acquire the trylock() here... */
-    if (kfree_try_put_on_percpu_caches(owner, ptr, size))
-        return;
-
+    /* other CPUs' magazines are off limits, so remote
+     * frees and overflow go through the owner's freequeue */
     if (kfree_free_queue_enqueue(owner, ptr))
         return;
 
@@ -1270,7 +1345,7 @@ void *krealloc_internal(void *ptr, size_t size, enum alloc_flags flags,
     /* Touch nothing. This can still use the same slab allocation */
     size_t old_idx = slab_size_to_index(old);
     size_t new_idx = slab_size_to_index(size);
-    if (old_idx == new_idx)
+    if (old_idx == new_idx && size <= old)
         return ptr;
 
     void *new_ptr = kmalloc(size, flags, behavior);
@@ -18,6 +18,21 @@ void slab_domain_bucket_print(const struct slab_domain_bucket *bucket) {
     printf("    free_to_remote_domain: %zu,\n", bucket->free_to_remote_domain);
     printf("    free_to_percpu: %zu\n", bucket->free_to_percpu);
     printf("\n");
+    printf("    alloc_depot_hits: %zu,\n", bucket->alloc_depot_hits);
+    printf("    free_to_depot: %zu,\n", bucket->free_to_depot);
+    printf("    depot_contention: %zu,\n", bucket->depot_contention);
+    printf("    magazine_resizes: %zu\n", bucket->magazine_resizes);
+    printf("\n");
+    printf("    objcache_alloc_calls: %zu,\n", bucket->objcache_alloc_calls);
+    printf("    objcache_magazine_hits: %zu,\n",
+           bucket->objcache_magazine_hits);
+    printf("    objcache_depot_hits: %zu,\n", bucket->objcache_depot_hits);
+    printf("    objcache_constructs: %zu,\n", bucket->objcache_constructs);
+    printf("    objcache_free_calls: %zu,\n", bucket->objcache_free_calls);
+    printf("    objcache_free_to_depot: %zu,\n",
+           bucket->objcache_free_to_depot);
+    printf("    objcache_destructs: %zu\n", bucket->objcache_destructs);
+    printf("\n");
     printf("    freequeue_enqueues: %zu,\n", bucket->freequeue_enqueues);
     printf("    freequeue_dequeues: %zu,\n", bucket->freequeue_dequeues);
     printf("    gc_collections: %zu,\n", bucket->gc_collections);
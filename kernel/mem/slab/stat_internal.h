@@ -31,6 +31,17 @@ SLAB_STAT_SERIES_GENERATE(free_to_ring, free_to_ring);
 SLAB_STAT_SERIES_GENERATE(free_to_local_slab, free_to_local_slab);
 SLAB_STAT_SERIES_GENERATE(free_to_remote_domain, free_to_remote_domain);
 SLAB_STAT_SERIES_GENERATE(free_to_percpu, free_to_percpu);
+SLAB_STAT_SERIES_GENERATE(alloc_depot_hit, alloc_depot_hits);
+SLAB_STAT_SERIES_GENERATE(free_to_depot, free_to_depot);
+SLAB_STAT_SERIES_GENERATE(depot_contention, depot_contention);
+SLAB_STAT_SERIES_GENERATE(magazine_resize, magazine_resizes);
+SLAB_STAT_SERIES_GENERATE(objcache_alloc_call, objcache_alloc_calls);
+SLAB_STAT_SERIES_GENERATE(objcache_magazine_hit, objcache_magazine_hits);
+SLAB_STAT_SERIES_GENERATE(objcache_depot_hit, objcache_depot_hits);
+SLAB_STAT_SERIES_GENERATE(objcache_construct, objcache_constructs);
+SLAB_STAT_SERIES_GENERATE(objcache_free_call, objcache_free_calls);
+SLAB_STAT_SERIES_GENERATE(objcache_free_to_depot, objcache_free_to_depot);
+SLAB_STAT_SERIES_GENERATE(objcache_destruct, objcache_destructs);
 SLAB_STAT_SERIES_GENERATE(freequeue_enqueue, freequeue_enqueues);
 SLAB_STAT_SERIES_GENERATE(freequeue_dequeue, freequeue_dequeues);
 SLAB_STAT_SERIES_GENERATE(gc_collection, gc_collections);
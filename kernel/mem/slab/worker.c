@@ -14,6 +14,8 @@
 enum daemon_thread_command slab_background_work(struct daemon_work *work,
                                                 struct daemon_thread *thread,
                                                 void *a, void *b) {
+    /* our threads are pinned to the domain's CPUs */
+    slab_depot_trim(slab_domain_local());
     return DAEMON_THREAD_COMMAND_DEFAULT;
 }
 
@@ -580,6 +580,37 @@ err:
     return (uintptr_t) -1;
 }
 
+/* Returns PAGE_2MB or PAGE_SIZE depending on what maps `virt`, 0 if nothing */
+uint64_t vmm_get_mapping_size(uintptr_t virt) {
+    struct page_table *current_table = kernel_pml4;
+
+    for (uint64_t i = 0; i < 2; i++) {
+        uint64_t level = (virt >> (39 - i * 9)) & 0x1FF;
+        pte_t *entry = &current_table->entries[level];
+        if (!ENTRY_PRESENT(*entry))
+            return 0;
+
+        current_table = (struct page_table *) ((*entry & PAGE_PHYS_MASK) +
+                                               global.hhdm_offset);
+    }
+
+    pte_t entry = current_table->entries[(virt >> 21) & 0x1FF];
+    if (!ENTRY_PRESENT(entry))
+        return 0;
+
+    if (entry & PAGE_2MB_page)
+        return PAGE_2MB;
+
+    current_table =
+        (struct page_table *) ((entry & PAGE_PHYS_MASK) + global.hhdm_offset);
+
+    entry = current_table->entries[(virt >> 12) & 0x1FF];
+    return ENTRY_PRESENT(entry) ? PAGE_SIZE : 0;
+}
+
+/* Anything at least 2MiB long gets a virtual address with the same offset
+ * into a 2MiB page as the physical one, so every 2MiB aligned stretch in
+ * the middle can go in with a single PDE and the ends use 4KiB pages */
 void *vmm_map_phys(uint64_t addr, uint64_t len, uint64_t flags,
                    enum vmm_flags vflags) {
 
@@ -588,17 +619,34 @@ void *vmm_map_phys(uint64_t addr, uint64_t len, uint64_t flags,
 
     uint64_t total_len = len + offset;
     uint64_t total_pages = (total_len + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t map_len = total_pages * PAGE_SIZE;
 
-    if (vmm_map_top + total_pages * PAGE_SIZE > VMM_MAP_LIMIT) {
+    uintptr_t virt_start = vmm_map_top;
+    if (map_len >= PAGE_2MB) {
+        virt_start = ALIGN_DOWN(vmm_map_top, PAGE_2MB) +
+                     (phys_start & (PAGE_2MB - 1));
+        if (virt_start < vmm_map_top)
+            virt_start += PAGE_2MB;
+    }
+
+    if (virt_start + map_len > VMM_MAP_LIMIT) {
         return NULL;
     }
 
-    uintptr_t virt_start = vmm_map_top;
-    vmm_map_top += total_pages * PAGE_SIZE;
+    vmm_map_top = virt_start + map_len;
 
-    for (uint64_t i = 0; i < total_pages; i++) {
-        vmm_map_page(virt_start + i * PAGE_SIZE, phys_start + i * PAGE_SIZE,
-                     PAGE_PRESENT | PAGE_WRITE | flags, vflags);
+    flags |= PAGE_PRESENT | PAGE_WRITE;
+    for (uint64_t done = 0; done < map_len;) {
+        uintptr_t virt = virt_start + done;
+        uintptr_t phys = phys_start + done;
+
+        if (IS_ALIGNED(virt, PAGE_2MB) && map_len - done >= PAGE_2MB) {
+            vmm_map_2mb_page(virt, phys, flags, vflags);
+            done += PAGE_2MB;
+        } else {
+            vmm_map_page(virt, phys, flags, vflags);
+            done += PAGE_SIZE;
+        }
     }
 
     return (void *) (virt_start + offset);
@@ -610,9 +658,19 @@ void vmm_unmap_virt(void *addr, uint64_t len, enum vmm_flags vflags) {
     uintptr_t aligned_virt = PAGE_ALIGN_DOWN(virt_addr);
 
     uint64_t total_len = len + page_offset;
-    uint64_t total_pages = PAGES_NEEDED_FOR(total_len);
+    uint64_t unmap_len = PAGES_NEEDED_FOR(total_len) * PAGE_SIZE;
 
-    for (uint64_t i = 0; i < total_pages; i++) {
-        vmm_unmap_page(aligned_virt + i * PAGE_SIZE, vflags);
+    for (uint64_t done = 0; done < unmap_len;) {
+        uintptr_t virt = aligned_virt + done;
+
+        if (vmm_get_mapping_size(virt) == PAGE_2MB) {
+            kassert(IS_ALIGNED(virt, PAGE_2MB) &&
+                    unmap_len - done >= PAGE_2MB);
+            vmm_unmap_2mb_page(virt, vflags);
+            done += PAGE_2MB;
+        } else {
+            vmm_unmap_page(virt, vflags);
+            done += PAGE_SIZE;
+        }
     }
 }
@@ -0,0 +1,488 @@
+#include <asm.h>
+#include <compiler.h>
+#include <console/panic.h>
+#include <log.h>
+#include <mem/alloc.h>
+#include <memops.h>
+#include <smp/core.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* The kernel is built with -mgeneral-regs-only and does not save any
+ * vector state across context switches, so everything in here sticks
+ * to GPRs and string instructions. `movnti` is an SSE2 instruction,
+ * but it stores from a GPR and does not touch XMM state. */
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) u64_unaligned_t;
+
+#define MEMOPS_FILL_PATTERN(c) (0x0101010101010101ULL * (uint8_t) (c))
+
+static __no_builtin_patterns void copy_bytes(void *dest, const void *src,
+                                             size_t n) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+
+    while (n--)
+        *d++ = *s++;
+}
+
+static __no_builtin_patterns void fill_bytes(void *dest, uint8_t c, size_t n) {
+    uint8_t *d = dest;
+
+    while (n--)
+        *d++ = c;
+}
+
+static __no_builtin_patterns void copy_words(void *dest, const void *src,
+                                             size_t n) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+
+    while (n && ((uintptr_t) d & 7)) {
+        *d++ = *s++;
+        n--;
+    }
+
+    /* all four loads land before any store so that this stays
+     * safe for memmove() with dest below src */
+    for (; n >= 32; n -= 32, d += 32, s += 32) {
+        uint64_t a = ((const u64_unaligned_t *) s)[0];
+        uint64_t b = ((const u64_unaligned_t *) s)[1];
+        uint64_t c = ((const u64_unaligned_t *) s)[2];
+        uint64_t e = ((const u64_unaligned_t *) s)[3];
+        ((uint64_t *) d)[0] = a;
+        ((uint64_t *) d)[1] = b;
+        ((uint64_t *) d)[2] = c;
+        ((uint64_t *) d)[3] = e;
+    }
+
+    for (; n >= 8; n -= 8, d += 8, s += 8)
+        *(uint64_t *) d = *(const u64_unaligned_t *) s;
+
+    while (n--)
+        *d++ = *s++;
+}
+
+static __no_builtin_patterns void copy_words_backward(void *dest,
+                                                      const void *src,
+                                                      size_t n) {
+    uint8_t *d = (uint8_t *) dest + n;
+    const uint8_t *s = (const uint8_t *) src + n;
+
+    while (n && ((uintptr_t) d & 7)) {
+        *--d = *--s;
+        n--;
+    }
+
+    for (; n >= 8; n -= 8) {
+        d -= 8;
+        s -= 8;
+        *(uint64_t *) d = *(const u64_unaligned_t *) s;
+    }
+
+    while (n--)
+        *--d = *--s;
+}
+
+static __no_builtin_patterns void fill_words(void *dest, uint8_t c, size_t n) {
+    uint8_t *d = dest;
+    uint64_t pattern = MEMOPS_FILL_PATTERN(c);
+
+    while (n && ((uintptr_t) d & 7)) {
+        *d++ = c;
+        n--;
+    }
+
+    for (; n >= 32; n -= 32, d += 32) {
+        ((uint64_t *) d)[0] = pattern;
+        ((uint64_t *) d)[1] = pattern;
+        ((uint64_t *) d)[2] = pattern;
+        ((uint64_t *) d)[3] = pattern;
+    }
+
+    for (; n >= 8; n -= 8, d += 8)
+        *(uint64_t *) d = pattern;
+
+    while (n--)
+        *d++ = c;
+}
+
+static void copy_movsq(void *dest, const void *src, size_t n) {
+    size_t qwords = n >> 3;
+    size_t bytes = n & 7;
+
+    asm volatile("rep movsq\n\t"
+                 "mov %3, %%rcx\n\t"
+                 "rep movsb"
+                 : "+D"(dest), "+S"(src), "+c"(qwords)
+                 : "r"(bytes)
+                 : "memory");
+}
+
+static void fill_stosq(void *dest, uint8_t c, size_t n) {
+    size_t qwords = n >> 3;
+    size_t bytes = n & 7;
+
+    asm volatile("rep stosq\n\t"
+                 "mov %3, %%rcx\n\t"
+                 "rep stosb"
+                 : "+D"(dest), "+c"(qwords)
+                 : "a"(MEMOPS_FILL_PATTERN(c)), "r"(bytes)
+                 : "memory");
+}
+
+static inline void rep_movsb(void *dest, const void *src, size_t n) {
+    asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_stosb(void *dest, uint8_t c, size_t n) {
+    asm volatile("rep stosb" : "+D"(dest), "+c"(n) : "a"(c) : "memory");
+}
+
+static void copy_erms(void *dest, const void *src, size_t n) {
+    if (n < MEMOPS_ERMS_MIN)
+        copy_words(dest, src, n);
+    else
+        rep_movsb(dest, src, n);
+}
+
+static void copy_fsrm(void *dest, const void *src, size_t n) {
+    rep_movsb(dest, src, n);
+}
+
+static void fill_erms(void *dest, uint8_t c, size_t n) {
+    if (n < MEMOPS_ERMS_MIN)
+        fill_words(dest, c, n);
+    else
+        rep_stosb(dest, c, n);
+}
+
+/* Fastest first, the first one supported and passing the self-test wins */
+static const struct memops_impl memops_impls[] = {
+    {"fsrm", CPU_FEAT_ERMS | CPU_FEAT_FSRM, copy_fsrm, fill_erms},
+    {"erms", CPU_FEAT_ERMS, copy_erms, fill_erms},
+    {"movsq", 0, copy_movsq, fill_stosq},
+    {"words", 0, copy_words, fill_words},
+};
+
+#define MEMOPS_IMPL_COUNT (sizeof(memops_impls) / sizeof(memops_impls[0]))
+#define MEMOPS_IMPL_FALLBACK (&memops_impls[MEMOPS_IMPL_COUNT - 1])
+
+static struct {
+    const struct memops_impl *impl;
+    size_t nt_threshold; /* 0 means non-temporal stores are off */
+} memops = {
+    .impl = MEMOPS_IMPL_FALLBACK,
+    .nt_threshold = 0,
+};
+
+static void copy_nt(void *dest, const void *src, size_t n) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    size_t head = (-(uintptr_t) d) & 7;
+
+    if (head > n)
+        head = n;
+
+    memops.impl->copy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    for (; n >= 32; n -= 32, d += 32, s += 32) {
+        uint64_t a = ((const u64_unaligned_t *) s)[0];
+        uint64_t b = ((const u64_unaligned_t *) s)[1];
+        uint64_t c = ((const u64_unaligned_t *) s)[2];
+        uint64_t e = ((const u64_unaligned_t *) s)[3];
+        asm volatile("movnti %1, 0(%0)\n\t"
+                     "movnti %2, 8(%0)\n\t"
+                     "movnti %3, 16(%0)\n\t"
+                     "movnti %4, 24(%0)"
+                     :
+                     : "r"(d), "r"(a), "r"(b), "r"(c), "r"(e)
+                     : "memory");
+    }
+
+    /* NT stores are weakly ordered, fence them before anyone can
+     * observe the copy as complete */
+    asm volatile("sfence" ::: "memory");
+    memops.impl->copy(d, s, n);
+}
+
+static void fill_nt(void *dest, uint8_t c, size_t n) {
+    uint8_t *d = dest;
+    uint64_t pattern = MEMOPS_FILL_PATTERN(c);
+    size_t head = (-(uintptr_t) d) & 7;
+
+    if (head > n)
+        head = n;
+
+    memops.impl->fill(d, c, head);
+    d += head;
+    n -= head;
+
+    for (; n >= 32; n -= 32, d += 32) {
+        asm volatile("movnti %1, 0(%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)"
+                     :
+                     : "r"(d), "r"(pattern)
+                     : "memory");
+    }
+
+    asm volatile("sfence" ::: "memory");
+    memops.impl->fill(d, c, n);
+}
+
+void *memcpy(void *dest, const void *src, uint64_t n) {
+    if (unlikely(memops.nt_threshold && n >= memops.nt_threshold))
+        copy_nt(dest, src, n);
+    else
+        memops.impl->copy(dest, src, n);
+
+    return dest;
+}
+
+void *memset(void *s, int c, uint64_t n) {
+    if (unlikely(memops.nt_threshold && n >= memops.nt_threshold))
+        fill_nt(s, (uint8_t) c, n);
+    else
+        memops.impl->fill(s, (uint8_t) c, n);
+
+    return s;
+}
+
+void *memmove(void *dest, const void *src, uint64_t n) {
+    uintptr_t d = (uintptr_t) dest;
+    uintptr_t s = (uintptr_t) src;
+
+    if (d == s || n == 0)
+        return dest;
+
+    /* Wraps around when dest is below src, so this covers both the
+     * disjoint case and the overlap that a forward copy handles */
+    if (d - s >= n)
+        memops.impl->copy(dest, src, n);
+    else
+        copy_words_backward(dest, src, n);
+
+    return dest;
+}
+
+int memcmp(const void *s1, const void *s2, uint64_t n) {
+    const uint8_t *p1 = (const uint8_t *) s1;
+    const uint8_t *p2 = (const uint8_t *) s2;
+
+    for (; n >= 8; n -= 8, p1 += 8, p2 += 8) {
+        uint64_t a = *(const u64_unaligned_t *) p1;
+        uint64_t b = *(const u64_unaligned_t *) p2;
+
+        /* byte-swap so the first differing byte is the most significant */
+        if (a != b)
+            return __builtin_bswap64(a) < __builtin_bswap64(b) ? -1 : 1;
+    }
+
+    for (; n; n--, p1++, p2++) {
+        if (*p1 != *p2)
+            return *p1 < *p2 ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Self-test
+ */
+
+#define SELFTEST_BUF_SIZE (8192 + 64)
+#define SELFTEST_GUARD 0xC5
+
+static const size_t selftest_sizes[] = {0,   1,    7,    8,    15,   16,
+                                        31,  32,   33,   63,   64,   127,
+                                        128, 129,  255,  256,  1023, 4095,
+                                        4096, 4097, 8191, 8192};
+static const size_t selftest_aligns[] = {0, 1, 3, 7};
+
+#define SELFTEST_COUNT(arr) (sizeof(arr) / sizeof(arr[0]))
+
+static __no_builtin_patterns bool bytes_equal(const uint8_t *a,
+                                              const uint8_t *b, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        if (a[i] != b[i])
+            return false;
+
+    return true;
+}
+
+static void selftest_prepare(uint8_t *src, uint8_t *dst, uint8_t *ref) {
+    for (size_t i = 0; i < SELFTEST_BUF_SIZE; i++)
+        src[i] = (uint8_t) (i * 131 + 7);
+
+    fill_bytes(dst, SELFTEST_GUARD, SELFTEST_BUF_SIZE);
+    fill_bytes(ref, SELFTEST_GUARD, SELFTEST_BUF_SIZE);
+}
+
+static bool selftest_copy(memops_copy_fn_t fn, uint8_t *src, uint8_t *dst,
+                          uint8_t *ref) {
+    for (size_t i = 0; i < SELFTEST_COUNT(selftest_sizes); i++) {
+        size_t n = selftest_sizes[i];
+        for (size_t sa = 0; sa < SELFTEST_COUNT(selftest_aligns); sa++) {
+            for (size_t da = 0; da < SELFTEST_COUNT(selftest_aligns); da++) {
+                size_t so = selftest_aligns[sa], doff = selftest_aligns[da];
+                selftest_prepare(src, dst, ref);
+                fn(dst + doff, src + so, n);
+                copy_bytes(ref + doff, src + so, n);
+                if (!bytes_equal(dst, ref, SELFTEST_BUF_SIZE))
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool selftest_fill(memops_fill_fn_t fn, uint8_t *src, uint8_t *dst,
+                          uint8_t *ref) {
+    for (size_t i = 0; i < SELFTEST_COUNT(selftest_sizes); i++) {
+        size_t n = selftest_sizes[i];
+        for (size_t a = 0; a < SELFTEST_COUNT(selftest_aligns); a++) {
+            size_t off = selftest_aligns[a];
+            uint8_t c = (uint8_t) (0x80 | n);
+            selftest_prepare(src, dst, ref);
+            fn(dst + off, c, n);
+            fill_bytes(ref + off, c, n);
+            if (!bytes_equal(dst, ref, SELFTEST_BUF_SIZE))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static bool selftest_memmove(uint8_t *src, uint8_t *dst, uint8_t *ref) {
+    const size_t n = 4096 + 3;
+    const size_t shifts[] = {1, 7, 8, 33, 4095};
+
+    for (size_t i = 0; i < SELFTEST_COUNT(shifts); i++) {
+        size_t shift = shifts[i];
+
+        /* forward overlap: dest above src */
+        selftest_prepare(src, dst, ref);
+        copy_bytes(dst, src, SELFTEST_BUF_SIZE);
+        copy_bytes(ref, src, SELFTEST_BUF_SIZE);
+        memmove(dst + shift, dst, n);
+        copy_bytes(ref + shift, src, n);
+        if (!bytes_equal(dst, ref, SELFTEST_BUF_SIZE))
+            return false;
+
+        /* backward overlap: dest below src */
+        copy_bytes(dst, src, SELFTEST_BUF_SIZE);
+        copy_bytes(ref, src, SELFTEST_BUF_SIZE);
+        memmove(dst, dst + shift, n);
+        copy_bytes(ref, src + shift, n);
+        if (!bytes_equal(dst, ref, SELFTEST_BUF_SIZE))
+            return false;
+    }
+
+    return true;
+}
+
+static bool selftest_memcmp(uint8_t *src, uint8_t *dst) {
+    const size_t n = 100;
+
+    copy_bytes(dst, src, n);
+    if (memcmp(dst, src, n) != 0)
+        return false;
+
+    for (size_t i = 0; i < n; i++) {
+        uint8_t saved = dst[i];
+
+        dst[i] = saved ^ 0x80;
+        int want = dst[i] > saved ? 1 : -1;
+        if (memcmp(dst, src, n) != want || memcmp(src, dst, n) != -want)
+            return false;
+
+        dst[i] = saved;
+    }
+
+    return true;
+}
+
+static bool selftest_impl(const struct memops_impl *impl, uint8_t *src,
+                          uint8_t *dst, uint8_t *ref) {
+    return selftest_copy(impl->copy, src, dst, ref) &&
+           selftest_fill(impl->fill, src, dst, ref);
+}
+
+static size_t nt_threshold_for(size_t llc_bytes) {
+    if (!llc_bytes)
+        return MEMOPS_NT_THRESHOLD_DEFAULT;
+
+    /* half the LLC leaves room for whatever else is resident */
+    size_t t = llc_bytes / 2;
+    return t < MEMOPS_NT_THRESHOLD_MIN ? MEMOPS_NT_THRESHOLD_MIN : t;
+}
+
+void memops_init(uint64_t cpu_features, size_t llc_bytes) {
+    uint8_t *src = kmalloc(SELFTEST_BUF_SIZE);
+    uint8_t *dst = kmalloc(SELFTEST_BUF_SIZE);
+    uint8_t *ref = kmalloc(SELFTEST_BUF_SIZE);
+
+    if (!src || !dst || !ref) {
+        log_msg(LOG_WARN, "memops: no memory for self-test, using \"%s\"",
+                memops.impl->name);
+        goto out;
+    }
+
+    for (size_t i = 0; i < MEMOPS_IMPL_COUNT; i++) {
+        const struct memops_impl *impl = &memops_impls[i];
+        uint64_t req = impl->required_features;
+
+        if ((cpu_features & req) != req)
+            continue;
+
+        if (!selftest_impl(impl, src, dst, ref)) {
+            log_msg(LOG_WARN, "memops: \"%s\" failed self-test", impl->name);
+            continue;
+        }
+
+        memops.impl = impl;
+        break;
+    }
+
+    if (!selftest_memmove(src, dst, ref) || !selftest_memcmp(src, dst))
+        panic("memops: memmove/memcmp failed self-test\n");
+
+    if (cpu_features & CPU_FEAT_SSE2) {
+        if (selftest_copy(copy_nt, src, dst, ref) &&
+            selftest_fill(fill_nt, src, dst, ref)) {
+            memops.nt_threshold = nt_threshold_for(llc_bytes);
+        } else {
+            log_msg(LOG_WARN, "memops: non-temporal path failed self-test");
+        }
+    }
+
+    log_msg(LOG_INFO, "memops: using \"%s\", non-temporal stores %s (>= %zu)",
+            memops.impl->name, memops.nt_threshold ? "on" : "off",
+            memops.nt_threshold);
+
+out:
+    kfree(src);
+    kfree(dst);
+    kfree(ref);
+}
+
+const char *memops_name(void) {
+    return memops.impl->name;
+}
+
+size_t memops_nt_threshold(void) {
+    return memops.nt_threshold;
+}
+
+bool memops_nt_enabled(void) {
+    return memops.nt_threshold != 0;
+}
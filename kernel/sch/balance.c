@@ -1,4 +1,5 @@
 /* Scheduler load balancing policy */
+#include <math/min_max.h>
 #include <mem/numa.h>
 #include <smp/domain.h>
 
@@ -7,50 +8,74 @@
 #define SCHEDULER_REMOTE_NODE_SCALE_NUMERATOR 1
 #define SCHEDULER_REMOTE_NODE_SCALE_DENOMINATOR 5
 #define IDLE_LONG_ENOUGH 10   /* if the other core is idle for 10ms */
-#define IDLE_MIN_MIGRATABLE 3 /* and we have 3 migratable */
+#define IDLE_MIN_MIGRATABLE 3 /* and we have 3 threads' worth migratable */
 
-/* fraction = remote_scale * (1 / (1 + dist))
+/* Everything here goes by load (see sch/load.h), not thread counts, so
+ * one thread that always runs weighs as much as a handful that mostly
+ * sleep. A move takes whole threads that fit in what is left of the load
+ * budget, so it never hands over much more than it was meant to.
+ *
+ * fraction = remote_scale * (1 / (1 + dist))
  *
  * using integer math:
  *
- * to_migrate = (count * remote_scale_num)  / ((1 + dist) * remote_scale_den);
+ * budget = (load * remote_scale_num)  / ((1 + dist) * remote_scale_den);
  */
 
-/* it's OK if this races, we are just counting threads */
-static size_t migratable_in_tree(size_t caller, struct rbt *rbt) {
+/* it's OK if this races, we are just adding up loads */
+static uint64_t migratable_in_tree(size_t caller, struct rbt *rbt,
+                                   uint64_t now_us) {
     struct rbt_node *rb;
-    size_t agg = 0;
+    uint64_t agg = 0;
     rbt_for_each(rb, rbt) {
         struct thread *t = thread_from_rq_rbt_node(rb);
         if (scheduler_can_take_thread(caller, t))
-            agg++;
+            agg += thread_load(t, now_us);
     }
     return agg;
 }
 
-static size_t migratable_in_list(size_t caller, struct list_head *tq) {
+static uint64_t migratable_in_list(size_t caller, struct list_head *tq,
+                                   uint64_t now_us) {
     struct list_head *ln;
-    size_t agg = 0;
+    uint64_t agg = 0;
     list_for_each(ln, tq) {
         struct thread *t = thread_from_rq_list_node(ln);
         if (scheduler_can_take_thread(caller, t))
-            agg++;
+            agg += thread_load(t, now_us);
     }
     return agg;
 }
 
-void scheduler_count_migratable_threads(struct scheduler *caller,
-                                        struct scheduler *s,
-                                        size_t agg[THREAD_PRIO_CLASS_COUNT]) {
+void scheduler_migratable_load(struct scheduler *caller, struct scheduler *s,
+                               uint64_t agg[THREAD_PRIO_CLASS_COUNT],
+                               uint64_t now_us) {
     SPINLOCK_ASSERT_HELD(&caller->lock);
     SPINLOCK_ASSERT_HELD(&s->lock);
-    /* count urgent, count realtime, count timesharing, count background */
+    /* urgent, realtime, timesharing, background */
     size_t c = caller->core_id;
-    agg[THREAD_PRIO_CLASS_URGENT] = migratable_in_list(c, &s->urgent_threads);
-    agg[THREAD_PRIO_CLASS_RT] = migratable_in_list(c, &s->rt_threads);
-    agg[THREAD_PRIO_CLASS_BACKGROUND] = migratable_in_list(c, &s->bg_threads);
-    agg[THREAD_PRIO_CLASS_TIMESHARE] = migratable_in_tree(c, &s->completed_rbt);
-    agg[THREAD_PRIO_CLASS_TIMESHARE] += migratable_in_tree(c, &s->thread_rbt);
+    agg[THREAD_PRIO_CLASS_URGENT] =
+        migratable_in_list(c, &s->urgent_threads, now_us);
+    agg[THREAD_PRIO_CLASS_RT] = migratable_in_list(c, &s->rt_threads, now_us);
+    agg[THREAD_PRIO_CLASS_BACKGROUND] =
+        migratable_in_list(c, &s->bg_threads, now_us);
+    agg[THREAD_PRIO_CLASS_TIMESHARE] =
+        migratable_in_tree(c, &s->completed_rbt, now_us);
+    agg[THREAD_PRIO_CLASS_TIMESHARE] +=
+        migratable_in_tree(c, &s->thread_rbt, now_us);
+}
+
+/* Taking a thread that doesn't fit would overshoot and can flip the
+ * imbalance around. The first one goes regardless, or a budget smaller
+ * than any single thread would never move anything */
+static inline bool spend_budget(uint64_t *budget, struct thread *t,
+                                uint64_t now_us, bool first) {
+    uint64_t load = thread_load(t, now_us);
+    if (load > *budget && !first)
+        return false;
+
+    *budget -= MIN(*budget, load);
+    return true;
 }
 
 /* this is a fun trick... if there is no NUMA, the `associated_node` will be
@@ -74,7 +99,8 @@ static void move_ts_thread_raw(struct scheduler *dest, struct scheduler *source,
 
 static size_t migrate_from_tree(struct scheduler *to,
                                 struct scheduler *from_sched, struct rbt *from,
-                                size_t target) {
+                                uint64_t *budget, uint64_t now_us,
+                                size_t already_migrated) {
     size_t migrated = 0;
     struct rbt_node *rb;
 
@@ -85,14 +111,16 @@ static size_t migrate_from_tree(struct scheduler *to,
      * even if it slightly breaks our "every other thread" rule. */
     bool prev_migrated = false;
     rbt_for_each(rb, from) {
-        if (migrated >= target)
+        if (!*budget)
             break;
 
         struct thread *t = thread_from_rq_rbt_node(rb);
 
         /* we are on a thread we will give priority to migrating */
         if (!prev_migrated) {
-            if (scheduler_can_take_thread(to->core_id, t)) {
+            bool first = !already_migrated && !migrated;
+            if (scheduler_can_take_thread(to->core_id, t) &&
+                spend_budget(budget, t, now_us, first)) {
                 move_ts_thread_raw(to, from_sched, from, t);
                 prev_migrated = true;
                 migrated++;
@@ -106,16 +134,19 @@ static size_t migrate_from_tree(struct scheduler *to,
     return migrated;
 }
 
-/* migrate `num_threads` threads, and return how many threads we migrated. In
- * the event that we are migrating from the timesharing threads, every OTHER
- * thread will be migrated until `num_threads` is reached. we do this to
- * prevent stealing either all the high prio threads, all the low prio threads,
- * or all the middlers. */
+/* migrate threads until `budget` worth of load moved, and return how many
+ * threads we migrated. `already_migrated` is how many earlier classes moved,
+ * only a push that hasn't moved anything yet may overshoot. In the event
+ * that we are migrating from the timesharing threads, every OTHER thread
+ * will be migrated until the budget is used up. we do this to prevent
+ * stealing either all the high prio threads, all the low prio threads, or
+ * all the middlers. */
 static size_t migrate_from_prio_class(struct scheduler *to,
                                       struct scheduler *from,
                                       enum thread_prio_class class,
-                                      size_t nthreads) {
-    if (!nthreads)
+                                      uint64_t budget, uint64_t now_us,
+                                      size_t already_migrated) {
+    if (!budget)
         return 0;
 
     size_t migrated = 0;
@@ -126,12 +157,13 @@ static size_t migrate_from_prio_class(struct scheduler *to,
 
         struct list_head *ln, *tmp;
         list_for_each_safe(ln, tmp, from_queue) {
-            if (migrated >= nthreads)
+            if (!budget)
                 break;
 
             struct thread *t = thread_from_rq_list_node(ln);
-            if (scheduler_can_take_thread(to->core_id, t)) {
-
+            if (scheduler_can_take_thread(to->core_id, t) &&
+                spend_budget(&budget, t, now_us,
+                             !already_migrated && !migrated)) {
                 list_del_init(ln);
                 scheduler_decrement_thread_count(from, t);
 
@@ -147,11 +179,10 @@ static size_t migrate_from_prio_class(struct scheduler *to,
         /* migrating timesharing threads. first try to migrate threads that have
          * not ran this period, skipping every other thread, and then try and
          * migrate the completed threads */
-        size_t took = migrate_from_tree(to, from, &from->thread_rbt, nthreads);
-        migrated += took;
-        nthreads -= took;
-
-        migrated += migrate_from_tree(to, from, &from->completed_rbt, nthreads);
+        migrated += migrate_from_tree(to, from, &from->thread_rbt, &budget,
+                                      now_us, already_migrated + migrated);
+        migrated += migrate_from_tree(to, from, &from->completed_rbt, &budget,
+                                      now_us, already_migrated + migrated);
     }
 
     return migrated;
@@ -175,11 +206,12 @@ size_t scheduler_try_push_to_idle_core(struct scheduler *sched) {
     if (!spin_trylock_raw(&other->lock))
         return 0;
 
-    /* from the OTHER core's perspective, how many threads can we migrate? */
-    size_t migratable[THREAD_PRIO_CLASS_COUNT];
-    scheduler_count_migratable_threads(other, sched, migratable);
+    /* from the OTHER core's perspective, how much load can we migrate? */
+    uint64_t now_us = time_get_us();
+    uint64_t migratable[THREAD_PRIO_CLASS_COUNT];
+    scheduler_migratable_load(other, sched, migratable, now_us);
 
-    size_t total_migratable = 0;
+    uint64_t total_migratable = 0;
     for (size_t i = 0; i < THREAD_PRIO_CLASS_COUNT; i++)
         total_migratable += migratable[i];
 
@@ -187,12 +219,13 @@ size_t scheduler_try_push_to_idle_core(struct scheduler *sched) {
     if (!total_migratable)
         goto out;
 
-    /* if we are in the same NUMA node, migrate half of our threads
+    /* if we are in the same NUMA node, migrate half of our load
      * from each priority class so we are near identical */
     if (cores_in_same_numa_node(this_core, other_core)) {
         for (size_t i = 0; i < THREAD_PRIO_CLASS_COUNT; i++) {
-            size_t to_migrate = migratable[i] / 2;
-            migrated += migrate_from_prio_class(other, sched, i, to_migrate);
+            uint64_t budget = migratable[i] / 2;
+            migrated += migrate_from_prio_class(other, sched, i, budget,
+                                                now_us, migrated);
         }
     } else {
         /* remote node */
@@ -209,29 +242,31 @@ size_t scheduler_try_push_to_idle_core(struct scheduler *sched) {
         size_t dist_factor = (1 + dist) * remote_scale_den;
 
         for (size_t i = 0; i < THREAD_PRIO_CLASS_COUNT; i++) {
-            size_t count = migratable[i];
-            if (count == 0)
+            uint64_t load = migratable[i];
+            if (load == 0)
                 continue;
 
-            size_t to_migrate = (count * remote_scale_num) / dist_factor;
+            uint64_t budget = (load * remote_scale_num) / dist_factor;
 
-            /* Enforce minimum if remote move is allowed */
-            if (to_migrate == 0 && count > 0)
-                to_migrate = 1;
+            /* Enforce minimum if remote move is allowed, any budget at
+             * all lets the first thread of the push go */
+            if (budget == 0 && load > 0)
+                budget = 1;
 
             time_t idle_entry = other->idle_thread_data.last_entry_ms;
-            time_t idle_for = time_get_ms() - idle_entry;
-            if (to_migrate == 0 && count >= IDLE_MIN_MIGRATABLE &&
+            time_t idle_for = US_TO_MS(now_us) - idle_entry;
+            if (budget == 0 && load >= IDLE_MIN_MIGRATABLE * LOAD_SCALE &&
                 idle_for >= IDLE_LONG_ENOUGH) {
-                to_migrate = 1;
+                budget = 1;
             }
 
-            migrated += migrate_from_prio_class(other, sched, i, to_migrate);
+            migrated += migrate_from_prio_class(other, sched, i, budget,
+                                                now_us, migrated);
         }
     }
 
-    /* if the other core is in the same node as us, we push half of our threads
-     * over there. otherwise, we push (1 / distance * scale) of our threads */
+    /* if the other core is in the same node as us, we push half of our load
+     * over there. otherwise, we push (1 / distance * scale) of our load */
 
 out:
     spin_unlock_raw(&other->lock);
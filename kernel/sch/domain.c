@@ -27,6 +27,14 @@ static bool cpu_mask_intersects(const struct cpu_mask *a,
     return false;
 }
 
+static int32_t cpu_mask_first(const struct cpu_mask *m) {
+    for (size_t cpu = 0; cpu < m->nbits; cpu++)
+        if (cpu_mask_test(m, cpu))
+            return cpu;
+
+    return -1;
+}
+
 static struct scheduler_domain *
 build_domain_for_level(enum topology_level lvl) {
     struct topology *t = &global.topology;
@@ -55,8 +63,12 @@ build_domain_for_level(enum topology_level lvl) {
 
         d->groups[i].parent_index = -1;
 
-        /* dummy capacity for now */
-        d->groups[i].capacity = 1;
+        /* every CPU counts as one for now */
+        d->groups[i].capacity = cpu_mask_popcount(&d->groups[i].cpus);
+
+        d->groups[i].cpu = -1;
+        if (lvl == TOPOLOGY_LEVEL_SMT)
+            d->groups[i].cpu = cpu_mask_first(&node->cpus);
     }
 
     return d;
@@ -75,10 +87,30 @@ static void link_parent_groups(struct scheduler_domain *child,
             struct scheduler_group *pgp = &parent->groups[pg];
             if (cpu_mask_intersects(&cg->cpus, &pgp->cpus)) {
                 cg->parent_index = pg;
+                pgp->nchildren++;
                 break;
             }
         }
     }
+
+    /* and the other way around, for walking down when stealing */
+    for (size_t pg = 0; pg < parent->ngroups; pg++) {
+        struct scheduler_group *pgp = &parent->groups[pg];
+        pgp->children = kzalloc(sizeof(int32_t) * pgp->nchildren);
+        if (pgp->nchildren && !pgp->children)
+            panic("OOM\n");
+
+        pgp->nchildren = 0;
+    }
+
+    for (size_t g = 0; g < child->ngroups; g++) {
+        int32_t pg = child->groups[g].parent_index;
+        if (pg < 0)
+            continue;
+
+        struct scheduler_group *pgp = &parent->groups[pg];
+        pgp->children[pgp->nchildren++] = g;
+    }
 }
 
 static void map_cpus_to_groups(void) {
@@ -0,0 +1,185 @@
+/* Idle governor.
+ *
+ * Every time the idle thread is about to sleep, it guesses how long it
+ * will stay asleep: no longer than until the next timer on this CPU,
+ * and usually about as long as recent idle periods have lasted. The
+ * deepest state that pays off for that long gets picked.
+ *
+ * MWAIT states sleep on the CPU's `needs_resched` flag. While a CPU is
+ * in one, `idle_polling` is set, and waking it for a reschedule is just
+ * the store to the flag instead of an IPI. */
+
+#include <acpi/cst.h>
+#include <asm.h>
+#include <global.h>
+#include <log.h>
+#include <math/min_max.h>
+#include <sch/idle.h>
+#include <sch/sched.h>
+#include <sch/tick.h>
+#include <smp/core.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+/* the average moves 1/8th of the way to each new idle period */
+#define IDLE_PREDICT_SHIFT 3
+
+/* ACPI gives exit latency only, a state is worth it past twice that */
+#define IDLE_RESIDENCY_FACTOR 2
+
+/* MWAIT bit 0 of ECX, break on interrupts even when they are off */
+#define IDLE_MWAIT_BREAK_ON_IRQ 1
+
+static struct idle_state states[IDLE_MAX_STATES];
+static size_t state_count = 0;
+static LOG_HANDLE_DECLARE_DEFAULT(idle);
+
+static void add_state(const char *name, enum idle_entry entry, uint32_t hint,
+                      uint32_t latency_us) {
+    if (state_count == IDLE_MAX_STATES)
+        return;
+
+    struct idle_state *s = &states[state_count++];
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    s->entry = entry;
+    s->hint = hint;
+    s->exit_latency_us = latency_us;
+    s->target_residency_us = MAX(latency_us * IDLE_RESIDENCY_FACTOR, 1u);
+}
+
+static bool cpu_has_mwait(void) {
+    return smp_core()->cap.feature_bits & CPU_FEAT_MWAIT;
+}
+
+void idle_init(void) {
+    bool mwait_ok = cpu_has_mwait();
+
+    /* C1 always exists, MWAIT hint 0 is C1 too */
+    if (mwait_ok)
+        add_state("C1", IDLE_ENTRY_MWAIT, 0, 1);
+    else
+        add_state("C1", IDLE_ENTRY_HALT, 0, 1);
+
+    for (size_t i = 0; i < acpi_cst.count; i++) {
+        struct acpi_cpu_context *cx = &acpi_cst.states[i];
+
+        /* the firmware's C1 might come with a better MWAIT hint */
+        if (cx->type <= 1) {
+            if (mwait_ok && cx->entry_method == ACPI_CSTATE_FFH)
+                states[0].hint = cx->addr;
+
+            continue;
+        }
+
+        if (cx->entry_method == ACPI_CSTATE_FFH && mwait_ok) {
+            add_state(cx->desc, IDLE_ENTRY_MWAIT, cx->addr, cx->latency);
+        } else if (cx->entry_method == ACPI_CSTATE_SYSTEMIO && cx->type == 2) {
+            add_state(cx->desc, IDLE_ENTRY_IO, cx->addr, cx->latency);
+        }
+
+        /* I/O port C3 needs bus master arbitration handled, and we
+         * don't do that, so it's skipped */
+    }
+
+    for (size_t i = 0; i < state_count; i++)
+        log_info_global(LOG_HANDLE(idle),
+                        "%s: %s, hint 0x%x, exit %u us, residency %u us",
+                        states[i].name,
+                        states[i].entry == IDLE_ENTRY_MWAIT ? "mwait"
+                        : states[i].entry == IDLE_ENTRY_IO  ? "io"
+                                                            : "hlt",
+                        states[i].hint, states[i].exit_latency_us,
+                        states[i].target_residency_us);
+}
+
+static size_t select_state(struct core *c, uint64_t now_us) {
+    struct idle_governor_data *gov = &c->idle_gov;
+    uint64_t predicted = gov->predicted_us;
+
+    uint64_t next = tick_next_deadline(&c->tick);
+    if (next != TICK_NEVER)
+        predicted = MIN(predicted, next > now_us ? next - now_us : 0);
+
+    size_t pick = 0;
+    for (size_t i = 1; i < state_count; i++)
+        if (states[i].target_residency_us <= predicted)
+            pick = i;
+
+    return pick;
+}
+
+/* Interrupts are off going in and coming out */
+static void enter_state(struct core *c, struct idle_state *s) {
+    switch (s->entry) {
+    case IDLE_ENTRY_MWAIT:
+        atomic_store(&c->idle_polling, true);
+        monitor(&c->needs_resched);
+
+        /* a store before the monitor was armed won't wake us */
+        if (!atomic_load(&c->needs_resched))
+            mwait(s->hint, IDLE_MWAIT_BREAK_ON_IRQ);
+
+        atomic_store(&c->idle_polling, false);
+        break;
+
+    case IDLE_ENTRY_IO:
+        inb(s->hint);
+        break;
+
+    case IDLE_ENTRY_HALT:
+        enable_interrupts_and_wait();
+        disable_interrupts();
+        break;
+    }
+}
+
+static void account(struct core *c, size_t idx, uint64_t slept_us) {
+    struct idle_governor_data *gov = &c->idle_gov;
+    gov->stats[idx].usage++;
+    gov->stats[idx].residency_us += slept_us;
+
+    int64_t diff = (int64_t) slept_us - (int64_t) gov->predicted_us;
+    gov->predicted_us += diff >> IDLE_PREDICT_SHIFT;
+}
+
+void idle_enter(void) {
+    if (!state_count) {
+        enable_interrupts_and_wait();
+        return;
+    }
+
+    /* HIGH_LEVEL so time_get_us() won't turn interrupts back on */
+    enum irql irql = irql_raise(IRQL_HIGH_LEVEL);
+    disable_interrupts();
+
+    struct core *c = smp_core();
+    if (atomic_load(&c->needs_resched)) {
+        irql_lower(irql);
+        enable_interrupts();
+        return;
+    }
+
+    uint64_t start = time_get_us();
+    size_t idx = select_state(c, start);
+    enter_state(c, &states[idx]);
+
+    uint64_t end = time_get_us();
+    account(c, idx, end > start ? end - start : 0);
+
+    irql_lower(irql);
+    enable_interrupts();
+}
+
+size_t idle_state_count(void) {
+    return state_count;
+}
+
+const struct idle_state *idle_state_get(size_t idx) {
+    return idx < state_count ? &states[idx] : NULL;
+}
+
+void idle_get_stats(size_t cpu, struct idle_state_stats *out) {
+    struct core *c = global.cores[cpu];
+    memcpy(out, c->idle_gov.stats, sizeof(c->idle_gov.stats));
+}
@@ -56,6 +56,41 @@ static inline void scheduler_increment_thread_count(struct scheduler *sched,
     atomic_fetch_add(&scheduler_data.total_threads, 1);
 }
 
+/* Call after the thread's state changes, what it accumulates from here
+ * on follows from the state: on a CPU, waiting for one, or neither */
+static inline void thread_update_load(struct thread *t, uint64_t now_us) {
+    enum thread_state state = thread_get_state(t);
+    if (state == THREAD_STATE_IDLE_THREAD)
+        return;
+
+    bool running = state == THREAD_STATE_RUNNING;
+    bool runnable = running || state == THREAD_STATE_READY;
+    load_avg_set(&t->load, now_us, runnable, running);
+}
+
+/* Same for the runqueue, after anything was queued, dequeued or
+ * switched to. The current thread isn't in the counts, so it's added */
+static inline void scheduler_update_load(struct scheduler *sched,
+                                         uint64_t now_us) {
+    struct thread *curr = sched->current;
+    bool running = curr && thread_get_state(curr) == THREAD_STATE_RUNNING;
+    load_avg_set(&sched->load, now_us, sched->total_thread_count + running,
+                 running);
+}
+
+/* Runnable load of a runqueue, also readable without its lock */
+static inline uint64_t scheduler_load(struct scheduler *sched,
+                                      uint64_t now_us) {
+    return load_avg_runnable(&sched->load, now_us);
+}
+
+/* Never 0, so a thread that hasn't built up any history yet still
+ * counts for something when load gets moved around */
+static inline uint64_t thread_load(struct thread *t, uint64_t now_us) {
+    uint64_t load = load_avg_runnable(&t->load, now_us);
+    return load ? load : 1;
+}
+
 static inline size_t scheduler_get_thread_count(struct scheduler *sched,
                                                 enum thread_prio_class prio) {
     return sched->thread_count[prio];
@@ -229,3 +264,10 @@ void thread_wake_locked(struct thread *t, enum thread_wake_reason r,
                         void *wake_src);
 void scheduler_switch_in();
 void thread_post_migrate(struct thread *t, size_t old_cpu, size_t new_cpu);
+
+#ifdef TEST_SCHED
+/* One level of the victim walk over a load per CPU id instead of the
+ * live runqueues, the CPU it would steal from or -1 */
+int32_t scheduler_steal_candidate_loads(struct core *me, size_t lvl,
+                                        const uint64_t *loads);
+#endif
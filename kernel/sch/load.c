@@ -0,0 +1,124 @@
+/* Per-entity load tracking, see sch/load.h.
+ *
+ * Each period contributes up to LOAD_AVG_PERIOD_US to a sum, and every
+ * period that passes multiplies the sum by y, where y^32 = 1/2. The sum
+ * of a signal that never turns off converges on LOAD_AVG_MAX, so the
+ * average is just the sum over that. */
+
+#include <math/min_max.h>
+#include <sch/load.h>
+
+/* y^n in 0.32 fixed point, for n in [0, LOAD_AVG_HALFLIFE) */
+static const uint32_t decay_inv[LOAD_AVG_HALFLIFE] = {
+    0xffffffff, 0xfa83b2db, 0xf5257d15, 0xefe4b99b, 0xeac0c6e7, 0xe5b906e7,
+    0xe0ccdeec, 0xdbfbb797, 0xd744fcca, 0xd2a81d91, 0xce248c15, 0xc9b9bd86,
+    0xc5672a11, 0xc12c4cca, 0xbd08a39f, 0xb8fbaf47, 0xb504f333, 0xb123f581,
+    0xad583eea, 0xa9a15ab4, 0xa5fed6a9, 0xa2704303, 0x9ef53260, 0x9b8d39b9,
+    0x9837f051, 0x94f4efa8, 0x91c3d373, 0x8ea4398b, 0x8b95c1e3, 0x88980e80,
+    0x85aac367, 0x82cd8698,
+};
+
+/* past this many periods, anything has decayed to nothing */
+#define LOAD_AVG_MAX_PERIODS (LOAD_AVG_HALFLIFE * 63)
+
+static uint64_t decay(uint64_t val, uint64_t periods) {
+    if (periods > LOAD_AVG_MAX_PERIODS)
+        return 0;
+
+    val >>= periods / LOAD_AVG_HALFLIFE;
+    periods %= LOAD_AVG_HALFLIFE;
+
+    return (uint64_t) (((unsigned __int128) val * decay_inv[periods]) >> 32);
+}
+
+/* What `periods` whole periods add, split in three:
+ *
+ *   d1: the rest of the period we were in, decayed the full way
+ *   d2: every full period in between, as a closed form off LOAD_AVG_MAX
+ *   d3: the start of the period we are in now, not decayed at all */
+static uint64_t segments(uint64_t periods, uint32_t d1, uint32_t d3) {
+    uint64_t c1 = decay(d1, periods);
+    uint64_t c2 = LOAD_AVG_MAX - decay(LOAD_AVG_MAX, periods) -
+                  LOAD_AVG_PERIOD_US;
+
+    return c1 + c2 + d3;
+}
+
+static void refresh_avgs(struct load_avg *la) {
+    uint32_t div = LOAD_AVG_MAX - LOAD_AVG_PERIOD_US + la->period_contrib;
+    la->runnable_avg = la->runnable_sum * LOAD_SCALE / div;
+    la->util_avg = MIN(la->running_sum * LOAD_SCALE / div, LOAD_SCALE);
+}
+
+void load_avg_update(struct load_avg *la, uint64_t now_us) {
+    if (!la->last_update_us) {
+        la->last_update_us = now_us;
+        return;
+    }
+
+    if (now_us <= la->last_update_us)
+        return;
+
+    uint64_t delta = now_us - la->last_update_us;
+    la->last_update_us = now_us;
+
+    uint64_t contrib = delta;
+    delta += la->period_contrib;
+    uint64_t periods = delta / LOAD_AVG_PERIOD_US;
+
+    /* only a period boundary decays anything */
+    if (periods) {
+        la->runnable_sum = decay(la->runnable_sum, periods);
+        la->running_sum = decay(la->running_sum, periods);
+
+        delta %= LOAD_AVG_PERIOD_US;
+        contrib = segments(periods, LOAD_AVG_PERIOD_US - la->period_contrib,
+                           delta);
+    }
+
+    la->period_contrib = delta;
+
+    la->runnable_sum += contrib * la->nr_runnable;
+    if (la->running)
+        la->running_sum += contrib;
+
+    refresh_avgs(la);
+}
+
+void load_avg_set(struct load_avg *la, uint64_t now_us, uint32_t nr_runnable,
+                  bool running) {
+    load_avg_update(la, now_us);
+    la->nr_runnable = nr_runnable;
+    la->running = running;
+}
+
+/* Both sides have to be up to the same time for the sums to line up */
+void load_avg_attach(struct load_avg *rq, const struct load_avg *t) {
+    rq->runnable_sum += t->runnable_sum;
+    rq->running_sum += t->running_sum;
+
+    refresh_avgs(rq);
+}
+
+void load_avg_detach(struct load_avg *rq, const struct load_avg *t) {
+    /* the runqueue only ever saw part of the thread's history */
+    rq->runnable_sum -= MIN(rq->runnable_sum, t->runnable_sum);
+    rq->running_sum -= MIN(rq->running_sum, t->running_sum);
+
+    refresh_avgs(rq);
+}
+
+/* Runs the update on a copy, the owner keeps writing the real one */
+static struct load_avg project(const struct load_avg *la, uint64_t now_us) {
+    struct load_avg copy = *la;
+    load_avg_update(&copy, now_us);
+    return copy;
+}
+
+uint32_t load_avg_runnable(const struct load_avg *la, uint64_t now_us) {
+    return project(la, now_us).runnable_avg;
+}
+
+uint32_t load_avg_util(const struct load_avg *la, uint64_t now_us) {
+    return project(la, now_us).util_avg;
+}
@@ -53,6 +53,18 @@ void thread_post_migrate(struct thread *t, size_t old_cpu, size_t new_cpu) {
     SPINLOCK_ASSERT_HELD(&global.schedulers[old_cpu]->lock);
     SPINLOCK_ASSERT_HELD(&global.schedulers[new_cpu]->lock);
     climb_post_migrate_hook(t, old_cpu, new_cpu);
+
+    /* everything has to be up to now before the history moves over */
+    struct scheduler *from = global.schedulers[old_cpu];
+    struct scheduler *to = global.schedulers[new_cpu];
+    uint64_t now_us = time_get_us();
+
+    thread_update_load(t, now_us);
+    scheduler_update_load(from, now_us);
+    scheduler_update_load(to, now_us);
+
+    load_avg_detach(&from->load, &t->load);
+    load_avg_attach(&to->load, &t->load);
 }
 
 void thread_migrate(struct thread *t, size_t dest_core) {
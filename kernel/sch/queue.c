@@ -33,6 +33,10 @@ void scheduler_add_thread(struct scheduler *sched, struct thread *task,
     thread_set_runqueue(task, sched);
     scheduler_increment_thread_count(sched, task);
 
+    uint64_t now_us = time_get_us();
+    thread_update_load(task, now_us);
+    scheduler_update_load(sched, now_us);
+
     bool is_local = sched == smp_core_scheduler();
     bool period_disabled = !sched->period_enabled;
 
@@ -63,6 +67,8 @@ void scheduler_remove_thread(struct scheduler *sched, struct thread *t,
     }
 
     scheduler_decrement_thread_count(sched, t);
+    scheduler_update_load(sched, time_get_us());
+
     if (!lock_held)
         spin_unlock(&sched->lock, irql);
 }
@@ -1,7 +1,7 @@
-#include <acpi/lapic.h>
 #include <mem/vmm.h>
 #include <sch/periodic_work.h>
 #include <sch/sched.h>
+#include <sch/tick.h>
 #include <smp/smp.h>
 #include <sync/rcu.h>
 #include <thread/apc.h>
@@ -28,10 +28,19 @@ struct scheduler_data scheduler_data = {
     .steal_min_diff = SCHEDULER_DEFAULT_WORK_STEAL_MIN_DIFF,
 };
 
+/* The tick is one-shot, every slice has to be armed on its own */
+static inline void arm_slice(struct scheduler *self) {
+    time_t duration = self->tick_duration_ms;
+    if (!duration)
+        duration = THREAD_DEFAULT_TIMESLICE;
+
+    tick_set_deadline(TICK_EVENT_SLICE, time_get_us() + MS_TO_US(duration));
+}
+
 static inline void tick_disable() {
     struct scheduler *self = smp_core_scheduler();
     if (scheduler_tick_enabled(self)) {
-        lapic_timer_disable();
+        tick_set_deadline(TICK_EVENT_SLICE, TICK_NEVER);
         scheduler_set_tick_enabled(self, false);
     }
 }
@@ -39,7 +48,7 @@ static inline void tick_disable() {
 static inline void tick_enable() {
     struct scheduler *self = smp_core_scheduler();
     if (!scheduler_tick_enabled(self)) {
-        lapic_timer_enable();
+        arm_slice(self);
         scheduler_set_tick_enabled(self, true);
     }
 }
@@ -55,13 +64,10 @@ void scheduler_tick_disable() {
 static inline void change_tick_duration(uint64_t new_duration) {
     struct scheduler *self = smp_core_scheduler();
 
-    /* Tick duration is the same */
-    if (self->tick_duration_ms == new_duration && scheduler_tick_enabled(self))
-        return;
-
+    /* Even the same duration gets re-armed, the last slice is spent */
     self->tick_duration_ms = new_duration;
-    lapic_timer_set_ms(new_duration);
-    tick_enable();
+    arm_slice(self);
+    scheduler_set_tick_enabled(self, true);
 }
 
 void scheduler_change_tick_duration(uint64_t new_duration) {
@@ -255,6 +261,9 @@ static void change_tick(struct scheduler *sched, struct thread *next) {
          * URGENT still needs it so that it can switch out and
          * run another thread when the boost leaves */
         tick_disable();
+    } else if (scheduler_tick_enabled(sched)) {
+        /* URGENT keeps the tick, but a new slice has to be armed */
+        change_tick_duration(sched->tick_duration_ms);
     }
 }
 
@@ -289,7 +298,8 @@ static inline void context_switch(struct thread *curr, struct thread *next) {
 }
 
 void schedule(void) {
-    time_t time = time_get_ms();
+    uint64_t now_us = time_get_us();
+    time_t time = US_TO_MS(now_us);
 
     struct scheduler *sched = smp_core_scheduler();
 
@@ -308,6 +318,9 @@ void schedule(void) {
         save_thread(sched, curr, time);
     }
 
+    if (curr)
+        thread_update_load(curr, now_us);
+
     /* Checks if we can steal, finds a victim, and tries to steal.
      * NULL is returned if any step was unsuccessful */
     struct thread *stolen = scheduler_try_do_steal(sched);
@@ -326,10 +339,27 @@ void schedule(void) {
     }
 
     load_thread(sched, next, time);
+    thread_update_load(next, now_us);
+    scheduler_update_load(sched, now_us);
 
     context_switch(curr, next);
 }
 
+void scheduler_tick_update_load(void) {
+    struct scheduler *sched = smp_core_scheduler();
+
+    /* whoever holds it is about to update it anyways */
+    if (!spin_trylock_raw(&sched->lock))
+        return;
+
+    uint64_t now_us = time_get_us();
+    if (sched->current)
+        thread_update_load(sched->current, now_us);
+
+    scheduler_update_load(sched, now_us);
+    spin_unlock_raw(&sched->lock);
+}
+
 void scheduler_switch_in() {
     struct scheduler *us = smp_core_scheduler();
     struct scheduler *other = us->other_locked;
@@ -1,3 +1,5 @@
+#include <math/min_max.h>
+#include <sch/domain.h>
 #include <sch/sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -5,6 +7,7 @@
 #include <stdint.h>
 #include <sync/spinlock.h>
 #include <thread/apc.h>
+#include <time.h>
 
 #include "internal.h"
 #include "sched_profiling.h"
@@ -20,48 +23,198 @@ bool scheduler_can_take_thread(size_t core, struct thread *target) {
            -1;
 }
 
-/* self->stealing_work should already be set before this is called */
-/* TODO: Rate limit me so I don't do a full scan of all cores due to that being
- * expensive */
-struct scheduler *scheduler_pick_victim(struct scheduler *self) {
+/* Runnable load, so a CPU with one thread that always runs and a few
+ * that mostly sleep doesn't look like it has a pile of work queued */
+static uint64_t cpu_load(int32_t cpu, uint64_t now_us) {
+    if (cpu < 0)
+        return 0;
+
+    return scheduler_load(global.schedulers[cpu], now_us);
+}
+
+/* `loads` is NULL for the live runqueues. Anything else is a load per
+ * CPU id to use instead, and never touches the group caches */
+static uint64_t group_load(size_t lvl, struct scheduler_group *g,
+                           uint64_t now_us, const uint64_t *loads);
+
+static uint64_t group_sum(size_t lvl, struct scheduler_group *g,
+                          uint64_t now_us, const uint64_t *loads) {
+    struct scheduler_domain *below = global.scheduler_domains[lvl - 1];
+    uint64_t sum = 0;
+    for (size_t i = 0; i < g->nchildren; i++)
+        sum += group_load(lvl - 1, &below->groups[g->children[i]], now_us,
+                          loads);
+
+    return sum;
+}
+
+/* Cached per group, and summed up from the level below by whoever
+ * finds it stale. A steal only ever looks at the groups along one path
+ * down the hierarchy, so it's only as expensive as the hierarchy is deep */
+static uint64_t group_load(size_t lvl, struct scheduler_group *g,
+                           uint64_t now_us, const uint64_t *loads) {
+    if (lvl == TOPOLOGY_LEVEL_SMT) {
+        if (loads)
+            return g->cpu < 0 ? 0 : loads[g->cpu];
+
+        return cpu_load(g->cpu, now_us);
+    }
+
+    if (loads)
+        return group_sum(lvl, g, now_us, loads);
+
+    uint64_t now = US_TO_MS(now_us);
+    uint64_t stamp = atomic_load(&g->load_stamp_ms);
+    if (now - stamp < SCHEDULER_GROUP_LOAD_TTL_MS ||
+        !atomic_compare_exchange_strong(&g->load_stamp_ms, &stamp, now))
+        return atomic_load(&g->load);
+
+    uint64_t sum = group_sum(lvl, g, now_us, loads);
+    atomic_store(&g->load, sum);
+    return sum;
+}
+
+/* Per CPU in the group, scaled by 100 like the steal threshold */
+static inline uint64_t group_avg_load(size_t lvl, struct scheduler_group *g,
+                                      uint64_t now_us, const uint64_t *loads) {
+    return group_load(lvl, g, now_us, loads) * 100 / MAX(g->capacity, 1u);
+}
+
+/* The busiest group below `g`, skipping `skip` */
+static struct scheduler_group *busiest_child(size_t lvl,
+                                             struct scheduler_group *g,
+                                             int32_t skip, uint64_t now_us,
+                                             const uint64_t *loads,
+                                             uint64_t *avg_out) {
+    struct scheduler_domain *below = global.scheduler_domains[lvl - 1];
+    struct scheduler_group *busiest = NULL;
+    uint64_t busiest_avg = 0;
+
+    for (size_t i = 0; i < g->nchildren; i++) {
+        if (g->children[i] == skip)
+            continue;
+
+        struct scheduler_group *child = &below->groups[g->children[i]];
+        uint64_t avg = group_avg_load(lvl - 1, child, now_us, loads);
+        if (avg > busiest_avg) {
+            busiest_avg = avg;
+            busiest = child;
+        }
+    }
+
+    *avg_out = busiest_avg;
+    return busiest;
+}
+
+/* Our own load takes a while to decay once we run out of work, and
+ * with nothing queued anything is worth taking */
+static inline uint64_t stealer_load(struct scheduler *self, uint64_t now_us) {
+    return self->total_thread_count ? scheduler_load(self, now_us) : 0;
+}
+
+static bool victim_worth_it(struct scheduler *self, struct scheduler *victim,
+                            uint64_t now_us) {
+    if (victim == self || !victim->total_thread_count)
+        return false;
+
+    if (atomic_load(&victim->stealing_work))
+        return false;
+
+    uint64_t victim_scaled = scheduler_load(victim, now_us) * 100;
+    uint64_t scaled =
+        stealer_load(self, now_us) * scheduler_data.steal_min_diff;
+    return victim_scaled >= scaled;
+}
+
+static inline bool claim_victim(struct scheduler *victim) {
+    return !atomic_exchange(&victim->being_robbed, true);
+}
+
+/* Before the domains are up, every CPU gets looked at */
+static struct scheduler *pick_victim_flat(struct scheduler *self) {
     /* Ideally, we want to steal from our busiest core */
-    uint64_t max_thread_count = 0;
+    uint64_t now_us = time_get_us();
+    uint64_t max_load = 0;
     struct scheduler *victim = NULL;
 
     size_t i;
     for_each_cpu_id(i) {
         struct scheduler *potential_victim = global.schedulers[i];
 
-        /* duh.... */
-        if (potential_victim == self)
+        if (atomic_load(&potential_victim->being_robbed) ||
+            !victim_worth_it(self, potential_victim, now_us))
             continue;
 
-        bool victim_busy = atomic_load(&potential_victim->being_robbed) ||
-                           atomic_load(&potential_victim->stealing_work);
+        uint64_t load = scheduler_load(potential_victim, now_us);
+        if (!victim || load > max_load) {
+            max_load = load;
+            victim = potential_victim;
+        }
+    }
+
+    if (victim && !claim_victim(victim))
+        return NULL;
+
+    return victim;
+}
+
+/* At `lvl`, the busiest group next to ours is followed down, busiest
+ * child first, to a single CPU, or -1 */
+static int32_t steal_candidate(struct core *me, size_t lvl,
+                               uint64_t threshold, uint64_t now_us,
+                               const uint64_t *loads) {
+    struct scheduler_domain *d = me->domains[lvl];
+    struct scheduler_group *g = &d->groups[me->group_index[lvl]];
 
-        size_t victim_thread_count = potential_victim->total_thread_count;
-        if (global.cores && global.cores[i] &&
-            !scheduler_core_idle(global.cores[i]))
-            victim_thread_count++;
+    uint64_t avg;
+    struct scheduler_group *next = busiest_child(
+        lvl, g, me->group_index[lvl - 1], now_us, loads, &avg);
 
-        uint64_t victim_scaled = victim_thread_count * 100;
-        uint64_t scaled =
-            self->total_thread_count * scheduler_data.steal_min_diff;
-        bool victim_is_poor = victim_scaled < scaled;
+    /* nothing next to us, or nothing worth the trip */
+    if (!next || !avg || avg < threshold)
+        return -1;
 
-        if (victim_busy || victim_is_poor)
+    for (size_t down = lvl - 1; down > 0 && next; down--)
+        next = busiest_child(down, next, -1, now_us, loads, &avg);
+
+    return next ? next->cpu : -1;
+}
+
+#ifdef TEST_SCHED
+int32_t scheduler_steal_candidate_loads(struct core *me, size_t lvl,
+                                        const uint64_t *loads) {
+    return steal_candidate(me, lvl, 0, 0, loads);
+}
+#endif
+
+/* Walks outward from our own CPU one domain level at a time, so the
+ * SMT sibling gets asked before the rest of the LLC, which gets asked
+ * before anything further away. */
+static struct scheduler *pick_victim_near(struct scheduler *self) {
+    struct core *me = global.cores[self->core_id];
+    uint64_t now_us = time_get_us();
+    uint64_t threshold =
+        stealer_load(self, now_us) * scheduler_data.steal_min_diff;
+
+    for (size_t lvl = 1; lvl < TOPOLOGY_LEVEL_MAX; lvl++) {
+        int32_t cpu = steal_candidate(me, lvl, threshold, now_us, NULL);
+        if (cpu < 0)
             continue;
 
-        if (potential_victim->total_thread_count > max_thread_count) {
-            max_thread_count = victim_thread_count;
-            victim = potential_victim;
-        }
+        struct scheduler *victim = global.schedulers[cpu];
+        if (victim_worth_it(self, victim, now_us) && claim_victim(victim))
+            return victim;
     }
 
-    if (victim)
-        atomic_store(&victim->being_robbed, true);
+    return NULL;
+}
 
-    return victim;
+/* self->stealing_work should already be set before this is called */
+struct scheduler *scheduler_pick_victim(struct scheduler *self) {
+    if (!global.scheduler_domains_ready)
+        return pick_victim_flat(self);
+
+    return pick_victim_near(self);
 }
 
 static struct thread *steal_from_thread_rbt(struct scheduler *victim,
@@ -187,10 +340,26 @@ static inline void stop_steal(struct scheduler *sched,
     atomic_fetch_sub(&scheduler_data.active_stealers, 1);
 }
 
+/* Nothing to take, so don't go looking again right away */
+void scheduler_steal_failed(struct scheduler *sched, time_t now) {
+    time_t backoff = sched->steal_backoff_ms ? sched->steal_backoff_ms * 2 : 1;
+    sched->steal_backoff_ms = MIN(backoff, SCHEDULER_STEAL_BACKOFF_MAX_MS);
+    sched->next_steal_ms = now + sched->steal_backoff_ms;
+}
+
+void scheduler_steal_succeeded(struct scheduler *sched) {
+    sched->steal_backoff_ms = 0;
+    sched->next_steal_ms = 0;
+}
+
 struct thread *scheduler_try_do_steal(struct scheduler *sched) {
     if (!scheduler_can_steal_work(sched))
         return NULL;
 
+    time_t now = time_get_ms();
+    if (now < sched->next_steal_ms)
+        return NULL;
+
     if (!try_begin_steal())
         return NULL;
 
@@ -199,6 +368,7 @@ struct thread *scheduler_try_do_steal(struct scheduler *sched) {
 
     if (!victim) {
         stop_steal(sched, victim);
+        scheduler_steal_failed(sched, now);
         return NULL;
     }
 
@@ -206,8 +376,10 @@ struct thread *scheduler_try_do_steal(struct scheduler *sched) {
     stop_steal(sched, victim);
 
     if (stolen) {
+        scheduler_steal_succeeded(sched);
         sched_profiling_record_steal();
     } else {
+        scheduler_steal_failed(sched, now);
         scheduler_try_push_to_idle_core(sched);
     }
 
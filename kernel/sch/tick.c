@@ -0,0 +1,82 @@
+/* Tickless per-CPU timer.
+ *
+ * The LAPIC timer is always one-shot (or TSC-deadline when the CPU has
+ * it), and gets armed for the nearest of the deadlines in the CPU's
+ * tick state. When it goes off, whatever is due gets handled and the
+ * timer is armed again for what's left, if anything is. */
+
+#include <acpi/lapic.h>
+#include <sch/sched.h>
+#include <sch/tick.h>
+#include <smp/core.h>
+#include <thread/timer.h>
+#include <time.h>
+
+/* Caller is at HIGH_LEVEL on the CPU `ts` belongs to */
+static void tick_program(struct tick_state *ts) {
+    uint64_t next = tick_next_deadline(ts);
+    if (next == ts->armed_us)
+        return;
+
+    ts->armed_us = next;
+    if (next == TICK_NEVER) {
+        lapic_timer_disarm();
+        return;
+    }
+
+    uint64_t now = time_get_us();
+    uint64_t delta = next > now ? next - now : 0;
+    if (delta > TICK_MAX_DELTA_US)
+        delta = TICK_MAX_DELTA_US;
+
+    lapic_timer_arm_us(delta);
+}
+
+void tick_set_deadline(enum tick_event ev, uint64_t deadline_us) {
+    enum irql irql = irql_raise(IRQL_HIGH_LEVEL);
+    struct tick_state *ts = &smp_core()->tick;
+
+    ts->deadline_us[ev] = deadline_us;
+    if (ts->ready)
+        tick_program(ts);
+
+    irql_lower(irql);
+}
+
+/* Called once the LAPIC timer on this CPU is set up. Anything that was
+ * asked for before then gets armed now */
+void tick_start(void) {
+    enum irql irql = irql_raise(IRQL_HIGH_LEVEL);
+    struct tick_state *ts = &smp_core()->tick;
+
+    ts->ready = true;
+    ts->armed_us = TICK_NEVER;
+    lapic_timer_disarm();
+    tick_program(ts);
+
+    irql_lower(irql);
+}
+
+void tick_handle(void) {
+    enum irql irql = irql_raise(IRQL_HIGH_LEVEL);
+    struct core *c = smp_core();
+    struct tick_state *ts = &c->tick;
+    uint64_t now = time_get_us();
+
+    /* it went off, whatever it was armed for is gone */
+    ts->armed_us = TICK_NEVER;
+
+    if (ts->deadline_us[TICK_EVENT_SLICE] <= now) {
+        ts->deadline_us[TICK_EVENT_SLICE] = TICK_NEVER;
+        scheduler_mark_self_needs_resched(true);
+    }
+
+    /* the wheel sets its next deadline once it has caught up */
+    if (ts->deadline_us[TICK_EVENT_TIMER] <= now) {
+        ts->deadline_us[TICK_EVENT_TIMER] = TICK_NEVER;
+        timer_wheel_kick(c->id);
+    }
+
+    tick_program(ts);
+    irql_lower(irql);
+}
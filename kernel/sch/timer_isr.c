@@ -1,10 +1,13 @@
 #include <acpi/lapic.h>
 #include <irq/irq.h>
 #include <sch/sched.h>
+#include <sch/tick.h>
 
 enum irq_result scheduler_timer_isr(void *ctx, uint8_t vector,
                                     struct irq_context *rsp) {
-    scheduler_mark_self_needs_resched(true);
+    /* slice end, timer wheel, or both */
+    tick_handle();
+    scheduler_tick_update_load();
     (void) ctx, (void) vector, (void) rsp;
     return IRQ_HANDLED;
 }
@@ -28,9 +28,9 @@ static void init_global_domain(uint64_t domain_count) {
 
     for (size_t i = 0; i < domain_count; i++) {
 
-        /* We align this up to the page so that they can all be
+        /* These get their own pages so that they can all be
          * migrated later on to pages on each domain... */
-        global.domains[i] = kzalloc(PAGE_ALIGN_UP(sizeof(struct domain)));
+        global.domains[i] = kzalloc_pages(sizeof(struct domain));
         if (!global.domains[i])
             panic("Cannot allocate core domain %u\n");
 
@@ -31,6 +31,14 @@ static void detect_cpu_features(struct cpu_capability *cap) {
         cap->feature_bits |= CPU_FEAT_SSE2;
     if (ecx & (1 << 28))
         cap->feature_bits |= CPU_FEAT_AVX;
+    if (ecx & (1 << 24))
+        cap->feature_bits |= CPU_FEAT_TSC_DEADLINE;
+
+    /* MWAIT is only any good for idle if interrupts can break it */
+    bool has_monitor = ecx & (1 << 3);
+    cpuid_count(5, 0, &eax, &ebx, &ecx, &edx);
+    if (has_monitor && (ecx & 0x3) == 0x3)
+        cap->feature_bits |= CPU_FEAT_MWAIT;
 
     /* CPUID.7.0 */
     cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
@@ -39,6 +47,10 @@ static void detect_cpu_features(struct cpu_capability *cap) {
         cap->feature_bits |= CPU_FEAT_AVX2;
     if (ebx & (1 << 16))
         cap->feature_bits |= CPU_FEAT_AVX512F;
+    if (ebx & (1 << 9))
+        cap->feature_bits |= CPU_FEAT_ERMS;
+    if (edx & (1 << 4))
+        cap->feature_bits |= CPU_FEAT_FSRM;
 }
 
 static void detect_cpu_class(struct cpu_capability *cap) {
@@ -123,6 +135,10 @@ static void dump_cpu_features(uint64_t f) {
         strcat(buf, " AVX2");
     if (f & CPU_FEAT_AVX512F)
         strcat(buf, " AVX-512F");
+    if (f & CPU_FEAT_ERMS)
+        strcat(buf, " ERMS");
+    if (f & CPU_FEAT_FSRM)
+        strcat(buf, " FSRM");
 
     if (buf[0] == '\0')
         strcpy(buf, " (none)");
@@ -228,6 +244,10 @@ static struct core *setup_cpu(uint64_t cpu) {
     kassert(c->id == cpu);
     c->self = c;
     c->current_irql = IRQL_PASSIVE_LEVEL;
+    c->qnode_depth = 0;
+    tick_state_init(&c->tick);
+    c->idle_gov = (struct idle_governor_data) {0};
+    atomic_store(&c->idle_polling, false);
     c->tsc_hz = tsc_calibrate();
     init_smt_info(c);
     detect_llc(&c->llc);
@@ -312,6 +332,7 @@ void smp_setup_bsp() {
     c->id = 0;
     c->self = c;
     c->current_irql = IRQL_PASSIVE_LEVEL;
+    tick_state_init(&c->tick);
     wrmsr(MSR_GS_BASE, (uint64_t) c);
     global.cores = kzalloc(sizeof(struct core *) * global.core_count);
 
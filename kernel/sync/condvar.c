@@ -109,8 +109,14 @@ enum wake_reason condvar_wait_timeout(struct condvar *cv, struct spinlock *lock,
     if (!thread_get(curr))
         panic("What? Someone has pulled the rug out from under me!\n");
 
-    defer_enqueue(condvar_timeout_wakeup, WORK_ARGS(curr, cwcb), timeout_ms);
+    timer_init(&curr->wait_timer, condvar_timeout_wakeup, curr, cwcb,
+               TIMER_FLAG_NONE);
+    timer_arm(&curr->wait_timer, timeout_ms);
     condvar_wait(cv, lock, irql, out);
 
+    /* signalled in time, the reference was for the timeout */
+    if (timer_cancel(&curr->wait_timer))
+        thread_put(curr);
+
     return curr->wake_reason;
 }
@@ -230,6 +230,11 @@ void mutex_unlock(struct mutex *mutex) {
     }
 }
 
+bool mutex_trylock(struct mutex *mutex) {
+    mutex_sanity_check();
+    return mutex_try_lock(mutex, thread_get_current());
+}
+
 bool mutex_held(struct mutex *mtx) {
     return MUTEX_READ_LOCK_WORD(mtx) & MUTEX_HELD_BIT;
 }
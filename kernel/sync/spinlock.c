@@ -0,0 +1,101 @@
+/* Contended path of the queued spinlock.
+ *
+ * A CPU that finds the lock taken grabs one of its per-CPU nodes and
+ * swaps itself in as the tail. If someone was queued before it, it links
+ * itself behind them and spins on its own node until they hand it the
+ * head of the queue. The head spins on the lock byte, takes the lock once
+ * it drops, and passes the head on to whoever queued up behind it. */
+
+#include <asm.h>
+#include <bootstage.h>
+#include <global.h>
+#include <kassert.h>
+#include <smp/core.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sync/spinlock.h>
+
+#define QNODE_IDX_BITS 2
+#define QNODE_IDX_MASK ((1u << QNODE_IDX_BITS) - 1)
+
+static inline uint32_t encode_tail(cpu_id_t cpu, uint32_t idx) {
+    return ((cpu + 1) << QNODE_IDX_BITS | idx) << SPINLOCK_TAIL_SHIFT;
+}
+
+static inline struct spinlock_qnode *decode_tail(uint32_t tail) {
+    tail >>= SPINLOCK_TAIL_SHIFT;
+    struct core *c = global.cores[(tail >> QNODE_IDX_BITS) - 1];
+    return &c->qnodes[tail & QNODE_IDX_MASK];
+}
+
+/* Until every CPU has its core structure, there are no nodes to queue
+ * on, and waiting is done the test-and-set way. Same for callers that
+ * can be preempted: the nodes are a per-CPU stack, and a waiter that got
+ * switched out or moved to another CPU mid-queue would corrupt it */
+static void spin_lock_unqueued(struct spinlock *lock) {
+    while (!spin_trylock_raw(lock))
+        spin_raw(lock);
+}
+
+void spin_lock_queued(struct spinlock *lock) {
+    if (global.current_bootstage < BOOTSTAGE_MID_MP ||
+        irql_get() < IRQL_DISPATCH_LEVEL) {
+        spin_lock_unqueued(lock);
+        return;
+    }
+
+    struct core *c = smp_core();
+    uint32_t idx = c->qnode_depth++;
+    kassert(idx < SPINLOCK_QNODES);
+
+    struct spinlock_qnode *node = &c->qnodes[idx];
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->locked, false, memory_order_relaxed);
+
+    uint32_t tail = encode_tail(c->id, idx);
+    uint32_t old = atomic_load_explicit(&lock->state, memory_order_relaxed);
+
+    /* Becoming the tail publishes the node, hence the release */
+    while (!atomic_compare_exchange_weak_explicit(
+        &lock->state, &old, (old & ~SPINLOCK_TAIL_MASK) | tail,
+        memory_order_acq_rel, memory_order_relaxed))
+        ;
+
+    if (old & SPINLOCK_TAIL_MASK) {
+        struct spinlock_qnode *prev = decode_tail(old);
+        atomic_store_explicit(&prev->next, node, memory_order_release);
+
+        while (!atomic_load_explicit(&node->locked, memory_order_acquire))
+            cpu_relax();
+    }
+
+    /* Head of the queue, wait for the owner to let go */
+    uint32_t val;
+    while ((val = atomic_load_explicit(&lock->state, memory_order_acquire)) &
+           SPINLOCK_LOCKED_MASK)
+        cpu_relax();
+
+    /* Nobody behind us, the queue goes away along with taking the lock */
+    while ((val & SPINLOCK_TAIL_MASK) == tail) {
+        if (atomic_compare_exchange_weak_explicit(
+                &lock->state, &val, SPINLOCK_LOCKED, memory_order_acquire,
+                memory_order_relaxed))
+            goto out;
+    }
+
+    /* With a tail in there, trylock can't succeed for anyone but us */
+    atomic_fetch_or_explicit(&lock->state, SPINLOCK_LOCKED,
+                             memory_order_acquire);
+
+    struct spinlock_qnode *next;
+    while (!(next = atomic_load_explicit(&node->next, memory_order_acquire)))
+        cpu_relax();
+
+    atomic_store_explicit(&next->locked, true, memory_order_release);
+
+out:
+    /* still on the CPU whose node we took, and nobody else used it */
+    kassert(c == smp_core() && c->qnode_depth == idx + 1);
+    c->qnode_depth--;
+}
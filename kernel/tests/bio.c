@@ -1,6 +1,7 @@
 #ifdef TEST_BIO
 #include <block/bio.h>
 #include <block/generic.h>
+#include <drivers/nvme.h>
 #include <fs/ext2.h>
 #include <fs/vfs.h>
 #include <global.h>
@@ -9,6 +10,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <tests.h>
 
 #include "fs/detect.h"
@@ -72,4 +74,81 @@ TEST_REGISTER(blkdev_bio_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
     TEST_ASSERT(current_test->message_count == run_times);
     SET_SUCCESS();
 }
+
+/* Every polled request ends up as either a hit or a miss */
+static uint64_t nvme_polled_total(struct generic_disk *d) {
+    uint64_t total = 0, hits, misses;
+    for (uint32_t qid = 1; nvme_poll_stat(d, qid, &hits, &misses); qid++)
+        total += hits + misses;
+
+    return total;
+}
+
+TEST_REGISTER(blkdev_bio_polled_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    EXT2_INIT;
+    struct ext2_fs *fs = root->fs_data;
+    struct generic_disk *d = fs->drive;
+    bool nvme = d->type == G_NVME_DRIVE;
+    uint64_t polled = nvme ? nvme_polled_total(d) : 0;
+    enable_interrupts();
+
+    struct bio_request *bio = bio_create_read(d, 0, 8, 8 * d->sector_size,
+                                              NULL, NULL, NULL);
+    TEST_ASSERT(bio);
+
+    /* it has to be done by the time this returns, no sleeping on it */
+    TEST_ASSERT(bio_submit_polled(bio));
+    TEST_ASSERT(bio->done);
+    TEST_ASSERT(!bio_request_failed(bio));
+
+    if (nvme)
+        TEST_ASSERT(nvme_polled_total(d) > polled);
+
+    kfree_aligned(bio->buffer);
+    bio_request_free(bio);
+    SET_SUCCESS();
+}
+
+TEST_REGISTER(blkdev_bio_vectored_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    EXT2_INIT;
+    struct ext2_fs *fs = root->fs_data;
+    struct generic_disk *d = fs->drive;
+    uint64_t pages = 4;
+    uint64_t spp = PAGE_SIZE / d->sector_size;
+    enable_interrupts();
+
+    struct bio_request *flat = bio_create_read(
+        d, 0, pages * spp, pages * PAGE_SIZE, NULL, NULL, NULL);
+    TEST_ASSERT(flat);
+    TEST_ASSERT(bio_submit_polled(flat));
+    TEST_ASSERT(!bio_request_failed(flat));
+
+    /* separate allocations, so nothing says they're contiguous */
+    uint8_t *bufs[4];
+    struct bio_request *vec =
+        bio_create_vectored(d, 0, false, pages, NULL, NULL);
+    TEST_ASSERT(vec);
+
+    for (uint64_t i = 0; i < pages; i++) {
+        bufs[i] = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+        TEST_ASSERT(bufs[i]);
+        TEST_ASSERT(bio_add_buffer(vec, bufs[i], PAGE_SIZE));
+    }
+
+    TEST_ASSERT(vec->vec_count == pages);
+    TEST_ASSERT(vec->sector_count == pages * spp);
+    TEST_ASSERT(bio_submit_polled(vec));
+    TEST_ASSERT(!bio_request_failed(vec));
+
+    for (uint64_t i = 0; i < pages; i++) {
+        uint8_t *expect = (uint8_t *) flat->buffer + i * PAGE_SIZE;
+        TEST_ASSERT(memcmp(bufs[i], expect, PAGE_SIZE) == 0);
+        kfree_aligned(bufs[i]);
+    }
+
+    kfree_aligned(flat->buffer);
+    bio_request_free(flat);
+    bio_request_free(vec);
+    SET_SUCCESS();
+}
 #endif
@@ -92,6 +92,9 @@ TEST_REGISTER(bio_sched_coalesce_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
     bio->on_complete = bio_sch_callback1;
     bio2->on_complete = bio_sch_callback2;
 
+    struct bio_sched_stats before, after;
+    bio_sched_stat(d, &before, NULL);
+
     char *name = kmalloc(100);
     uint64_t t = time_get_us();
     bio_sched_enqueue(d, bio);
@@ -101,8 +104,19 @@ TEST_REGISTER(bio_sched_coalesce_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
 
     bio_sched_dispatch_all(d);
 
-    for (int i = 0; i < 5000; i++)
+    for (int i = 0; i < 5000 && !(atomic_load(&cb1d) && atomic_load(&cb2d));
+         i++)
         scheduler_yield();
+
+    TEST_ASSERT(atomic_load(&cb1d) && atomic_load(&cb2d));
+    TEST_ASSERT(bio->status == BIO_STATUS_OK && bio2->status == BIO_STATUS_OK);
+
+    /* both go out as one command on the drivers that coalesce */
+    bio_sched_stat(d, &after, NULL);
+    if (d->type == G_AHCI_DRIVE || d->type == G_NVME_DRIVE)
+        TEST_ASSERT(after.front_merges + after.back_merges >
+                    before.front_merges + before.back_merges);
+
     SET_SUCCESS();
 }
 
@@ -196,4 +210,139 @@ TEST_REGISTER(bio_sched_delay_enqueue_test, SHOULD_NOT_FAIL,
 
     SET_SUCCESS();
 }
+
+static atomic_bool staged_done = false;
+
+static void bio_sched_staged_callback(struct bio_request *req) {
+    (void) req;
+    atomic_store(&staged_done, true);
+}
+
+TEST_REGISTER(bio_sched_swq_stage_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    EXT2_INIT;
+    struct ext2_fs *fs = root->fs_data;
+    struct generic_disk *d = fs->drive;
+    enable_interrupts();
+
+    struct bio_request *bio = bio_create_read(
+        d, 0, 1, d->sector_size, bio_sched_staged_callback, NULL, NULL);
+    TEST_ASSERT(bio);
+    bio->priority = BIO_RQ_LOW;
+
+    /* with its context busy, the request has to stay on this CPU */
+    enum irql irql = irql_raise(IRQL_DISPATCH_LEVEL);
+    struct bio_sched_swq *swq = bio_sched_swq_local(d->scheduler);
+    uint32_t staged = swq->count;
+
+    if (staged + 1 >= BIO_SCHED_SWQ_BATCH ||
+        !mutex_trylock(&swq->hctx->lock)) {
+        irql_lower(irql);
+        kfree_aligned(bio->buffer);
+        bio_request_free(bio);
+        ADD_MESSAGE("the disk is busy");
+        SET_SKIP();
+        return;
+    }
+
+    bio_sched_enqueue(d, bio);
+    TEST_ASSERT(swq->count == staged + 1);
+    mutex_unlock(&swq->hctx->lock);
+    irql_lower(irql);
+
+    bio_sched_dispatch_all(d);
+
+    for (int i = 0; i < 5000 && !atomic_load(&staged_done); i++)
+        scheduler_yield();
+
+    TEST_ASSERT(atomic_load(&staged_done));
+    kfree_aligned(bio->buffer);
+    bio_request_free(bio);
+    SET_SUCCESS();
+}
+
+static atomic_uint stat_done = 0;
+
+static void bio_sched_stat_callback(struct bio_request *req) {
+    (void) req;
+    atomic_fetch_add(&stat_done, 1);
+}
+
+TEST_REGISTER(bio_sched_stat_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    EXT2_INIT;
+    struct ext2_fs *fs = root->fs_data;
+    struct generic_disk *d = fs->drive;
+    enable_interrupts();
+
+    struct bio_sched_stats before, after;
+    uint64_t avg;
+    bio_sched_stat(d, &before, NULL);
+
+    struct bio_request *bios[4];
+    for (size_t i = 0; i < 4; i++) {
+        bios[i] = bio_create_read(d, i * 8, 1, d->sector_size,
+                                  bio_sched_stat_callback, NULL, NULL);
+        TEST_ASSERT(bios[i]);
+        bios[i]->priority = BIO_RQ_MEDIUM;
+        bio_sched_enqueue(d, bios[i]);
+    }
+
+    bio_sched_dispatch_all(d);
+
+    for (int i = 0; i < 5000 && atomic_load(&stat_done) < 4; i++)
+        scheduler_yield();
+
+    TEST_ASSERT(atomic_load(&stat_done) == 4);
+
+    bio_sched_stat(d, &after, &avg);
+    TEST_ASSERT(after.dispatched >= before.dispatched + 4);
+    TEST_ASSERT(after.dispatched_sectors >= after.dispatched);
+    TEST_ASSERT(avg >= d->sector_size);
+
+    char *msg = kmalloc(100);
+    TEST_ASSERT(msg);
+    snprintf(msg, 100, "%d front and %d back merges, average I/O is %d bytes",
+             after.front_merges, after.back_merges, avg);
+    ADD_MESSAGE(msg);
+
+    for (size_t i = 0; i < 4; i++) {
+        kfree_aligned(bios[i]->buffer);
+        bio_request_free(bios[i]);
+    }
+
+    SET_SUCCESS();
+}
+
+static atomic_bool issuer_done = false;
+
+static void bio_sched_issuer_callback(struct bio_request *req) {
+    (void) req;
+    atomic_store(&issuer_done, true);
+}
+
+TEST_REGISTER(bio_sched_issuer_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    EXT2_INIT;
+    struct ext2_fs *fs = root->fs_data;
+    struct generic_disk *d = fs->drive;
+    enable_interrupts();
+
+    struct bio_request *bio = bio_create_read(
+        d, 0, 1, d->sector_size, bio_sched_issuer_callback, NULL, NULL);
+    TEST_ASSERT(bio);
+    bio->priority = BIO_RQ_MEDIUM;
+
+    struct thread *curr = thread_get_current();
+    bio_sched_enqueue(d, bio);
+    TEST_ASSERT(bio->issuer == curr->id);
+    TEST_ASSERT(bio->io_weight == bio_sched_thread_weight(curr));
+
+    bio_sched_dispatch_all(d);
+
+    for (int i = 0; i < 5000 && !atomic_load(&issuer_done); i++)
+        scheduler_yield();
+
+    TEST_ASSERT(atomic_load(&issuer_done));
+    kfree_aligned(bio->buffer);
+    bio_request_free(bio);
+    SET_SUCCESS();
+}
 #endif
@@ -3,11 +3,13 @@
 #include <mem/alloc.h>
 #include <sch/sched.h>
 #include <sleep.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <tests.h>
+#include <thread/timer.h>
 #include <thread/workqueue.h>
 #include <time.h>
 
@@ -35,4 +37,65 @@ TEST_REGISTER(defer_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
     sleep_ms(100);
 }
 
+static atomic_uint timer_fired = 0;
+
+static void timer_func(void *counter, void *unused) {
+    (void) unused;
+    atomic_fetch_add((atomic_uint *) counter, 1);
+}
+
+/* Static so a failed assert can return with them still on the wheel */
+static struct timer cancelled, near, far;
+
+TEST_REGISTER(timer_wheel_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    timer_init(&cancelled, timer_func, &timer_fired, NULL, TIMER_FLAG_DPC);
+    timer_init(&near, timer_func, &timer_fired, NULL, TIMER_FLAG_DPC);
+    timer_init(&far, timer_func, &timer_fired, NULL, TIMER_FLAG_NONE);
+
+    TEST_ASSERT(!timer_cancel(&cancelled));
+
+    timer_arm(&cancelled, 5);
+    TEST_ASSERT(timer_pending(&cancelled));
+    TEST_ASSERT(timer_cancel(&cancelled));
+    TEST_ASSERT(!timer_pending(&cancelled));
+
+    /* 100 ms is past level 0 and has to be cascaded down */
+    timer_arm(&near, 5);
+    timer_arm(&far, 100);
+    sleep_ms(200);
+
+    TEST_ASSERT(!timer_pending(&near) && !timer_pending(&far));
+    TEST_ASSERT(atomic_load(&timer_fired) == 2);
+    SET_SUCCESS();
+}
+
+static struct timer hrtimer;
+static atomic_bool hrtimer_fired = false;
+static char hrtimer_msg[64] = {0};
+
+static void hrtimer_func(void *unused, void *unused2) {
+    (void) unused, (void) unused2;
+    atomic_store(&hrtimer_fired, true);
+}
+
+/* Well under a wheel slot, it goes straight onto the near list */
+TEST_REGISTER(timer_sub_ms_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    timer_init(&hrtimer, hrtimer_func, NULL, NULL, TIMER_FLAG_DPC);
+
+    uint64_t start = time_get_us();
+    timer_arm_us(&hrtimer, 200);
+
+    while (!atomic_load(&hrtimer_fired) && time_get_us() - start < 50000)
+        cpu_relax();
+
+    uint64_t took = time_get_us() - start;
+    TEST_ASSERT(atomic_load(&hrtimer_fired));
+    TEST_ASSERT(took >= 200);
+
+    snprintf(hrtimer_msg, sizeof(hrtimer_msg), "200 us timer took %llu us",
+             took);
+    ADD_MESSAGE(hrtimer_msg);
+    SET_SUCCESS();
+}
+
 #endif
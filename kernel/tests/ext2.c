@@ -5,6 +5,7 @@
 #include <fs/vfs.h>
 #include <mem/alloc.h>
 #include <sleep.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <tests.h>
@@ -168,6 +169,85 @@ TEST_REGISTER(ext2_dir_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
     SET_SUCCESS();
 }
 
+/* Is there a remembered run that covers `block_index`? */
+static bool map_cached(struct ext2_full_inode *inode, uint32_t block_index) {
+    for (uint32_t i = 0; i < EXT2_MAP_CACHE_RUNS; i++) {
+        struct ext2_map_run *r = &inode->map.runs[i];
+        if (r->len && block_index >= r->logical &&
+            block_index - r->logical < r->len)
+            return true;
+    }
+
+    return false;
+}
+
+static void fill_pattern(uint8_t *buf, uint64_t len, uint8_t seed) {
+    for (uint64_t i = 0; i < len; i++)
+        buf[i] = (uint8_t) (i * 7 + seed);
+}
+
+TEST_REGISTER(ext2_indirect_rw_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    EXT2_INIT;
+
+    FAIL_IF_FATAL(
+        root->ops->create(root, "ext2_indirect_rw_test", VFS_MODE_FILE));
+
+    struct vfs_dirent ent;
+    struct vfs_node *node;
+    FAIL_IF_FATAL(root->ops->finddir(root, "ext2_indirect_rw_test", &ent));
+
+    node = ent.node;
+    TEST_ASSERT(node != NULL);
+
+    struct ext2_fs *fs = node->fs_data;
+    struct ext2_full_inode *inode = node->fs_node_data;
+
+    /* two blocks on either side of the first indirect block */
+    uint64_t boundary = (uint64_t) fs->block_size * EXT2_NDIR_BLOCKS;
+    uint64_t len = boundary + fs->block_size * 2;
+    uint64_t off = boundary - fs->block_size * 2;
+
+    uint8_t *in_buf = kzalloc(len);
+    uint8_t *out_buf = kzalloc(len);
+    TEST_ASSERT(in_buf != NULL && out_buf != NULL);
+
+    fill_pattern(in_buf, len, 0);
+    FAIL_IF_FATAL(node->ops->write(node, in_buf, len, 0));
+    TEST_ASSERT(node->size == len);
+
+    /* the first read walks the chain, the second one hits the cache */
+    FAIL_IF_FATAL(node->ops->read(node, out_buf, len, 0));
+    TEST_ASSERT(memcmp(out_buf, in_buf, len) == 0);
+    TEST_ASSERT(map_cached(inode, EXT2_NDIR_BLOCKS));
+
+    memset(out_buf, 0, len);
+    FAIL_IF_FATAL(node->ops->read(node, out_buf + off, len - off, off));
+    TEST_ASSERT(memcmp(out_buf + off, in_buf + off, len - off) == 0);
+
+    /* dropping the indirect block has to take the cached runs with it */
+    FAIL_IF_FATAL(node->ops->truncate(node, boundary));
+    for (uint32_t i = 0; i < EXT2_MAP_CACHE_RUNS; i++)
+        TEST_ASSERT(inode->map.runs[i].len == 0);
+
+    TEST_ASSERT(ext2_map_block(fs, inode, EXT2_NDIR_BLOCKS, NULL) == 0);
+
+    /* a stale run here would read back the freed blocks */
+    fill_pattern(in_buf + off, len - off, 0x5a);
+    FAIL_IF_FATAL(node->ops->write(node, in_buf + off, len - off, off));
+
+    memset(out_buf, 0, len);
+    FAIL_IF_FATAL(node->ops->read(node, out_buf, len, 0));
+    TEST_ASSERT(memcmp(out_buf, in_buf, len) == 0);
+
+    kfree(in_buf);
+    kfree(out_buf);
+
+    FAIL_IF_FATAL(node->ops->unlink(root, "ext2_indirect_rw_test"));
+
+    flush();
+    SET_SUCCESS();
+}
+
 TEST_REGISTER(ext2_integration_test, SHOULD_NOT_FAIL, IS_INTEGRATION_TEST) {
     EXT2_INIT;
 
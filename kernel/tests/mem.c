@@ -35,6 +35,38 @@ TEST_REGISTER(vmm_map_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
     SET_SUCCESS();
 }
 
+#define HUGE_MAP_PAGES 1024 /* 4 MiB, so at least one 2 MiB page fits */
+
+TEST_REGISTER(vmm_map_hugepage_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    ABORT_IF_RAM_LOW();
+
+    paddr_t p = pmm_alloc_pages(HUGE_MAP_PAGES);
+    TEST_ASSERT(p != 0);
+
+    size_t len = HUGE_MAP_PAGES * PAGE_SIZE;
+    uint8_t *ptr = vmm_map_phys(p, len, 0, VMM_FLAG_NONE);
+    TEST_ASSERT(ptr != NULL);
+
+    bool saw_huge = false;
+    for (size_t off = 0; off < len; off += PAGE_SIZE) {
+        vaddr_t v = (vaddr_t) ptr + off;
+        TEST_ASSERT(vmm_get_phys(v, VMM_FLAG_NONE) == p + off);
+        saw_huge |= vmm_get_mapping_size(v) == PAGE_2MB;
+    }
+
+    TEST_ASSERT(saw_huge);
+
+    ptr[0] = 0x42;
+    ptr[len - 1] = 0x67;
+    TEST_ASSERT(ptr[0] == 0x42 && ptr[len - 1] == 0x67);
+
+    vmm_unmap_virt(ptr, len, VMM_FLAG_NONE);
+    TEST_ASSERT(vmm_get_mapping_size((vaddr_t) ptr + len / 2) == 0);
+    pmm_free_pages(p, HUGE_MAP_PAGES);
+
+    SET_SUCCESS();
+}
+
 /* probably don't need these at all but I'll keep
  * them in case something decides to be funny */
 #define ALIGNED_ALLOC_TIMES 512
@@ -76,6 +108,26 @@ TEST_REGISTER(pmm_stress_alloc_free_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
     SET_SUCCESS();
 }
 
+#define LOW_ORDER_ALLOC_TIMES 256
+
+/* Orders 1 through 3 go through the per-core arenas */
+static paddr_t pmm_low_order_ptrs[LOW_ORDER_ALLOC_TIMES];
+TEST_REGISTER(pmm_low_order_alloc_free_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    ABORT_IF_RAM_LOW();
+
+    for (size_t pages = 2; pages <= 8; pages *= 2) {
+        for (size_t i = 0; i < LOW_ORDER_ALLOC_TIMES; i++) {
+            pmm_low_order_ptrs[i] = pmm_alloc_pages(pages);
+            TEST_ASSERT(pmm_low_order_ptrs[i] != 0);
+        }
+
+        for (size_t i = 0; i < LOW_ORDER_ALLOC_TIMES; i++)
+            pmm_free_pages(pmm_low_order_ptrs[i], pages);
+    }
+
+    SET_SUCCESS();
+}
+
 static void *stress_alloc_free_ptrs[STRESS_ALLOC_TIMES] = {0};
 TEST_REGISTER(kmalloc_stress_alloc_free_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
     ABORT_IF_RAM_LOW();
@@ -437,6 +489,34 @@ TEST_REGISTER(kmalloc_new_alloc_free_sequence_test, SHOULD_NOT_FAIL,
     SET_SUCCESS();
 }
 
+/* -------------------- Multi-page slab classes -------------------- */
+
+#define LARGE_CLASS_OBJS 16
+static void *large_class_ptrs[LARGE_CLASS_OBJS] = {0};
+TEST_REGISTER(kmalloc_large_class_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    ABORT_IF_RAM_LOW();
+
+    for (size_t size = 2048; size <= 32768; size *= 2) {
+        for (size_t i = 0; i < LARGE_CLASS_OBJS; i++) {
+            uint8_t *p = kmalloc(size);
+            TEST_ASSERT(p != NULL);
+            TEST_ASSERT(ksize(p) == size);
+
+            /* every byte must be mapped and belong only to us */
+            memset(p, (uint8_t) i, size);
+            large_class_ptrs[i] = p;
+        }
+
+        for (size_t i = 0; i < LARGE_CLASS_OBJS; i++) {
+            uint8_t *p = large_class_ptrs[i];
+            TEST_ASSERT(p[0] == (uint8_t) i && p[size - 1] == (uint8_t) i);
+            kfree(p);
+        }
+    }
+
+    SET_SUCCESS();
+}
+
 TEST_REGISTER(tlb_shootdown_single_cpu_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
     ABORT_IF_RAM_LOW();
 
@@ -593,6 +673,73 @@ static void print_cand(struct elcm_candidate c) {
            c.obj_count);
 }
 
+struct kmem_cache_test_obj {
+    uint64_t magic;
+    uint64_t payload[7];
+};
+
+#define KMEM_CACHE_TEST_MAGIC 0xCAFEBABE
+#define KMEM_CACHE_TEST_OBJS 256
+
+static atomic_size_t kmem_cache_test_ctors = 0;
+static atomic_size_t kmem_cache_test_dtors = 0;
+
+static bool kmem_cache_test_ctor(void *obj) {
+    struct kmem_cache_test_obj *o = obj;
+    o->magic = KMEM_CACHE_TEST_MAGIC;
+    atomic_fetch_add(&kmem_cache_test_ctors, 1);
+    return true;
+}
+
+static void kmem_cache_test_dtor(void *obj) {
+    struct kmem_cache_test_obj *o = obj;
+    kassert(o->magic == KMEM_CACHE_TEST_MAGIC);
+    atomic_fetch_add(&kmem_cache_test_dtors, 1);
+}
+
+static void *kmem_cache_test_ptrs[KMEM_CACHE_TEST_OBJS] = {0};
+TEST_REGISTER(kmem_cache_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    ABORT_IF_RAM_LOW();
+
+    struct kmem_cache *c = kmem_cache_create(
+        "kmem_cache_test", sizeof(struct kmem_cache_test_obj), 64,
+        kmem_cache_test_ctor, kmem_cache_test_dtor);
+    TEST_ASSERT(c != NULL);
+
+    for (size_t i = 0; i < KMEM_CACHE_TEST_OBJS; i++) {
+        struct kmem_cache_test_obj *o = kmem_cache_alloc(c);
+        TEST_ASSERT(o != NULL);
+        ASSERT_ALIGNED(o, 64);
+        TEST_ASSERT(o->magic == KMEM_CACHE_TEST_MAGIC);
+        kmem_cache_test_ptrs[i] = o;
+    }
+
+    size_t constructed = atomic_load(&kmem_cache_test_ctors);
+    TEST_ASSERT(constructed == KMEM_CACHE_TEST_OBJS);
+
+    for (size_t i = 0; i < KMEM_CACHE_TEST_OBJS; i++)
+        kmem_cache_free(c, kmem_cache_test_ptrs[i]);
+
+    /* everything should fit in the magazines and the depot, so
+     * nothing gets constructed the second time around */
+    for (size_t i = 0; i < KMEM_CACHE_TEST_OBJS; i++) {
+        struct kmem_cache_test_obj *o = kmem_cache_alloc(c);
+        TEST_ASSERT(o != NULL);
+        TEST_ASSERT(o->magic == KMEM_CACHE_TEST_MAGIC);
+        kmem_cache_test_ptrs[i] = o;
+    }
+
+    TEST_ASSERT(atomic_load(&kmem_cache_test_ctors) == constructed);
+
+    for (size_t i = 0; i < KMEM_CACHE_TEST_OBJS; i++)
+        kmem_cache_free(c, kmem_cache_test_ptrs[i]);
+
+    size_t shrunk = kmem_cache_shrink(c);
+    TEST_ASSERT(atomic_load(&kmem_cache_test_dtors) == shrunk);
+
+    SET_SUCCESS();
+}
+
 TEST_REGISTER(elcm_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
     struct elcm_params params = {
         .obj_size = 938,
@@ -1,4 +1,71 @@
 #ifdef TEST_MISC
+#include <asm.h>
+#include <mem/alloc.h>
+#include <memops.h>
+#include <smp/core.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <tests.h>
 
+#define MEMOPS_BENCH_MAX (4 * 1024 * 1024)
+#define MEMOPS_BENCH_BYTES (64ULL * 1024 * 1024) /* per size, per op */
+
+static const size_t memops_bench_sizes[] = {
+    64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, MEMOPS_BENCH_MAX,
+};
+
+#define MEMOPS_BENCH_SIZE_COUNT                                                \
+    (sizeof(memops_bench_sizes) / sizeof(memops_bench_sizes[0]))
+
+static char memops_bench_msgs[MEMOPS_BENCH_SIZE_COUNT + 1][128];
+
+/* returns hundredths of a GB/s, bytes per ns is GB/s */
+static uint64_t memops_bench_rate(uint64_t bytes, uint64_t cycles) {
+    uint64_t ns = cycles * 1000000000ULL / smp_core()->tsc_hz;
+    return ns ? bytes * 100 / ns : 0;
+}
+
+TEST_REGISTER(memops_bench_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    ABORT_IF_RAM_LOW();
+
+    uint8_t *src = kmalloc(MEMOPS_BENCH_MAX);
+    uint8_t *dst = kmalloc(MEMOPS_BENCH_MAX);
+    TEST_ASSERT(src && dst);
+
+    memset(src, 0x5A, MEMOPS_BENCH_MAX);
+    memcpy(dst, src, MEMOPS_BENCH_MAX);
+    TEST_ASSERT(memcmp(dst, src, MEMOPS_BENCH_MAX) == 0);
+
+    snprintf(memops_bench_msgs[0], 128, "impl \"%s\", nt threshold %zu",
+             memops_name(), memops_nt_threshold());
+    ADD_MESSAGE(memops_bench_msgs[0]);
+
+    for (size_t i = 0; i < MEMOPS_BENCH_SIZE_COUNT; i++) {
+        size_t size = memops_bench_sizes[i];
+        uint64_t iters = MEMOPS_BENCH_BYTES / size;
+
+        uint64_t start = rdtsc();
+        for (uint64_t j = 0; j < iters; j++)
+            memcpy(dst, src, size);
+        uint64_t copy_rate = memops_bench_rate(size * iters, rdtsc() - start);
+
+        start = rdtsc();
+        for (uint64_t j = 0; j < iters; j++)
+            memset(dst, (int) j, size);
+        uint64_t set_rate = memops_bench_rate(size * iters, rdtsc() - start);
+
+        snprintf(memops_bench_msgs[i + 1], 128,
+                 "%8zu B: memcpy %llu.%02llu GB/s, memset %llu.%02llu GB/s",
+                 size, copy_rate / 100, copy_rate % 100, set_rate / 100,
+                 set_rate % 100);
+        ADD_MESSAGE(memops_bench_msgs[i + 1]);
+    }
+
+    kfree(src);
+    kfree(dst);
+    SET_SUCCESS();
+}
+
 #endif
@@ -35,6 +35,35 @@ TEST_REGISTER(mutex_test_basic, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
     SET_SUCCESS();
 }
 
+/* trylock takes a free mutex, and fails without blocking on a held one */
+static struct mutex trylock_mtx = MUTEX_INIT;
+static _Atomic int trylock_other_got = -1;
+
+static void trylock_other(void *) {
+    bool got = mutex_trylock(&trylock_mtx);
+    if (got)
+        mutex_unlock(&trylock_mtx);
+
+    atomic_store(&trylock_other_got, got);
+}
+
+TEST_REGISTER(mutex_trylock_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    TEST_ASSERT(mutex_trylock(&trylock_mtx));
+    TEST_ASSERT(mutex_get_owner(&trylock_mtx) == thread_get_current());
+
+    thread_spawn("trylock", trylock_other, NULL);
+    while (atomic_load(&trylock_other_got) < 0)
+        scheduler_yield();
+
+    bool other_got = atomic_load(&trylock_other_got);
+    mutex_unlock(&trylock_mtx);
+    TEST_ASSERT(!other_got);
+
+    TEST_ASSERT(mutex_trylock(&trylock_mtx));
+    mutex_unlock(&trylock_mtx);
+    SET_SUCCESS();
+}
+
 #define MUTEX_MANY_WAITER_TEST_WAITER_COUNT 10
 #define MUTEX_MANY_WAITER_LOOP_COUNT 500
 
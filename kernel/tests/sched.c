@@ -1,5 +1,7 @@
 #ifdef TEST_SCHED
 
+#include <sch/idle.h>
+#include <sch/load.h>
 #include <sch/sched.h>
 #include <sleep.h>
 #include <string.h>
@@ -10,6 +12,8 @@
 #include <thread/thread.h>
 #include <thread/workqueue.h>
 
+#include "sch/internal.h"
+
 static atomic_bool workqueue_ran = false;
 static _Atomic uint32_t workqueue_times = 0;
 static void workqueue_fn(void *arg, void *unused) {
@@ -303,4 +307,164 @@ TEST_REGISTER(sched_push_target_test, SHOULD_NOT_FAIL, IS_INTEGRATION_TEST) {
     SET_SUCCESS();
 }
 
+static uint64_t idle_usage_total(void) {
+    struct idle_state_stats stats[IDLE_MAX_STATES];
+    uint64_t total = 0;
+
+    for (size_t cpu = 0; cpu < global.core_count; cpu++) {
+        idle_get_stats(cpu, stats);
+        for (size_t i = 0; i < idle_state_count(); i++)
+            total += stats[i].usage;
+    }
+
+    return total;
+}
+
+/* Sleeping lets this CPU go idle, so the counters have to move */
+TEST_REGISTER(idle_residency_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    TEST_ASSERT(idle_state_count() > 0);
+
+    uint64_t before = idle_usage_total();
+    sleep_ms(50);
+    TEST_ASSERT(idle_usage_total() > before);
+
+    struct idle_state_stats stats[IDLE_MAX_STATES];
+    idle_get_stats(smp_core_id(), stats);
+
+    for (size_t i = 0; i < idle_state_count(); i++) {
+        const struct idle_state *st = idle_state_get(i);
+        char *msg = kzalloc(100);
+        TEST_ASSERT(msg);
+        snprintf(msg, 100, "%s: entered %llu times, %llu us total", st->name,
+                 stats[i].usage, stats[i].residency_us);
+        ADD_MESSAGE(msg);
+    }
+
+    SET_SUCCESS();
+}
+
+/* Backoff doubles up to the cap on every failed steal, and one steal
+ * that goes through puts it back to nothing */
+static struct scheduler backoff_sched = {0};
+
+TEST_REGISTER(steal_backoff_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    struct scheduler *s = &backoff_sched;
+
+    scheduler_steal_failed(s, 100);
+    TEST_ASSERT(s->steal_backoff_ms == 1 && s->next_steal_ms == 101);
+
+    scheduler_steal_failed(s, 200);
+    TEST_ASSERT(s->steal_backoff_ms == 2 && s->next_steal_ms == 202);
+
+    for (size_t i = 0; i < 16; i++)
+        scheduler_steal_failed(s, 300);
+
+    TEST_ASSERT(s->steal_backoff_ms == SCHEDULER_STEAL_BACKOFF_MAX_MS);
+    TEST_ASSERT(s->next_steal_ms == 300 + SCHEDULER_STEAL_BACKOFF_MAX_MS);
+
+    scheduler_steal_succeeded(s);
+    TEST_ASSERT(s->steal_backoff_ms == 0 && s->next_steal_ms == 0);
+
+    SET_SUCCESS();
+}
+
+/* Lowest domain level where `cpu` shares a group with `me` */
+static size_t shared_level(struct core *me, size_t cpu) {
+    for (size_t lvl = 1; lvl < TOPOLOGY_LEVEL_MAX; lvl++) {
+        struct scheduler_domain *d = me->domains[lvl];
+        if (cpu_mask_test(&d->groups[me->group_index[lvl]].cpus, cpu))
+            return lvl;
+    }
+
+    return TOPOLOGY_LEVEL_MAX;
+}
+
+static int32_t first_candidate(struct core *me, const uint64_t *loads) {
+    for (size_t lvl = 1; lvl < TOPOLOGY_LEVEL_MAX; lvl++) {
+        int32_t cpu = scheduler_steal_candidate_loads(me, lvl, loads);
+        if (cpu >= 0)
+            return cpu;
+    }
+
+    return -1;
+}
+
+/* The walk settles on the nearest busy CPU, even with a busier one
+ * further out, and only goes out to that one once the near one idles */
+TEST_REGISTER(steal_walk_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    if (!global.scheduler_domains_ready || global.core_count < 3) {
+        SET_SKIP();
+        return;
+    }
+
+    struct core *me = global.cores[0];
+    int32_t near = -1, far = -1;
+    size_t near_lvl = TOPOLOGY_LEVEL_MAX;
+
+    for (size_t cpu = 1; cpu < global.core_count; cpu++) {
+        size_t lvl = shared_level(me, cpu);
+        if (lvl < near_lvl) {
+            near = cpu;
+            near_lvl = lvl;
+        }
+    }
+
+    for (size_t cpu = 1; cpu < global.core_count; cpu++)
+        if (shared_level(me, cpu) > near_lvl)
+            far = cpu;
+
+    /* every CPU is as far from us as every other one */
+    if (near < 0 || far < 0) {
+        ADD_MESSAGE("No two distances to tell apart");
+        SET_SKIP();
+        return;
+    }
+
+    uint64_t *loads = kzalloc(sizeof(uint64_t) * global.core_count);
+    TEST_ASSERT(loads);
+
+    loads[near] = LOAD_SCALE;
+    loads[far] = LOAD_SCALE * 4;
+    int32_t with_near = first_candidate(me, loads);
+
+    loads[near] = 0;
+    int32_t without_near = first_candidate(me, loads);
+
+    kfree(loads);
+    TEST_ASSERT(with_near == near);
+    TEST_ASSERT(without_near == far);
+
+    SET_SUCCESS();
+}
+
+/* Synthetic clock, one thread always running and one running a quarter
+ * of the time end up about 4:1, whatever their thread counts say */
+TEST_REGISTER(load_avg_test, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    struct load_avg busy = {0}, sleepy = {0};
+    uint64_t now = 1;
+
+    load_avg_set(&busy, now, 1, true);
+    load_avg_set(&sleepy, now, 0, false);
+
+    for (size_t i = 0; i < 1000; i++) {
+        now += 750;
+        load_avg_set(&sleepy, now, 1, true);
+        now += 250;
+        load_avg_set(&sleepy, now, 0, false);
+    }
+
+    load_avg_update(&busy, now);
+    TEST_ASSERT(busy.util_avg >= LOAD_SCALE - 8);
+    TEST_ASSERT(sleepy.util_avg > LOAD_SCALE / 5);
+    TEST_ASSERT(sleepy.util_avg < LOAD_SCALE / 3);
+
+    /* half as much after one half-life asleep */
+    load_avg_set(&busy, now, 0, false);
+    uint64_t later = now + LOAD_AVG_HALFLIFE * LOAD_AVG_PERIOD_US;
+    uint32_t halved = load_avg_util(&busy, later);
+    TEST_ASSERT(halved > LOAD_SCALE / 2 - 16 && halved < LOAD_SCALE / 2 + 16);
+
+    SET_SUCCESS();
+}
+
 #endif
@@ -0,0 +1,109 @@
+#ifdef TEST_SPINLOCK
+
+#include <console/printf.h>
+#include <global.h>
+#include <mem/alloc.h>
+#include <sch/sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sync/spinlock.h>
+#include <tests.h>
+#include <thread/thread.h>
+#include <time.h>
+
+static struct spinlock basic_lock = SPINLOCK_INIT;
+
+TEST_REGISTER(spinlock_basic, SHOULD_NOT_FAIL, IS_UNIT_TEST) {
+    enum irql irql = spin_lock(&basic_lock);
+    bool held = spinlock_held(&basic_lock);
+
+    enum irql inner;
+    bool relocked = spin_trylock(&basic_lock, &inner);
+
+    spin_unlock(&basic_lock, irql);
+    TEST_ASSERT(held && !relocked);
+    TEST_ASSERT(!spinlock_held(&basic_lock));
+
+    TEST_ASSERT(spin_trylock(&basic_lock, &inner));
+    spin_unlock(&basic_lock, inner);
+    TEST_ASSERT(atomic_load(&basic_lock.state) == 0);
+    SET_SUCCESS();
+}
+
+#define SPINLOCK_BENCH_LOOPS 20000
+#define SPINLOCK_BENCH_WORK 16
+
+static struct spinlock bench_lock = SPINLOCK_INIT;
+static uint64_t bench_counter = 0;
+static _Atomic uint32_t bench_left = 0;
+static atomic_bool bench_go = false;
+static _Atomic uint64_t bench_max_wait_ns = 0;
+
+static void bench_worker(void *) {
+    while (!atomic_load(&bench_go))
+        cpu_relax();
+
+    uint64_t max_wait = 0;
+    for (size_t i = 0; i < SPINLOCK_BENCH_LOOPS; i++) {
+        time_t start = time_get_ns();
+        enum irql irql = spin_lock(&bench_lock);
+        time_t waited = time_get_ns() - start;
+        if ((uint64_t) waited > max_wait)
+            max_wait = waited;
+
+        bench_counter++;
+        for (volatile size_t j = 0; j < SPINLOCK_BENCH_WORK; j++)
+            ;
+
+        spin_unlock(&bench_lock, irql);
+    }
+
+    uint64_t seen = atomic_load(&bench_max_wait_ns);
+    while (max_wait > seen &&
+           !atomic_compare_exchange_weak(&bench_max_wait_ns, &seen, max_wait))
+        ;
+
+    atomic_fetch_sub(&bench_left, 1);
+}
+
+/* One thread per CPU hammering the same lock. The max wait is what
+ * fairness buys, with test-and-set an unlucky CPU can lose every race */
+TEST_REGISTER(spinlock_contention_bench, SHOULD_NOT_FAIL,
+              IS_INTEGRATION_TEST) {
+    size_t cpus = global.core_count;
+    if (cpus < 2) {
+        ADD_MESSAGE("needs more than one core to contend");
+        SET_SKIP();
+        return;
+    }
+
+    atomic_store(&bench_left, cpus);
+    for (size_t i = 0; i < cpus; i++)
+        TEST_ASSERT(
+            thread_spawn_on_core("spin_bench", bench_worker, NULL, i));
+
+    time_t start = time_get_ns();
+    atomic_store(&bench_go, true);
+
+    while (atomic_load(&bench_left))
+        scheduler_yield();
+
+    time_t elapsed = time_get_ns() - start;
+    TEST_ASSERT(bench_counter == cpus * SPINLOCK_BENCH_LOOPS);
+
+    char *msg = kmalloc(128);
+    TEST_ASSERT(msg);
+#ifdef SPINLOCK_TAS
+    const char *kind = "test-and-set";
+#else
+    const char *kind = "queued";
+#endif
+    snprintf(msg, 128, "%s, %zu CPUs: %llu ns per acquire, max wait %llu ns",
+             kind, cpus, elapsed / (cpus * SPINLOCK_BENCH_LOOPS),
+             atomic_load(&bench_max_wait_ns));
+    ADD_MESSAGE(msg);
+
+    SET_SUCCESS();
+}
+
+#endif
@@ -1,76 +1,58 @@
-#include <acpi/hpet.h>
-#include <acpi/ioapic.h>
-#include <acpi/lapic.h>
-#include <irq/idt.h>
+#include <global.h>
+#include <math/min_max.h>
 #include <mem/alloc.h>
 #include <sch/sched.h>
 #include <sync/semaphore.h>
-#include <sync/spinlock.h>
+#include <thread/timer.h>
 #include <thread/workqueue.h>
 
-struct deferred_event_queue {
-    struct deferred_event *head;
-    size_t timer;
-    struct spinlock lock;
-    size_t next_fire_time;
+/* Timer callbacks that might block run on a worker instead of in the
+ * expiry DPC. Each worker serves a few neighbouring CPUs */
+#define DEFER_CPUS_PER_WORKER 4
+
+struct defer_worker {
+    size_t first_cpu;
     struct semaphore semaphore;
     struct work work;
 };
 
-static struct deferred_event_queue *defer_queues = NULL;
-static struct workqueue *defer_workqueue;
+/* Fire and forget timers for whoever doesn't have one to embed */
+struct deferred_event {
+    struct timer timer;
+    work_function callback;
+    struct work_args args;
+};
 
-static inline uint64_t this_timer(void) {
-    return HPET_CURRENT;
-}
+static struct defer_worker *defer_workers = NULL;
+static size_t defer_worker_count = 0;
+static struct workqueue *defer_workqueue;
 
-static inline struct deferred_event_queue *this_defer_queue(void) {
-    return &defer_queues[this_timer()];
-}
+static void defer_work(void *a, void *b) {
+    (void) b;
+    struct defer_worker *worker = a;
+    size_t end = MIN(worker->first_cpu + DEFER_CPUS_PER_WORKER,
+                     (size_t) global.core_count);
 
-static void hpet_work(void *a, void *b) {
     while (true) {
-        time_t now = hpet_timestamp_ms();
-        struct deferred_event_queue *defer_queue = a;
-        struct deferred_event *head = defer_queue->head;
-
-        enum irql irql = spin_lock_irq_disable(&defer_queue->lock);
-        while (head && head->timestamp_ms <= now) {
-            struct deferred_event *ev = head;
-            head = ev->next;
-            defer_queue->head = head;
-
-            spin_unlock(&defer_queue->lock, irql);
-
-            if (ev->callback)
-                ev->callback(ev->args.arg1, ev->args.arg2);
-
-            kfree(ev);
-            irql = spin_lock_irq_disable(&defer_queue->lock);
-        }
-
-        if (defer_queue->head) {
-            defer_queue->next_fire_time = defer_queue->head->timestamp_ms;
-            hpet_program_oneshot(defer_queue->head->timestamp_ms);
-        } else {
-            defer_queue->next_fire_time = UINT64_MAX;
-        }
-
-        spin_unlock(&defer_queue->lock, irql);
-        semaphore_wait(&defer_queue->semaphore);
+        semaphore_wait(&worker->semaphore);
+
+        for (size_t cpu = worker->first_cpu; cpu < end; cpu++)
+            timer_run_ready(cpu);
     }
 }
 
-static enum irq_result hpet_irq_handler(void *ctx, uint8_t irq,
-                                        struct irq_context *rsp) {
-    (void) irq, (void) ctx, (void) rsp;
+void defer_wake_worker(size_t cpu) {
+    semaphore_post(&defer_workers[cpu / DEFER_CPUS_PER_WORKER].semaphore);
+}
 
-    struct deferred_event_queue *defer_queue = this_defer_queue();
+static void defer_fire(void *a, void *b) {
+    (void) b;
+    struct deferred_event *ev = a;
 
-    semaphore_post(&defer_queue->semaphore);
+    if (ev->callback)
+        ev->callback(ev->args.arg1, ev->args.arg2);
 
-    hpet_clear_interrupt_status();
-    return IRQ_HANDLED;
+    kfree(ev);
 }
 
 bool defer_enqueue(work_function func, struct work_args args,
@@ -79,41 +61,21 @@ bool defer_enqueue(work_function func, struct work_args args,
     if (!ev)
         return false;
 
-    uint64_t now = hpet_timestamp_ms();
-    ev->timestamp_ms = now + delay_ms;
     ev->callback = func;
     ev->args = args;
-
-    struct deferred_event_queue *queue = this_defer_queue();
-    enum irql irql = spin_lock(&queue->lock);
-
-    if (!queue->head || ev->timestamp_ms < queue->head->timestamp_ms) {
-
-        ev->next = queue->head;
-        queue->head = ev;
-
-        if (ev->timestamp_ms < queue->next_fire_time) {
-            queue->next_fire_time = ev->timestamp_ms;
-            hpet_program_oneshot(ev->timestamp_ms);
-        }
-    } else {
-        struct deferred_event *curr = queue->head;
-        while (curr->next && curr->next->timestamp_ms < ev->timestamp_ms)
-            curr = curr->next;
-
-        ev->next = curr->next;
-        curr->next = ev;
-    }
-
-    spin_unlock(&queue->lock, irql);
+    timer_init(&ev->timer, defer_fire, ev, NULL, TIMER_FLAG_NONE);
+    timer_arm(&ev->timer, delay_ms);
     return true;
 }
 
 void defer_init(void) {
-    defer_queues =
-        kzalloc(sizeof(struct deferred_event_queue) * hpet_timer_count);
-    if (!defer_queues)
-        panic("Defer queue allocation failed!\n");
+    defer_worker_count =
+        (global.core_count + DEFER_CPUS_PER_WORKER - 1) / DEFER_CPUS_PER_WORKER;
+    defer_workers = kzalloc(sizeof(struct defer_worker) * defer_worker_count);
+    if (!defer_workers)
+        panic("Defer worker allocation failed!\n");
+
+    timer_wheels_init();
 
     struct cpu_mask mask;
     if (!cpu_mask_init(&mask, global.core_count))
@@ -123,8 +85,8 @@ void defer_init(void) {
     struct workqueue_attributes attrs = {
         .capacity = WORKQUEUE_DEFAULT_CAPACITY,
         .flags = WORKQUEUE_FLAG_ON_DEMAND | WORKQUEUE_FLAG_NO_WORKER_GC,
-        .max_workers = 1,
-        .min_workers = 1,
+        .max_workers = defer_worker_count,
+        .min_workers = defer_worker_count,
         .idle_check =
             {
                 .min = WORKQUEUE_DEFAULT_MIN_IDLE_CHECK,
@@ -135,26 +97,11 @@ void defer_init(void) {
     };
     defer_workqueue = workqueue_create(/* fmt = */ NULL, &attrs);
 
-    for (uint64_t i = 0; i < hpet_timer_count; i++) {
-        work_init(&defer_queues[i].work, hpet_work,
-                  WORK_ARGS(&defer_queues[i], NULL));
-
-        defer_queues[i].next_fire_time = UINT64_MAX;
-        defer_queues[i].timer = i;
-        workqueue_enqueue(defer_workqueue, &defer_queues[i].work);
-        semaphore_init(&defer_queues[i].semaphore, 0,
-                       SEMAPHORE_INIT_IRQ_DISABLE);
-        spinlock_init(&defer_queues[i].lock);
-
-        uint8_t vector = irq_alloc_entry();
-
-        irq_register("hpet_irq", vector, hpet_irq_handler, NULL, IRQ_FLAG_NONE);
-        irq_set_chip(vector, lapic_get_chip(), NULL);
-        ioapic_route_irq(i + 3, vector, i, false);
-
-        hpet_setup_timer(i, i + 3, false, true);
-
-        log_msg(LOG_INFO, "Timer %llu routed to IRQ %u (vector %u on core %u)",
-                i, i + HPET_IRQ_BASE, vector, i);
+    for (size_t i = 0; i < defer_worker_count; i++) {
+        struct defer_worker *worker = &defer_workers[i];
+        worker->first_cpu = i * DEFER_CPUS_PER_WORKER;
+        semaphore_init(&worker->semaphore, 0, SEMAPHORE_INIT_IRQ_DISABLE);
+        work_init(&worker->work, defer_work, WORK_ARGS(worker, NULL));
+        workqueue_enqueue(defer_workqueue, &worker->work);
     }
 }
@@ -1,6 +1,7 @@
 #include <asm.h>
 #include <irq/idt.h>
 #include <kassert.h>
+#include <sch/idle.h>
 #include <sch/sched.h>
 #include <sync/rcu.h>
 #include <thread/dpc.h>
@@ -12,6 +13,6 @@ void scheduler_idle_main(void *nop) {
     while (true) {
         enable_interrupts();
         scheduler_resched_if_needed();
-        wait_for_interrupt();
+        idle_enter();
     }
 }
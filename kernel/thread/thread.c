@@ -22,6 +22,54 @@
 
 SLAB_SIZE_REGISTER_FOR_STRUCT(thread, /*alignment*/ 32);
 
+/* The turnstile and activity buffers live as long as the cached thread
+ * object does, so creating a thread doesn't have to allocate them */
+static bool thread_ctor(void *obj) {
+    struct thread *t = obj;
+    memset(t, 0, sizeof(struct thread));
+
+    t->activity_data = kzalloc(sizeof(struct thread_activity_data));
+    t->activity_stats = kzalloc(sizeof(struct thread_activity_stats));
+    t->turnstile = turnstile_create();
+    if (t->activity_data && t->activity_stats && t->turnstile)
+        return true;
+
+    kfree(t->activity_data);
+    kfree(t->activity_stats);
+    kfree(t->turnstile);
+    return false;
+}
+
+static void thread_dtor(void *obj) {
+    struct thread *t = obj;
+    kfree(t->activity_data);
+    kfree(t->activity_stats);
+    kfree(t->turnstile);
+}
+
+/* The registered slab size above already provides the alignment */
+KMEM_CACHE_DEFINE_FOR_STRUCT(thread_cache, thread, SLAB_OBJ_ALIGN_DEFAULT,
+                             thread_ctor, thread_dtor);
+
+/* Zeroed like a fresh `kzalloc`, since thread_init and everything after it
+ * count on that for most of the struct. The activity buffers are not, as
+ * thread_init resets every field of them anyways */
+static struct thread *thread_alloc(void) {
+    struct thread *t = kmem_cache_alloc(&thread_cache);
+    if (!t)
+        return NULL;
+
+    struct thread_activity_data *data = t->activity_data;
+    struct thread_activity_stats *stats = t->activity_stats;
+    struct turnstile *ts = t->turnstile;
+
+    memset(t, 0, sizeof(struct thread));
+    t->activity_data = data;
+    t->activity_stats = stats;
+    t->turnstile = ts;
+    return t;
+}
+
 #define THREAD_STACKS_HEAP_START 0xFFFFF10000000000ULL
 #define THREAD_STACKS_HEAP_END 0xFFFFF20000000000ULL
 
@@ -168,6 +216,7 @@ static struct thread *thread_init(struct thread *thread,
     climb_thread_init(thread);
     INIT_LIST_HEAD(&thread->io_wait_tokens);
     INIT_LIST_HEAD(&thread->thread_list);
+    timer_init(&thread->wait_timer, NULL, NULL, NULL, TIMER_FLAG_NONE);
 
     for (size_t i = 0; i < APC_TYPE_COUNT; i++)
         apc_queue_init(&thread->apc_head[i]);
@@ -190,7 +239,7 @@ static struct thread *thread_init(struct thread *thread,
 struct thread *thread_create_internal(char *name, void (*entry_point)(void *),
                                       void *arg, size_t stack_size,
                                       va_list args) {
-    struct thread *new_thread = kzalloc(sizeof(struct thread));
+    struct thread *new_thread = thread_alloc();
     if (unlikely(!new_thread))
         goto err;
 
@@ -198,18 +247,6 @@ struct thread *thread_create_internal(char *name, void (*entry_point)(void *),
     if (unlikely(!stack))
         goto err;
 
-    new_thread->activity_data = kzalloc(sizeof(struct thread_activity_data));
-    if (unlikely(!new_thread->activity_data))
-        goto err;
-
-    new_thread->turnstile = turnstile_create();
-    if (unlikely(!new_thread->turnstile))
-        goto err;
-
-    new_thread->activity_stats = kzalloc(sizeof(struct thread_activity_stats));
-    if (unlikely(!new_thread->activity_stats))
-        goto err;
-
     if (unlikely(!cpu_mask_init(&new_thread->allowed_cpus, global.core_count)))
         goto err;
 
@@ -246,13 +283,10 @@ err:
     if (!new_thread)
         return NULL;
 
-    kfree(new_thread->turnstile);
     kfree(new_thread->name);
-    kfree(new_thread->activity_data);
-    kfree(new_thread->activity_stats);
     thread_free_stack(new_thread);
     tid_free(global_tid_space, new_thread->id);
-    kfree(new_thread);
+    kmem_cache_free(&thread_cache, new_thread);
 
     return NULL;
 }
@@ -280,14 +314,11 @@ struct thread *thread_create_custom_stack(char *name,
 
 void thread_free(struct thread *t) {
     tid_free(global_tid_space, t->id);
-    kfree(t->activity_data);
-    kfree(t->activity_stats);
     kfree(t->name);
     log_site_destroy(t->log_site);
-    kfree(t->turnstile);
     apc_free_on_thread(t);
     thread_free_stack(t);
-    kfree(t);
+    kmem_cache_free(&thread_cache, t);
 }
 
 void thread_queue_init(struct thread_queue *q) {
@@ -349,11 +380,15 @@ static void wake_thread(void *a, void *unused) {
 
 void thread_sleep_for_ms(uint64_t ms) {
     struct thread *curr = thread_get_current();
-    defer_enqueue(wake_thread, WORK_ARGS(curr, NULL), ms);
+    timer_init(&curr->wait_timer, wake_thread, curr, NULL, TIMER_FLAG_DPC);
+    timer_arm(&curr->wait_timer, ms);
     thread_sleep(curr, THREAD_SLEEP_REASON_MANUAL, THREAD_WAIT_UNINTERRUPTIBLE,
                  curr);
 
     thread_wait_for_wake_match();
+
+    /* woken up early, don't let it go off in the middle of something else */
+    timer_cancel(&curr->wait_timer);
 }
 
 void thread_wake_manual(struct thread *t, void *wake_src) {
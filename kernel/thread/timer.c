@@ -0,0 +1,344 @@
+/* Per-CPU hierarchical timing wheels.
+ *
+ * The CPU's timer only ever gets armed for the next thing a wheel has
+ * to do, which is the first timer on the near list, the next occupied
+ * level 0 slot, or the next time level 0 wraps around and a slot from
+ * further up has to be cascaded down. Everything expired gets collected
+ * by a DPC on the wheel's CPU, which runs the DPC timers itself and
+ * hands the rest off to the timer worker. */
+
+#include <console/panic.h>
+#include <global.h>
+#include <kassert.h>
+#include <math/min_max.h>
+#include <mem/alloc.h>
+#include <smp/core.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <structures/list.h>
+#include <sch/tick.h>
+#include <sync/spinlock.h>
+#include <thread/dpc.h>
+#include <thread/timer.h>
+#include <time.h>
+
+static struct timer_wheel *wheels = NULL;
+
+static inline uint32_t level_shift(uint32_t level) {
+    return level * TIMER_WHEEL_BITS;
+}
+
+static inline uint32_t level_index(uint64_t when, uint32_t level) {
+    return (when >> level_shift(level)) & TIMER_WHEEL_MASK;
+}
+
+/* Caller holds the wheel's lock */
+static void near_insert(struct timer_wheel *w, struct timer *t) {
+    struct timer *pos;
+    list_for_each_entry(pos, &w->near, node)
+        if (pos->expires_us > t->expires_us)
+            break;
+
+    list_add_tail(&t->node, &pos->node);
+    t->level = TIMER_LEVEL_NEAR;
+}
+
+/* Caller holds the wheel's lock */
+static void wheel_insert(struct timer_wheel *w, struct timer *t) {
+    uint64_t expires = US_TO_MS(t->expires_us);
+
+    /* its slot is the one being run, or it's late */
+    if (expires <= w->clk) {
+        near_insert(w, t);
+        return;
+    }
+
+    uint64_t delta = expires - w->clk;
+    uint32_t level = 0;
+
+    if (delta > TIMER_WHEEL_MAX_DELTA) {
+        delta = TIMER_WHEEL_MAX_DELTA;
+        expires = w->clk + delta;
+    }
+
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= 1ULL << level_shift(level + 1))
+        level++;
+
+    uint32_t slot = level_index(expires, level);
+    list_add_tail(&t->node, &w->slots[level][slot]);
+    w->occupied[level] |= 1ULL << slot;
+
+    t->level = level;
+    t->slot = slot;
+}
+
+/* Caller holds the wheel's lock */
+static void wheel_remove(struct timer_wheel *w, struct timer *t) {
+    list_del_init(&t->node);
+
+    if (t->level != TIMER_LEVEL_FIRING) {
+        if (t->level != TIMER_LEVEL_NEAR &&
+            list_empty(&w->slots[t->level][t->slot]))
+            w->occupied[t->level] &= ~(1ULL << t->slot);
+
+        w->count--;
+    }
+
+    atomic_store(&t->wheel, NULL);
+}
+
+/* Moves everything in the current slot of `level` down to where it
+ * belongs now. Returns the slot, the next level only needs cascading
+ * when this one wrapped around too */
+static uint32_t wheel_cascade(struct timer_wheel *w, uint32_t level) {
+    uint32_t slot = level_index(w->clk, level);
+    struct list_head batch;
+    INIT_LIST_HEAD(&batch);
+
+    list_splice_init(&w->slots[level][slot], &batch);
+    w->occupied[level] &= ~(1ULL << slot);
+
+    struct timer *t, *tmp;
+    list_for_each_entry_safe(t, tmp, &batch, node) {
+        list_del_init(&t->node);
+        wheel_insert(w, t);
+    }
+
+    return slot;
+}
+
+/* Caller holds the wheel's lock, `t` is on no list */
+static void wheel_fire(struct timer_wheel *w, struct timer *t) {
+    t->level = TIMER_LEVEL_FIRING;
+    w->count--;
+
+    if (t->flags & TIMER_FLAG_DPC)
+        list_add_tail(&t->node, &w->dpc_ready);
+    else
+        list_add_tail(&t->node, &w->ready);
+}
+
+/* Caller holds the wheel's lock */
+static void wheel_advance(struct timer_wheel *w, uint64_t now_us) {
+    uint64_t now = US_TO_MS(now_us);
+    if (!w->count) {
+        w->clk = now + 1;
+        return;
+    }
+
+    struct list_head expired;
+    INIT_LIST_HEAD(&expired);
+
+    while (w->clk <= now) {
+        uint32_t idx = level_index(w->clk, 0);
+
+        if (!idx)
+            for (uint32_t l = 1; l < TIMER_WHEEL_LEVELS; l++)
+                if (wheel_cascade(w, l))
+                    break;
+
+        /* nothing left this time around, skip to where it wraps */
+        if (!w->occupied[0]) {
+            uint64_t wrap = (w->clk | TIMER_WHEEL_MASK) + 1;
+            w->clk = wrap <= now + 1 ? wrap : now + 1;
+            continue;
+        }
+
+        list_splice_init(&w->slots[0][idx], &expired);
+        w->occupied[0] &= ~(1ULL << idx);
+        w->clk++;
+    }
+
+    /* a slot covers a whole millisecond, not all of it is due yet */
+    struct timer *t, *tmp;
+    list_for_each_entry_safe(t, tmp, &expired, node) {
+        list_del_init(&t->node);
+        if (t->expires_us > now_us)
+            near_insert(w, t);
+        else
+            wheel_fire(w, t);
+    }
+
+    list_for_each_entry_safe(t, tmp, &w->near, node) {
+        if (t->expires_us > now_us)
+            break;
+
+        list_del_init(&t->node);
+        wheel_fire(w, t);
+    }
+}
+
+/* Caller holds the wheel's lock. In microseconds */
+static uint64_t wheel_next_expiry(struct timer_wheel *w) {
+    uint64_t next = TICK_NEVER;
+    if (!list_empty(&w->near))
+        next = list_first_entry(&w->near, struct timer, node)->expires_us;
+
+    uint64_t upper = 0;
+    for (uint32_t l = 1; l < TIMER_WHEEL_LEVELS; l++)
+        upper |= w->occupied[l];
+
+    uint64_t occ = w->occupied[0];
+    if (!occ && !upper)
+        return next;
+
+    /* anything further up gets cascaded when level 0 wraps */
+    uint64_t ms = (w->clk | TIMER_WHEEL_MASK) + 1;
+    if (occ) {
+        uint32_t idx = level_index(w->clk, 0);
+        uint64_t rotated = idx ? (occ >> idx) | (occ << (64 - idx)) : occ;
+        uint64_t slot = w->clk + __builtin_ctzll(rotated);
+        if (!upper || slot < ms)
+            ms = slot;
+    }
+
+    return MIN(next, MS_TO_US(ms));
+}
+
+/* Caller holds the wheel's lock, on the wheel's CPU */
+static void wheel_set_deadline(struct timer_wheel *w, uint64_t next) {
+    w->next_expiry = next;
+    tick_set_deadline(TICK_EVENT_TIMER, next);
+}
+
+static struct timer *pop_ready(struct timer_wheel *w, struct list_head *list,
+                               timer_function *func, void **a1, void **a2) {
+    enum irql irql = spin_lock_irq_disable(&w->lock);
+    struct timer *t = NULL;
+
+    if (!list_empty(list)) {
+        t = list_first_entry(list, struct timer, node);
+        *func = t->func;
+        *a1 = t->arg1;
+        *a2 = t->arg2;
+        wheel_remove(w, t);
+    }
+
+    spin_unlock(&w->lock, irql);
+    return t;
+}
+
+/* One at a time with the lock dropped in between, the callback is free
+ * to re-arm or cancel anything, its own timer included */
+static void run_list(struct timer_wheel *w, struct list_head *list) {
+    timer_function func;
+    void *a1, *a2;
+
+    while (pop_ready(w, list, &func, &a1, &a2))
+        if (func)
+            func(a1, a2);
+}
+
+static void wheel_expire(struct dpc *dpc, void *ctx) {
+    (void) dpc;
+    struct timer_wheel *w = ctx;
+
+    enum irql irql = spin_lock_irq_disable(&w->lock);
+    wheel_advance(w, time_get_us());
+
+    bool worker = !list_empty(&w->ready);
+    wheel_set_deadline(w, wheel_next_expiry(w));
+    spin_unlock(&w->lock, irql);
+
+    if (worker)
+        defer_wake_worker(w->cpu);
+
+    run_list(w, &w->dpc_ready);
+}
+
+void timer_wheel_kick(size_t cpu) {
+    dpc_enqueue_on_cpu(cpu, &wheels[cpu].dpc, DPC_NONE);
+}
+
+void timer_run_ready(size_t cpu) {
+    struct timer_wheel *w = &wheels[cpu];
+    run_list(w, &w->ready);
+}
+
+void timer_init(struct timer *t, timer_function func, void *arg1, void *arg2,
+                enum timer_flags flags) {
+    INIT_LIST_HEAD(&t->node);
+    t->expires_us = 0;
+    t->func = func;
+    t->arg1 = arg1;
+    t->arg2 = arg2;
+    t->flags = flags;
+    t->level = 0;
+    t->slot = 0;
+    atomic_store(&t->wheel, NULL);
+}
+
+bool timer_cancel(struct timer *t) {
+    while (true) {
+        struct timer_wheel *w = atomic_load(&t->wheel);
+        if (!w)
+            return false;
+
+        enum irql irql = spin_lock_irq_disable(&w->lock);
+        if (atomic_load(&t->wheel) != w) {
+            spin_unlock(&w->lock, irql);
+            continue;
+        }
+
+        /* expired but not picked up yet still counts as pending */
+        wheel_remove(w, t);
+        spin_unlock(&w->lock, irql);
+        return true;
+    }
+}
+
+void timer_arm_us(struct timer *t, uint64_t delay_us) {
+    timer_cancel(t);
+
+    /* can't move CPUs between picking the wheel and arming its timer */
+    enum irql irql = irql_raise(IRQL_HIGH_LEVEL);
+    struct timer_wheel *w = &wheels[smp_core_id()];
+    spin_lock_raw(&w->lock);
+
+    uint64_t now = time_get_us();
+
+    /* an empty wheel doesn't get advanced, catch it up first */
+    if (!w->count)
+        w->clk = US_TO_MS(now);
+
+    t->expires_us = now + delay_us;
+    atomic_store(&t->wheel, w);
+    wheel_insert(w, t);
+    w->count++;
+
+    uint64_t next = wheel_next_expiry(w);
+    if (next < w->next_expiry)
+        wheel_set_deadline(w, next);
+
+    spin_unlock(&w->lock, irql);
+}
+
+void timer_arm(struct timer *t, uint64_t delay_ms) {
+    timer_arm_us(t, MS_TO_US(delay_ms));
+}
+
+void timer_wheels_init(void) {
+    wheels = kzalloc(sizeof(struct timer_wheel) * global.core_count);
+    if (!wheels)
+        panic("Could not allocate timer wheels\n");
+
+    uint64_t now = US_TO_MS(time_get_us());
+    for (size_t cpu = 0; cpu < global.core_count; cpu++) {
+        struct timer_wheel *w = &wheels[cpu];
+        spinlock_init(&w->lock);
+        w->clk = now;
+        w->next_expiry = TICK_NEVER;
+        w->cpu = cpu;
+
+        for (size_t l = 0; l < TIMER_WHEEL_LEVELS; l++)
+            for (size_t s = 0; s < TIMER_WHEEL_SLOTS; s++)
+                INIT_LIST_HEAD(&w->slots[l][s]);
+
+        INIT_LIST_HEAD(&w->near);
+        INIT_LIST_HEAD(&w->dpc_ready);
+        INIT_LIST_HEAD(&w->ready);
+        dpc_init(&w->dpc, wheel_expire, w);
+    }
+}